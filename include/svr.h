@@ -37,9 +37,11 @@
 #include <svr/messagerouting.h>
 #include <svr/messagehandlers.h>
 
+#include <svr/framepool.h>
 #include <svr/encoding.h>
 #include <svr/frameproperties.h>
 #include <svr/responseset.h>
+#include <svr/handletable.h>
 
 #define SVR_CRASH(m) { \
     fprintf(stderr, "[SVR_CRASH in %s] %s\n", __func__, (m)); \
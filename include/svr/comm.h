@@ -5,5 +5,8 @@
 int SVR_Comm_init(const char* server_address);
 void* SVR_Comm_sendMessage(SVR_Message* message, bool is_request);
 int SVR_Comm_parseResponse(SVR_Message* response);
+int SVR_Comm_getProtocol(void);
+void SVR_Comm_requestProtocol(int protocol);
+void SVR_Comm_setReceiveProtocol(int protocol);
 
 #endif // #ifndef __SVR_COMM_H
@@ -45,13 +45,49 @@ struct SVR_Encoding_s {
      * Provide data for decoding. Return number of frames ready
      */
     void (*decode)(SVR_Decoder* decoder, void* data, size_t n);
+
+    /**
+     * Optional. Called when a decoded frame is returned to the decoder,
+     * before it is placed back in the frame pool, and when a decoded frame is
+     * dropped without being retrieved
+     */
+    void (*returnFrame)(SVR_Decoder* decoder, IplImage* frame);
+
+    /**
+     * Optional. Called after each encoded frame is sent with the time the
+     * send took and the number of bytes still queued in the socket, so the
+     * encoder can adapt to the link. May be called from any thread, including
+     * while a frame is being encoded
+     */
+    void (*reportSend)(SVR_Encoder* encoder, unsigned int send_ms, size_t backlog);
+
+    /**
+     * Optional. Implemented by encodings whose frames depend on earlier
+     * frames, to make the next encoded frame decodable on its own. Such
+     * encodings also set the encoder's keyframe flag on each encode
+     */
+    void (*forceKeyframe)(SVR_Encoder* encoder);
+
+    /**
+     * If true, decoded frames point at data owned by the decoder instance,
+     * and the frame pool only allocates image headers
+     */
+    bool external_frame_data;
 };
 
 struct SVR_Encoder_s {
-    void* buffer;
-    unsigned int read_index;
-    unsigned int write_index;
-    ssize_t buffer_size;
+    /* Encoded data. Unread data runs from read_index to write_index */
+    uint8_t* buffer;
+    size_t read_index;
+    size_t write_index;
+    size_t buffer_size;
+
+    /* Size of the data last taken by SVR_Encoder_takeData */
+    size_t last_size;
+
+    /* Whether the last encoded frame can be decoded without the frames
+       before it */
+    bool keyframe;
 
     SVR_Encoding* encoding;
     void* private_data;
@@ -59,13 +95,22 @@ struct SVR_Encoder_s {
 };
 
 struct SVR_Decoder_s {
-    List* ready_frames;
-    List* free_frames;
+    SVR_FramePool* frame_pool;
+
+    /* Frame currently being buffered, and the offset into it. Only used by
+       the thread providing data to the decoder */
+    IplImage* current_frame;
     unsigned int write_offset;
 
     SVR_FrameProperties* frame_properties;
     SVR_Encoding* encoding;
     void* private_data;
+
+    /* Decoders this one replaced whose frames are still held by the caller,
+       linked through this member. Each is destroyed once its last frame is
+       returned. Protected by the decoder lock */
+    SVR_Decoder* retired;
+
     SVR_LOCKABLE;
 };
 
@@ -82,13 +127,20 @@ void SVR_Encoder_destroy(SVR_Encoder* encoder);
 size_t SVR_Encoder_encode(SVR_Encoder* encoder, IplImage* frame);
 size_t SVR_Encoder_dataReady(SVR_Encoder* encoder);
 size_t SVR_Encoder_readData(SVR_Encoder* encoder, void* buffer, size_t buffer_size);
+void* SVR_Encoder_peekData(SVR_Encoder* encoder, size_t* n);
+void SVR_Encoder_consumeData(SVR_Encoder* encoder, size_t n);
+void* SVR_Encoder_takeData(SVR_Encoder* encoder, size_t* n);
+void SVR_Encoder_reportSend(SVR_Encoder* encoder, unsigned int send_ms, size_t backlog);
+void SVR_Encoder_forceKeyframe(SVR_Encoder* encoder);
 
 SVR_Decoder* SVR_Decoder_new(SVR_Encoding* encoding, SVR_FrameProperties* frame_properties);
+SVR_Decoder* SVR_Decoder_newWithFramePool(SVR_Encoding* encoding, SVR_FrameProperties* frame_properties, int depth, SVR_FramePoolPolicy policy);
 void SVR_Decoder_destroy(SVR_Decoder* decoder);
 int SVR_Decoder_decode(SVR_Decoder* decoder, void* data, size_t n);
 int SVR_Decoder_framesReady(SVR_Decoder* decoder);
 IplImage* SVR_Decoder_getFrame(SVR_Decoder* decoder);
 void SVR_Decoder_returnFrame(SVR_Decoder* decoder, IplImage* frame);
+void SVR_Decoder_retire(SVR_Decoder* decoder, SVR_Decoder* successor);
 
 #endif // #ifndef __SVR_ENCODING_H
 
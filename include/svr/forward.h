@@ -16,6 +16,8 @@ struct SVR_Stream_s;
 struct SVR_FrameProperties_s;
 struct SVR_ResponseSet_s;
 struct SVR_Source_s;
+struct SVR_HandleTable_s;
+struct SVR_FramePool_s;
 
 typedef struct SVR_MemPool_s SVR_MemPool;
 typedef struct SVR_MemPool_Block_s SVR_MemPool_Block;
@@ -31,5 +33,7 @@ typedef struct SVR_Stream_s SVR_Stream;
 typedef struct SVR_FrameProperties_s SVR_FrameProperties;
 typedef struct SVR_ResponseSet_s SVR_ResponseSet;
 typedef struct SVR_Source_s SVR_Source;
+typedef struct SVR_HandleTable_s SVR_HandleTable;
+typedef struct SVR_FramePool_s SVR_FramePool;
 
 #endif // #ifndef __SVR_FORWARDDECLARATIONS_H
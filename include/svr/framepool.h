@@ -0,0 +1,67 @@
+
+#ifndef __SVR_FRAMEPOOL_H
+#define __SVR_FRAMEPOOL_H
+
+#include <svr/forward.h>
+#include <svr/lockable.h>
+#include <svr/cv.h>
+
+/* Default number of frames in a decoder's frame pool */
+#define SVR_FRAMEPOOL_DEFAULT_DEPTH 4
+
+/* Alignment of the image data of pooled frames */
+#define SVR_FRAMEPOOL_ALIGNMENT 64
+
+typedef enum {
+    /* Reuse the oldest unretrieved frame, or drop the incoming frame if every
+       frame is held by the consumer */
+    SVR_FRAMEPOOL_DROP_OLDEST,
+
+    /* Wait for the consumer to return a frame */
+    SVR_FRAMEPOOL_BLOCK
+} SVR_FramePoolPolicy;
+
+/* Called with a frame whose contents are being discarded */
+typedef void (*SVR_FramePool_RecycleCallback)(void* arg, IplImage* frame);
+
+struct SVR_FramePool_s {
+    /* Every frame owned by the pool */
+    IplImage** frames;
+    int depth;
+
+    /* Rings of frames available for writing, and of completed frames not yet
+       retrieved, oldest first */
+    IplImage** free_ring;
+    int free_head;
+    int free_count;
+
+    IplImage** ready_ring;
+    int ready_head;
+    int ready_count;
+
+    /* Written to when no frame can be reused, and never made ready */
+    IplImage* sink;
+
+    SVR_FramePoolPolicy policy;
+    bool allocate_data;
+
+    SVR_FramePool_RecycleCallback recycle;
+    void* recycle_arg;
+
+    pthread_cond_t frame_returned;
+    SVR_LOCKABLE;
+};
+
+SVR_FramePool* SVR_FramePool_new(SVR_FrameProperties* frame_properties, int depth, SVR_FramePoolPolicy policy, bool allocate_data);
+void SVR_FramePool_destroy(SVR_FramePool* pool);
+void SVR_FramePool_setRecycleCallback(SVR_FramePool* pool, SVR_FramePool_RecycleCallback recycle, void* arg);
+IplImage* SVR_FramePool_acquire(SVR_FramePool* pool);
+void SVR_FramePool_commit(SVR_FramePool* pool, IplImage* frame);
+int SVR_FramePool_readyCount(SVR_FramePool* pool);
+IplImage* SVR_FramePool_getReady(SVR_FramePool* pool);
+bool SVR_FramePool_returnFrame(SVR_FramePool* pool, IplImage* frame);
+bool SVR_FramePool_owns(SVR_FramePool* pool, IplImage* frame);
+int SVR_FramePool_getOutstanding(SVR_FramePool* pool);
+int SVR_FramePool_getRowPadding(SVR_FramePool* pool);
+
+#endif // #ifndef __SVR_FRAMEPOOL_H
@@ -0,0 +1,26 @@
+
+#ifndef __SVR_HANDLETABLE_H
+#define __SVR_HANDLETABLE_H
+
+#include <svr/forward.h>
+
+struct SVR_HandleTable_s {
+    void** objects;
+    uint16_t* generations;
+
+    /* Indices of unused entries */
+    uint16_t* free_indices;
+    int free_count;
+
+    int table_size;
+
+    SVR_LOCKABLE;
+};
+
+SVR_HandleTable* SVR_HandleTable_new(void);
+void SVR_HandleTable_destroy(SVR_HandleTable* handle_table);
+uint32_t SVR_HandleTable_add(SVR_HandleTable* handle_table, void* object);
+void* SVR_HandleTable_get(SVR_HandleTable* handle_table, uint32_t handle);
+void SVR_HandleTable_remove(SVR_HandleTable* handle_table, uint32_t handle);
+
+#endif // #ifndef __SVR_HANDLETABLE_H
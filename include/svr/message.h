@@ -23,9 +23,11 @@ struct SVR_Message_s {
     void* payload;
 
     /**
-     * Payload size in bytes. A payload is appended to the message as part of the stream
+     * Payload size in bytes. A payload is appended to the message as part of the
+     * stream. Payloads larger than SVR_MAX_PAYLOAD_V1 require protocol version
+     * 2
      */
-    uint16_t payload_size;
+    uint32_t payload_size;
 
     /**
      * The components of the message. Each component is an ASCII string
@@ -37,6 +39,18 @@ struct SVR_Message_s {
      */
     unsigned short count;
 
+    /**
+     * Binary message type, or SVR_OPCODE_NONE for a message identified by its
+     * first component. Binary messages require protocol version 2 and have no
+     * components
+     */
+    uint16_t opcode;
+
+    /**
+     * Handle of the stream or source a binary message is for
+     */
+    uint32_t handle;
+
     /**
      * The Arena allocation that backs this message
      */
@@ -63,13 +77,38 @@ struct SVR_Message_s {
  *
  * The length, request ID, and component count constitute a 6 byte binary
  * header, and the rest of the message is null separated ASCII strings
+ *
+ * Protocol version 2 extends the header to 12 bytes to allow payloads larger
+ * than 64 KiB,<br>
+ * <pre>
+ *  length           [0:15]
+ *  request id       [16:31]
+ *  component count  [32:47]
+ *  opcode           [48:63]
+ *  payload size     [64:95]
+ *  data             [96:96 + length]
+ *  payload
+ * </pre>
+ *
+ * A message with an opcode other than SVR_OPCODE_NONE is a binary message. It
+ * has no components, and its data is a 32 bit handle identifying the stream
+ * or source it is for, as assigned by the receiver when the stream or source
+ * was opened. Binary messages are routed by opcode and handle without any
+ * string handling.
+ *
+ * Every connection starts with version 1. The server advertises the latest
+ * version it supports with an "SVR.protocol" message when a client connects.
+ * A client supporting that version replies with "SVR.setProtocol", after
+ * which every message it sends uses the new version. The server answers with
+ * its own "SVR.setProtocol", after which every message the server sends uses
+ * the new version.
  */
 struct SVR_PackedMessage_s {
     size_t length;
 
     void* data;
 
-    uint16_t payload_size;
+    uint32_t payload_size;
 
     void* payload;
 
@@ -79,16 +118,41 @@ struct SVR_PackedMessage_s {
     SVR_Arena* alloc;
 };
 
+/* Protocol versions */
+#define SVR_PROTOCOL_V1 1
+#define SVR_PROTOCOL_V2 2
+#define SVR_PROTOCOL_LATEST SVR_PROTOCOL_V2
+
+/* Packed header lengths for each protocol version */
 #define SVR_MESSAGE_PREFIX_LEN 8
+#define SVR_MESSAGE_PREFIX_LEN_V2 12
+#define SVR_MESSAGE_MAX_PREFIX_LEN SVR_MESSAGE_PREFIX_LEN_V2
+
+/* Binary message opcodes */
+#define SVR_OPCODE_NONE 0
+#define SVR_OPCODE_DATA 1
+#define SVR_OPCODE_COUNT 2
+
+/* Data length of a binary message, holding its handle */
+#define SVR_BINARY_DATA_LEN 4
+
+/* Largest payload which can be sent with protocol version 1 */
+#define SVR_MAX_PAYLOAD_V1 0xffff
+
+/* Largest payload accepted with protocol version 2 */
+#define SVR_MAX_PAYLOAD_V2 (64 * 1024 * 1024)
 
 void SVR_Message_init(void);
 
 SVR_Message* SVR_Message_new(unsigned int component_count);
-SVR_PackedMessage* SVR_Message_pack(SVR_Message* message);
+size_t SVR_Message_prefixLength(int protocol);
+size_t SVR_Message_packHeader(void* buffer, int protocol, SVR_Message* message, uint16_t data_length);
+void SVR_Message_unpackLengths(void* buffer, int protocol, uint16_t* data_length, uint32_t* payload_size);
+SVR_PackedMessage* SVR_Message_pack(SVR_Message* message, int protocol);
 void SVR_Message_release(SVR_Message* message);
 
 SVR_PackedMessage* SVR_PackedMessage_new(size_t packed_length);
-SVR_Message* SVR_PackedMessage_unpack(SVR_PackedMessage* packed_message);
+SVR_Message* SVR_PackedMessage_unpack(SVR_PackedMessage* packed_message, int protocol);
 void SVR_PackedMessage_release(SVR_PackedMessage* packed_message);
 
 
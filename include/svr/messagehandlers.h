@@ -4,6 +4,9 @@
 
 int SVR_MessageHandler_streamOrphaned(SVR_Message* message);
 int SVR_MessageHandler_data(SVR_Message* message);
+int SVR_MessageHandler_binaryData(SVR_Message* message);
 int SVR_MessageHandler_kick(SVR_Message* message);
+int SVR_MessageHandler_protocol(SVR_Message* message);
+int SVR_MessageHandler_setProtocol(SVR_Message* message);
 
 #endif // #ifndef __SVR_MESSAGEHANDLERS_H
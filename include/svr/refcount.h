@@ -2,40 +2,94 @@
 #ifndef __SVR_REFCOUNT_H
 #define __SVR_REFCOUNT_H
 
-#include <svr/lockable.h>
+#include <stdint.h>
 
+/**
+ * Reference counter embedded in each reference counted object. The count is
+ * only modified atomically.
+ */
 struct SVR_RefCounter_s {
     uint32_t ref_count;
     void (*cleanup)(void*);
     void* object;
 
-    SVR_LOCKABLE;
+    /* Time the last reference was released, in microseconds */
+    uint64_t release_time;
 };
 
+/**
+ * Selects when and where an object is cleaned up once its last reference is
+ * released
+ */
+typedef enum {
+    /** Queue the object for the garbage collector thread (default) */
+    SVR_RECLAIM_DEFERRED,
+
+    /** Clean up the object immediately on the releasing thread */
+    SVR_RECLAIM_INLINE,
+
+    /** Collect objects in a per-thread batch, cleaned up on the releasing
+        thread when the batch fills or SVR_RefCounter_flush is called */
+    SVR_RECLAIM_BATCHED
+} SVR_ReclaimMode;
+
+/**
+ * Reclamation statistics returned by SVR_RefCounter_getStats. Latencies are
+ * measured from the release of the last reference to the start of cleanup.
+ */
+typedef struct {
+    /** Objects waiting for the garbage collector thread */
+    uint64_t queue_depth;
+
+    /** Largest queue depth seen */
+    uint64_t max_queue_depth;
+
+    /** Objects waiting in per-thread batches */
+    uint64_t batched;
+
+    /** Objects cleaned up */
+    uint64_t cleanups;
+
+    /** Sum of all cleanup latencies in microseconds */
+    uint64_t total_latency;
+
+    /** Largest cleanup latency in microseconds */
+    uint64_t max_latency;
+} SVR_RefCounterStats;
+
 /**
  * \addtogroup RefCounter
  * \{
  */
 
 /** Increment the reference count of an object */
-#define SVR_REF(object) (SVR_RefCounter_ref((object)->ref_counter))
+#define SVR_REF(object) (SVR_RefCounter_ref(&(object)->ref_counter))
+
+/** Increment the reference count of an object unless it has already been
+    released. Evaluates to true if a reference was taken */
+#define SVR_TRYREF(object) (SVR_RefCounter_tryRef(&(object)->ref_counter))
 
 /** Decrement the reference count of an object */
-#define SVR_UNREF(object) (SVR_RefCounter_unref((object)->ref_counter))
+#define SVR_UNREF(object) (SVR_RefCounter_unref(&(object)->ref_counter))
 
 /** Structure member making an object type reference countable */
-#define SVR_REFCOUNTED SVR_RefCounter* ref_counter
+#define SVR_REFCOUNTED SVR_RefCounter ref_counter
 
 /** Initialize the reference counter of a new reference counted object */
-#define SVR_REFCOUNTED_INIT(object, cleanup) ((object)->ref_counter = SVR_RefCounter_new((cleanup), (object)))
+#define SVR_REFCOUNTED_INIT(object, cleanup) (SVR_RefCounter_initCounter(&(object)->ref_counter, (cleanup), (object)))
 
 /** \} */
 
 void SVR_RefCounter_init(void);
 void SVR_RefCounter_close(void);
-SVR_RefCounter* SVR_RefCounter_new(void (*cleanup)(void*), void* object);
-void SVR_RefCounter_destroy(SVR_RefCounter* ref_counter);
+void SVR_RefCounter_initCounter(SVR_RefCounter* ref_counter, void (*cleanup)(void*), void* object);
 void SVR_RefCounter_ref(SVR_RefCounter* ref_counter);
+bool SVR_RefCounter_tryRef(SVR_RefCounter* ref_counter);
 void SVR_RefCounter_unref(SVR_RefCounter* ref_counter);
+void SVR_RefCounter_setReclaimMode(SVR_ReclaimMode mode);
+SVR_ReclaimMode SVR_RefCounter_getReclaimMode(void);
+int SVR_RefCounter_getReclaimModeFromName(const char* name);
+void SVR_RefCounter_flush(void);
+void SVR_RefCounter_getStats(SVR_RefCounterStats* stats);
 
 #endif // #ifndef __SVR_REFCOUNT_H
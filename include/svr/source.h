@@ -10,8 +10,13 @@ struct SVR_Source_s {
     Dictionary* encoding_options;
     SVR_Encoder* encoder;
     SVR_FrameProperties* frame_properties;
-    void* payload_buffer;
-    size_t payload_buffer_size;
+
+    /* Maximum payload size of each data message sent with protocol version 1 */
+    size_t chunk_size;
+
+    /* Handle the server assigned to identify binary data messages for this
+       source, or 0 if data is sent with Data messages */
+    uint32_t handle;
 };
 
 SVR_Source* SVR_Source_new(const char* name);
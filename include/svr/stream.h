@@ -5,6 +5,7 @@
 #include <svr/forward.h>
 #include <svr/lockable.h>
 #include <svr/cv.h>
+#include <svr/framepool.h>
 
 typedef enum {
     SVR_PAUSED,
@@ -21,6 +22,20 @@ struct SVR_Stream_s {
     SVR_Decoder* decoder;
     bool orphaned;
 
+    /* Frame pool used by the decoder opened on the next unpause */
+    int frame_pool_depth;
+    SVR_FramePoolPolicy frame_pool_policy;
+
+    /* Handle the server tags binary data messages for this stream with, or 0
+       if data is sent with Data messages */
+    uint32_t handle;
+
+    /* Held while data is decoded, and while the decoder is replaced. Taken
+       before the stream lock, which is not held while decoding so that a
+       decoder waiting for a frame under SVR_FRAMEPOOL_BLOCK does not keep
+       the caller from getting one */
+    pthread_mutex_t decode_lock;
+
     pthread_cond_t new_frame;
     SVR_LOCKABLE;
 };
@@ -30,9 +45,13 @@ SVR_Stream* SVR_Stream_new(const char* source);
 void SVR_Stream_destroy(SVR_Stream* stream);
 int SVR_Stream_setEncoding(SVR_Stream* stream, const char* encoding);
 int SVR_Stream_resize(SVR_Stream* stream, int width, int height);
+int SVR_Stream_setROI(SVR_Stream* stream, int x, int y, int width, int height);
 int SVR_Stream_setGrayscale(SVR_Stream* stream, bool grayscale);
 int SVR_Stream_setPriority(SVR_Stream* stream, short priority);
 int SVR_Stream_setDropRate(SVR_Stream* stream, int drop_rate);
+int SVR_Stream_setMaxRate(SVR_Stream* stream, double fps);
+int SVR_Stream_getStats(SVR_Stream* stream, unsigned long* frames_sent, unsigned long* frames_dropped);
+int SVR_Stream_setFramePool(SVR_Stream* stream, int depth, SVR_FramePoolPolicy policy);
 int SVR_Stream_unpause(SVR_Stream* stream);
 int SVR_Stream_pause(SVR_Stream* stream);
 SVR_FrameProperties* SVR_Stream_getFrameProperties(SVR_Stream* stream);
@@ -42,5 +61,6 @@ bool SVR_Stream_isOrphaned(SVR_Stream* stream);
 void SVR_Stream_setOrphaned(const char* stream_name);
 void SVR_Stream_sync(void);
 void SVR_Stream_provideData(const char* stream_name, void* buffer, size_t n);
+void SVR_Stream_provideDataByHandle(uint32_t handle, void* buffer, size_t n);
 
 #endif // #ifndef __SVR_STREAM_H
@@ -19,6 +19,12 @@ static pthread_mutex_t send_lock = PTHREAD_MUTEX_INITIALIZER;
 static void* payload_buffer = NULL;
 static int payload_buffer_size = 0;
 
+/* Protocol versions used for sending and receiving. Every connection starts
+   with version 1. send_protocol is protected by send_lock and
+   receive_protocol is only used by the receive thread */
+static int send_protocol = SVR_PROTOCOL_V1;
+static int receive_protocol = SVR_PROTOCOL_V1;
+
 static void* SVR_Comm_receiveThread(void* _unused);
 
 /**
@@ -76,7 +82,7 @@ static void* SVR_Comm_receiveThread(void* _unused) {
     int n;
 
     while(true) {
-        message = SVR_Net_receiveMessage(client_sock);
+        message = SVR_Net_receiveMessage(client_sock, receive_protocol);
 
         if(message == NULL) {
             SVR_log(SVR_ERROR, "Server has closed");
@@ -131,7 +137,7 @@ void* SVR_Comm_sendMessage(SVR_Message* message, bool is_request) {
     }
 
     pthread_mutex_lock(&send_lock);
-    SVR_Net_sendMessage(client_sock, message);
+    SVR_Net_sendMessage(client_sock, send_protocol, message);
     pthread_mutex_unlock(&send_lock);
 
     if(is_request) {
@@ -141,17 +147,72 @@ void* SVR_Comm_sendMessage(SVR_Message* message, bool is_request) {
     return response;
 }
 
+/**
+ * \brief Get the protocol version
+ *
+ * Get the protocol version messages are currently sent with. Payloads larger
+ * than SVR_MAX_PAYLOAD_V1 may only be sent with version 2 or later.
+ *
+ * \return The current protocol version
+ */
+int SVR_Comm_getProtocol(void) {
+    int protocol;
+
+    pthread_mutex_lock(&send_lock);
+    protocol = send_protocol;
+    pthread_mutex_unlock(&send_lock);
+
+    return protocol;
+}
+
+/**
+ * \brief Switch to a newer protocol version
+ *
+ * Request that the server use the given protocol version. Every message sent
+ * after the request uses the new version. Messages from the server use the new
+ * version once it acknowledges the request, see SVR_Comm_setReceiveProtocol.
+ * Should only be called in response to the server advertising the version.
+ *
+ * \param protocol The protocol version to use
+ */
+void SVR_Comm_requestProtocol(int protocol) {
+    SVR_Message* message = SVR_Message_new(2);
+
+    message->components[0] = SVR_Arena_strdup(message->alloc, "SVR.setProtocol");
+    message->components[1] = SVR_Arena_sprintf(message->alloc, "%d", protocol);
+
+    pthread_mutex_lock(&send_lock);
+    SVR_Net_sendMessage(client_sock, send_protocol, message);
+    send_protocol = protocol;
+    pthread_mutex_unlock(&send_lock);
+
+    SVR_Message_release(message);
+}
+
+/**
+ * \brief Set the receive protocol version
+ *
+ * Set the protocol version used to receive messages from the server. Must only
+ * be called from the receive thread.
+ *
+ * \param protocol The protocol version to use
+ */
+void SVR_Comm_setReceiveProtocol(int protocol) {
+    receive_protocol = protocol;
+}
+
 /**
  * \brief Parse a SVR.response message
  *
- * Handle a SVR.response message and the associated return code
+ * Handle a SVR.response message and the associated return code. A response may
+ * carry additional components after the return code.
  *
  * \param response The response messages to verify
  * \return The contained error code, or -1 of the message can not be parsed as
  * an SVR.response message
  */
 int SVR_Comm_parseResponse(SVR_Message* response) {
-    if(response->count == 2 && strcmp(response->components[0], "SVR.response") == 0) {
+    if(response->count >= 2 && strcmp(response->components[0], "SVR.response") == 0) {
         return atoi(response->components[1]);
     } else {
         return -1;
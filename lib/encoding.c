@@ -10,6 +10,9 @@
 #include "encodings/encodings.h"
 
 static void SVR_Encoding_registerDefaultEncodings(void);
+static void SVR_Decoder_recycleFrame(void* arg, IplImage* frame);
+static void SVR_Decoder_releaseFrame(SVR_Decoder* decoder, IplImage* frame);
+static void SVR_Decoder_pruneRetired(SVR_Decoder* decoder);
 
 static Dictionary* encodings = NULL;
 
@@ -29,17 +32,21 @@ static Dictionary* encodings = NULL;
  * decoder processes raw, encoded data and produces decoded frames. The APIs
  * below, provide this functionality.
  *
- * An encoder maintains an internal, circular buffer of encoded data. As the
- * data is read out, internal buffer space is freed. The buffer will grow as
- * large as necessary to keep all unread data buffered.
- *
- * A decoder maintains internal free, and ready frames lists. The free frames
- * list is the list of frames which are available for the decoder to buffer
- * incoming frames. The ready frames list is the list of fully buffered frames
- * available to be returned by a call to SVR_Decoder_getFrame. Decoded frames
- * are placed into the free frames list with a call to SVR_Decoder_returnFrame,
- * so it is important that frames obtained by a call to SVR_Decoder_getFrame be
- * returned to avoid memory leaks and excessive memory reallocation.
+ * An encoder keeps its encoded data in a single contiguous buffer, which grows
+ * as large as necessary to hold all unread data. The data can be copied out
+ * with SVR_Encoder_readData, or used in place with SVR_Encoder_peekData and
+ * SVR_Encoder_consumeData. SVR_Encoder_takeData hands the whole buffer to the
+ * caller, so a frame can be kept, shared, and sent without being copied.
+ * Encodings can write encoded data straight into the buffer with
+ * SVR_Encoder_reserveData and SVR_Encoder_commitData.
+ *
+ * A decoder buffers decoded frames in a frame pool (SVR_FramePool) of fixed
+ * depth, allocated when the decoder is opened, so no memory is allocated per
+ * frame. Fully buffered frames are returned in order by SVR_Decoder_getFrame,
+ * and must be given back with SVR_Decoder_returnFrame once the caller is done
+ * with them so they can be reused. When every frame is in use, the pool policy
+ * given to SVR_Decoder_newWithFramePool decides whether the decoder drops
+ * frames or waits for one to be returned.
  *
  * \{
  */
@@ -62,6 +69,11 @@ void SVR_Encoding_init(void) {
 static void SVR_Encoding_registerDefaultEncodings(void) {
     SVR_Encoding_register(&SVR_ENCODING(raw));
     SVR_Encoding_register(&SVR_ENCODING(jpeg));
+    SVR_Encoding_register(&SVR_ENCODING(shm));
+    SVR_Encoding_register(&SVR_ENCODING(lz4));
+    SVR_Encoding_register(&SVR_ENCODING(delta));
+    SVR_Encoding_register(&SVR_ENCODING(yuv420));
+    SVR_Encoding_register(&SVR_ENCODING(nv12));
 }
 
 /**
@@ -122,7 +134,9 @@ SVR_Encoder* SVR_Encoder_new(SVR_Encoding* encoding, Dictionary* encoding_option
     encoder->buffer = NULL;
     encoder->write_index = 0;
     encoder->read_index = 0;
-    encoder->buffer_size = 1;
+    encoder->buffer_size = 0;
+    encoder->last_size = 0;
+    encoder->keyframe = true;
     SVR_LOCKABLE_INIT(encoder);
 
     if(encoding->openEncoder) {
@@ -156,13 +170,16 @@ void SVR_Encoder_destroy(SVR_Encoder* encoder) {
 /**
  * \brief Encode a frame
  *
- * Encode a frame
+ * Encode a frame. Afterwards, the encoder's keyframe flag tells whether the
+ * frame can be decoded without the frames encoded before it.
  *
  * \param encoder The encoder to use to process the frame
  * \param frame The frame to encode
  * \return The number of encoded bytes available to be read
  */
 size_t SVR_Encoder_encode(SVR_Encoder* encoder, IplImage* frame) {
+    /* Frames are independent unless the encoding says otherwise */
+    encoder->keyframe = true;
     encoder->encoding->encode(encoder, frame);
     return SVR_Encoder_dataReady(encoder);
 }
@@ -176,11 +193,7 @@ size_t SVR_Encoder_encode(SVR_Encoder* encoder, IplImage* frame) {
  * \return The number of bytes ready to be read
  */
 size_t SVR_Encoder_dataReady(SVR_Encoder* encoder) {
-    if(encoder->read_index <= encoder->write_index) {
-        return encoder->write_index - encoder->read_index;
-    } else {
-        return (encoder->buffer_size - encoder->read_index) + encoder->write_index;
-    }
+    return encoder->write_index - encoder->read_index;
 }
 
 /**
@@ -197,93 +210,228 @@ size_t SVR_Encoder_dataReady(SVR_Encoder* encoder) {
  */
 size_t SVR_Encoder_readData(SVR_Encoder* encoder, void* buffer, size_t buffer_size) {
     size_t read_size;
-    size_t first_chunk;
 
     SVR_LOCK(encoder);
     read_size = Util_min(SVR_Encoder_dataReady(encoder), buffer_size);
-    first_chunk = Util_min(read_size, encoder->buffer_size - encoder->read_index);
-
-    memcpy(buffer, ((uint8_t*)encoder->buffer) + encoder->read_index, first_chunk);
-    memcpy(((uint8_t*)buffer) + first_chunk, ((uint8_t*)encoder->buffer), read_size - first_chunk);
-    encoder->read_index = (encoder->read_index + read_size) % encoder->buffer_size;
+    memcpy(buffer, encoder->buffer + encoder->read_index, read_size);
+    SVR_Encoder_consumeData(encoder, read_size);
     SVR_UNLOCK(encoder);
 
     return read_size;
 }
 
 /**
- * \private
- * \brief Store encoded data
+ * \brief Get encoded data without copying it
  *
- * This call shall be used by encoding implementations to provide encoded data
- * for buffering before returning to the user.
+ * Get a pointer to the unread encoded data. The data remains valid until it
+ * is consumed, or more data is encoded.
  *
- * \param encoder The associated encoder instance
- * \param data Pointer to the encoded data
- * \param n Number of bytes to store
+ * \param encoder An encoder instance
+ * \param n Set to the number of bytes ready to be read
+ * \return Pointer to the first unread byte
  */
-void SVR_Encoder_provideData(SVR_Encoder* encoder, void* data, size_t n) {
-    size_t used_space;
-    size_t free_space;
-    size_t end_space;
-    void* temp_space;
+void* SVR_Encoder_peekData(SVR_Encoder* encoder, size_t* n) {
+    *n = SVR_Encoder_dataReady(encoder);
+    return encoder->buffer + encoder->read_index;
+}
 
+/**
+ * \brief Mark encoded data as read
+ *
+ * Advance past n bytes of data returned by SVR_Encoder_peekData
+ *
+ * \param encoder An encoder instance
+ * \param n Number of bytes read
+ */
+void SVR_Encoder_consumeData(SVR_Encoder* encoder, size_t n) {
     SVR_LOCK(encoder);
-    used_space = SVR_Encoder_dataReady(encoder);
-    free_space = encoder->buffer_size - used_space;
-
-    if(free_space <= n) {
-        if(encoder->write_index < encoder->read_index) {
-            /* Temporarily store unread data */
-            temp_space = malloc(used_space);
-            SVR_Encoder_readData(encoder, temp_space, used_space);
-
-            /* Grow buffer and restore data */
-            encoder->buffer = realloc(encoder->buffer, used_space + n + 1);
-            memcpy(encoder->buffer, temp_space, used_space);
-            encoder->read_index = 0;
-            free(temp_space);
-
-            encoder->write_index = used_space;
-        } else{
-            encoder->buffer = realloc(encoder->buffer, used_space + n + 1);
-        }
+    encoder->read_index += Util_min(n, SVR_Encoder_dataReady(encoder));
 
-        encoder->buffer_size = used_space + n + 1;
+    /* Start writing from the beginning of the buffer again once it is empty */
+    if(encoder->read_index == encoder->write_index) {
+        encoder->read_index = 0;
+        encoder->write_index = 0;
     }
+    SVR_UNLOCK(encoder);
+}
+
+/**
+ * \brief Take ownership of the encoded data
+ *
+ * Remove all unread data from the encoder and return the buffer holding it.
+ * The caller must free the returned buffer, which is trimmed to the data it
+ * holds. The encoder allocates a new buffer for the next frame, sized for the
+ * frame just taken.
+ *
+ * \param encoder An encoder instance
+ * \param n Set to the number of bytes in the returned buffer
+ * \return A buffer holding the unread data, or NULL if there is none
+ */
+void* SVR_Encoder_takeData(SVR_Encoder* encoder, size_t* n) {
+    uint8_t* data;
+    uint8_t* trimmed;
 
-    end_space = encoder->buffer_size - encoder->write_index;
-    if(n <= end_space) {
-        memcpy(((uint8_t*)encoder->buffer) + encoder->write_index, data, n);
+    SVR_LOCK(encoder);
+    *n = SVR_Encoder_dataReady(encoder);
+    data = encoder->buffer;
+
+    if(*n == 0) {
+        data = NULL;
     } else {
-        memcpy(((uint8_t*)encoder->buffer) + encoder->write_index, data, end_space);
-        memcpy(encoder->buffer, ((uint8_t*)data) + end_space, n - end_space);
+        if(encoder->read_index > 0) {
+            memmove(data, data + encoder->read_index, *n);
+        }
+
+        /* Encodings reserve room for their worst case, which taken frames
+           would otherwise hold on to while they wait to be sent */
+        if(*n < encoder->buffer_size) {
+            trimmed = realloc(data, *n);
+            if(trimmed) {
+                data = trimmed;
+            }
+        }
+
+        encoder->buffer = NULL;
+        encoder->buffer_size = 0;
+        encoder->last_size = *n;
     }
 
-    encoder->write_index = (encoder->write_index + n) % encoder->buffer_size;
+    encoder->read_index = 0;
+    encoder->write_index = 0;
+    SVR_UNLOCK(encoder);
+
+    return data;
+}
 
+/**
+ * \brief Report how an encoded frame was sent
+ *
+ * Tell the encoder how long sending its last frame took, and how much data is
+ * still queued to be sent. Encodings which adapt to the link, such as jpeg
+ * with automatic quality, use this to pick the settings for later frames.
+ * Other encodings ignore it.
+ *
+ * \param encoder The encoder which encoded the frame
+ * \param send_ms Time taken to send the frame, in milliseconds
+ * \param backlog Number of bytes queued but not yet sent
+ */
+void SVR_Encoder_reportSend(SVR_Encoder* encoder, unsigned int send_ms, size_t backlog) {
+    if(encoder->encoding->reportSend) {
+        encoder->encoding->reportSend(encoder, send_ms, backlog);
+    }
+}
+
+/**
+ * \brief Make the next encoded frame a keyframe
+ *
+ * Ask the encoder to encode the next frame so it can be decoded without any
+ * earlier frame, such as when a receiver missed frames. Encodings whose frames
+ * are always independent ignore this.
+ *
+ * \param encoder The encoder
+ */
+void SVR_Encoder_forceKeyframe(SVR_Encoder* encoder) {
+    if(encoder->encoding->forceKeyframe) {
+        encoder->encoding->forceKeyframe(encoder);
+    }
+}
+
+/**
+ * \private
+ * \brief Reserve space for encoded data
+ *
+ * Get space for at least n bytes of encoded data following any already
+ * buffered, so an encoding can write its output in place. The space is only
+ * added to the buffered data by SVR_Encoder_commitData.
+ *
+ * \param encoder The associated encoder instance
+ * \param n Number of bytes to reserve
+ * \return Pointer to the reserved space
+ */
+void* SVR_Encoder_reserveData(SVR_Encoder* encoder, size_t n) {
+    size_t needed = encoder->write_index + n;
+
+    if(needed > encoder->buffer_size) {
+        /* A new buffer is sized for the last frame taken from the encoder, so
+           it is rarely grown while encoding */
+        encoder->buffer_size = Util_max(Util_max(needed, encoder->buffer_size * 2), encoder->last_size);
+        encoder->buffer = realloc(encoder->buffer, encoder->buffer_size);
+    }
+
+    return encoder->buffer + encoder->write_index;
+}
+
+/**
+ * \private
+ * \brief Commit encoded data written to reserved space
+ *
+ * \param encoder The associated encoder instance
+ * \param n Number of bytes written, no more than were reserved
+ */
+void SVR_Encoder_commitData(SVR_Encoder* encoder, size_t n) {
+    encoder->write_index += n;
+}
+
+/**
+ * \private
+ * \brief Store encoded data
+ *
+ * This call shall be used by encoding implementations to provide encoded data
+ * for buffering before returning to the user.
+ *
+ * \param encoder The associated encoder instance
+ * \param data Pointer to the encoded data
+ * \param n Number of bytes to store
+ */
+void SVR_Encoder_provideData(SVR_Encoder* encoder, void* data, size_t n) {
+    SVR_LOCK(encoder);
+    memcpy(SVR_Encoder_reserveData(encoder, n), data, n);
+    SVR_Encoder_commitData(encoder, n);
     SVR_UNLOCK(encoder);
 }
 
 /**
  * \brief Open a decoder
  *
- * Open a new decoder using the given encoding and frame properties
+ * Open a new decoder using the given encoding and frame properties, buffering
+ * up to SVR_FRAMEPOOL_DEFAULT_DEPTH frames and dropping the oldest frames
+ * when all are in use
  *
  * \param encoding Encoding type to use
  * \param frame_properties Properties of the frames which will be decoded
  * \return A new decoder
  */
 SVR_Decoder* SVR_Decoder_new(SVR_Encoding* encoding, SVR_FrameProperties* frame_properties) {
+    return SVR_Decoder_newWithFramePool(encoding, frame_properties, SVR_FRAMEPOOL_DEFAULT_DEPTH, SVR_FRAMEPOOL_DROP_OLDEST);
+}
+
+/**
+ * \brief Open a decoder with a given frame pool
+ *
+ * Open a new decoder using the given encoding and frame properties. The
+ * decoder allocates depth frames up front and never more.
+ *
+ * \param encoding Encoding type to use
+ * \param frame_properties Properties of the frames which will be decoded
+ * \param depth Number of frames in the decoder's frame pool
+ * \param policy What to do when every frame is in use
+ * \return A new decoder
+ */
+SVR_Decoder* SVR_Decoder_newWithFramePool(SVR_Encoding* encoding, SVR_FrameProperties* frame_properties, int depth, SVR_FramePoolPolicy policy) {
     SVR_Decoder* decoder = malloc(sizeof(SVR_Decoder));
 
     decoder->encoding = encoding;
-    decoder->ready_frames = List_new();
-    decoder->free_frames = List_new();
+    decoder->frame_pool = SVR_FramePool_new(frame_properties, depth, policy, !encoding->external_frame_data);
+    decoder->current_frame = NULL;
     decoder->write_offset = 0;
     decoder->frame_properties = SVR_FrameProperties_clone(frame_properties);
+    decoder->retired = NULL;
     SVR_LOCKABLE_INIT(decoder);
 
+    if(encoding->returnFrame) {
+        SVR_FramePool_setRecycleCallback(decoder->frame_pool, SVR_Decoder_recycleFrame, decoder);
+    }
+
     if(encoding->openDecoder) {
         decoder->private_data = encoding->openDecoder(frame_properties);
     } else {
@@ -296,31 +444,30 @@ SVR_Decoder* SVR_Decoder_new(SVR_Encoding* encoding, SVR_FrameProperties* frame_
 /**
  * \brief Destroy a decoder
  *
- * Destroy the given decoder
+ * Destroy the given decoder, and any decoder it replaced which still had frames
+ * held by the caller
  *
  * \param decoder A decoder instance
  */
 void SVR_Decoder_destroy(SVR_Decoder* decoder) {
-    IplImage* frame;
+    SVR_Decoder* retired;
 
-    if(decoder->encoding->closeDecoder) {
-        decoder->encoding->closeDecoder(decoder);
+    while((retired = decoder->retired) != NULL) {
+        decoder->retired = retired->retired;
+        retired->retired = NULL;
+        SVR_Decoder_destroy(retired);
     }
 
-    SVR_FrameProperties_destroy(decoder->frame_properties);
-
-    /* Free frames in free frames list */
-    for(int i = 0; (frame = List_get(decoder->free_frames, i)) != NULL; i++) {
-        cvReleaseImage(&frame);
+    if(decoder->encoding->closeDecoder) {
+        decoder->encoding->closeDecoder(decoder);
     }
-    List_destroy(decoder->free_frames);
 
-    /* Free frames in ready frames list */
-    for(int i = 0; (frame = List_get(decoder->ready_frames, i)) != NULL; i++) {
-        cvReleaseImage(&frame);
+    if(decoder->current_frame) {
+        SVR_FramePool_returnFrame(decoder->frame_pool, decoder->current_frame);
     }
-    List_destroy(decoder->ready_frames);
 
+    SVR_FramePool_destroy(decoder->frame_pool);
+    SVR_FrameProperties_destroy(decoder->frame_properties);
     free(decoder);
 }
 
@@ -348,7 +495,7 @@ int SVR_Decoder_decode(SVR_Decoder* decoder, void* data, size_t n) {
  * \return Number of frames ready
  */
 int SVR_Decoder_framesReady(SVR_Decoder* decoder) {
-    return List_getSize(decoder->ready_frames);
+    return SVR_FramePool_readyCount(decoder->frame_pool);
 }
 
 /**
@@ -362,54 +509,148 @@ int SVR_Decoder_framesReady(SVR_Decoder* decoder) {
  * \return The next frame ready, or NULL if no frames available
  */
 IplImage* SVR_Decoder_getFrame(SVR_Decoder* decoder) {
-    IplImage* frame = NULL;
-
-    SVR_LOCK(decoder);
-    if(SVR_Decoder_framesReady(decoder)) {
-        frame = List_remove(decoder->ready_frames, 0);
-    }
-    SVR_UNLOCK(decoder);
-
-    return frame;
+    return SVR_FramePool_getReady(decoder->frame_pool);
 }
 
 /**
  * \brief Return a frame to the decoder
  *
  * Return a frame obtained by a call to SVR_Decoder_getFrame to the decoder. The
- * frame will be reused for future frames.
+ * frame will be reused for future frames. Frames from a decoder this one
+ * replaced through SVR_Decoder_retire are given back to that decoder, and
+ * frames from any other decoder are freed.
  *
  * \param decoder A decoder instance
  * \param frame A frame obtained by a call to SVR_Decoder_getFrame
  */
 void SVR_Decoder_returnFrame(SVR_Decoder* decoder, IplImage* frame) {
+    SVR_Decoder* owner;
+
     SVR_LOCK(decoder);
-    List_append(decoder->free_frames, frame);
+    owner = decoder;
+    while(owner != NULL && SVR_FramePool_owns(owner->frame_pool, frame) == false) {
+        owner = owner->retired;
+    }
+
+    if(owner == NULL) {
+        SVR_UNLOCK(decoder);
+
+        if(decoder->encoding->external_frame_data) {
+            cvReleaseImageHeader(&frame);
+        } else {
+            cvReleaseImage(&frame);
+        }
+        return;
+    }
+
+    SVR_Decoder_releaseFrame(owner, frame);
+    if(owner != decoder) {
+        SVR_Decoder_pruneRetired(decoder);
+    }
     SVR_UNLOCK(decoder);
 }
 
 /**
- * \brief Get the current, buffering frame
+ * \brief Replace a decoder
  *
- * Get the frame currently being buffered, or allocated and return a new frame
- * if there are already no new frames available
+ * Destroy a decoder which is being replaced by another, such as when a stream
+ * is reopened. The decoder is only destroyed once every frame the caller holds
+ * from it has been returned through its successor, so the frames stay valid
+ * until then, including frames pointing at data owned by the decoder.
  *
- * \param decoder A decoder instance
+ * \param decoder The decoder being replaced
+ * \param successor The decoder replacing it
  */
-static IplImage* SVR_Decoder_getCurrentFrame(SVR_Decoder* decoder) {
+void SVR_Decoder_retire(SVR_Decoder* decoder, SVR_Decoder* successor) {
+    SVR_Decoder* last;
     IplImage* frame;
 
-    /* Allocate a new frame */
-    if(List_getSize(decoder->free_frames) == 0) {
-        frame = SVR_FrameProperties_imageFromProperties(decoder->frame_properties);
-        List_append(decoder->free_frames, frame);
+    /* Frames never retrieved by the caller are released now */
+    while((frame = SVR_FramePool_getReady(decoder->frame_pool)) != NULL) {
+        SVR_Decoder_releaseFrame(decoder, frame);
+    }
+
+    if(decoder->current_frame) {
+        SVR_FramePool_returnFrame(decoder->frame_pool, decoder->current_frame);
+        decoder->current_frame = NULL;
+    }
+
+    for(last = decoder; last->retired != NULL; last = last->retired);
+
+    SVR_LOCK(successor);
+    last->retired = successor->retired;
+    successor->retired = decoder;
+    SVR_Decoder_pruneRetired(successor);
+    SVR_UNLOCK(successor);
+}
+
+/**
+ * \brief Give a frame back to the decoder owning it
+ */
+static void SVR_Decoder_releaseFrame(SVR_Decoder* decoder, IplImage* frame) {
+    if(decoder->encoding->returnFrame) {
+        SVR_Decoder_recycleFrame(decoder, frame);
+    }
+
+    SVR_FramePool_returnFrame(decoder->frame_pool, frame);
+}
+
+/**
+ * \brief Destroy replaced decoders whose frames have all been returned
+ *
+ * Must be called with the decoder locked
+ */
+static void SVR_Decoder_pruneRetired(SVR_Decoder* decoder) {
+    SVR_Decoder** link = &decoder->retired;
+    SVR_Decoder* retired;
+
+    while((retired = *link) != NULL) {
+        if(SVR_FramePool_getOutstanding(retired->frame_pool) == 0) {
+            *link = retired->retired;
+            retired->retired = NULL;
+            SVR_Decoder_destroy(retired);
+        } else {
+            link = &retired->retired;
+        }
+    }
+}
+
+/**
+ * \brief Let the encoding release a frame's contents
+ *
+ * Called for frames returned by the caller, and for decoded frames the frame
+ * pool drops before they are retrieved
+ */
+static void SVR_Decoder_recycleFrame(void* arg, IplImage* frame) {
+    SVR_Decoder* decoder = arg;
+
+    SVR_LOCK(decoder);
+    decoder->encoding->returnFrame(decoder, frame);
+    SVR_UNLOCK(decoder);
+}
+
+/**
+ * \private
+ * \brief Get the current, buffering frame
+ *
+ * Get the frame currently being buffered, acquiring one from the frame pool if
+ * no frame is being buffered. This may block, depending on the pool policy.
+ * Encodings may decode directly into the returned frame, and then call
+ * SVR_Decoder_currentFrameComplete.
+ *
+ * \param decoder A decoder instance
+ * \return The frame being buffered
+ */
+IplImage* SVR_Decoder_getCurrentFrame(SVR_Decoder* decoder) {
+    if(decoder->current_frame == NULL) {
+        decoder->current_frame = SVR_FramePool_acquire(decoder->frame_pool);
     }
 
-    frame = List_get(decoder->free_frames, 0);
-    return frame;
+    return decoder->current_frame;
 }
 
 /**
+ * \private
  * \brief Mark the currently buffering frames as complete
  *
  * Called once the currently buffering frame has been completely buffered. This
@@ -418,10 +659,10 @@ static IplImage* SVR_Decoder_getCurrentFrame(SVR_Decoder* decoder) {
  *
  * \param decoder A decoder instance
  */
-static void SVR_Decoder_currentFrameComplete(SVR_Decoder* decoder) {
-    if(List_getSize(decoder->free_frames) > 0) {
-        /* Move current item from free frames to end of ready frames */
-        List_append(decoder->ready_frames, List_remove(decoder->free_frames, 0));
+void SVR_Decoder_currentFrameComplete(SVR_Decoder* decoder) {
+    if(decoder->current_frame) {
+        SVR_FramePool_commit(decoder->frame_pool, decoder->current_frame);
+        decoder->current_frame = NULL;
         decoder->write_offset = 0;
     }
 }
@@ -443,7 +684,6 @@ void SVR_Decoder_writePaddedFrameData(SVR_Decoder* decoder, void* data, size_t n
     size_t chunk_size;
     int offset = 0;
 
-    SVR_LOCK(decoder);
     while(offset < n) {
         current_frame = SVR_Decoder_getCurrentFrame(decoder);
 
@@ -456,7 +696,6 @@ void SVR_Decoder_writePaddedFrameData(SVR_Decoder* decoder, void* data, size_t n
             SVR_Decoder_currentFrameComplete(decoder);
         }
     }
-    SVR_UNLOCK(decoder);
 }
 
 /**
@@ -523,15 +762,7 @@ void SVR_Decoder_writeUnpaddedFrameData(SVR_Decoder* decoder, void* data, size_t
  * \return The number of pad bytes in the decoded frames
  */
 int SVR_Decoder_getRowPadding(SVR_Decoder* decoder) {
-    IplImage* frame;
-    int padding;
-
-    SVR_LOCK(decoder);
-    frame = SVR_Decoder_getCurrentFrame(decoder);
-    padding = frame->widthStep - (frame->width * frame->nChannels);
-    SVR_UNLOCK(decoder);
-
-    return padding;
+    return SVR_FramePool_getRowPadding(decoder->frame_pool);
 }
 
 /** \} */
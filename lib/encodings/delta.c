@@ -0,0 +1,403 @@
+
+#include <svr.h>
+
+#include "encoding_internal.h"
+
+#define DELTA_DEFAULT_TILE_SIZE 32
+#define DELTA_MIN_TILE_SIZE 8
+#define DELTA_MAX_TILE_SIZE 256
+#define DELTA_DEFAULT_KEYFRAME_INTERVAL 30
+
+/* Each encoded frame starts with a type byte, a reserved byte, the tile size,
+   the number of tiles which follow and the frame's sequence number. A keyframe
+   is followed by the whole frame without row padding, and a delta frame by
+   each changed tile's index and rows. A delta frame only applies to the frame
+   with the sequence number before its own */
+#define DELTA_HEADER_LEN 12
+#define DELTA_TILE_INDEX_LEN 4
+
+typedef enum {
+    DELTA_KEYFRAME,
+    DELTA_FRAME
+} SVR_DeltaFrameType;
+
+static void* openEncoder(SVR_FrameProperties* frame_properties, Dictionary* options);
+static void closeEncoder(SVR_Encoder* encoder);
+static void encode(SVR_Encoder* encoder, IplImage* frame);
+static void forceKeyframe(SVR_Encoder* encoder);
+
+static void* openDecoder(SVR_FrameProperties* frame_properties);
+static void closeDecoder(SVR_Decoder* decoder);
+static void decode(SVR_Decoder* decoder, void* data, size_t n);
+
+SVR_Encoding SVR_ENCODING(delta) = {
+        .name = "delta",
+        .openEncoder = openEncoder,
+        .closeEncoder = closeEncoder,
+        .encode = encode,
+        .openDecoder = openDecoder,
+        .closeDecoder = closeDecoder,
+        .decode = decode,
+        .forceKeyframe = forceKeyframe
+};
+
+typedef struct {
+    int tile_size;
+    int tiles_x;
+    int tiles_y;
+
+    /* A keyframe is sent every keyframe_interval frames */
+    int keyframe_interval;
+    int frames_since_keyframe;
+
+    /* Sequence number of the next encoded frame */
+    uint32_t sequence;
+
+    /* Tiles whose mean absolute difference per byte is at most this much are
+       not resent. 0 resends any tile which changed at all */
+    int threshold;
+
+    /* The frame as decoders hold it, without row padding */
+    uint8_t* reference;
+    bool have_reference;
+
+    /* Largest possible encoded frame, including its length */
+    size_t output_size;
+
+    int width;
+    int height;
+    int channels;
+    size_t row_size;
+    size_t frame_size;
+} SVR_DeltaEncoder;
+
+typedef struct {
+    /* The frame as last decoded, without row padding, and its sequence
+       number */
+    uint8_t* reference;
+    bool have_reference;
+    uint32_t sequence;
+
+    SVR_FramedData framed;
+
+    int width;
+    int height;
+    int channels;
+    size_t row_size;
+    size_t frame_size;
+} SVR_DeltaDecoder;
+
+static inline uint8_t* writeUint32(uint8_t* p, uint32_t v) {
+    v = htonl(v);
+    memcpy(p, &v, sizeof(v));
+    return p + sizeof(v);
+}
+
+static inline uint32_t readUint32(const uint8_t* p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return ntohl(v);
+}
+
+/**
+ * Check if a tile of the frame differs from the reference. Rows are compared
+ * with memcmp, or by their sum of absolute differences when a threshold is
+ * set. Both loops are simple enough to be vectorised
+ */
+static bool tileChanged(SVR_DeltaEncoder* private_data, IplImage* frame, int x0, int y0, int tile_width, int tile_height) {
+    const size_t length = tile_width * private_data->channels;
+    const uint8_t* row;
+    const uint8_t* reference;
+    uint32_t sad = 0;
+
+    for(int y = y0; y < y0 + tile_height; y++) {
+        row = (uint8_t*) frame->imageData + y * frame->widthStep + x0 * private_data->channels;
+        reference = private_data->reference + y * private_data->row_size + x0 * private_data->channels;
+
+        if(private_data->threshold == 0) {
+            if(memcmp(row, reference, length) != 0) {
+                return true;
+            }
+        } else {
+            for(size_t i = 0; i < length; i++) {
+                sad += abs(row[i] - reference[i]);
+            }
+        }
+    }
+
+    return sad > private_data->threshold * length * tile_height;
+}
+
+static void* openEncoder(SVR_FrameProperties* frame_properties, Dictionary* options) {
+    SVR_DeltaEncoder* private_data = malloc(sizeof(SVR_DeltaEncoder));
+    int tile_count;
+
+    private_data->tile_size = DELTA_DEFAULT_TILE_SIZE;
+    private_data->keyframe_interval = DELTA_DEFAULT_KEYFRAME_INTERVAL;
+    private_data->threshold = 0;
+
+    if(Dictionary_exists(options, "tile")) {
+        private_data->tile_size = atoi(Dictionary_get(options, "tile"));
+        if(private_data->tile_size < DELTA_MIN_TILE_SIZE || private_data->tile_size > DELTA_MAX_TILE_SIZE) {
+            SVR_log(SVR_WARNING, Util_format("Invalid delta tile size %s. Falling back to default",
+                                             Dictionary_get(options, "tile")));
+            private_data->tile_size = DELTA_DEFAULT_TILE_SIZE;
+        }
+    }
+
+    if(Dictionary_exists(options, "keyframe")) {
+        private_data->keyframe_interval = atoi(Dictionary_get(options, "keyframe"));
+        if(private_data->keyframe_interval < 1) {
+            SVR_log(SVR_WARNING, Util_format("Invalid delta keyframe interval %s. Falling back to default",
+                                             Dictionary_get(options, "keyframe")));
+            private_data->keyframe_interval = DELTA_DEFAULT_KEYFRAME_INTERVAL;
+        }
+    }
+
+    if(Dictionary_exists(options, "threshold")) {
+        private_data->threshold = atoi(Dictionary_get(options, "threshold"));
+        if(private_data->threshold < 0 || private_data->threshold > 255) {
+            SVR_log(SVR_WARNING, Util_format("Invalid delta threshold %s. Falling back to 0",
+                                             Dictionary_get(options, "threshold")));
+            private_data->threshold = 0;
+        }
+    }
+
+    private_data->width = frame_properties->width;
+    private_data->height = frame_properties->height;
+    private_data->channels = frame_properties->channels;
+    private_data->row_size = frame_properties->width * frame_properties->channels;
+    private_data->frame_size = private_data->row_size * frame_properties->height;
+
+    private_data->tiles_x = (frame_properties->width + private_data->tile_size - 1) / private_data->tile_size;
+    private_data->tiles_y = (frame_properties->height + private_data->tile_size - 1) / private_data->tile_size;
+    tile_count = private_data->tiles_x * private_data->tiles_y;
+
+    private_data->reference = malloc(private_data->frame_size);
+    private_data->have_reference = false;
+    private_data->frames_since_keyframe = 0;
+    private_data->sequence = 0;
+    private_data->output_size = sizeof(uint32_t) + DELTA_HEADER_LEN +
+                                tile_count * DELTA_TILE_INDEX_LEN + private_data->frame_size;
+
+    return private_data;
+}
+
+static void closeEncoder(SVR_Encoder* encoder) {
+    SVR_DeltaEncoder* private_data = encoder->private_data;
+
+    free(private_data->reference);
+    free(private_data);
+}
+
+static void encode(SVR_Encoder* encoder, IplImage* frame) {
+    SVR_DeltaEncoder* private_data = encoder->private_data;
+    uint8_t* output = SVR_Encoder_reserveData(encoder, private_data->output_size);
+    uint8_t* op = output + sizeof(uint32_t) + DELTA_HEADER_LEN;
+    uint8_t* reference;
+    uint8_t* row;
+    uint32_t tile_count = 0;
+    int tile_width;
+    int tile_height;
+    int x0;
+    int y0;
+    bool keyframe;
+
+    keyframe = !private_data->have_reference || private_data->frames_since_keyframe + 1 >= private_data->keyframe_interval;
+
+    if(keyframe) {
+        for(int y = 0; y < private_data->height; y++) {
+            row = (uint8_t*) frame->imageData + y * frame->widthStep;
+            memcpy(private_data->reference + y * private_data->row_size, row, private_data->row_size);
+        }
+
+        memcpy(op, private_data->reference, private_data->frame_size);
+        op += private_data->frame_size;
+
+        private_data->have_reference = true;
+        private_data->frames_since_keyframe = 0;
+    } else {
+        for(int ty = 0; ty < private_data->tiles_y; ty++) {
+            for(int tx = 0; tx < private_data->tiles_x; tx++) {
+                x0 = tx * private_data->tile_size;
+                y0 = ty * private_data->tile_size;
+                tile_width = Util_min(private_data->tile_size, private_data->width - x0);
+                tile_height = Util_min(private_data->tile_size, private_data->height - y0);
+
+                if(!tileChanged(private_data, frame, x0, y0, tile_width, tile_height)) {
+                    continue;
+                }
+
+                /* Send the tile, and update the reference to match what the
+                   decoder will hold */
+                op = writeUint32(op, ty * private_data->tiles_x + tx);
+                for(int y = y0; y < y0 + tile_height; y++) {
+                    row = (uint8_t*) frame->imageData + y * frame->widthStep + x0 * private_data->channels;
+                    reference = private_data->reference + y * private_data->row_size + x0 * private_data->channels;
+
+                    memcpy(op, row, tile_width * private_data->channels);
+                    memcpy(reference, row, tile_width * private_data->channels);
+                    op += tile_width * private_data->channels;
+                }
+
+                tile_count++;
+            }
+        }
+
+        private_data->frames_since_keyframe++;
+    }
+
+    encoder->keyframe = keyframe;
+
+    writeUint32(output, op - output - sizeof(uint32_t));
+    output[sizeof(uint32_t)] = keyframe ? DELTA_KEYFRAME : DELTA_FRAME;
+    output[sizeof(uint32_t) + 1] = 0;
+    output[sizeof(uint32_t) + 2] = private_data->tile_size >> 8;
+    output[sizeof(uint32_t) + 3] = private_data->tile_size & 0xff;
+    writeUint32(output + sizeof(uint32_t) + 4, tile_count);
+    writeUint32(output + sizeof(uint32_t) + 8, private_data->sequence++);
+
+    SVR_Encoder_commitData(encoder, op - output);
+}
+
+static void forceKeyframe(SVR_Encoder* encoder) {
+    SVR_DeltaEncoder* private_data = encoder->private_data;
+
+    private_data->have_reference = false;
+}
+
+static void* openDecoder(SVR_FrameProperties* frame_properties) {
+    SVR_DeltaDecoder* private_data = malloc(sizeof(SVR_DeltaDecoder));
+
+    private_data->width = frame_properties->width;
+    private_data->height = frame_properties->height;
+    private_data->channels = frame_properties->channels;
+    private_data->row_size = frame_properties->width * frame_properties->channels;
+    private_data->frame_size = private_data->row_size * frame_properties->height;
+
+    private_data->reference = malloc(private_data->frame_size);
+    private_data->have_reference = false;
+    SVR_FramedData_init(&private_data->framed);
+
+    return private_data;
+}
+
+static void closeDecoder(SVR_Decoder* decoder) {
+    SVR_DeltaDecoder* private_data = decoder->private_data;
+
+    free(private_data->reference);
+    SVR_FramedData_destroy(&private_data->framed);
+    free(private_data);
+}
+
+/**
+ * Patch the tiles of a delta frame into the reference frame. Returns false if
+ * the frame is malformed
+ */
+static bool patchTiles(SVR_DeltaDecoder* private_data, const uint8_t* data, unsigned long n, int tile_size, uint32_t tile_count) {
+    const int tiles_x = (private_data->width + tile_size - 1) / tile_size;
+    const int tiles_y = (private_data->height + tile_size - 1) / tile_size;
+    const uint8_t* end = data + n;
+    uint8_t* reference;
+    uint32_t index;
+    int tile_width;
+    int tile_height;
+    int x0;
+    int y0;
+
+    for(uint32_t i = 0; i < tile_count; i++) {
+        if(end - data < DELTA_TILE_INDEX_LEN) {
+            return false;
+        }
+
+        index = readUint32(data);
+        data += DELTA_TILE_INDEX_LEN;
+        if(index >= tiles_x * tiles_y) {
+            return false;
+        }
+
+        x0 = (index % tiles_x) * tile_size;
+        y0 = (index / tiles_x) * tile_size;
+        tile_width = Util_min(tile_size, private_data->width - x0);
+        tile_height = Util_min(tile_size, private_data->height - y0);
+
+        if(end - data < tile_width * tile_height * private_data->channels) {
+            return false;
+        }
+
+        for(int y = y0; y < y0 + tile_height; y++) {
+            reference = private_data->reference + y * private_data->row_size + x0 * private_data->channels;
+            memcpy(reference, data, tile_width * private_data->channels);
+            data += tile_width * private_data->channels;
+        }
+    }
+
+    return data == end;
+}
+
+/**
+ * Apply a complete encoded frame to the reference frame, and provide the
+ * result as a decoded frame
+ */
+static void decodeFrame(SVR_Decoder* decoder, uint8_t* data, unsigned long n) {
+    SVR_DeltaDecoder* private_data = decoder->private_data;
+    IplImage* frame;
+    int tile_size;
+    uint32_t tile_count;
+    uint32_t sequence;
+
+    if(n < DELTA_HEADER_LEN) {
+        SVR_log(SVR_WARNING, "Invalid delta frame");
+        return;
+    }
+
+    tile_size = (data[2] << 8) | data[3];
+    tile_count = readUint32(data + 4);
+    sequence = readUint32(data + 8);
+
+    if(data[0] == DELTA_KEYFRAME) {
+        if(n - DELTA_HEADER_LEN != private_data->frame_size) {
+            SVR_log(SVR_WARNING, "Invalid delta keyframe");
+            return;
+        }
+
+        memcpy(private_data->reference, data + DELTA_HEADER_LEN, private_data->frame_size);
+        private_data->have_reference = true;
+    } else if(data[0] == DELTA_FRAME && tile_size > 0) {
+        /* Tiles are useless until the next keyframe arrives, including when
+           a frame between the reference and this one was never received */
+        if(!private_data->have_reference) {
+            return;
+        }
+
+        if(sequence != private_data->sequence + 1) {
+            SVR_log(SVR_DEBUG, "Delta frame skipped, waiting for a keyframe");
+            private_data->have_reference = false;
+            return;
+        }
+
+        if(!patchTiles(private_data, data + DELTA_HEADER_LEN, n - DELTA_HEADER_LEN, tile_size, tile_count)) {
+            SVR_log(SVR_WARNING, "Invalid delta frame");
+            private_data->have_reference = false;
+            return;
+        }
+    } else {
+        SVR_log(SVR_WARNING, "Invalid delta frame");
+        return;
+    }
+
+    private_data->sequence = sequence;
+
+    frame = SVR_Decoder_getCurrentFrame(decoder);
+    for(int y = 0; y < private_data->height; y++) {
+        memcpy(frame->imageData + y * frame->widthStep, private_data->reference + y * private_data->row_size,
+               private_data->row_size);
+    }
+    SVR_Decoder_currentFrameComplete(decoder);
+}
+
+static void decode(SVR_Decoder* decoder, void* data, size_t n) {
+    SVR_DeltaDecoder* private_data = decoder->private_data;
+
+    SVR_FramedData_read(&private_data->framed, decoder, data, n, decodeFrame);
+}
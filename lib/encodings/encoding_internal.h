@@ -9,9 +9,35 @@
 /* Provide encoded data for the encoder to buffer and provide via SVR_Encoder_readData */
 void SVR_Encoder_provideData(SVR_Encoder* encoder, void* data, size_t n);
 
+/* Write encoded data in place. Up to n reserved bytes may be written, then
+   the number actually written is committed */
+void* SVR_Encoder_reserveData(SVR_Encoder* encoder, size_t n);
+void SVR_Encoder_commitData(SVR_Encoder* encoder, size_t n);
+
 /* Provide the next n bytes of decoded frame data. Assumes required frame padding is already included */
 void SVR_Decoder_writePaddedFrameData(SVR_Decoder* decoder, void* data, size_t n);
 void SVR_Decoder_writeUnpaddedFrameData(SVR_Decoder* decoder, void* data, size_t n);
 int SVR_Decoder_getRowPadding(SVR_Decoder* decoder);
 
+/* Decode directly into the frame being buffered, then mark it complete */
+IplImage* SVR_Decoder_getCurrentFrame(SVR_Decoder* decoder);
+void SVR_Decoder_currentFrameComplete(SVR_Decoder* decoder);
+
+/* Splits decoder input into length prefixed frames */
+typedef struct {
+    uint8_t length_bytes[sizeof(uint32_t)];
+    int length_received;
+
+    /* Frames which arrive split between calls are gathered here */
+    uint8_t* buffer;
+    unsigned long buffer_size;
+    unsigned long bytes_needed;
+    unsigned long bytes_received;
+} SVR_FramedData;
+
+void SVR_FramedData_init(SVR_FramedData* framed);
+void SVR_FramedData_destroy(SVR_FramedData* framed);
+void SVR_FramedData_read(SVR_FramedData* framed, SVR_Decoder* decoder, void* data, size_t n,
+                         void (*frame_complete)(SVR_Decoder* decoder, uint8_t* frame, unsigned long length));
+
 #endif // #ifndef __SVR_ENCODING_INTERNAL_H
@@ -4,5 +4,10 @@
 
 extern SVR_Encoding SVR_ENCODING(raw);
 extern SVR_Encoding SVR_ENCODING(jpeg);
+extern SVR_Encoding SVR_ENCODING(shm);
+extern SVR_Encoding SVR_ENCODING(lz4);
+extern SVR_Encoding SVR_ENCODING(delta);
+extern SVR_Encoding SVR_ENCODING(yuv420);
+extern SVR_Encoding SVR_ENCODING(nv12);
 
 #endif // #ifndef __SVR_ENCODINGS_H
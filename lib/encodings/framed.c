@@ -0,0 +1,78 @@
+/**
+ * \file
+ * \brief Framed decoder data
+ */
+
+#include <svr.h>
+
+#include "encoding_internal.h"
+
+/* Encoded frames are sent as a 4 byte, network order length followed by the
+   frame data. These helpers split incoming decoder data back into frames */
+
+void SVR_FramedData_init(SVR_FramedData* framed) {
+    framed->length_received = 0;
+    framed->buffer = NULL;
+    framed->buffer_size = 0;
+    framed->bytes_needed = 0;
+    framed->bytes_received = 0;
+}
+
+void SVR_FramedData_destroy(SVR_FramedData* framed) {
+    free(framed->buffer);
+}
+
+/**
+ * Pass each complete frame in the data to frame_complete. A frame which
+ * arrives whole is passed directly from the data, without being copied. A
+ * frame split between calls is gathered into an internal buffer first
+ */
+void SVR_FramedData_read(SVR_FramedData* framed, SVR_Decoder* decoder, void* data, size_t n,
+                         void (*frame_complete)(SVR_Decoder* decoder, uint8_t* frame, unsigned long length)) {
+    unsigned long chunk_size;
+
+    while(n) {
+        if(framed->bytes_needed == 0) {
+            /* Read the 4 bytes which give the size of the encoded frame */
+            chunk_size = Util_min(n, sizeof(uint32_t) - framed->length_received);
+            memcpy(framed->length_bytes + framed->length_received, data, chunk_size);
+            framed->length_received += chunk_size;
+            data = ((uint8_t*)data) + chunk_size;
+            n -= chunk_size;
+
+            if(framed->length_received < sizeof(uint32_t)) {
+                continue;
+            }
+
+            framed->length_received = 0;
+            framed->bytes_received = 0;
+            framed->bytes_needed = ntohl(*((uint32_t*) framed->length_bytes));
+
+            /* The whole frame is here, so decode it without copying it */
+            if(framed->bytes_needed > 0 && n >= framed->bytes_needed) {
+                frame_complete(decoder, data, framed->bytes_needed);
+                data = ((uint8_t*)data) + framed->bytes_needed;
+                n -= framed->bytes_needed;
+                framed->bytes_needed = 0;
+                continue;
+            }
+
+            if(framed->buffer_size < framed->bytes_needed) {
+                framed->buffer = realloc(framed->buffer, framed->bytes_needed);
+                framed->buffer_size = framed->bytes_needed;
+            }
+        } else {
+            chunk_size = Util_min(n, framed->bytes_needed - framed->bytes_received);
+            memcpy(framed->buffer + framed->bytes_received, data, chunk_size);
+            framed->bytes_received += chunk_size;
+
+            n -= chunk_size;
+            data = ((uint8_t*)data) + chunk_size;
+
+            if(framed->bytes_received == framed->bytes_needed) {
+                frame_complete(decoder, framed->buffer, framed->bytes_needed);
+                framed->bytes_needed = 0;
+            }
+        }
+    }
+}
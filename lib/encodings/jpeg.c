@@ -5,8 +5,30 @@
 
 #include "encoding_internal.h"
 
-#define BUFFER_GROW_SIZE 1024
 #define JPEG_DEFAULT_QUALITY 70
+#define JPEG_MIN_QUALITY 5
+#define JPEG_MAX_QUALITY 100
+
+/* Defaults for automatic quality */
+#define JPEG_AUTO_MIN_QUALITY 30
+#define JPEG_AUTO_MAX_QUALITY 90
+#define JPEG_AUTO_TARGET_MS 50
+#define JPEG_MAX_THREADS 16
+
+/* The output buffer starts at this fraction of the raw frame size, and is kept
+   this much larger than the last encoded frame */
+#define BUFFER_INITIAL_DIVISOR 4
+#define BUFFER_HEADROOM_DIVISOR 4
+
+/* Frames are BGR, as OpenCV stores them, and always stored as RGB in the
+   JPEG. libjpeg-turbo converts the pixel order itself. Plain libjpeg only
+   handles RGB, so the red and blue channels are swapped around it */
+#ifdef JCS_EXTENSIONS
+# define JPEG_COLOR_SPACE JCS_EXT_BGR
+#else
+# define JPEG_COLOR_SPACE JCS_RGB
+# define JPEG_SWAP_CHANNELS
+#endif
 
 static void* openEncoder(SVR_FrameProperties* frame_properties, Dictionary* options);
 static void closeEncoder(SVR_Encoder* encoder);
@@ -15,6 +37,7 @@ static void encode(SVR_Encoder* encoder, IplImage* frame);
 static void* openDecoder(SVR_FrameProperties* frame_properties);
 static void closeDecoder(SVR_Decoder* decoder);
 static void decode(SVR_Decoder* decoder, void* data, size_t n);
+static void reportSend(SVR_Encoder* encoder, unsigned int send_ms, size_t backlog);
 
 SVR_Encoding SVR_ENCODING(jpeg) = {
         .name = "jpeg",
@@ -23,28 +46,90 @@ SVR_Encoding SVR_ENCODING(jpeg) = {
         .encode = encode,
         .openDecoder = openDecoder,
         .closeDecoder = closeDecoder,
-        .decode = decode
+        .decode = decode,
+        .reportSend = reportSend
 };
 
+/* Growable output buffer used as a libjpeg destination */
 typedef struct {
     struct jpeg_destination_mgr pub;
-    struct jpeg_compress_struct cinfo;
-    struct jpeg_error_mgr jerr;
-    SVR_Encoder* encoder;
 
     unsigned char* buffer;
     unsigned long buffer_size;
+
+    /* Length of the last image written */
+    unsigned long length;
+} SVR_JpegBuffer;
+
+struct SVR_JpegEncoder_s;
+
+/* A horizontal band of the frame, compressed as its own image */
+typedef struct {
+    SVR_JpegBuffer output;
+    struct jpeg_compress_struct cinfo;
+    struct jpeg_error_mgr jerr;
+
+    /* Rows of the frame in the band */
+    JSAMPROW* rows;
+
+#ifdef JPEG_SWAP_CHANNELS
+    /* Rows of the band converted to RGB, or NULL for a grayscale band */
+    JSAMPROW* swapped_rows;
+    JSAMPLE* swapped;
+#endif
+
+    /* Set if the band has a thread of its own. Otherwise the encoding thread
+       compresses it after band 0 */
+    pthread_t thread;
+    bool threaded;
+    struct SVR_JpegEncoder_s* parent;
+} SVR_JpegBand;
+
+typedef struct SVR_JpegEncoder_s {
+    /* Bands of the frame, each a whole number of MCU rows. Band 0 is
+       compressed by the encoding thread, and every other band by a thread of
+       its own. With more than one band, the bands are stitched into a single
+       image with a restart marker between each */
+    SVR_JpegBand* bands;
+    int band_count;
+    unsigned int restart_interval;
+
+    /* Pointers to each row of the frame being encoded */
+    JSAMPROW* rows;
+
+    /* Quality to use for the next frame, and the quality the bands are set
+       to. With automatic quality, reportSend moves quality between
+       min_quality and max_quality to keep sends within target_ms. reportSend
+       may run during an encode, so quality and frame_length are accessed
+       atomically */
+    int quality;
+    int applied_quality;
+    bool auto_quality;
+    int min_quality;
+    int max_quality;
+    unsigned int target_ms;
+
+    /* Size of the last encoded frame */
+    unsigned long frame_length;
+
+    /* Band threads compress their band each time generation changes, and
+       the last to finish signals bands_done */
+    pthread_mutex_t band_lock;
+    pthread_cond_t bands_start;
+    pthread_cond_t bands_done;
+    unsigned int generation;
+    int bands_pending;
+    bool closing;
 } SVR_JpegEncoder;
 
 typedef struct {
     struct jpeg_decompress_struct cinfo;
     struct jpeg_error_mgr jerr;
-    JSAMPROW row;
 
-    unsigned char* buffer;
-    unsigned long buffer_size;
-    unsigned long bytes_needed;
-    unsigned long bytes_received;
+    /* Pointers to each row of the frame being decoded into */
+    JSAMPROW* rows;
+
+    SVR_FramedData framed;
 } SVR_JpegDecoder;
 
 #if JPEG_LIB_VERSION < 80
@@ -128,96 +213,514 @@ jpeg_mem_src (j_decompress_ptr cinfo,
 
 #endif
 
+#ifdef JPEG_SWAP_CHANNELS
+/**
+ * Swap the red and blue channels of a row of pixels. The row may be swapped
+ * in place
+ */
+static void swapChannels(JSAMPROW destination, JSAMPROW source, JDIMENSION width) {
+    JSAMPLE blue;
+
+    for(JDIMENSION i = 0; i < width * 3; i += 3) {
+        blue = source[i];
+        destination[i] = source[i + 2];
+        destination[i + 1] = source[i + 1];
+        destination[i + 2] = blue;
+    }
+}
+#endif
+
 METHODDEF(void) init_svr_destination(j_compress_ptr cinfo) {
-    SVR_JpegEncoder* private_data = (SVR_JpegEncoder*) cinfo->dest;
+    SVR_JpegBuffer* output = (SVR_JpegBuffer*) cinfo->dest;
 
-    private_data->pub.next_output_byte = private_data->buffer;
-    private_data->pub.free_in_buffer = private_data->buffer_size;
+    output->pub.next_output_byte = output->buffer;
+    output->pub.free_in_buffer = output->buffer_size;
 }
 
 METHODDEF(boolean) empty_svr_output_buffer(j_compress_ptr cinfo) {
-    SVR_JpegEncoder* private_data = (SVR_JpegEncoder*) cinfo->dest;
+    SVR_JpegBuffer* output = (SVR_JpegBuffer*) cinfo->dest;
 
-    private_data->buffer = realloc(private_data->buffer, private_data->buffer_size + BUFFER_GROW_SIZE);
-    private_data->pub.next_output_byte = private_data->buffer + private_data->buffer_size;
-    private_data->pub.free_in_buffer = BUFFER_GROW_SIZE;
-    private_data->buffer_size += BUFFER_GROW_SIZE;
+    /* Double the buffer, so a frame needs few of these calls even when it is
+       much larger than the last */
+    output->buffer = realloc(output->buffer, output->buffer_size * 2);
+    output->pub.next_output_byte = output->buffer + output->buffer_size;
+    output->pub.free_in_buffer = output->buffer_size;
+    output->buffer_size *= 2;
 
     return true;
 }
 
 METHODDEF(void) term_svr_destination(j_compress_ptr cinfo) {
-    SVR_JpegEncoder* private_data = (SVR_JpegEncoder*) cinfo->dest;
-    uint32_t data_length = private_data->buffer_size - private_data->pub.free_in_buffer;
-    uint32_t encoded_length = htonl(data_length);
+    SVR_JpegBuffer* output = (SVR_JpegBuffer*) cinfo->dest;
 
-    /* Write data */
-    SVR_Encoder_provideData(private_data->encoder, &encoded_length, sizeof(encoded_length));
-    SVR_Encoder_provideData(private_data->encoder, private_data->buffer, data_length);
+    output->length = output->buffer_size - output->pub.free_in_buffer;
 }
 
-static void* openEncoder(SVR_FrameProperties* frame_properties, Dictionary* options) {
-    SVR_JpegEncoder* private_data = malloc(sizeof(SVR_JpegEncoder));
-    int quality = JPEG_DEFAULT_QUALITY;;
-
-    private_data->cinfo.err = jpeg_std_error(&private_data->jerr);
-    jpeg_create_compress(&private_data->cinfo);
+static void openBand(SVR_JpegBand* band, SVR_FrameProperties* frame_properties, int quality) {
+    band->cinfo.err = jpeg_std_error(&band->jerr);
+    jpeg_create_compress(&band->cinfo);
 
-    private_data->cinfo.image_width = frame_properties->width;
-    private_data->cinfo.image_height = frame_properties->height;
-    private_data->cinfo.input_components = frame_properties->channels;
+    band->cinfo.image_width = frame_properties->width;
+    band->cinfo.image_height = frame_properties->height;
+    band->cinfo.input_components = frame_properties->channels;
 
     if(frame_properties->channels == 1) {
-        private_data->cinfo.in_color_space = JCS_GRAYSCALE;
+        band->cinfo.in_color_space = JCS_GRAYSCALE;
     } else {
-        private_data->cinfo.in_color_space = JCS_RGB;
+        band->cinfo.in_color_space = JPEG_COLOR_SPACE;
+    }
+
+#ifdef JPEG_SWAP_CHANNELS
+    band->swapped_rows = NULL;
+    band->swapped = NULL;
+#endif
+
+    jpeg_set_defaults(&band->cinfo);
+    jpeg_set_quality(&band->cinfo, quality, true);
+
+    band->cinfo.dest = (struct jpeg_destination_mgr*) &band->output;
+    band->output.buffer_size = (frame_properties->width * frame_properties->height *
+                                frame_properties->channels) / BUFFER_INITIAL_DIVISOR + 1;
+    band->output.buffer = malloc(band->output.buffer_size);
+    band->output.length = 0;
+    band->output.pub.init_destination = init_svr_destination;
+    band->output.pub.empty_output_buffer = empty_svr_output_buffer;
+    band->output.pub.term_destination = term_svr_destination;
+}
+
+#ifdef JPEG_SWAP_CHANNELS
+/**
+ * Give a band its own RGB copy of its rows. Called once the band's height is
+ * known
+ */
+static void openSwappedRows(SVR_JpegBand* band) {
+    size_t row_size = band->cinfo.image_width * 3;
+
+    if(band->cinfo.input_components != 3) {
+        return;
+    }
+
+    band->swapped = malloc(row_size * band->cinfo.image_height);
+    band->swapped_rows = malloc(sizeof(JSAMPROW) * band->cinfo.image_height);
+    for(JDIMENSION r = 0; r < band->cinfo.image_height; r++) {
+        band->swapped_rows[r] = band->swapped + r * row_size;
+    }
+}
+#endif
+
+static void compressBand(SVR_JpegBand* band) {
+    SVR_JpegBuffer* output = &band->output;
+    JSAMPROW* rows = band->rows;
+    unsigned long wanted_size;
+
+    /* Size the output buffer for the last frame, so it is rarely grown while
+       compressing */
+    wanted_size = output->length + output->length / BUFFER_HEADROOM_DIVISOR;
+    if(output->buffer_size < wanted_size) {
+        output->buffer = realloc(output->buffer, wanted_size);
+        output->buffer_size = wanted_size;
+    }
+
+#ifdef JPEG_SWAP_CHANNELS
+    if(band->swapped_rows) {
+        for(JDIMENSION r = 0; r < band->cinfo.image_height; r++) {
+            swapChannels(band->swapped_rows[r], band->rows[r], band->cinfo.image_width);
+        }
+        rows = band->swapped_rows;
+    }
+#endif
+
+    /* Hand every row over at once. libjpeg may still stop early, so continue
+       from wherever it stopped */
+    jpeg_start_compress(&band->cinfo, true);
+    while(band->cinfo.next_scanline < band->cinfo.image_height) {
+        jpeg_write_scanlines(&band->cinfo, rows + band->cinfo.next_scanline,
+                             band->cinfo.image_height - band->cinfo.next_scanline);
+    }
+    jpeg_finish_compress(&band->cinfo);
+}
+
+static void* bandThread(void* arg) {
+    SVR_JpegBand* band = arg;
+    SVR_JpegEncoder* private_data = band->parent;
+    unsigned int generation = 0;
+
+    pthread_mutex_lock(&private_data->band_lock);
+    while(true) {
+        while(private_data->generation == generation && !private_data->closing) {
+            pthread_cond_wait(&private_data->bands_start, &private_data->band_lock);
+        }
+
+        if(private_data->closing) {
+            break;
+        }
+
+        generation = private_data->generation;
+        pthread_mutex_unlock(&private_data->band_lock);
+
+        compressBand(band);
+
+        pthread_mutex_lock(&private_data->band_lock);
+        private_data->bands_pending--;
+        if(private_data->bands_pending == 0) {
+            pthread_cond_signal(&private_data->bands_done);
+        }
+    }
+    pthread_mutex_unlock(&private_data->band_lock);
+
+    return NULL;
+}
+
+/**
+ * Get the offset of the entropy coded data in a compressed image, and the
+ * offsets of its start of frame and start of scan markers
+ */
+static unsigned long findScanData(SVR_JpegBuffer* output, unsigned long* sof_offset, unsigned long* sos_offset) {
+    unsigned char* data = output->buffer;
+    unsigned long offset = 2;
+    unsigned int segment_length;
+
+    /* Skip SOI, then walk marker segments until the start of scan */
+    while(offset + 4 <= output->length) {
+        segment_length = (data[offset + 2] << 8) | data[offset + 3];
+
+        if(data[offset + 1] >= 0xc0 && data[offset + 1] <= 0xc3 && sof_offset) {
+            *sof_offset = offset;
+        }
+
+        if(data[offset + 1] == 0xda) {
+            if(sos_offset) {
+                *sos_offset = offset;
+            }
+            return offset + 2 + segment_length;
+        }
+
+        offset += 2 + segment_length;
+    }
+
+    return output->length;
+}
+
+/**
+ * Provide the bands as a single image. The header of band 0 is used, with the
+ * frame height patched and a restart interval added, and the entropy coded
+ * data of each band follows, separated by restart markers. Each band starts
+ * with no DC prediction and ends byte aligned, just as a restart interval does
+ */
+static void provideStitched(SVR_Encoder* encoder) {
+    SVR_JpegEncoder* private_data = encoder->private_data;
+    SVR_JpegBuffer* first = &private_data->bands[0].output;
+    unsigned long scan_starts[JPEG_MAX_THREADS];
+    unsigned long sof_offset = 0;
+    unsigned long sos_offset = 0;
+    unsigned int height = private_data->bands[0].cinfo.image_height;
+    uint8_t dri[6] = {0xff, 0xdd, 0x00, 0x04,
+                      private_data->restart_interval >> 8, private_data->restart_interval & 0xff};
+    uint8_t marker[2] = {0xff, 0x00};
+    uint32_t data_length;
+    uint32_t encoded_length;
+
+    scan_starts[0] = findScanData(first, &sof_offset, &sos_offset);
+    data_length = first->length - 2 + sizeof(dri);
+
+    for(int i = 1; i < private_data->band_count; i++) {
+        scan_starts[i] = findScanData(&private_data->bands[i].output, NULL, NULL);
+        data_length += sizeof(marker) + (private_data->bands[i].output.length - 2 - scan_starts[i]);
+        height += private_data->bands[i].cinfo.image_height;
+    }
+    data_length += sizeof(marker);
+
+    /* Frame height is stored after the marker, segment length, and precision */
+    first->buffer[sof_offset + 5] = height >> 8;
+    first->buffer[sof_offset + 6] = height & 0xff;
+
+    encoded_length = htonl(data_length);
+    SVR_Encoder_provideData(encoder, &encoded_length, sizeof(encoded_length));
+    SVR_Encoder_provideData(encoder, first->buffer, sos_offset);
+    SVR_Encoder_provideData(encoder, dri, sizeof(dri));
+    SVR_Encoder_provideData(encoder, first->buffer + sos_offset, first->length - 2 - sos_offset);
+
+    for(int i = 1; i < private_data->band_count; i++) {
+        marker[1] = 0xd0 + ((i - 1) % 8);
+        SVR_Encoder_provideData(encoder, marker, sizeof(marker));
+        SVR_Encoder_provideData(encoder, private_data->bands[i].output.buffer + scan_starts[i],
+                                private_data->bands[i].output.length - 2 - scan_starts[i]);
+    }
+
+    marker[1] = 0xd9;
+    SVR_Encoder_provideData(encoder, marker, sizeof(marker));
+}
+
+/**
+ * Parse a quality option, falling back to the given default if invalid
+ */
+static int parseQuality(Dictionary* options, const char* name, int default_quality) {
+    int quality = atoi(Dictionary_get(options, name));
+
+    if(quality < JPEG_MIN_QUALITY || quality > JPEG_MAX_QUALITY) {
+        SVR_log(SVR_WARNING, Util_format("Invalid JPEG %s %s. Falling back to default",
+                                         name, Dictionary_get(options, name)));
+        return default_quality;
+    }
+
+    return quality;
+}
+
+/**
+ * Parse the min, max, and target_ms options of automatic quality
+ */
+static void parseAutoQuality(SVR_JpegEncoder* private_data, Dictionary* options) {
+    int target_ms;
+
+    private_data->min_quality = JPEG_AUTO_MIN_QUALITY;
+    private_data->max_quality = JPEG_AUTO_MAX_QUALITY;
+    private_data->target_ms = JPEG_AUTO_TARGET_MS;
+
+    if(Dictionary_exists(options, "min")) {
+        private_data->min_quality = parseQuality(options, "min", JPEG_AUTO_MIN_QUALITY);
     }
 
-    jpeg_set_defaults(&private_data->cinfo);
+    if(Dictionary_exists(options, "max")) {
+        private_data->max_quality = parseQuality(options, "max", JPEG_AUTO_MAX_QUALITY);
+    }
+
+    if(private_data->min_quality > private_data->max_quality) {
+        SVR_log(SVR_WARNING, Util_format("JPEG min quality %d is above max quality %d. Falling back to defaults",
+                                         private_data->min_quality, private_data->max_quality));
+        private_data->min_quality = JPEG_AUTO_MIN_QUALITY;
+        private_data->max_quality = JPEG_AUTO_MAX_QUALITY;
+    }
 
-    if(Dictionary_exists(options, "quality")) {
-        quality = atoi(Dictionary_get(options, "quality"));
-        if(quality < 5 || quality > 100) {
-            SVR_log(SVR_WARNING, Util_format("Invalid JPEG quality %s. Falling back to default",
-                                             Dictionary_get(options, "quality")));
-            quality = JPEG_DEFAULT_QUALITY;
+    if(Dictionary_exists(options, "target_ms")) {
+        target_ms = atoi(Dictionary_get(options, "target_ms"));
+        if(target_ms < 1) {
+            SVR_log(SVR_WARNING, Util_format("Invalid JPEG target_ms %s. Falling back to default",
+                                             Dictionary_get(options, "target_ms")));
+            target_ms = JPEG_AUTO_TARGET_MS;
         }
+        private_data->target_ms = target_ms;
+    }
+}
+
+static void* openEncoder(SVR_FrameProperties* frame_properties, Dictionary* options) {
+    SVR_JpegEncoder* private_data = malloc(sizeof(SVR_JpegEncoder));
+    int quality = JPEG_DEFAULT_QUALITY;
+    int threads = 1;
+    int mcu_width;
+    int mcu_height;
+    int mcus_per_row;
+    int mcu_rows;
+    int band_mcu_rows;
+    int first_row = 0;
+
+    private_data->auto_quality = false;
+    if(Dictionary_exists(options, "quality") && strcmp(Dictionary_get(options, "quality"), "auto") == 0) {
+        private_data->auto_quality = true;
+        parseAutoQuality(private_data, options);
+
+        /* Start at the default quality, or the nearest allowed */
+        quality = Util_max(Util_min(JPEG_DEFAULT_QUALITY, private_data->max_quality), private_data->min_quality);
+    } else if(Dictionary_exists(options, "quality")) {
+        quality = parseQuality(options, "quality", JPEG_DEFAULT_QUALITY);
+    }
+
+    if(Dictionary_exists(options, "threads")) {
+        threads = atoi(Dictionary_get(options, "threads"));
+        if(threads < 1 || threads > JPEG_MAX_THREADS) {
+            SVR_log(SVR_WARNING, Util_format("Invalid JPEG thread count %s. Using a single thread",
+                                             Dictionary_get(options, "threads")));
+            threads = 1;
+        }
+    }
+
+    private_data->quality = quality;
+    private_data->applied_quality = quality;
+    private_data->frame_length = 0;
+
+    private_data->rows = malloc(sizeof(JSAMPROW) * frame_properties->height);
+    private_data->bands = malloc(sizeof(SVR_JpegBand) * threads);
+    openBand(&private_data->bands[0], frame_properties, quality);
+
+    /* Split the frame into bands of whole MCU rows, using band 0's sampling
+       factors. Bands are joined with restart markers, and a restart interval is
+       at most 65535 MCUs. Frames which can not be split into bands that small
+       are compressed as a single band, which needs no restart interval */
+    mcu_width = DCTSIZE;
+    mcu_height = DCTSIZE;
+    for(int i = 0; i < private_data->bands[0].cinfo.num_components; i++) {
+        mcu_width = Util_max(mcu_width, DCTSIZE * private_data->bands[0].cinfo.comp_info[i].h_samp_factor);
+        mcu_height = Util_max(mcu_height, DCTSIZE * private_data->bands[0].cinfo.comp_info[i].v_samp_factor);
+    }
+
+    mcus_per_row = (frame_properties->width + mcu_width - 1) / mcu_width;
+    mcu_rows = (frame_properties->height + mcu_height - 1) / mcu_height;
+    band_mcu_rows = (mcu_rows + threads - 1) / threads;
+    if(threads > 1 && (mcus_per_row > 0xffff || band_mcu_rows > 0xffff / mcus_per_row)) {
+        SVR_log(SVR_WARNING, Util_format("JPEG frame too large to split between %d threads. Using a single thread", threads));
+        band_mcu_rows = mcu_rows;
     }
 
-    jpeg_set_quality(&private_data->cinfo, quality, true);
+    private_data->band_count = (mcu_rows + band_mcu_rows - 1) / band_mcu_rows;
+    private_data->restart_interval = band_mcu_rows * mcus_per_row;
+
+    for(int i = 0; i < private_data->band_count; i++) {
+        if(i > 0) {
+            openBand(&private_data->bands[i], frame_properties, quality);
+        }
+
+        private_data->bands[i].parent = private_data;
+        private_data->bands[i].threaded = false;
+        private_data->bands[i].rows = private_data->rows + first_row;
+        private_data->bands[i].cinfo.image_height = Util_min(band_mcu_rows * mcu_height,
+                                                             frame_properties->height - first_row);
+        first_row += private_data->bands[i].cinfo.image_height;
+
+#ifdef JPEG_SWAP_CHANNELS
+        openSwappedRows(&private_data->bands[i]);
+#endif
+    }
 
-    private_data->cinfo.dest = (struct jpeg_destination_mgr*) private_data;
-    private_data->buffer_size = BUFFER_GROW_SIZE;
-    private_data->buffer = malloc(private_data->buffer_size);
-    private_data->pub.next_output_byte = private_data->buffer;
-    private_data->pub.free_in_buffer = private_data->buffer_size;
-    private_data->pub.init_destination = init_svr_destination;
-    private_data->pub.empty_output_buffer = empty_svr_output_buffer;
-    private_data->pub.term_destination = term_svr_destination;
+    pthread_mutex_init(&private_data->band_lock, NULL);
+    pthread_cond_init(&private_data->bands_start, NULL);
+    pthread_cond_init(&private_data->bands_done, NULL);
+    private_data->generation = 0;
+    private_data->bands_pending = 0;
+    private_data->closing = false;
+
+    for(int i = 1; i < private_data->band_count; i++) {
+        if(pthread_create(&private_data->bands[i].thread, NULL, bandThread, &private_data->bands[i]) != 0) {
+            SVR_log(SVR_WARNING, "Could not start JPEG band thread. The band is compressed by the encoding thread");
+            continue;
+        }
+        private_data->bands[i].threaded = true;
+    }
 
     return private_data;
 }
 
 static void closeEncoder(SVR_Encoder* encoder) {
     SVR_JpegEncoder* private_data = encoder->private_data;
-    jpeg_destroy_compress(&private_data->cinfo);
-    free(private_data->buffer);
+
+    pthread_mutex_lock(&private_data->band_lock);
+    private_data->closing = true;
+    pthread_cond_broadcast(&private_data->bands_start);
+    pthread_mutex_unlock(&private_data->band_lock);
+
+    for(int i = 0; i < private_data->band_count; i++) {
+        if(private_data->bands[i].threaded) {
+            pthread_join(private_data->bands[i].thread, NULL);
+        }
+
+        jpeg_destroy_compress(&private_data->bands[i].cinfo);
+        free(private_data->bands[i].output.buffer);
+#ifdef JPEG_SWAP_CHANNELS
+        free(private_data->bands[i].swapped_rows);
+        free(private_data->bands[i].swapped);
+#endif
+    }
+
+    pthread_mutex_destroy(&private_data->band_lock);
+    pthread_cond_destroy(&private_data->bands_start);
+    pthread_cond_destroy(&private_data->bands_done);
+    free(private_data->bands);
+    free(private_data->rows);
     free(private_data);
 }
 
 static void encode(SVR_Encoder* encoder, IplImage* frame) {
     SVR_JpegEncoder* private_data = encoder->private_data;
-    JSAMPROW row;
-
-    private_data->encoder = encoder;
-    jpeg_start_compress(&private_data->cinfo, true);
+    SVR_JpegBuffer* output = &private_data->bands[0].output;
+    unsigned long frame_length;
+    uint32_t encoded_length;
+    int quality;
 
     for(int r = 0; r < frame->height; r++) {
-        row = (JSAMPROW) frame->imageData + (r * frame->widthStep);
-        jpeg_write_scanlines(&private_data->cinfo, (JSAMPARRAY) &row, 1);
+        private_data->rows[r] = (JSAMPROW) frame->imageData + (r * frame->widthStep);
     }
 
-    jpeg_finish_compress(&private_data->cinfo);
+    /* Every band must share the same quantization tables to be stitched */
+    quality = __atomic_load_n(&private_data->quality, __ATOMIC_RELAXED);
+    if(quality != private_data->applied_quality) {
+        for(int i = 0; i < private_data->band_count; i++) {
+            jpeg_set_quality(&private_data->bands[i].cinfo, quality, true);
+        }
+        private_data->applied_quality = quality;
+    }
+
+    if(private_data->band_count == 1) {
+        compressBand(&private_data->bands[0]);
+        __atomic_store_n(&private_data->frame_length, output->length, __ATOMIC_RELAXED);
+
+        encoded_length = htonl(output->length);
+        SVR_Encoder_provideData(encoder, &encoded_length, sizeof(encoded_length));
+        SVR_Encoder_provideData(encoder, output->buffer, output->length);
+        return;
+    }
+
+    /* Start the band threads, compress band 0 and any band without a thread
+       here, then wait for the rest */
+    pthread_mutex_lock(&private_data->band_lock);
+    private_data->bands_pending = 0;
+    for(int i = 1; i < private_data->band_count; i++) {
+        private_data->bands_pending += private_data->bands[i].threaded;
+    }
+    private_data->generation++;
+    pthread_cond_broadcast(&private_data->bands_start);
+    pthread_mutex_unlock(&private_data->band_lock);
+
+    for(int i = 0; i < private_data->band_count; i++) {
+        if(!private_data->bands[i].threaded) {
+            compressBand(&private_data->bands[i]);
+        }
+    }
+
+    pthread_mutex_lock(&private_data->band_lock);
+    while(private_data->bands_pending > 0) {
+        pthread_cond_wait(&private_data->bands_done, &private_data->band_lock);
+    }
+    pthread_mutex_unlock(&private_data->band_lock);
+
+    frame_length = 0;
+    for(int i = 0; i < private_data->band_count; i++) {
+        frame_length += private_data->bands[i].output.length;
+    }
+    __atomic_store_n(&private_data->frame_length, frame_length, __ATOMIC_RELAXED);
+
+    provideStitched(encoder);
+}
+
+/**
+ * Adjust automatic quality after a frame is sent. Quality drops quickly when
+ * a send overruns the target or more than a frame is left queued in the
+ * socket, and recovers one step at a time while sends finish well within the
+ * target with little queued. When several streams share the encoder, quality
+ * follows the slowest of them. Reports may arrive from several threads at once,
+ * and while a frame is encoded.
+ */
+static void reportSend(SVR_Encoder* encoder, unsigned int send_ms, size_t backlog) {
+    SVR_JpegEncoder* private_data = encoder->private_data;
+    unsigned long frame_length;
+    int quality;
+    int new_quality;
+
+    if(!private_data->auto_quality) {
+        return;
+    }
+
+    frame_length = __atomic_load_n(&private_data->frame_length, __ATOMIC_RELAXED);
+    quality = __atomic_load_n(&private_data->quality, __ATOMIC_RELAXED);
+    do {
+        new_quality = quality;
+        if(send_ms > private_data->target_ms || backlog > frame_length) {
+            new_quality -= Util_max((quality - private_data->min_quality) / 4, 1);
+        } else if(send_ms < private_data->target_ms / 2 && backlog < frame_length / 2) {
+            new_quality++;
+        }
+
+        new_quality = Util_max(Util_min(new_quality, private_data->max_quality),
+                               private_data->min_quality);
+    } while(!__atomic_compare_exchange_n(&private_data->quality, &quality, new_quality, false,
+                                         __ATOMIC_RELAXED, __ATOMIC_RELAXED));
 }
 
 static void* openDecoder(SVR_FrameProperties* frame_properties) {
@@ -226,12 +729,9 @@ static void* openDecoder(SVR_FrameProperties* frame_properties) {
     private_data->cinfo.err = jpeg_std_error(&private_data->jerr);
     jpeg_create_decompress(&private_data->cinfo);
 
-    private_data->buffer = NULL;
-    private_data->buffer_size = 0;
-    private_data->bytes_needed = 0;
-    private_data->bytes_received = 0;
+    SVR_FramedData_init(&private_data->framed);
 
-    private_data->row = malloc(frame_properties->width * frame_properties->channels);
+    private_data->rows = malloc(sizeof(JSAMPROW) * frame_properties->height);
 
     return private_data;
 }
@@ -239,51 +739,60 @@ static void* openDecoder(SVR_FrameProperties* frame_properties) {
 static void closeDecoder(SVR_Decoder* decoder) {
     SVR_JpegDecoder* private_data = decoder->private_data;
     jpeg_destroy_decompress(&private_data->cinfo);
-    free(private_data->buffer);
-    free(private_data->row);
+    SVR_FramedData_destroy(&private_data->framed);
+    free(private_data->rows);
     free(private_data);
 }
 
-static void decode(SVR_Decoder* decoder, void* data, size_t n) {
+/**
+ * Decompress a complete encoded frame directly into the decoder's current
+ * frame
+ */
+static void decodeFrame(SVR_Decoder* decoder, uint8_t* data, unsigned long n) {
     SVR_JpegDecoder* private_data = decoder->private_data;
-    unsigned long chunk_size;
+    struct jpeg_decompress_struct* cinfo = &private_data->cinfo;
+    IplImage* frame;
 
-    while(n) {
-        if(private_data->bytes_needed == 0) {
-            private_data->bytes_received = 0;
+    jpeg_mem_src(cinfo, data, n);
+    jpeg_read_header(cinfo, true);
+    if(cinfo->out_color_space == JCS_RGB) {
+        cinfo->out_color_space = JPEG_COLOR_SPACE;
+    }
+    jpeg_start_decompress(cinfo);
+
+    if(cinfo->output_width != decoder->frame_properties->width ||
+       cinfo->output_height != decoder->frame_properties->height ||
+       cinfo->output_components != decoder->frame_properties->channels) {
+        SVR_log(SVR_WARNING, "JPEG frame does not match stream properties");
+        jpeg_abort_decompress(cinfo);
+        return;
+    }
 
-            /* Read the first 4 bytes which give us the size of the encoded
-               frame */
-            private_data->bytes_needed = ntohl(((uint32_t*)data)[0]);
-            data = ((uint8_t*)data) + sizeof(uint32_t);
-            n -= sizeof(uint32_t);
+    frame = SVR_Decoder_getCurrentFrame(decoder);
+    for(int r = 0; r < frame->height; r++) {
+        private_data->rows[r] = (JSAMPROW) frame->imageData + (r * frame->widthStep);
+    }
 
-            if(private_data->buffer_size < private_data->bytes_needed) {
-                private_data->buffer = realloc(private_data->buffer, private_data->bytes_needed);
-                private_data->buffer_size = private_data->bytes_needed;
-            }
-        } else {
-            chunk_size = Util_min(n, private_data->bytes_needed);
-            memcpy(private_data->buffer + private_data->bytes_received, data, chunk_size);
-            private_data->bytes_received += chunk_size;
-
-            n -= chunk_size;
-            data = ((uint8_t*)data) + chunk_size;
-
-            if(private_data->bytes_received == private_data->bytes_needed) {
-                jpeg_mem_src(&private_data->cinfo, private_data->buffer, private_data->bytes_needed);
-                jpeg_read_header(&private_data->cinfo, true);
-                jpeg_start_decompress(&private_data->cinfo);
-
-                for(int r = 0; r < decoder->frame_properties->height; r++) {
-                    jpeg_read_scanlines(&private_data->cinfo, &private_data->row, 1);
-                    SVR_Decoder_writeUnpaddedFrameData(decoder, private_data->row,
-                            decoder->frame_properties->width * decoder->frame_properties->channels);
-                }
-                jpeg_finish_decompress(&private_data->cinfo);
-
-                private_data->bytes_needed = 0;
-            }
+    /* Read rows straight into the frame, as many per call as libjpeg allows */
+    while(cinfo->output_scanline < cinfo->output_height) {
+        jpeg_read_scanlines(cinfo, private_data->rows + cinfo->output_scanline,
+                            cinfo->output_height - cinfo->output_scanline);
+    }
+    jpeg_finish_decompress(cinfo);
+
+#ifdef JPEG_SWAP_CHANNELS
+    if(cinfo->output_components == 3) {
+        for(int r = 0; r < frame->height; r++) {
+            swapChannels(private_data->rows[r], private_data->rows[r], frame->width);
         }
     }
+#endif
+
+    SVR_Decoder_currentFrameComplete(decoder);
+}
+
+static void decode(SVR_Decoder* decoder, void* data, size_t n) {
+    SVR_JpegDecoder* private_data = decoder->private_data;
+
+    SVR_FramedData_read(&private_data->framed, decoder, data, n, decodeFrame);
 }
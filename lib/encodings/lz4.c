@@ -0,0 +1,417 @@
+
+#include <svr.h>
+
+#include "encoding_internal.h"
+
+#define LZ4_DEFAULT_LEVEL 1
+#define LZ4_MAX_LEVEL 9
+
+/* Hash table size, in bits, for level 1. Each level doubles the table */
+#define LZ4_BASE_HASH_LOG 12
+
+/* LZ4 block format limits */
+#define LZ4_MIN_MATCH 4
+#define LZ4_MAX_OFFSET 65535
+#define LZ4_LAST_LITERALS 5
+#define LZ4_MATCH_FIND_LIMIT 12
+#define LZ4_COMPRESS_BOUND(n) ((n) + ((n) / 255) + 16)
+
+/* Each encoded frame is a 4 byte length, a filter byte, then an LZ4 block */
+#define LZ4_FRAME_HEADER_LEN (sizeof(uint32_t) + 1)
+
+typedef enum {
+    LZ4_FILTER_NONE,
+    LZ4_FILTER_LEFT,
+    LZ4_FILTER_UP
+} SVR_Lz4Filter;
+
+static void* openEncoder(SVR_FrameProperties* frame_properties, Dictionary* options);
+static void closeEncoder(SVR_Encoder* encoder);
+static void encode(SVR_Encoder* encoder, IplImage* frame);
+
+static void* openDecoder(SVR_FrameProperties* frame_properties);
+static void closeDecoder(SVR_Decoder* decoder);
+static void decode(SVR_Decoder* decoder, void* data, size_t n);
+
+SVR_Encoding SVR_ENCODING(lz4) = {
+        .name = "lz4",
+        .openEncoder = openEncoder,
+        .closeEncoder = closeEncoder,
+        .encode = encode,
+        .openDecoder = openDecoder,
+        .closeDecoder = closeDecoder,
+        .decode = decode
+};
+
+typedef struct {
+    SVR_Lz4Filter filter;
+    int hash_log;
+    uint32_t* hash_table;
+
+    /* Filtered frame without row padding */
+    uint8_t* filtered;
+
+    size_t row_size;
+    size_t frame_size;
+} SVR_Lz4Encoder;
+
+typedef struct {
+    /* Decompressed, still filtered, frame */
+    uint8_t* filtered;
+
+    SVR_FramedData framed;
+
+    size_t row_size;
+    size_t frame_size;
+} SVR_Lz4Decoder;
+
+static inline uint32_t read32(const uint8_t* p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t hash32(uint32_t v, int hash_log) {
+    return (v * 2654435761U) >> (32 - hash_log);
+}
+
+/**
+ * Write a literal or match length continuation, after the first 15 counted in
+ * the token
+ */
+static uint8_t* writeLength(uint8_t* op, size_t length) {
+    while(length >= 255) {
+        *op++ = 255;
+        length -= 255;
+    }
+    *op++ = length;
+
+    return op;
+}
+
+static uint8_t* writeSequence(uint8_t* op, const uint8_t* literals, size_t literal_length, unsigned int offset, size_t match_length) {
+    uint8_t* token = op++;
+
+    *token = Util_min(literal_length, 15) << 4;
+    if(literal_length >= 15) {
+        op = writeLength(op, literal_length - 15);
+    }
+
+    memcpy(op, literals, literal_length);
+    op += literal_length;
+
+    /* The last sequence has no match */
+    if(match_length == 0) {
+        return op;
+    }
+
+    *op++ = offset & 0xff;
+    *op++ = offset >> 8;
+
+    match_length -= LZ4_MIN_MATCH;
+    *token |= Util_min(match_length, 15);
+    if(match_length >= 15) {
+        op = writeLength(op, match_length - 15);
+    }
+
+    return op;
+}
+
+/**
+ * Compress a block in the LZ4 block format with greedy matching. The
+ * destination must have room for LZ4_COMPRESS_BOUND(n) bytes. Returns the
+ * compressed size
+ */
+static size_t lz4Compress(const uint8_t* src, size_t n, uint8_t* dst, uint32_t* hash_table, int hash_log) {
+    const uint8_t* ip = src;
+    const uint8_t* anchor = src;
+    const uint8_t* match_limit = src + n - LZ4_MATCH_FIND_LIMIT;
+    const uint8_t* match_end = src + n - LZ4_LAST_LITERALS;
+    const uint8_t* match;
+    uint8_t* op = dst;
+    uint32_t h;
+    size_t length;
+    unsigned int misses = 0;
+
+    memset(hash_table, 0, sizeof(uint32_t) << hash_log);
+
+    if(n > LZ4_MATCH_FIND_LIMIT) {
+        while(ip < match_limit) {
+            h = hash32(read32(ip), hash_log);
+            match = src + hash_table[h];
+            hash_table[h] = ip - src;
+
+            if(match >= ip || ip - match > LZ4_MAX_OFFSET || read32(match) != read32(ip)) {
+                /* Step further through data which is not compressing */
+                ip += 1 + (misses++ >> 6);
+                continue;
+            }
+
+            length = LZ4_MIN_MATCH;
+            while(ip + length < match_end && match[length] == ip[length]) {
+                length++;
+            }
+
+            op = writeSequence(op, anchor, ip - anchor, ip - match, length);
+            ip += length;
+            anchor = ip;
+            misses = 0;
+        }
+    }
+
+    op = writeSequence(op, anchor, src + n - anchor, 0, 0);
+
+    return op - dst;
+}
+
+/**
+ * Decompress an LZ4 block, checking every length and offset against the
+ * buffers. Returns the decompressed size, or -1 if the block is invalid
+ */
+static ssize_t lz4Decompress(const uint8_t* src, size_t n, uint8_t* dst, size_t dst_size) {
+    const uint8_t* ip = src;
+    const uint8_t* src_end = src + n;
+    uint8_t* op = dst;
+    uint8_t* dst_end = dst + dst_size;
+    const uint8_t* match;
+    size_t length;
+    unsigned int offset;
+    uint8_t token;
+    uint8_t b;
+
+    while(ip < src_end) {
+        token = *ip++;
+
+        length = token >> 4;
+        if(length == 15) {
+            do {
+                if(ip >= src_end) {
+                    return -1;
+                }
+                b = *ip++;
+                length += b;
+            } while(b == 255);
+        }
+
+        if(length > src_end - ip || length > dst_end - op) {
+            return -1;
+        }
+        memcpy(op, ip, length);
+        ip += length;
+        op += length;
+
+        /* The last sequence ends with its literals */
+        if(ip == src_end) {
+            break;
+        }
+
+        if(src_end - ip < 2) {
+            return -1;
+        }
+        offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if(offset == 0 || offset > op - dst) {
+            return -1;
+        }
+
+        length = token & 15;
+        if(length == 15) {
+            do {
+                if(ip >= src_end) {
+                    return -1;
+                }
+                b = *ip++;
+                length += b;
+            } while(b == 255);
+        }
+        length += LZ4_MIN_MATCH;
+
+        if(length > dst_end - op) {
+            return -1;
+        }
+
+        /* Matches may overlap the bytes they produce */
+        match = op - offset;
+        if(offset >= length) {
+            memcpy(op, match, length);
+            op += length;
+        } else {
+            while(length--) {
+                *op++ = *match++;
+            }
+        }
+    }
+
+    return op - dst;
+}
+
+/**
+ * Delta filter a frame into an unpadded buffer. Each byte is replaced by its
+ * difference from the same channel of the pixel to its left, or of the pixel
+ * above
+ */
+static void filterFrame(SVR_Lz4Filter filter, IplImage* frame, uint8_t* out) {
+    const int channels = frame->nChannels;
+    const size_t row_size = frame->width * channels;
+    const uint8_t* row;
+    const uint8_t* above;
+
+    for(int y = 0; y < frame->height; y++) {
+        row = (uint8_t*) frame->imageData + y * frame->widthStep;
+        above = row - frame->widthStep;
+
+        if(filter == LZ4_FILTER_LEFT) {
+            memcpy(out, row, channels);
+            for(size_t x = channels; x < row_size; x++) {
+                out[x] = row[x] - row[x - channels];
+            }
+        } else if(filter == LZ4_FILTER_UP && y > 0) {
+            for(size_t x = 0; x < row_size; x++) {
+                out[x] = row[x] - above[x];
+            }
+        } else {
+            memcpy(out, row, row_size);
+        }
+
+        out += row_size;
+    }
+}
+
+/**
+ * Reverse filterFrame, writing into a frame's rows
+ */
+static void unfilterFrame(SVR_Lz4Filter filter, const uint8_t* in, IplImage* frame) {
+    const int channels = frame->nChannels;
+    const size_t row_size = frame->width * channels;
+    uint8_t* row;
+    uint8_t* above;
+
+    for(int y = 0; y < frame->height; y++) {
+        row = (uint8_t*) frame->imageData + y * frame->widthStep;
+        above = row - frame->widthStep;
+
+        if(filter == LZ4_FILTER_LEFT) {
+            memcpy(row, in, channels);
+            for(size_t x = channels; x < row_size; x++) {
+                row[x] = in[x] + row[x - channels];
+            }
+        } else if(filter == LZ4_FILTER_UP && y > 0) {
+            for(size_t x = 0; x < row_size; x++) {
+                row[x] = in[x] + above[x];
+            }
+        } else {
+            memcpy(row, in, row_size);
+        }
+
+        in += row_size;
+    }
+}
+
+static void* openEncoder(SVR_FrameProperties* frame_properties, Dictionary* options) {
+    SVR_Lz4Encoder* private_data = malloc(sizeof(SVR_Lz4Encoder));
+    const char* filter = "left";
+    int level = LZ4_DEFAULT_LEVEL;
+
+    if(Dictionary_exists(options, "level")) {
+        level = atoi(Dictionary_get(options, "level"));
+        if(level < 1 || level > LZ4_MAX_LEVEL) {
+            SVR_log(SVR_WARNING, Util_format("Invalid LZ4 level %s. Falling back to default",
+                                             Dictionary_get(options, "level")));
+            level = LZ4_DEFAULT_LEVEL;
+        }
+    }
+
+    if(Dictionary_exists(options, "filter")) {
+        filter = Dictionary_get(options, "filter");
+    }
+
+    if(strcmp(filter, "none") == 0) {
+        private_data->filter = LZ4_FILTER_NONE;
+    } else if(strcmp(filter, "up") == 0) {
+        private_data->filter = LZ4_FILTER_UP;
+    } else {
+        if(strcmp(filter, "left") != 0) {
+            SVR_log(SVR_WARNING, Util_format("Invalid LZ4 filter %s. Falling back to left", filter));
+        }
+        private_data->filter = LZ4_FILTER_LEFT;
+    }
+
+    private_data->row_size = frame_properties->width * frame_properties->channels;
+    private_data->frame_size = private_data->row_size * frame_properties->height;
+
+    private_data->hash_log = LZ4_BASE_HASH_LOG + level - 1;
+    private_data->hash_table = malloc(sizeof(uint32_t) << private_data->hash_log);
+    private_data->filtered = malloc(private_data->frame_size);
+
+    return private_data;
+}
+
+static void closeEncoder(SVR_Encoder* encoder) {
+    SVR_Lz4Encoder* private_data = encoder->private_data;
+
+    free(private_data->hash_table);
+    free(private_data->filtered);
+    free(private_data);
+}
+
+static void encode(SVR_Encoder* encoder, IplImage* frame) {
+    SVR_Lz4Encoder* private_data = encoder->private_data;
+    uint8_t* output = SVR_Encoder_reserveData(encoder, LZ4_FRAME_HEADER_LEN + LZ4_COMPRESS_BOUND(private_data->frame_size));
+    uint32_t encoded_length;
+    size_t n;
+
+    filterFrame(private_data->filter, frame, private_data->filtered);
+    n = lz4Compress(private_data->filtered, private_data->frame_size, output + LZ4_FRAME_HEADER_LEN,
+                    private_data->hash_table, private_data->hash_log);
+
+    /* Prefix the block with its length, including the filter byte */
+    encoded_length = htonl(n + 1);
+    memcpy(output, &encoded_length, sizeof(encoded_length));
+    output[sizeof(encoded_length)] = private_data->filter;
+
+    SVR_Encoder_commitData(encoder, LZ4_FRAME_HEADER_LEN + n);
+}
+
+static void* openDecoder(SVR_FrameProperties* frame_properties) {
+    SVR_Lz4Decoder* private_data = malloc(sizeof(SVR_Lz4Decoder));
+
+    private_data->row_size = frame_properties->width * frame_properties->channels;
+    private_data->frame_size = private_data->row_size * frame_properties->height;
+    private_data->filtered = malloc(private_data->frame_size);
+
+    SVR_FramedData_init(&private_data->framed);
+
+    return private_data;
+}
+
+static void closeDecoder(SVR_Decoder* decoder) {
+    SVR_Lz4Decoder* private_data = decoder->private_data;
+
+    free(private_data->filtered);
+    SVR_FramedData_destroy(&private_data->framed);
+    free(private_data);
+}
+
+/**
+ * Decompress and unfilter a complete encoded frame into the decoder's current
+ * frame
+ */
+static void decodeFrame(SVR_Decoder* decoder, uint8_t* data, unsigned long n) {
+    SVR_Lz4Decoder* private_data = decoder->private_data;
+    SVR_Lz4Filter filter = data[0];
+
+    if(filter > LZ4_FILTER_UP ||
+       lz4Decompress(data + 1, n - 1, private_data->filtered, private_data->frame_size) != private_data->frame_size) {
+        SVR_log(SVR_WARNING, "Invalid LZ4 frame");
+        return;
+    }
+
+    unfilterFrame(filter, private_data->filtered, SVR_Decoder_getCurrentFrame(decoder));
+    SVR_Decoder_currentFrameComplete(decoder);
+}
+
+static void decode(SVR_Decoder* decoder, void* data, size_t n) {
+    SVR_Lz4Decoder* private_data = decoder->private_data;
+
+    SVR_FramedData_read(&private_data->framed, decoder, data, n, decodeFrame);
+}
@@ -0,0 +1,452 @@
+
+#include <svr.h>
+
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "encoding_internal.h"
+
+#define SHM_MAGIC 0x53565232
+#define SHM_DEFAULT_SLOTS 4
+#define SHM_MAX_SLOTS 64
+#define SHM_MAX_READERS 16
+#define SHM_ALIGNMENT 64
+#define SHM_NOTIFICATION_SIZE 256
+
+#define SHM_ALIGN(n) (((n) + SHM_ALIGNMENT - 1) & ~((size_t) SHM_ALIGNMENT - 1))
+
+static void* openEncoder(SVR_FrameProperties* frame_properties, Dictionary* options);
+static void closeEncoder(SVR_Encoder* encoder);
+static void encode(SVR_Encoder* encoder, IplImage* frame);
+
+static void* openDecoder(SVR_FrameProperties* frame_properties);
+static void closeDecoder(SVR_Decoder* decoder);
+static void decode(SVR_Decoder* decoder, void* data, size_t n);
+static void returnFrame(SVR_Decoder* decoder, IplImage* frame);
+
+SVR_Encoding SVR_ENCODING(shm) = {
+        .name = "shm",
+        .openEncoder = openEncoder,
+        .closeEncoder = closeEncoder,
+        .encode = encode,
+        .openDecoder = openDecoder,
+        .closeDecoder = closeDecoder,
+        .decode = decode,
+        .returnFrame = returnFrame,
+        .external_frame_data = true
+};
+
+/* Placed at the start of the shared memory segment */
+typedef struct {
+    uint32_t magic;
+    uint32_t slot_count;
+
+    /* Size of each slot including its header */
+    uint32_t slot_size;
+    uint32_t image_size;
+    uint32_t width_step;
+} SVR_ShmSegmentHeader;
+
+/* Frames of a slot held by one client process. An entry is claimed by
+   setting its pid, and stays with the process until the server finds that
+   the process has exited */
+typedef struct {
+    int32_t pid;
+
+    /* Number of decoded frames in the process referencing the slot */
+    uint32_t count;
+} SVR_ShmLease;
+
+/* Placed at the start of each frame slot. The frame data follows, aligned to
+   SHM_ALIGNMENT bytes */
+typedef struct {
+    /* Sequence number of the frame held in the slot, or 0 while the slot is
+       being written */
+    uint64_t sequence;
+
+    SVR_ShmLease leases[SHM_MAX_READERS];
+} SVR_ShmSlotHeader;
+
+typedef struct {
+    char* name;
+    void* segment;
+    size_t segment_size;
+
+    unsigned int next_slot;
+    unsigned long sequence;
+} SVR_ShmEncoder;
+
+typedef struct {
+    char* name;
+    void* segment;
+    size_t segment_size;
+
+    /* Number of frames given out by the decoder which still hold a slot */
+    int leased_frames;
+
+    char notification[SHM_NOTIFICATION_SIZE];
+    size_t notification_length;
+} SVR_ShmDecoder;
+
+static SVR_ShmSlotHeader* getSlot(void* segment, unsigned int slot_index) {
+    SVR_ShmSegmentHeader* header = segment;
+    return (SVR_ShmSlotHeader*) (((uint8_t*) segment) + SHM_ALIGN(sizeof(SVR_ShmSegmentHeader)) + (slot_index * header->slot_size));
+}
+
+static void* getSlotData(SVR_ShmSlotHeader* slot) {
+    return ((uint8_t*) slot) + SHM_ALIGN(sizeof(SVR_ShmSlotHeader));
+}
+
+/**
+ * Check if any client holds frames from a slot. Leases held by processes which
+ * no longer exist, such as a client which crashed before returning its frames,
+ * are released instead
+ */
+static bool slotLeased(SVR_ShmSlotHeader* slot) {
+    SVR_ShmLease* lease;
+    int32_t pid;
+    bool leased = false;
+
+    for(int i = 0; i < SHM_MAX_READERS; i++) {
+        lease = &slot->leases[i];
+        if(__atomic_load_n(&lease->count, __ATOMIC_SEQ_CST) == 0) {
+            continue;
+        }
+
+        pid = __atomic_load_n(&lease->pid, __ATOMIC_SEQ_CST);
+        if(kill(pid, 0) < 0 && errno == ESRCH) {
+            /* Clear the count before freeing the entry, so a process claiming
+               the entry next starts from zero */
+            SVR_log(SVR_DEBUG, Util_format("Reclaiming shared memory slot lease of exited process %d", (int) pid));
+            __atomic_store_n(&lease->count, 0, __ATOMIC_SEQ_CST);
+            __atomic_compare_exchange_n(&lease->pid, &pid, 0, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+            continue;
+        }
+
+        leased = true;
+    }
+
+    return leased;
+}
+
+/**
+ * Get this process's lease entry for a slot, claiming a free entry if it has
+ * none. Returns NULL if every entry belongs to another process
+ */
+static SVR_ShmLease* getLease(SVR_ShmSlotHeader* slot) {
+    int32_t pid = getpid();
+    int32_t expected;
+
+    for(int i = 0; i < SHM_MAX_READERS; i++) {
+        if(__atomic_load_n(&slot->leases[i].pid, __ATOMIC_SEQ_CST) == pid) {
+            return &slot->leases[i];
+        }
+    }
+
+    for(int i = 0; i < SHM_MAX_READERS; i++) {
+        expected = 0;
+        if(__atomic_compare_exchange_n(&slot->leases[i].pid, &expected, pid, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+            return &slot->leases[i];
+        }
+    }
+
+    return NULL;
+}
+
+static void* openEncoder(SVR_FrameProperties* frame_properties, Dictionary* options) {
+    static unsigned int segment_count = 0;
+    SVR_ShmEncoder* private_data = malloc(sizeof(SVR_ShmEncoder));
+    SVR_ShmSegmentHeader* header;
+    IplImage* frame_header;
+    int slot_count = SHM_DEFAULT_SLOTS;
+    size_t slot_size;
+    int fd;
+
+    if(Dictionary_exists(options, "slots")) {
+        slot_count = atoi(Dictionary_get(options, "slots"));
+        if(slot_count < 2 || slot_count > SHM_MAX_SLOTS) {
+            SVR_log(SVR_WARNING, Util_format("Invalid shared memory slot count %s. Falling back to default",
+                                             Dictionary_get(options, "slots")));
+            slot_count = SHM_DEFAULT_SLOTS;
+        }
+    }
+
+    /* Determine the size and row stride of frames as OpenCV would allocate
+       them */
+    frame_header = cvCreateImageHeader(cvSize(frame_properties->width, frame_properties->height),
+                                       frame_properties->depth, frame_properties->channels);
+    slot_size = SHM_ALIGN(sizeof(SVR_ShmSlotHeader)) + SHM_ALIGN(frame_header->imageSize);
+
+    private_data->name = strdup(Util_format("/svr-%d-%u", (int) getpid(),
+                                            __atomic_fetch_add(&segment_count, 1, __ATOMIC_SEQ_CST)));
+    private_data->segment_size = SHM_ALIGN(sizeof(SVR_ShmSegmentHeader)) + (slot_count * slot_size);
+    private_data->segment = NULL;
+    private_data->next_slot = 0;
+    private_data->sequence = 0;
+
+    fd = shm_open(private_data->name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if(fd < 0) {
+        SVR_log(SVR_ERROR, Util_format("Could not create shared memory segment %s", private_data->name));
+        cvReleaseImageHeader(&frame_header);
+        return private_data;
+    }
+
+    if(ftruncate(fd, private_data->segment_size) == 0) {
+        private_data->segment = mmap(NULL, private_data->segment_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if(private_data->segment == MAP_FAILED) {
+            private_data->segment = NULL;
+        }
+    }
+    close(fd);
+
+    if(private_data->segment == NULL) {
+        SVR_log(SVR_ERROR, Util_format("Could not map shared memory segment %s", private_data->name));
+        shm_unlink(private_data->name);
+        cvReleaseImageHeader(&frame_header);
+        return private_data;
+    }
+
+    /* The segment is zero filled by ftruncate so every slot starts empty with
+       no readers */
+    header = private_data->segment;
+    header->slot_count = slot_count;
+    header->slot_size = slot_size;
+    header->image_size = frame_header->imageSize;
+    header->width_step = frame_header->widthStep;
+    __atomic_store_n(&header->magic, SHM_MAGIC, __ATOMIC_RELEASE);
+
+    cvReleaseImageHeader(&frame_header);
+
+    return private_data;
+}
+
+static void closeEncoder(SVR_Encoder* encoder) {
+    SVR_ShmEncoder* private_data = encoder->private_data;
+
+    /* Clients which still have the segment mapped keep their mapping until
+       they release it */
+    if(private_data->segment) {
+        munmap(private_data->segment, private_data->segment_size);
+        shm_unlink(private_data->name);
+    }
+
+    free(private_data->name);
+    free(private_data);
+}
+
+static void encode(SVR_Encoder* encoder, IplImage* frame) {
+    SVR_ShmEncoder* private_data = encoder->private_data;
+    SVR_ShmSegmentHeader* header = private_data->segment;
+    SVR_ShmSlotHeader* slot;
+    uint64_t previous_sequence;
+    unsigned int slot_index;
+    const char* notification;
+
+    if(header == NULL) {
+        return;
+    }
+
+    for(unsigned int i = 0; i < header->slot_count; i++) {
+        slot_index = (private_data->next_slot + i) % header->slot_count;
+        slot = getSlot(header, slot_index);
+
+        /* Invalidate the slot before checking for readers. A reader taking a
+           lease at the same time will either be seen here, or will see the
+           invalidated sequence number and give the lease back */
+        previous_sequence = __atomic_exchange_n(&slot->sequence, 0, __ATOMIC_SEQ_CST);
+        if(slotLeased(slot)) {
+            __atomic_store_n(&slot->sequence, previous_sequence, __ATOMIC_SEQ_CST);
+            continue;
+        }
+
+        memcpy(getSlotData(slot), frame->imageData, Util_min(frame->imageSize, header->image_size));
+        private_data->sequence++;
+        __atomic_store_n(&slot->sequence, private_data->sequence, __ATOMIC_SEQ_CST);
+        private_data->next_slot = (slot_index + 1) % header->slot_count;
+
+        /* Only a short, null terminated notification is sent over the
+           network */
+        notification = Util_format("%s %u %lu", private_data->name, slot_index, private_data->sequence);
+        SVR_Encoder_provideData(encoder, (void*) notification, strlen(notification) + 1);
+        return;
+    }
+
+    SVR_log(SVR_DEBUG, "All shared memory slots in use, dropping frame");
+}
+
+static void* openDecoder(SVR_FrameProperties* frame_properties) {
+    SVR_ShmDecoder* private_data = malloc(sizeof(SVR_ShmDecoder));
+
+    private_data->name = NULL;
+    private_data->segment = NULL;
+    private_data->segment_size = 0;
+    private_data->leased_frames = 0;
+    private_data->notification_length = 0;
+
+    return private_data;
+}
+
+static void unmapSegment(SVR_ShmDecoder* private_data) {
+    if(private_data->segment) {
+        munmap(private_data->segment, private_data->segment_size);
+        private_data->segment = NULL;
+    }
+
+    if(private_data->name) {
+        free(private_data->name);
+        private_data->name = NULL;
+    }
+}
+
+static int mapSegment(SVR_ShmDecoder* private_data, const char* name) {
+    SVR_ShmSegmentHeader* header;
+    struct stat segment_stat;
+    void* segment;
+    int fd;
+
+    unmapSegment(private_data);
+
+    fd = shm_open(name, O_RDWR, 0);
+    if(fd < 0) {
+        SVR_log(SVR_ERROR, Util_format("Could not open shared memory segment %s", name));
+        return SVR_UNKNOWNERROR;
+    }
+
+    if(fstat(fd, &segment_stat) < 0 || segment_stat.st_size < sizeof(SVR_ShmSegmentHeader)) {
+        close(fd);
+        return SVR_UNKNOWNERROR;
+    }
+
+    segment = mmap(NULL, segment_stat.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if(segment == MAP_FAILED) {
+        SVR_log(SVR_ERROR, Util_format("Could not map shared memory segment %s", name));
+        return SVR_UNKNOWNERROR;
+    }
+
+    header = segment;
+    if(__atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) != SHM_MAGIC ||
+       SHM_ALIGN(sizeof(SVR_ShmSegmentHeader)) + (header->slot_count * header->slot_size) > segment_stat.st_size) {
+        SVR_log(SVR_ERROR, Util_format("Invalid shared memory segment %s", name));
+        munmap(segment, segment_stat.st_size);
+        return SVR_UNKNOWNERROR;
+    }
+
+    private_data->name = strdup(name);
+    private_data->segment = segment;
+    private_data->segment_size = segment_stat.st_size;
+
+    return SVR_SUCCESS;
+}
+
+static void readNotification(SVR_Decoder* decoder, const char* notification) {
+    SVR_ShmDecoder* private_data = decoder->private_data;
+    SVR_FrameProperties* frame_properties = decoder->frame_properties;
+    SVR_ShmSegmentHeader* header;
+    SVR_ShmSlotHeader* slot;
+    SVR_ShmLease* lease;
+    char name[SHM_NOTIFICATION_SIZE];
+    unsigned int slot_index;
+    unsigned long sequence;
+    IplImage* frame;
+
+    if(sscanf(notification, "%255s %u %lu", name, &slot_index, &sequence) != 3) {
+        SVR_log(SVR_WARNING, "Invalid shared memory frame notification");
+        return;
+    }
+
+    SVR_LOCK(decoder);
+
+    /* The segment only changes when the server recreates its encoder. Frames
+       still pointing into the old segment must be returned first */
+    if(private_data->name == NULL || strcmp(private_data->name, name) != 0) {
+        if(private_data->leased_frames > 0 || mapSegment(private_data, name) != SVR_SUCCESS) {
+            SVR_UNLOCK(decoder);
+            return;
+        }
+    }
+
+    header = private_data->segment;
+    if(slot_index >= header->slot_count ||
+       header->width_step * frame_properties->height > header->image_size) {
+        SVR_log(SVR_WARNING, "Shared memory frame does not match stream properties");
+        SVR_UNLOCK(decoder);
+        return;
+    }
+
+    /* Take a lease on the slot, then make sure it still holds the announced
+       frame. If the server has already reused it, the frame is dropped */
+    slot = getSlot(header, slot_index);
+    lease = getLease(slot);
+    if(lease == NULL) {
+        SVR_log(SVR_WARNING, "Too many processes reading shared memory slot, dropping frame");
+        SVR_UNLOCK(decoder);
+        return;
+    }
+
+    __atomic_add_fetch(&lease->count, 1, __ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&slot->sequence, __ATOMIC_SEQ_CST) != sequence) {
+        __atomic_sub_fetch(&lease->count, 1, __ATOMIC_SEQ_CST);
+        SVR_UNLOCK(decoder);
+        return;
+    }
+
+    private_data->leased_frames++;
+    SVR_UNLOCK(decoder);
+
+    /* Frames are only image headers pointing directly into the slot. The
+       frame pool may wait for a frame to be returned, which takes the decoder
+       lock, so the frame is acquired with the decoder unlocked. If the frame
+       is dropped, the lease is released through returnFrame */
+    frame = SVR_FramePool_acquire(decoder->frame_pool);
+    cvSetData(frame, getSlotData(slot), header->width_step);
+    SVR_FramePool_commit(decoder->frame_pool, frame);
+}
+
+static void decode(SVR_Decoder* decoder, void* data, size_t n) {
+    SVR_ShmDecoder* private_data = decoder->private_data;
+    char* bytes = data;
+
+    for(size_t i = 0; i < n; i++) {
+        if(private_data->notification_length == SHM_NOTIFICATION_SIZE) {
+            SVR_log(SVR_WARNING, "Shared memory frame notification too long");
+            private_data->notification_length = 0;
+        }
+
+        private_data->notification[private_data->notification_length++] = bytes[i];
+
+        if(bytes[i] == '\0') {
+            readNotification(decoder, private_data->notification);
+            private_data->notification_length = 0;
+        }
+    }
+}
+
+static void returnFrame(SVR_Decoder* decoder, IplImage* frame) {
+    SVR_ShmDecoder* private_data = decoder->private_data;
+    SVR_ShmSegmentHeader* header = private_data->segment;
+    size_t offset = ((uint8_t*) frame->imageData) - ((uint8_t*) getSlot(header, 0));
+
+    /* The lease entry taken in readNotification still belongs to this
+       process, as it is only reclaimed once the process exits */
+    __atomic_sub_fetch(&getLease(getSlot(header, offset / header->slot_size))->count, 1, __ATOMIC_SEQ_CST);
+    private_data->leased_frames--;
+}
+
+static void closeDecoder(SVR_Decoder* decoder) {
+    SVR_ShmDecoder* private_data = decoder->private_data;
+    IplImage* frame;
+
+    /* Release leases held by frames never retrieved */
+    while((frame = SVR_FramePool_getReady(decoder->frame_pool)) != NULL) {
+        returnFrame(decoder, frame);
+        SVR_FramePool_returnFrame(decoder->frame_pool, frame);
+    }
+
+    unmapSegment(private_data);
+    free(private_data);
+}
@@ -0,0 +1,263 @@
+
+#include <svr.h>
+
+#include "encoding_internal.h"
+
+/* Fixed point BT.601 coefficients, scaled by 256, for limited range YUV as
+   produced by cameras and hardware video codecs */
+#define YUV_Y_OFFSET 16
+#define YUV_C_OFFSET 128
+
+typedef enum {
+    /* Y plane, then a U plane and a V plane at half resolution (I420) */
+    YUV_LAYOUT_PLANAR,
+
+    /* Y plane, then a single plane of interleaved U and V samples */
+    YUV_LAYOUT_NV12
+} SVR_YuvLayout;
+
+static void* openEncoderPlanar(SVR_FrameProperties* frame_properties, Dictionary* options);
+static void* openEncoderNV12(SVR_FrameProperties* frame_properties, Dictionary* options);
+static void closeEncoder(SVR_Encoder* encoder);
+static void encode(SVR_Encoder* encoder, IplImage* frame);
+
+static void* openDecoderPlanar(SVR_FrameProperties* frame_properties);
+static void* openDecoderNV12(SVR_FrameProperties* frame_properties);
+static void closeDecoder(SVR_Decoder* decoder);
+static void decode(SVR_Decoder* decoder, void* data, size_t n);
+
+SVR_Encoding SVR_ENCODING(yuv420) = {
+        .name = "yuv420",
+        .openEncoder = openEncoderPlanar,
+        .closeEncoder = closeEncoder,
+        .encode = encode,
+        .openDecoder = openDecoderPlanar,
+        .closeDecoder = closeDecoder,
+        .decode = decode
+};
+
+SVR_Encoding SVR_ENCODING(nv12) = {
+        .name = "nv12",
+        .openEncoder = openEncoderNV12,
+        .closeEncoder = closeEncoder,
+        .encode = encode,
+        .openDecoder = openDecoderNV12,
+        .closeDecoder = closeDecoder,
+        .decode = decode
+};
+
+/* Shared by the encoder and decoder */
+typedef struct {
+    SVR_YuvLayout layout;
+
+    /* Frames which are not 3 channel are passed through as with raw */
+    bool passthrough;
+
+    int width;
+    int height;
+    int chroma_width;
+    int chroma_height;
+
+    /* Frames which arrive split between calls are gathered here by the
+       decoder. Encoders write straight to the encoder's output */
+    uint8_t* buffer;
+    size_t frame_size;
+    size_t bytes_received;
+} SVR_YuvCoder;
+
+static inline uint8_t clamp255(int v) {
+    return v < 0 ? 0 : (v > 255 ? 255 : v);
+}
+
+static SVR_YuvCoder* SVR_YuvCoder_new(SVR_FrameProperties* frame_properties, SVR_YuvLayout layout) {
+    SVR_YuvCoder* coder = malloc(sizeof(SVR_YuvCoder));
+
+    coder->layout = layout;
+    coder->passthrough = (frame_properties->channels != 3 || frame_properties->depth != 8);
+    coder->width = frame_properties->width;
+    coder->height = frame_properties->height;
+
+    /* Odd sized frames round the chroma planes up */
+    coder->chroma_width = (coder->width + 1) / 2;
+    coder->chroma_height = (coder->height + 1) / 2;
+
+    coder->frame_size = coder->width * coder->height + 2 * coder->chroma_width * coder->chroma_height;
+    coder->bytes_received = 0;
+    coder->buffer = NULL;
+
+    return coder;
+}
+
+static void SVR_YuvCoder_destroy(SVR_YuvCoder* coder) {
+    free(coder->buffer);
+    free(coder);
+}
+
+/**
+ * Get the chroma planes of a YUV frame. Both layouts are handled by stepping
+ * through U and V samples with a stride, which is 1 for separate planes and
+ * 2 for interleaved samples
+ */
+static int chromaPlanes(SVR_YuvCoder* coder, uint8_t* yuv, uint8_t** u_plane, uint8_t** v_plane) {
+    uint8_t* chroma = yuv + coder->width * coder->height;
+
+    if(coder->layout == YUV_LAYOUT_NV12) {
+        *u_plane = chroma;
+        *v_plane = chroma + 1;
+        return 2;
+    }
+
+    *u_plane = chroma;
+    *v_plane = chroma + coder->chroma_width * coder->chroma_height;
+    return 1;
+}
+
+/**
+ * Convert a BGR frame to YUV 4:2:0. Luma is computed per pixel, and chroma from
+ * the average of each 2x2 block. The inner loops are free of branches so the
+ * compiler can vectorize them
+ */
+static void bgrToYuv(SVR_YuvCoder* coder, IplImage* frame, uint8_t* yuv) {
+    const int width = coder->width;
+    uint8_t* u_plane;
+    uint8_t* v_plane;
+    int step = chromaPlanes(coder, yuv, &u_plane, &v_plane);
+
+    for(int y = 0; y < coder->height; y++) {
+        const uint8_t* restrict row = (uint8_t*) frame->imageData + y * frame->widthStep;
+        uint8_t* restrict y_row = yuv + y * width;
+
+        for(int x = 0; x < width; x++) {
+            int b = row[x * 3 + 0];
+            int g = row[x * 3 + 1];
+            int r = row[x * 3 + 2];
+
+            y_row[x] = ((66 * r + 129 * g + 25 * b + 128) >> 8) + YUV_Y_OFFSET;
+        }
+    }
+
+    for(int cy = 0; cy < coder->chroma_height; cy++) {
+        const uint8_t* row0 = (uint8_t*) frame->imageData + (2 * cy) * frame->widthStep;
+        const uint8_t* row1 = (uint8_t*) frame->imageData + Util_min(2 * cy + 1, coder->height - 1) * frame->widthStep;
+        uint8_t* u_row = u_plane + cy * coder->chroma_width * step;
+        uint8_t* v_row = v_plane + cy * coder->chroma_width * step;
+
+        for(int cx = 0; cx < coder->chroma_width; cx++) {
+            int x0 = 2 * cx * 3;
+            int x1 = Util_min(2 * cx + 1, width - 1) * 3;
+            int b = (row0[x0 + 0] + row0[x1 + 0] + row1[x0 + 0] + row1[x1 + 0] + 2) >> 2;
+            int g = (row0[x0 + 1] + row0[x1 + 1] + row1[x0 + 1] + row1[x1 + 1] + 2) >> 2;
+            int r = (row0[x0 + 2] + row0[x1 + 2] + row1[x0 + 2] + row1[x1 + 2] + 2) >> 2;
+
+            u_row[cx * step] = ((-38 * r - 74 * g + 112 * b + 128) >> 8) + YUV_C_OFFSET;
+            v_row[cx * step] = ((112 * r - 94 * g - 18 * b + 128) >> 8) + YUV_C_OFFSET;
+        }
+    }
+}
+
+/**
+ * Convert a YUV 4:2:0 frame to BGR, writing into a frame's rows. Each chroma
+ * sample is shared by a 2x2 block of pixels
+ */
+static void yuvToBgr(SVR_YuvCoder* coder, uint8_t* yuv, IplImage* frame) {
+    const int width = coder->width;
+    uint8_t* u_plane;
+    uint8_t* v_plane;
+    int step = chromaPlanes(coder, yuv, &u_plane, &v_plane);
+
+    for(int y = 0; y < coder->height; y++) {
+        const uint8_t* restrict y_row = yuv + y * width;
+        const uint8_t* restrict u_row = u_plane + (y / 2) * coder->chroma_width * step;
+        const uint8_t* restrict v_row = v_plane + (y / 2) * coder->chroma_width * step;
+        uint8_t* restrict row = (uint8_t*) frame->imageData + y * frame->widthStep;
+
+        for(int x = 0; x < width; x++) {
+            int c = 298 * (y_row[x] - YUV_Y_OFFSET) + 128;
+            int d = u_row[(x >> 1) * step] - YUV_C_OFFSET;
+            int e = v_row[(x >> 1) * step] - YUV_C_OFFSET;
+
+            row[x * 3 + 0] = clamp255((c + 516 * d) >> 8);
+            row[x * 3 + 1] = clamp255((c - 100 * d - 208 * e) >> 8);
+            row[x * 3 + 2] = clamp255((c + 409 * e) >> 8);
+        }
+    }
+}
+
+static void* openEncoderPlanar(SVR_FrameProperties* frame_properties, Dictionary* options) {
+    return SVR_YuvCoder_new(frame_properties, YUV_LAYOUT_PLANAR);
+}
+
+static void* openEncoderNV12(SVR_FrameProperties* frame_properties, Dictionary* options) {
+    return SVR_YuvCoder_new(frame_properties, YUV_LAYOUT_NV12);
+}
+
+static void closeEncoder(SVR_Encoder* encoder) {
+    SVR_YuvCoder_destroy(encoder->private_data);
+}
+
+static void encode(SVR_Encoder* encoder, IplImage* frame) {
+    SVR_YuvCoder* coder = encoder->private_data;
+
+    if(coder->passthrough) {
+        SVR_Encoder_provideData(encoder, frame->imageData, frame->imageSize);
+        return;
+    }
+
+    bgrToYuv(coder, frame, SVR_Encoder_reserveData(encoder, coder->frame_size));
+    SVR_Encoder_commitData(encoder, coder->frame_size);
+}
+
+static SVR_YuvCoder* openDecoder(SVR_FrameProperties* frame_properties, SVR_YuvLayout layout) {
+    SVR_YuvCoder* coder = SVR_YuvCoder_new(frame_properties, layout);
+
+    if(!coder->passthrough) {
+        coder->buffer = malloc(coder->frame_size);
+    }
+
+    return coder;
+}
+
+static void* openDecoderPlanar(SVR_FrameProperties* frame_properties) {
+    return openDecoder(frame_properties, YUV_LAYOUT_PLANAR);
+}
+
+static void* openDecoderNV12(SVR_FrameProperties* frame_properties) {
+    return openDecoder(frame_properties, YUV_LAYOUT_NV12);
+}
+
+static void closeDecoder(SVR_Decoder* decoder) {
+    SVR_YuvCoder_destroy(decoder->private_data);
+}
+
+static void decode(SVR_Decoder* decoder, void* data, size_t n) {
+    SVR_YuvCoder* coder = decoder->private_data;
+    size_t chunk_size;
+
+    if(coder->passthrough) {
+        SVR_Decoder_writePaddedFrameData(decoder, data, n);
+        return;
+    }
+
+    while(n) {
+        /* Whole frames are converted without being copied */
+        if(coder->bytes_received == 0 && n >= coder->frame_size) {
+            yuvToBgr(coder, data, SVR_Decoder_getCurrentFrame(decoder));
+            SVR_Decoder_currentFrameComplete(decoder);
+            data = ((uint8_t*) data) + coder->frame_size;
+            n -= coder->frame_size;
+            continue;
+        }
+
+        chunk_size = Util_min(n, coder->frame_size - coder->bytes_received);
+        memcpy(coder->buffer + coder->bytes_received, data, chunk_size);
+        coder->bytes_received += chunk_size;
+        data = ((uint8_t*) data) + chunk_size;
+        n -= chunk_size;
+
+        if(coder->bytes_received == coder->frame_size) {
+            yuvToBgr(coder, coder->buffer, SVR_Decoder_getCurrentFrame(decoder));
+            SVR_Decoder_currentFrameComplete(decoder);
+            coder->bytes_received = 0;
+        }
+    }
+}
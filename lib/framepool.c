@@ -0,0 +1,321 @@
+/**
+ * \file
+ * \brief Frame pool
+ */
+
+#include <svr.h>
+
+static IplImage* SVR_FramePool_allocateFrame(SVR_FramePool* pool, SVR_FrameProperties* frame_properties);
+static void SVR_FramePool_releaseFrame(SVR_FramePool* pool, IplImage* frame);
+
+/**
+ * \defgroup FramePool Frame pool
+ * \ingroup Util
+ * \brief Fixed set of reusable frames
+ * \{
+ *
+ * A frame pool allocates a fixed number of frames once, and passes them
+ * between a producer and a consumer. The producer acquires a frame, fills it,
+ * and commits it. The consumer retrieves committed frames in order and returns
+ * them once done with them.
+ *
+ * When no frame is free, the pool's policy decides what happens. Frames that
+ * were committed but not yet retrieved are always reused, oldest first, since
+ * consumers in SVR retrieve frames from the same thread that produces them.
+ * If every frame is held by the consumer, SVR_FRAMEPOOL_DROP_OLDEST gives the
+ * producer a scratch frame whose contents are discarded on commit, while
+ * SVR_FRAMEPOOL_BLOCK waits until the consumer returns a frame. A consumer
+ * which holds every frame and then waits for another will deadlock under
+ * SVR_FRAMEPOOL_BLOCK.
+ */
+
+/**
+ * \brief Create a new frame pool
+ *
+ * \param frame_properties Properties of the pooled frames
+ * \param depth Number of frames in the pool
+ * \param policy What to do when no frame is free
+ * \param allocate_data If false, only image headers are allocated and the
+ * producer is expected to point frames at its own data with cvSetData
+ * \return A new frame pool
+ */
+SVR_FramePool* SVR_FramePool_new(SVR_FrameProperties* frame_properties, int depth, SVR_FramePoolPolicy policy, bool allocate_data) {
+    SVR_FramePool* pool = malloc(sizeof(SVR_FramePool));
+
+    pool->depth = Util_max(depth, 1);
+    pool->policy = policy;
+    pool->allocate_data = allocate_data;
+    pool->recycle = NULL;
+    pool->recycle_arg = NULL;
+
+    pool->frames = malloc(sizeof(IplImage*) * pool->depth);
+    pool->free_ring = malloc(sizeof(IplImage*) * pool->depth);
+    pool->ready_ring = malloc(sizeof(IplImage*) * pool->depth);
+    pool->free_head = 0;
+    pool->free_count = pool->depth;
+    pool->ready_head = 0;
+    pool->ready_count = 0;
+
+    for(int i = 0; i < pool->depth; i++) {
+        pool->frames[i] = SVR_FramePool_allocateFrame(pool, frame_properties);
+        pool->free_ring[i] = pool->frames[i];
+    }
+    pool->sink = SVR_FramePool_allocateFrame(pool, frame_properties);
+
+    pthread_cond_init(&pool->frame_returned, NULL);
+    SVR_LOCKABLE_INIT(pool);
+
+    return pool;
+}
+
+/**
+ * \brief Destroy a frame pool
+ *
+ * Destroy a frame pool and the frames it holds. Frames still held by the
+ * consumer remain valid, and are released instead of pooled if returned to
+ * another pool.
+ *
+ * \param pool The frame pool to destroy
+ */
+void SVR_FramePool_destroy(SVR_FramePool* pool) {
+    for(int i = 0; i < pool->free_count; i++) {
+        SVR_FramePool_releaseFrame(pool, pool->free_ring[(pool->free_head + i) % pool->depth]);
+    }
+
+    for(int i = 0; i < pool->ready_count; i++) {
+        SVR_FramePool_releaseFrame(pool, pool->ready_ring[(pool->ready_head + i) % pool->depth]);
+    }
+
+    SVR_FramePool_releaseFrame(pool, pool->sink);
+
+    pthread_cond_destroy(&pool->frame_returned);
+    free(pool->frames);
+    free(pool->free_ring);
+    free(pool->ready_ring);
+    free(pool);
+}
+
+/**
+ * \brief Allocate a frame
+ *
+ * Allocate a frame with its image data aligned to SVR_FRAMEPOOL_ALIGNMENT. The
+ * unaligned allocation is kept as the image's data origin so the frame can be
+ * freed with cvReleaseImage
+ */
+static IplImage* SVR_FramePool_allocateFrame(SVR_FramePool* pool, SVR_FrameProperties* frame_properties) {
+    IplImage* frame = cvCreateImageHeader(cvSize(frame_properties->width, frame_properties->height),
+                                          frame_properties->depth, frame_properties->channels);
+    uintptr_t origin;
+
+    if(pool->allocate_data) {
+        origin = (uintptr_t) cvAlloc(frame->imageSize + SVR_FRAMEPOOL_ALIGNMENT - 1);
+        frame->imageDataOrigin = (char*) origin;
+        frame->imageData = (char*) ((origin + SVR_FRAMEPOOL_ALIGNMENT - 1) & ~((uintptr_t) SVR_FRAMEPOOL_ALIGNMENT - 1));
+    }
+
+    return frame;
+}
+
+/**
+ * \brief Free a frame allocated by a pool like this one
+ */
+static void SVR_FramePool_releaseFrame(SVR_FramePool* pool, IplImage* frame) {
+    if(pool->allocate_data) {
+        cvReleaseImage(&frame);
+    } else {
+        cvReleaseImageHeader(&frame);
+    }
+}
+
+/**
+ * \brief Check if a frame belongs to the pool
+ *
+ * \param pool A frame pool
+ * \param frame A frame
+ * \return True if the frame is one of the pool's frames
+ */
+bool SVR_FramePool_owns(SVR_FramePool* pool, IplImage* frame) {
+    for(int i = 0; i < pool->depth; i++) {
+        if(pool->frames[i] == frame) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * \brief Set the recycle callback
+ *
+ * Set a function to call whenever the contents of a committed frame are
+ * discarded, either because the frame is reused before being retrieved or
+ * because it was the scratch frame. The callback is called without the pool
+ * locked.
+ *
+ * \param pool A frame pool
+ * \param recycle The callback, or NULL
+ * \param arg Argument passed to the callback
+ */
+void SVR_FramePool_setRecycleCallback(SVR_FramePool* pool, SVR_FramePool_RecycleCallback recycle, void* arg) {
+    pool->recycle = recycle;
+    pool->recycle_arg = arg;
+}
+
+/**
+ * \brief Acquire a frame to write to
+ *
+ * Get a frame to write the next frame to. Never returns NULL, but may block
+ * under SVR_FRAMEPOOL_BLOCK. The frame must be passed to
+ * SVR_FramePool_commit or SVR_FramePool_returnFrame.
+ *
+ * \param pool A frame pool
+ * \return A frame to write to
+ */
+IplImage* SVR_FramePool_acquire(SVR_FramePool* pool) {
+    IplImage* frame;
+    bool recycled = false;
+
+    SVR_LOCK(pool);
+    while(pool->free_count == 0 && pool->ready_count == 0 && pool->policy == SVR_FRAMEPOOL_BLOCK) {
+        SVR_LOCK_WAIT(pool, &pool->frame_returned);
+    }
+
+    if(pool->free_count > 0) {
+        frame = pool->free_ring[pool->free_head];
+        pool->free_head = (pool->free_head + 1) % pool->depth;
+        pool->free_count--;
+    } else if(pool->ready_count > 0) {
+        frame = pool->ready_ring[pool->ready_head];
+        pool->ready_head = (pool->ready_head + 1) % pool->depth;
+        pool->ready_count--;
+        recycled = true;
+    } else {
+        frame = pool->sink;
+    }
+    SVR_UNLOCK(pool);
+
+    if(recycled && pool->recycle) {
+        pool->recycle(pool->recycle_arg, frame);
+    }
+
+    return frame;
+}
+
+/**
+ * \brief Commit a written frame
+ *
+ * Make an acquired frame available to the consumer
+ *
+ * \param pool A frame pool
+ * \param frame A frame returned by SVR_FramePool_acquire
+ */
+void SVR_FramePool_commit(SVR_FramePool* pool, IplImage* frame) {
+    if(frame == pool->sink) {
+        if(pool->recycle) {
+            pool->recycle(pool->recycle_arg, frame);
+        }
+        return;
+    }
+
+    SVR_LOCK(pool);
+    pool->ready_ring[(pool->ready_head + pool->ready_count) % pool->depth] = frame;
+    pool->ready_count++;
+    SVR_UNLOCK(pool);
+}
+
+/**
+ * \brief Get the number of committed frames not yet retrieved
+ *
+ * \param pool A frame pool
+ * \return The number of frames ready
+ */
+int SVR_FramePool_readyCount(SVR_FramePool* pool) {
+    int count;
+
+    SVR_LOCK(pool);
+    count = pool->ready_count;
+    SVR_UNLOCK(pool);
+
+    return count;
+}
+
+/**
+ * \brief Retrieve the oldest committed frame
+ *
+ * \param pool A frame pool
+ * \return The oldest committed frame, or NULL if none are ready
+ */
+IplImage* SVR_FramePool_getReady(SVR_FramePool* pool) {
+    IplImage* frame = NULL;
+
+    SVR_LOCK(pool);
+    if(pool->ready_count > 0) {
+        frame = pool->ready_ring[pool->ready_head];
+        pool->ready_head = (pool->ready_head + 1) % pool->depth;
+        pool->ready_count--;
+    }
+    SVR_UNLOCK(pool);
+
+    return frame;
+}
+
+/**
+ * \brief Return a frame to the pool
+ *
+ * Return a retrieved or acquired frame to the pool for reuse
+ *
+ * \param pool A frame pool
+ * \param frame The frame
+ * \return False if the frame does not belong to the pool, in which case the
+ * caller remains responsible for it
+ */
+bool SVR_FramePool_returnFrame(SVR_FramePool* pool, IplImage* frame) {
+    if(frame == pool->sink) {
+        return true;
+    }
+
+    if(!SVR_FramePool_owns(pool, frame)) {
+        return false;
+    }
+
+    SVR_LOCK(pool);
+    pool->free_ring[(pool->free_head + pool->free_count) % pool->depth] = frame;
+    pool->free_count++;
+    pthread_cond_signal(&pool->frame_returned);
+    SVR_UNLOCK(pool);
+
+    return true;
+}
+
+/**
+ * \brief Get the number of frames given out
+ *
+ * Get the number of the pool's frames which are neither free nor ready, that
+ * is, held by the consumer or being written by the producer
+ *
+ * \param pool A frame pool
+ * \return The number of frames given out
+ */
+int SVR_FramePool_getOutstanding(SVR_FramePool* pool) {
+    int count;
+
+    SVR_LOCK(pool);
+    count = pool->depth - pool->free_count - pool->ready_count;
+    SVR_UNLOCK(pool);
+
+    return count;
+}
+
+/**
+ * \brief Get the row padding of pooled frames
+ *
+ * \param pool A frame pool
+ * \return The number of bytes of padding at the end of each row
+ */
+int SVR_FramePool_getRowPadding(SVR_FramePool* pool) {
+    IplImage* frame = pool->frames[0];
+
+    return frame->widthStep - (frame->width * frame->nChannels);
+}
+
+/** \} */
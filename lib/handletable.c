@@ -0,0 +1,156 @@
+/**
+ * \file
+ * \brief Handle table
+ */
+
+#include <svr.h>
+
+#define HANDLE_TABLE_GROW 16
+#define HANDLE_TABLE_MAX_SIZE 0xffff
+
+/* The low 16 bits of a handle are the entry index plus one, so no handle is 0.
+   The high 16 bits are the entry's generation, which changes each time the
+   entry is reused so stale handles are not resolved to new objects */
+#define HANDLE_INDEX(handle) (((handle) & 0xffff) - 1)
+#define HANDLE_GENERATION(handle) ((handle) >> 16)
+#define HANDLE_MAKE(index, generation) ((((uint32_t)(generation)) << 16) | ((index) + 1))
+
+static void SVR_HandleTable_grow(SVR_HandleTable* handle_table);
+
+/**
+ * \defgroup HandleTable Handle table
+ * \ingroup Util
+ * \brief Map compact numeric handles to objects
+ * \{
+ *
+ * A handle table assigns a 32-bit handle to an object, which can then be
+ * resolved back to the object by direct indexing rather than a name lookup.
+ * Handles are never 0, so 0 can be used to mean "no handle". Removing an
+ * object invalidates its handle, and a stale handle resolves to NULL until its
+ * entry has been reused 65536 times.
+ */
+
+/**
+ * \brief Create a new handle table
+ *
+ * \return A new, empty handle table
+ */
+SVR_HandleTable* SVR_HandleTable_new(void) {
+    SVR_HandleTable* handle_table = malloc(sizeof(SVR_HandleTable));
+
+    handle_table->objects = NULL;
+    handle_table->generations = NULL;
+    handle_table->free_indices = NULL;
+    handle_table->free_count = 0;
+    handle_table->table_size = 0;
+    SVR_LOCKABLE_INIT(handle_table);
+
+    return handle_table;
+}
+
+/**
+ * \brief Destroy a handle table
+ *
+ * Destroy a handle table. Objects remaining in the table are not freed.
+ *
+ * \param handle_table The handle table to destroy
+ */
+void SVR_HandleTable_destroy(SVR_HandleTable* handle_table) {
+    free(handle_table->objects);
+    free(handle_table->generations);
+    free(handle_table->free_indices);
+    free(handle_table);
+}
+
+static void SVR_HandleTable_grow(SVR_HandleTable* handle_table) {
+    int old_size = handle_table->table_size;
+    int new_size = Util_min(old_size + HANDLE_TABLE_GROW, HANDLE_TABLE_MAX_SIZE);
+
+    handle_table->objects = realloc(handle_table->objects, sizeof(void*) * new_size);
+    handle_table->generations = realloc(handle_table->generations, sizeof(uint16_t) * new_size);
+    handle_table->free_indices = realloc(handle_table->free_indices, sizeof(uint16_t) * new_size);
+
+    /* Push new entries so lower indices are used first */
+    for(int i = new_size - 1; i >= old_size; i--) {
+        handle_table->objects[i] = NULL;
+        handle_table->generations[i] = 0;
+        handle_table->free_indices[handle_table->free_count++] = i;
+    }
+
+    handle_table->table_size = new_size;
+}
+
+/**
+ * \brief Add an object
+ *
+ * Add an object to the table and return a handle for it
+ *
+ * \param handle_table The handle table
+ * \param object The object to add
+ * \return A handle for the object, or 0 if the table is full
+ */
+uint32_t SVR_HandleTable_add(SVR_HandleTable* handle_table, void* object) {
+    uint32_t handle = 0;
+    int index;
+
+    SVR_LOCK(handle_table);
+    if(handle_table->free_count == 0 && handle_table->table_size < HANDLE_TABLE_MAX_SIZE) {
+        SVR_HandleTable_grow(handle_table);
+    }
+
+    if(handle_table->free_count > 0) {
+        index = handle_table->free_indices[--handle_table->free_count];
+        handle_table->objects[index] = object;
+        handle = HANDLE_MAKE(index, handle_table->generations[index]);
+    }
+    SVR_UNLOCK(handle_table);
+
+    return handle;
+}
+
+/**
+ * \brief Resolve a handle
+ *
+ * \param handle_table The handle table
+ * \param handle A handle returned by SVR_HandleTable_add
+ * \return The object associated with the handle, or NULL if the handle is
+ * invalid or the object has been removed
+ */
+void* SVR_HandleTable_get(SVR_HandleTable* handle_table, uint32_t handle) {
+    unsigned int index = HANDLE_INDEX(handle);
+    void* object = NULL;
+
+    SVR_LOCK(handle_table);
+    if(index < handle_table->table_size &&
+       handle_table->generations[index] == HANDLE_GENERATION(handle)) {
+        object = handle_table->objects[index];
+    }
+    SVR_UNLOCK(handle_table);
+
+    return object;
+}
+
+/**
+ * \brief Remove an object
+ *
+ * Remove the object associated with a handle. The handle is no longer valid
+ * after this call.
+ *
+ * \param handle_table The handle table
+ * \param handle The handle of the object to remove
+ */
+void SVR_HandleTable_remove(SVR_HandleTable* handle_table, uint32_t handle) {
+    unsigned int index = HANDLE_INDEX(handle);
+
+    SVR_LOCK(handle_table);
+    if(index < handle_table->table_size &&
+       handle_table->objects[index] != NULL &&
+       handle_table->generations[index] == HANDLE_GENERATION(handle)) {
+        handle_table->objects[index] = NULL;
+        handle_table->generations[index]++;
+        handle_table->free_indices[handle_table->free_count++] = index;
+    }
+    SVR_UNLOCK(handle_table);
+}
+
+/** \} */
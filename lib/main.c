@@ -65,6 +65,14 @@ int SVR_init(void) {
         SVR_Logging_setThreshold(SVR_DEBUG);
     }
 
+    if(getenv("SVR_RECLAIM")) {
+        if(SVR_RefCounter_getReclaimModeFromName(getenv("SVR_RECLAIM")) < 0) {
+            SVR_log(SVR_WARNING, Util_format("Invalid reclamation mode \"%s\" in SVR_RECLAIM environment variable", getenv("SVR_RECLAIM")));
+        } else {
+            SVR_RefCounter_setReclaimMode(SVR_RefCounter_getReclaimModeFromName(getenv("SVR_RECLAIM")));
+        }
+    }
+
     if(getenv("SVR_SERVER")) {
         SVR_setServerAddress(getenv("SVR_SERVER"));
         SVR_log(SVR_NORMAL, Util_format("Using SVR server \"%s\" from SVR_SERVER environment variable", server_address));
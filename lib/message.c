@@ -21,15 +21,75 @@ void SVR_Message_init(void) {
     message_allocator = SVR_BlockAlloc_newAllocator(256, 8);
 }
 
+/**
+ * \brief Get the header length of a protocol version
+ *
+ * \param protocol Protocol version
+ * \return Length of the packed message header in bytes
+ */
+size_t SVR_Message_prefixLength(int protocol) {
+    return (protocol >= SVR_PROTOCOL_V2) ? SVR_MESSAGE_PREFIX_LEN_V2 : SVR_MESSAGE_PREFIX_LEN;
+}
+
+/**
+ * \brief Pack a message header
+ *
+ * Pack the header of a message using the given protocol version
+ *
+ * Pack the header of a message using the given protocol version. The handle of
+ * a binary message is packed immediately after the header.
+ *
+ * \param buffer Buffer of at least SVR_Message_prefixLength(protocol) bytes,
+ * plus SVR_BINARY_DATA_LEN for binary messages
+ * \param protocol Protocol version
+ * \param message The message
+ * \param data_length Total length of the message's packed components
+ * \return The number of bytes packed
+ */
+size_t SVR_Message_packHeader(void* buffer, int protocol, SVR_Message* message, uint16_t data_length) {
+    if(message->opcode != SVR_OPCODE_NONE) {
+        return SVR_pack(buffer, 0, "hhhhii", SVR_BINARY_DATA_LEN, message->request_id, 0, message->opcode, message->payload_size, message->handle);
+    }
+
+    if(protocol >= SVR_PROTOCOL_V2) {
+        return SVR_pack(buffer, 0, "hhhhi", data_length, message->request_id, message->count, SVR_OPCODE_NONE, message->payload_size);
+    }
+
+    return SVR_pack(buffer, 0, "hhhh", data_length, message->request_id, message->count, message->payload_size);
+}
+
+/**
+ * \brief Read lengths from a packed message header
+ *
+ * \param buffer Buffer holding at least SVR_Message_prefixLength(protocol)
+ * bytes of a packed message
+ * \param protocol Protocol version
+ * \param data_length Set to the length of the packed components
+ * \param payload_size Set to the length of the payload following the message
+ */
+void SVR_Message_unpackLengths(void* buffer, int protocol, uint16_t* data_length, uint32_t* payload_size) {
+    uint16_t payload_size_v1;
+
+    if(protocol >= SVR_PROTOCOL_V2) {
+        SVR_unpack(buffer, 0, "h", data_length);
+        SVR_unpack(buffer, 8, "i", payload_size);
+    } else {
+        SVR_unpack(buffer, 0, "h", data_length);
+        SVR_unpack(buffer, 6, "h", &payload_size_v1);
+        *payload_size = payload_size_v1;
+    }
+}
+
 /**
  * \brief Pack a message
  *
  * Return a packed message constructed from the given message
  *
  * \param message The message to packe
+ * \param protocol Protocol version to pack the message for
  * \return The packed equivalent of message
  */
-SVR_PackedMessage* SVR_Message_pack(SVR_Message* message) {
+SVR_PackedMessage* SVR_Message_pack(SVR_Message* message, int protocol) {
     SVR_PackedMessage* packed_message;
     uint16_t total_data_length = 0;
     size_t pack_offset = 0;
@@ -39,10 +99,14 @@ SVR_PackedMessage* SVR_Message_pack(SVR_Message* message) {
         total_data_length += strlen(message->components[i]) + 1;
     }
 
+    if(message->opcode != SVR_OPCODE_NONE) {
+        total_data_length = SVR_BINARY_DATA_LEN;
+    }
+
     /* Constructed the empty, packed message */
-    packed_message = SVR_PackedMessage_newWithAlloc(total_data_length + SVR_MESSAGE_PREFIX_LEN, message->alloc);
+    packed_message = SVR_PackedMessage_newWithAlloc(total_data_length + SVR_Message_prefixLength(protocol), message->alloc);
 
-    pack_offset = SVR_pack(packed_message->data, pack_offset, "hhhh", total_data_length, message->request_id, message->count, message->payload_size);
+    pack_offset = SVR_Message_packHeader(packed_message->data, protocol, message, total_data_length);
     for(int i = 0; i < message->count; i++) {
         pack_offset = SVR_pack(packed_message->data, pack_offset, "s", message->components[i]);
     }
@@ -60,15 +124,31 @@ SVR_PackedMessage* SVR_Message_pack(SVR_Message* message) {
  * with a call to SVR_Message_destroyUnpacked()
  *
  * \param packed_message A packed message to unpack
+ * \param protocol Protocol version the message was packed with
  * \return The unpacked message
  */
-SVR_Message* SVR_PackedMessage_unpack(SVR_PackedMessage* packed_message) {
+SVR_Message* SVR_PackedMessage_unpack(SVR_PackedMessage* packed_message, int protocol) {
     SVR_Message* message = SVR_Message_newWithAlloc(0, packed_message->alloc);
     size_t pack_offset = 0;
     uint16_t data_length;
+    uint16_t payload_size_v1;
 
     /* Read header */
-    pack_offset = SVR_unpack(packed_message->data, pack_offset, "hhhh", &data_length, &message->request_id, &message->count, &message->payload_size);
+    if(protocol >= SVR_PROTOCOL_V2) {
+        pack_offset = SVR_unpack(packed_message->data, pack_offset, "hhhhi", &data_length, &message->request_id, &message->count, &message->opcode, &message->payload_size);
+
+        /* Binary messages carry only a handle */
+        if(message->opcode != SVR_OPCODE_NONE) {
+            message->count = 0;
+            if(data_length >= SVR_BINARY_DATA_LEN) {
+                SVR_unpack(packed_message->data, pack_offset, "i", &message->handle);
+            }
+            return message;
+        }
+    } else {
+        pack_offset = SVR_unpack(packed_message->data, pack_offset, "hhhh", &data_length, &message->request_id, &message->count, &payload_size_v1);
+        message->payload_size = payload_size_v1;
+    }
 
     /* Store points to components (does not copy) */
     message->components = SVR_Arena_reserve(packed_message->alloc, sizeof(char*) * message->count);
@@ -99,6 +179,8 @@ static SVR_Message* SVR_Message_newWithAlloc(unsigned int component_count, SVR_A
     message->components = NULL;
     message->payload = NULL;
     message->payload_size = 0;
+    message->opcode = SVR_OPCODE_NONE;
+    message->handle = 0;
     message->alloc = alloc;
 
     if(component_count) {
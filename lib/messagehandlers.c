@@ -52,6 +52,24 @@ int SVR_MessageHandler_data(SVR_Message* message) {
     return 0;
 }
 
+/**
+ * \brief Process a binary data message
+ *
+ * Process a binary data message which provides frame data for the stream with
+ * the message's handle
+ *
+ * \param message Message to process
+ * \return 0 on success, -1 otherwise
+ */
+int SVR_MessageHandler_binaryData(SVR_Message* message) {
+    if(message->payload_size == 0) {
+        return -1;
+    }
+
+    SVR_Stream_provideDataByHandle(message->handle, message->payload, message->payload_size);
+    return 0;
+}
+
 /**
  * \brief Process a "kick" message
  *
@@ -66,4 +84,54 @@ int SVR_MessageHandler_kick(SVR_Message* message) {
     return 0;
 }
 
+/**
+ * \brief Process a "protocol" message
+ *
+ * Process a protocol message sent by the server when the client connects,
+ * advertising the latest protocol version the server supports. Switches to the
+ * latest version supported by both.
+ *
+ * \param message Message to process
+ * \return 0 on success, -1 otherwise
+ */
+int SVR_MessageHandler_protocol(SVR_Message* message) {
+    int protocol;
+
+    if(message->count != 2) {
+        return -1;
+    }
+
+    protocol = Util_min(atoi(message->components[1]), SVR_PROTOCOL_LATEST);
+    if(protocol > SVR_Comm_getProtocol()) {
+        SVR_Comm_requestProtocol(protocol);
+    }
+
+    return 0;
+}
+
+/**
+ * \brief Process a "set protocol" message
+ *
+ * Process the server's acknowledgement of a protocol version request. Every
+ * following message from the server uses the new version.
+ *
+ * \param message Message to process
+ * \return 0 on success, -1 otherwise
+ */
+int SVR_MessageHandler_setProtocol(SVR_Message* message) {
+    int protocol;
+
+    if(message->count != 2) {
+        return -1;
+    }
+
+    protocol = atoi(message->components[1]);
+    if(protocol < SVR_PROTOCOL_V1 || protocol > SVR_PROTOCOL_LATEST) {
+        return -1;
+    }
+
+    SVR_Comm_setReceiveProtocol(protocol);
+    return 0;
+}
+
 /** \} */
@@ -13,7 +13,14 @@ typedef struct {
 static SVR_RequestMapping request_types[] = {
     {"Stream.orphaned", SVR_MessageHandler_streamOrphaned},
     {"Data", SVR_MessageHandler_data},
-    {"SVR.kick", SVR_MessageHandler_kick}
+    {"SVR.kick", SVR_MessageHandler_kick},
+    {"SVR.protocol", SVR_MessageHandler_protocol},
+    {"SVR.setProtocol", SVR_MessageHandler_setProtocol}
+};
+
+/* Handlers for binary messages, indexed by opcode */
+static int (*opcode_handlers[SVR_OPCODE_COUNT])(SVR_Message* message) = {
+    [SVR_OPCODE_DATA] = SVR_MessageHandler_binaryData
 };
 
 static int SVR_compareRequestMapping(const void* v1, const void* v2);
@@ -90,6 +97,15 @@ static SVR_RequestMapping* SVR_findRequestMapping(const char* request_string) {
 int SVR_MessageRouter_processMessage(SVR_Message* message) {
     SVR_RequestMapping* request_type;
 
+    if(message->opcode != SVR_OPCODE_NONE) {
+        if(message->opcode >= SVR_OPCODE_COUNT || opcode_handlers[message->opcode] == NULL) {
+            SVR_log(SVR_ERROR, Util_format("Unsupported binary message opcode: %d", message->opcode));
+            return -1;
+        }
+
+        return opcode_handlers[message->opcode](message);
+    }
+
     if(message->count == 0) {
         SVR_log(SVR_ERROR, "Received empty message");
         return -1;
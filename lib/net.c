@@ -5,6 +5,9 @@
 
 #include "svr.h"
 
+#include <sys/socket.h>
+#include <sys/uio.h>
+
 /**
  * \defgroup Net Message IO
  * \ingroup Comm
@@ -12,6 +15,259 @@
  * \{
  */
 
+/**
+ * Messages are gathered for sendmsg into at most this many buffers, limiting
+ * the size of the on stack gather state
+ */
+#define SVR_NET_MAX_IOV 64
+
+/**
+ * Messages gathered for a single sendmsg call
+ */
+typedef struct {
+    struct iovec iov[SVR_NET_MAX_IOV];
+    int iov_count;
+
+    /* Packed headers of the gathered messages, with room for the handle of
+       binary messages. A message without components or payload uses a single
+       buffer, so the header count is checked separately */
+    uint8_t headers[SVR_NET_MAX_IOV / 2][SVR_MESSAGE_MAX_PREFIX_LEN + SVR_BINARY_DATA_LEN];
+    int header_count;
+
+    /* Protocol version the messages are packed for */
+    int protocol;
+} SVR_Net_Gather;
+
+static void SVR_Net_skip(struct iovec** iov, int* iov_count, size_t n);
+static int SVR_Net_sendv(int socket, struct iovec* iov, int iov_count);
+static int SVR_Net_trySendv(int socket, struct iovec* iov, int iov_count, size_t* skip, size_t* sent);
+static bool SVR_Net_checkMessage(SVR_Message* message, int protocol);
+static bool SVR_Net_gatherMessage(SVR_Net_Gather* gather, SVR_Message* message);
+static int SVR_Net_sendGathered(int socket, SVR_Net_Gather* gather);
+static int SVR_Net_trySendGathered(int socket, SVR_Net_Gather* gather, size_t* skip, size_t* sent);
+
+/**
+ * \brief Advance through a list of buffers
+ *
+ * Skip n bytes of the buffers, dropping those completely skipped and
+ * advancing into a partially skipped one
+ *
+ * \param iov Buffers, updated to the first buffer with data left
+ * \param iov_count Number of buffers, updated to the number left
+ * \param n Number of bytes to skip
+ */
+static void SVR_Net_skip(struct iovec** iov, int* iov_count, size_t n) {
+    while(*iov_count > 0 && n >= (*iov)->iov_len) {
+        n -= (*iov)->iov_len;
+        (*iov)++;
+        (*iov_count)--;
+    }
+
+    if(*iov_count > 0) {
+        (*iov)->iov_base = ((uint8_t*)(*iov)->iov_base) + n;
+        (*iov)->iov_len -= n;
+    }
+}
+
+/**
+ * \brief Send a list of buffers
+ *
+ * Send the contents of each buffer, in order, over a socket using as few
+ * sendmsg calls as possible. The iovec array is modified to track partial
+ * sends.
+ *
+ * \param socket Socket to send over
+ * \param iov Buffers to send
+ * \param iov_count Number of buffers
+ * \return The total number of bytes sent, or -1 on error
+ */
+static int SVR_Net_sendv(int socket, struct iovec* iov, int iov_count) {
+    struct msghdr msg;
+    size_t total = 0;
+    ssize_t n;
+
+    for(int i = 0; i < iov_count; i++) {
+        total += iov[i].iov_len;
+    }
+
+    memset(&msg, 0, sizeof(msg));
+
+    while(iov_count > 0) {
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iov_count;
+
+        n = sendmsg(socket, &msg, 0);
+        if(n < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+
+            return -1;
+        }
+
+        SVR_Net_skip(&iov, &iov_count, n);
+    }
+
+    return total;
+}
+
+/**
+ * \brief Send a list of buffers without blocking
+ *
+ * Skip the first bytes of the buffers, which an earlier call already sent, and
+ * send as much of the rest as the socket accepts without blocking. The iovec
+ * array is modified.
+ *
+ * \param socket Socket to send over
+ * \param iov Buffers to send
+ * \param iov_count Number of buffers
+ * \param skip Number of bytes to skip. Reduced by the number of bytes of these
+ * buffers which were skipped
+ * \param sent Increased by the number of bytes sent
+ * \return 1 if every buffer was sent, 0 if the socket is full, or -1 on error
+ */
+static int SVR_Net_trySendv(int socket, struct iovec* iov, int iov_count, size_t* skip, size_t* sent) {
+    struct msghdr msg;
+    size_t total = 0;
+    ssize_t n;
+
+    for(int i = 0; i < iov_count; i++) {
+        total += iov[i].iov_len;
+    }
+
+    if(*skip >= total) {
+        *skip -= total;
+        return 1;
+    }
+
+    SVR_Net_skip(&iov, &iov_count, *skip);
+    *skip = 0;
+
+    memset(&msg, 0, sizeof(msg));
+
+    while(iov_count > 0) {
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iov_count;
+
+        n = sendmsg(socket, &msg, MSG_DONTWAIT);
+        if(n < 0) {
+            if(errno == EINTR) {
+                continue;
+            } else if(errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            }
+
+            return -1;
+        }
+
+        *sent += n;
+        SVR_Net_skip(&iov, &iov_count, n);
+    }
+
+    return 1;
+}
+
+/**
+ * \brief Check a message can be sent
+ *
+ * \param message Message to check
+ * \param protocol Protocol version the message is to be sent with
+ * \return False if the protocol version can not carry the message
+ */
+static bool SVR_Net_checkMessage(SVR_Message* message, int protocol) {
+    if(protocol < SVR_PROTOCOL_V2 && message->payload_size > SVR_MAX_PAYLOAD_V1) {
+        SVR_log(SVR_ERROR, "Payload too large for protocol version 1");
+        return false;
+    }
+
+    if(protocol < SVR_PROTOCOL_V2 && message->opcode != SVR_OPCODE_NONE) {
+        SVR_log(SVR_ERROR, "Binary messages require protocol version 2");
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * \brief Add a message to a gather
+ *
+ * Pack the message's header into the gather and reference its components and
+ * payload directly, without copying them
+ *
+ * \param gather Gather to add to
+ * \param message Message to add
+ * \return False if the gather has no room for the message
+ */
+static bool SVR_Net_gatherMessage(SVR_Net_Gather* gather, SVR_Message* message) {
+    struct iovec* iov = gather->iov + gather->iov_count;
+    uint16_t data_length = 0;
+    int iov_count = 0;
+
+    if(gather->iov_count + message->count + 2 > SVR_NET_MAX_IOV ||
+       gather->header_count >= SVR_NET_MAX_IOV / 2) {
+        return false;
+    }
+
+    /* Header, filled in once the data length is known. A binary message's
+       handle is packed along with the header */
+    iov[iov_count].iov_base = gather->headers[gather->header_count];
+    iov_count++;
+
+    /* Components, including their null terminators */
+    for(int i = 0; i < message->count; i++) {
+        iov[iov_count].iov_base = message->components[i];
+        iov[iov_count].iov_len = strlen(message->components[i]) + 1;
+        data_length += iov[iov_count].iov_len;
+        iov_count++;
+    }
+
+    if(message->payload_size > 0) {
+        iov[iov_count].iov_base = message->payload;
+        iov[iov_count].iov_len = message->payload_size;
+        iov_count++;
+    }
+
+    iov[0].iov_len = SVR_Message_packHeader(gather->headers[gather->header_count], gather->protocol, message, data_length);
+
+    gather->header_count++;
+    gather->iov_count += iov_count;
+
+    return true;
+}
+
+/**
+ * \brief Send gathered messages
+ *
+ * Send and then empty a gather
+ *
+ * \return The number of bytes sent, or -1 on error
+ */
+static int SVR_Net_sendGathered(int socket, SVR_Net_Gather* gather) {
+    int n = SVR_Net_sendv(socket, gather->iov, gather->iov_count);
+
+    gather->iov_count = 0;
+    gather->header_count = 0;
+
+    return n;
+}
+
+/**
+ * \brief Send gathered messages without blocking
+ *
+ * Send what the socket accepts of a gather without blocking, as
+ * SVR_Net_trySendv does, and then empty it
+ *
+ * \return 1 if the gather was sent, 0 if the socket is full, or -1 on error
+ */
+static int SVR_Net_trySendGathered(int socket, SVR_Net_Gather* gather, size_t* skip, size_t* sent) {
+    int n = SVR_Net_trySendv(socket, gather->iov, gather->iov_count, skip, sent);
+
+    gather->iov_count = 0;
+    gather->header_count = 0;
+
+    return n;
+}
+
 /**
  * \brief Send a packed message
  *
@@ -21,45 +277,156 @@
  * \param packed_message Packed message to send
  */
 int SVR_Net_sendPackedMessage(int socket, SVR_PackedMessage* packed_message) {
-    ssize_t sent_bytes, n;
+    struct iovec iov[2];
 
-    /* Send message body */
-    sent_bytes = 0;
-    while(sent_bytes < packed_message->length) {
-        n = send(socket, ((uint8_t*)packed_message->data) + sent_bytes, packed_message->length - sent_bytes, 0);
-        if(n < 0) {
-            return n;
+    /* Send the message body and payload together */
+    iov[0].iov_base = packed_message->data;
+    iov[0].iov_len = packed_message->length;
+    iov[1].iov_base = packed_message->payload;
+    iov[1].iov_len = packed_message->payload_size;
+
+    return SVR_Net_sendv(socket, iov, packed_message->payload_size > 0 ? 2 : 1);
+}
+
+/**
+ * \brief Send a message
+ *
+ * Send the message over the given socket. The header is packed on the stack
+ * and the header, components, and payload are sent with a single sendmsg call
+ * where possible, without packing the message
+ *
+ * \param socket The socket to use for IO
+ * \param protocol Protocol version to send the message with
+ * \param message The message to send
+ * \return The number of bytes sent, or -1 on error
+ */
+int SVR_Net_sendMessage(int socket, int protocol, SVR_Message* message) {
+    return SVR_Net_sendMessages(socket, protocol, &message, 1);
+}
+
+/**
+ * \brief Send several messages
+ *
+ * Send a sequence of messages over the given socket, coalescing as many as
+ * possible into each sendmsg call. Used to send all the data chunks of a frame
+ * at once.
+ *
+ * \param socket The socket to use for IO
+ * \param protocol Protocol version to send the messages with
+ * \param messages The messages to send, in order
+ * \param count The number of messages
+ * \return The total number of bytes sent, or -1 on error
+ */
+int SVR_Net_sendMessages(int socket, int protocol, SVR_Message** messages, int count) {
+    SVR_Net_Gather gather;
+    int total = 0;
+    int n;
+
+    gather.iov_count = 0;
+    gather.header_count = 0;
+    gather.protocol = protocol;
+
+    for(int i = 0; i < count; i++) {
+        if(SVR_Net_checkMessage(messages[i], protocol) == false) {
+            return -1;
+        }
+
+        if(SVR_Net_gatherMessage(&gather, messages[i])) {
+            continue;
         }
 
-        sent_bytes += n;
+        /* Gather is full, so send what has been gathered so far */
+        if(gather.iov_count > 0) {
+            n = SVR_Net_sendGathered(socket, &gather);
+            if(n < 0) {
+                return n;
+            }
+            total += n;
+        }
+
+        /* Messages with too many components to gather are packed instead */
+        if(SVR_Net_gatherMessage(&gather, messages[i]) == false) {
+            n = SVR_Net_sendPackedMessage(socket, SVR_Message_pack(messages[i], protocol));
+            if(n < 0) {
+                return n;
+            }
+            total += n;
+        }
     }
 
-    /* Send payload */
-    sent_bytes = 0;
-    while(sent_bytes < packed_message->payload_size) {
-        n = send(socket, ((uint8_t*)packed_message->payload) + sent_bytes, packed_message->payload_size - sent_bytes, 0);
+    if(gather.iov_count > 0) {
+        n = SVR_Net_sendGathered(socket, &gather);
         if(n < 0) {
             return n;
         }
-
-        sent_bytes += n;
+        total += n;
     }
 
-    return packed_message->length + packed_message->payload_size;
+    return total;
 }
 
 /**
- * \brief Send a message
+ * \brief Send several messages without blocking
  *
- * Send the message to the given client. The message will be packed using the
- * SVR_Arena associated with the original message
+ * Send as much of a sequence of messages as the socket accepts without
+ * blocking. A sequence which does not fit is resumed by calling again with the
+ * same messages, protocol version, and offset, until every byte is sent.
  *
  * \param socket The socket to use for IO
- * \param message The message to send
+ * \param protocol Protocol version to send the messages with
+ * \param messages The messages to send, in order
+ * \param count The number of messages
+ * \param offset Number of bytes of the sequence already sent. Increased by the
+ * number of bytes sent
+ * \return 1 if the whole sequence has been sent, 0 if the socket is full, or
+ * -1 on error
  */
-int SVR_Net_sendMessage(int socket, SVR_Message* message) {
-    SVR_PackedMessage* packed_message = SVR_Message_pack(message);
-    return SVR_Net_sendPackedMessage(socket, packed_message);
+int SVR_Net_trySendMessages(int socket, int protocol, SVR_Message** messages, int count, size_t* offset) {
+    SVR_PackedMessage* packed_message;
+    SVR_Net_Gather gather;
+    struct iovec iov[2];
+    size_t skip = *offset;
+    int n;
+
+    gather.iov_count = 0;
+    gather.header_count = 0;
+    gather.protocol = protocol;
+
+    for(int i = 0; i < count; i++) {
+        if(SVR_Net_checkMessage(messages[i], protocol) == false) {
+            return -1;
+        }
+
+        if(SVR_Net_gatherMessage(&gather, messages[i])) {
+            continue;
+        }
+
+        if(gather.iov_count > 0) {
+            n = SVR_Net_trySendGathered(socket, &gather, &skip, offset);
+            if(n <= 0) {
+                return n;
+            }
+        }
+
+        if(SVR_Net_gatherMessage(&gather, messages[i]) == false) {
+            packed_message = SVR_Message_pack(messages[i], protocol);
+            iov[0].iov_base = packed_message->data;
+            iov[0].iov_len = packed_message->length;
+            iov[1].iov_base = packed_message->payload;
+            iov[1].iov_len = packed_message->payload_size;
+
+            n = SVR_Net_trySendv(socket, iov, packed_message->payload_size > 0 ? 2 : 1, &skip, offset);
+            if(n <= 0) {
+                return n;
+            }
+        }
+    }
+
+    if(gather.iov_count > 0) {
+        return SVR_Net_trySendGathered(socket, &gather, &skip, offset);
+    }
+
+    return 1;
 }
 
 /**
@@ -98,9 +465,14 @@ static int SVR_Net_recv(int socket, void* buffer, size_t len, int flags) {
  * Receive a message from the given socket. Will not retrieve the payload. If a
  * payload accompanies the message a call to SVR_Net_receivePayload should be
  * made after this call
+ *
+ * \param socket The socket to receive from
+ * \param protocol Protocol version the message was sent with
+ * \return The received message, or NULL if the connection closed or failed
  */
-SVR_Message* SVR_Net_receiveMessage(int socket) {
+SVR_Message* SVR_Net_receiveMessage(int socket, int protocol) {
     SVR_PackedMessage* packed_message;
+    SVR_Message* message;
     uint16_t message_length;
     ssize_t n = 0;
 
@@ -114,7 +486,7 @@ SVR_Message* SVR_Net_receiveMessage(int socket) {
 
     /* Create space for the message and receive it */
     message_length = ntohs(message_length);
-    packed_message = SVR_PackedMessage_new(message_length + SVR_MESSAGE_PREFIX_LEN);
+    packed_message = SVR_PackedMessage_new(message_length + SVR_Message_prefixLength(protocol));
 
     n = SVR_Net_recv(socket, packed_message->data, packed_message->length, 0);
     if(n <= 0) {
@@ -122,7 +494,14 @@ SVR_Message* SVR_Net_receiveMessage(int socket) {
         return NULL;
     }
 
-    return SVR_PackedMessage_unpack(packed_message);
+    message = SVR_PackedMessage_unpack(packed_message, protocol);
+    if(message->payload_size > SVR_MAX_PAYLOAD_V2) {
+        SVR_log(SVR_ERROR, "Received payload exceeds maximum size");
+        SVR_Message_release(message);
+        return NULL;
+    }
+
+    return message;
 }
 
 /**
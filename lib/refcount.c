@@ -7,11 +7,27 @@
 
 #include "svr.h"
 
+#include <strings.h>
+#include <time.h>
+
+/* Number of objects collected by a thread in batched mode before they are
+   cleaned up */
+#define SVR_RECLAIM_BATCH_SIZE 16
+
+typedef struct {
+    SVR_RefCounter* ref_counters[SVR_RECLAIM_BATCH_SIZE];
+    int count;
+} SVR_RefCounterBatch;
+
 static Queue* garbage_queue = NULL;
-static SVR_BlockAllocator* allocator = NULL;
 static pthread_t garbage_collector_thread;
+static SVR_ReclaimMode reclaim_mode = SVR_RECLAIM_DEFERRED;
+static pthread_key_t batch_key;
+static SVR_RefCounterStats stats = {0, 0, 0, 0, 0, 0};
 
 static void* SVR_RefCounter_garbageCollector(void* _unused);
+static void SVR_RefCounter_flushBatch(SVR_RefCounterBatch* batch);
+static void SVR_RefCounter_destroyBatch(void* _batch);
 
 /**
  * \defgroup RefCounter Reference counter
@@ -44,6 +60,20 @@ static void* SVR_RefCounter_garbageCollector(void* _unused);
  * passed to SVR_REFCOUNTED_INIT with the object pass as the argument to the
  * cleanup routine.
  *
+ * The reference counter is stored in the object itself and is updated with
+ * atomic operations, so referencing an object never takes a lock. Cleanup
+ * routines may free the object, and with it the reference counter.
+ *
+ * By default cleanup happens asynchronously on a single garbage collector
+ * thread. SVR_RefCounter_setReclaimMode can instead select cleanup inline on
+ * the thread releasing the last reference, or in small per-thread batches.
+ * Inline and batched cleanup avoid funneling every cleanup through one thread,
+ * so resources such as frame buffers are recycled sooner. Cleanup routines
+ * must then be safe to run on any thread which releases a reference, and a
+ * reference which may be the last must not be released while holding a lock
+ * its cleanup routine could take or wait on. The server releases source
+ * frames, encoded frames and clients only after unlocking for this reason.
+ *
  * \{
  */
 
@@ -56,7 +86,7 @@ static void* SVR_RefCounter_garbageCollector(void* _unused);
  */
 void SVR_RefCounter_init(void) {
     garbage_queue = Queue_new();
-    allocator = SVR_BlockAlloc_newAllocator(sizeof(SVR_RefCounter), 8);
+    pthread_key_create(&batch_key, SVR_RefCounter_destroyBatch);
 
     pthread_create(&garbage_collector_thread, NULL, &SVR_RefCounter_garbageCollector, NULL);
 }
@@ -69,53 +99,192 @@ void SVR_RefCounter_init(void) {
  */
 void SVR_RefCounter_close(void) {
     Queue_append(garbage_queue, NULL);
-    SVR_BlockAlloc_freeAllocator(allocator);
 }
 
 /**
  * \private
- * \brief Allocate a new reference counter
+ * \brief Initialize a reference counter
  *
- * Initialize a new reference counter. A new reference counter initially has a
- * reference count of 1. This function should not be called directly, but
- * instead through SVR_REFCOUNTED_INIT.
+ * Initialize a reference counter embedded in an object. A new reference counter
+ * initially has a reference count of 1. This function should not be called
+ * directly, but instead through SVR_REFCOUNTED_INIT.
  *
+ * \param ref_counter The reference counter to initialize
  * \param cleanup Cleanup routine for the given object. The cleanup routine is
  * passed the object as its argument
  * \param object The object the reference counter is to be associated with
- * \return A new reference counter object
  */
-SVR_RefCounter* SVR_RefCounter_new(void (*cleanup)(void*), void* object) {
-    SVR_RefCounter* ref_counter;
-
-    ref_counter = SVR_BlockAlloc_alloc(allocator);
-    ref_counter->ref_count = 1;
+void SVR_RefCounter_initCounter(SVR_RefCounter* ref_counter, void (*cleanup)(void*), void* object) {
     ref_counter->cleanup = cleanup;
     ref_counter->object = object;
-    SVR_LOCKABLE_INIT(ref_counter);
+    __atomic_store_n(&ref_counter->ref_count, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * \brief Set the reclamation mode
+ *
+ * Set how objects are cleaned up once their last reference is released. This
+ * should be set before any reference counted objects are created.
+ *
+ * \param mode The new reclamation mode
+ */
+void SVR_RefCounter_setReclaimMode(SVR_ReclaimMode mode) {
+    __atomic_store_n(&reclaim_mode, mode, __ATOMIC_RELAXED);
+}
+
+/**
+ * \brief Get the reclamation mode
+ *
+ * Get the current reclamation mode
+ *
+ * \return The current reclamation mode
+ */
+SVR_ReclaimMode SVR_RefCounter_getReclaimMode(void) {
+    return __atomic_load_n(&reclaim_mode, __ATOMIC_RELAXED);
+}
+
+/**
+ * \brief Get a reclamation mode by name
+ *
+ * Convert the name of a reclamation mode ("deferred", "inline", or "batched")
+ * to the mode
+ *
+ * \param name Name of the mode
+ * \return The reclamation mode, or -1 if the name is invalid
+ */
+int SVR_RefCounter_getReclaimModeFromName(const char* name) {
+    if(strcasecmp(name, "deferred") == 0) {
+        return SVR_RECLAIM_DEFERRED;
+    } else if(strcasecmp(name, "inline") == 0) {
+        return SVR_RECLAIM_INLINE;
+    } else if(strcasecmp(name, "batched") == 0) {
+        return SVR_RECLAIM_BATCHED;
+    }
+
+    return -1;
+}
+
+/**
+ * \brief Get reclamation statistics
+ *
+ * Get a snapshot of the reclamation statistics
+ *
+ * \param stats_out Structure to store the statistics to
+ */
+void SVR_RefCounter_getStats(SVR_RefCounterStats* stats_out) {
+    stats_out->queue_depth = __atomic_load_n(&stats.queue_depth, __ATOMIC_RELAXED);
+    stats_out->max_queue_depth = __atomic_load_n(&stats.max_queue_depth, __ATOMIC_RELAXED);
+    stats_out->batched = __atomic_load_n(&stats.batched, __ATOMIC_RELAXED);
+    stats_out->cleanups = __atomic_load_n(&stats.cleanups, __ATOMIC_RELAXED);
+    stats_out->total_latency = __atomic_load_n(&stats.total_latency, __ATOMIC_RELAXED);
+    stats_out->max_latency = __atomic_load_n(&stats.max_latency, __ATOMIC_RELAXED);
+}
+
+static uint64_t SVR_RefCounter_now(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((uint64_t) now.tv_sec * 1000000) + (now.tv_nsec / 1000);
+}
+
+static void SVR_RefCounter_updateMax(uint64_t* max, uint64_t value) {
+    uint64_t current = __atomic_load_n(max, __ATOMIC_RELAXED);
+
+    while(value > current &&
+          !__atomic_compare_exchange_n(max, &current, value, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+/**
+ * \private
+ * \brief Clean up an object
+ *
+ * Record statistics and call the cleanup routine of an object whose reference
+ * count has reached 0
+ *
+ * \param ref_counter Reference counter of the object
+ */
+static void SVR_RefCounter_cleanup(SVR_RefCounter* ref_counter) {
+    uint64_t latency = SVR_RefCounter_now() - ref_counter->release_time;
+
+    __atomic_add_fetch(&stats.cleanups, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stats.total_latency, latency, __ATOMIC_RELAXED);
+    SVR_RefCounter_updateMax(&stats.max_latency, latency);
+
+    /* The cleanup routine may free the counter along with the object */
+    ref_counter->cleanup(ref_counter->object);
+}
+
+/**
+ * \private
+ * \brief Clean up all objects in a batch
+ *
+ * \param batch The batch to empty
+ */
+static void SVR_RefCounter_flushBatch(SVR_RefCounterBatch* batch) {
+    SVR_RefCounter* ref_counter;
 
-    return ref_counter;
+    /* Cleanup routines may release further objects into the same batch */
+    while(batch->count > 0) {
+        ref_counter = batch->ref_counters[--batch->count];
+        __atomic_sub_fetch(&stats.batched, 1, __ATOMIC_RELAXED);
+        SVR_RefCounter_cleanup(ref_counter);
+    }
 }
 
 /**
  * \private
- * \brief Free a reference counter
+ * \brief Thread exit handler for batches
  *
- * Free a reference counter
+ * Clean up any objects still batched by an exiting thread
  *
- * \param ref_counter Reference counter to free
+ * \param _batch The exiting thread's batch
  */
-void SVR_RefCounter_destroy(SVR_RefCounter* ref_counter) {
-    SVR_BlockAlloc_free(allocator, ref_counter);
+static void SVR_RefCounter_destroyBatch(void* _batch) {
+    SVR_RefCounterBatch* batch = (SVR_RefCounterBatch*) _batch;
+
+    SVR_RefCounter_flushBatch(batch);
+    free(batch);
+}
+
+/**
+ * \brief Clean up the calling thread's batch
+ *
+ * Immediately clean up any objects batched by the calling thread. In batched
+ * mode, threads should call this when they are about to block so that batched
+ * objects are not held while the thread is idle.
+ */
+void SVR_RefCounter_flush(void) {
+    SVR_RefCounterBatch* batch = pthread_getspecific(batch_key);
+
+    if(batch) {
+        SVR_RefCounter_flushBatch(batch);
+    }
+}
+
+static void SVR_RefCounter_addToBatch(SVR_RefCounter* ref_counter) {
+    SVR_RefCounterBatch* batch = pthread_getspecific(batch_key);
+
+    if(batch == NULL) {
+        batch = malloc(sizeof(SVR_RefCounterBatch));
+        batch->count = 0;
+        pthread_setspecific(batch_key, batch);
+    }
+
+    if(batch->count == SVR_RECLAIM_BATCH_SIZE) {
+        SVR_RefCounter_flushBatch(batch);
+    }
+
+    batch->ref_counters[batch->count++] = ref_counter;
+    __atomic_add_fetch(&stats.batched, 1, __ATOMIC_RELAXED);
 }
 
 /**
  * \private
  * \brief Garbage collector thread
  *
- * Background thread that cleans up objects and frees reference counters when
- * their reference count reaches 0. This is done asychronously from SVR_UNREF to
- * avoid any unexpected latency from object cleanup.
+ * Background thread that cleans up objects when their reference count reaches
+ * 0 in deferred mode. This is done asychronously from SVR_UNREF to avoid any
+ * unexpected latency from object cleanup.
  *
  * \param _unused Unused parameter
  * \return Always returns NULL
@@ -130,11 +299,8 @@ static void* SVR_RefCounter_garbageCollector(void* _unused) {
             break;
         }
 
-        SVR_LOCK(ref_counter);
-        ref_counter->cleanup(ref_counter->object);
-        SVR_UNLOCK(ref_counter);
-
-        SVR_RefCounter_destroy(ref_counter);
+        __atomic_sub_fetch(&stats.queue_depth, 1, __ATOMIC_RELAXED);
+        SVR_RefCounter_cleanup(ref_counter);
     }
 
     return NULL;
@@ -150,28 +316,76 @@ static void* SVR_RefCounter_garbageCollector(void* _unused) {
  * \param ref_counter Reference counter to increment the reference count of
  */
 void SVR_RefCounter_ref(SVR_RefCounter* ref_counter) {
-    SVR_LOCK(ref_counter);
-    ref_counter->ref_count++;
-    SVR_UNLOCK(ref_counter);
+    /* Taking a new reference requires an existing one, so no ordering is
+       needed */
+    __atomic_add_fetch(&ref_counter->ref_count, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * \private
+ * \brief Increment reference count if not released
+ *
+ * Increment the reference count of the object unless it has already reached
+ * 0. Used to reference an object loaded from a shared pointer without holding
+ * a reference, where the object may be released concurrently. The object's
+ * memory must stay valid after it is released, as it does for objects from a
+ * block allocator, and the caller must check that the pointer still refers to
+ * the object afterwards. This function should not be called directly, but
+ * through SVR_TRYREF.
+ *
+ * \param ref_counter Reference counter to increment the reference count of
+ * \return True if a reference was taken
+ */
+bool SVR_RefCounter_tryRef(SVR_RefCounter* ref_counter) {
+    uint32_t ref_count = __atomic_load_n(&ref_counter->ref_count, __ATOMIC_RELAXED);
+
+    do {
+        if(ref_count == 0) {
+            return false;
+        }
+    } while(!__atomic_compare_exchange_n(&ref_counter->ref_count, &ref_count, ref_count + 1, true,
+                                         __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+
+    return true;
 }
 
 /**
  * \private
  * \brief Decrement reference count
  *
- * Decrement the reference count of the object. An object will be marked for
- * garbage colleciton/cleanup once its reference count reaches 0. This function
- * should not be called directly, but through SVR_UNREF.
+ * Decrement the reference count of the object. An object will be cleaned up
+ * according to the reclamation mode once its reference count reaches 0. This
+ * function should not be called directly, but through SVR_UNREF.
  *
  * \param ref_counter Reference counter to decrement the reference count of
  */
 void SVR_RefCounter_unref(SVR_RefCounter* ref_counter) {
-    SVR_LOCK(ref_counter);
-    ref_counter->ref_count--;
-    if(ref_counter->ref_count == 0) {
+    /* Release orders this thread's use of the object before the decrement.
+       The thread dropping the last reference acquires every other thread's
+       use before queuing the object for cleanup */
+    if(__atomic_sub_fetch(&ref_counter->ref_count, 1, __ATOMIC_RELEASE) != 0) {
+        return;
+    }
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    ref_counter->release_time = SVR_RefCounter_now();
+
+    switch(SVR_RefCounter_getReclaimMode()) {
+    case SVR_RECLAIM_INLINE:
+        SVR_RefCounter_cleanup(ref_counter);
+        break;
+
+    case SVR_RECLAIM_BATCHED:
+        SVR_RefCounter_addToBatch(ref_counter);
+        break;
+
+    case SVR_RECLAIM_DEFERRED:
+    default:
+        SVR_RefCounter_updateMax(&stats.max_queue_depth,
+                                 __atomic_add_fetch(&stats.queue_depth, 1, __ATOMIC_RELAXED));
         Queue_append(garbage_queue, ref_counter);
+        break;
     }
-    SVR_UNLOCK(ref_counter);
 }
 
 /** \} */
@@ -33,22 +33,31 @@ SVR_Source* SVR_Source_new(const char* name) {
     response = SVR_Comm_sendMessage(message, true);
     return_code = SVR_Comm_parseResponse(response);
 
-    SVR_Message_release(message);
-    SVR_Message_release(response);
-
     if(return_code != SVR_SUCCESS) {
+        SVR_Message_release(message);
+        SVR_Message_release(response);
         return NULL;
     }
 
     source = malloc(sizeof(SVR_Source));
+
+    /* A protocol version 2 server includes a handle for binary data
+       messages */
+    source->handle = 0;
+    if(response->count == 3) {
+        source->handle = strtoul(response->components[2], NULL, 10);
+    }
+
+    SVR_Message_release(message);
+    SVR_Message_release(response);
+
     source->name = strdup(name);
     source->encoding = NULL;
     source->encoding_options = NULL;
     source->encoder = NULL;
     source->frame_properties = NULL;
 
-    source->payload_buffer_size = 4 * 1024;
-    source->payload_buffer = malloc(source->payload_buffer_size);
+    source->chunk_size = 4 * 1024;
 
     /* Attempt to set encoding to jpeg and try raw if that fails */
     if(SVR_Source_setEncoding(source, "jpeg") != SVR_SUCCESS) {
@@ -91,10 +100,6 @@ int SVR_Source_destroy(SVR_Source* source) {
         SVR_FrameProperties_destroy(source->frame_properties);
     }
 
-    if(source->payload_buffer) {
-        free(source->payload_buffer);
-    }
-
     free(source);
 
     return return_code;
@@ -209,6 +214,8 @@ int SVR_Source_setFrameProperties(SVR_Source* source, SVR_FrameProperties* frame
 int SVR_Source_sendFrame(SVR_Source* source, IplImage* frame) {
     SVR_FrameProperties* frame_properties;
     SVR_Message* message;
+    size_t chunk_size;
+    size_t ready;
     int return_code;
 
     if(source->encoding == NULL) {
@@ -247,14 +254,30 @@ int SVR_Source_sendFrame(SVR_Source* source, IplImage* frame) {
 
     SVR_Encoder_encode(source->encoder, frame);
 
-    message = SVR_Message_new(2);
-    message->components[0] = SVR_Arena_strdup(message->alloc, "Data");
-    message->components[1] = SVR_Arena_strdup(message->alloc, source->name);
-    message->payload = source->payload_buffer;
+    /* With protocol version 2 the whole encoded frame is sent as one binary
+       data message */
+    if(SVR_Comm_getProtocol() >= SVR_PROTOCOL_V2) {
+        chunk_size = SVR_MAX_PAYLOAD_V2;
+    } else {
+        chunk_size = source->chunk_size;
+    }
+
+    if(source->handle && SVR_Comm_getProtocol() >= SVR_PROTOCOL_V2) {
+        message = SVR_Message_new(0);
+        message->opcode = SVR_OPCODE_DATA;
+        message->handle = source->handle;
+    } else {
+        message = SVR_Message_new(2);
+        message->components[0] = SVR_Arena_strdup(message->alloc, "Data");
+        message->components[1] = SVR_Arena_strdup(message->alloc, source->name);
+    }
 
+    /* Send straight from the encoder's output */
     while(SVR_Encoder_dataReady(source->encoder) > 0) {
-        message->payload_size = SVR_Encoder_readData(source->encoder, message->payload, source->payload_buffer_size);
+        message->payload = SVR_Encoder_peekData(source->encoder, &ready);
+        message->payload_size = Util_min(ready, chunk_size);
         SVR_Comm_sendMessage(message, false);
+        SVR_Encoder_consumeData(source->encoder, message->payload_size);
     }
 
     SVR_Message_release(message);
@@ -9,9 +9,11 @@ static SVR_Stream* SVR_Stream_getByName(const char* stream_name);
 static int SVR_Stream_updateInfo(SVR_Stream* stream);
 static int SVR_Stream_open(SVR_Stream* stream);
 static int SVR_Stream_close(SVR_Stream* stream);
+static void SVR_Stream_decodeData(SVR_Stream* stream, void* buffer, size_t n);
 
 static pthread_mutex_t stream_list_lock = PTHREAD_MUTEX_INITIALIZER;
 static Dictionary* streams;
+static SVR_HandleTable* stream_handles;
 static unsigned int last_stream_num = 0;
 
 static pthread_mutex_t new_global_data_lock = PTHREAD_MUTEX_INITIALIZER;
@@ -31,6 +33,7 @@ static bool new_global_data = false;
  */
 void SVR_Stream_init(void) {
     streams = Dictionary_new();
+    stream_handles = SVR_HandleTable_new();
 }
 
 /**
@@ -61,7 +64,11 @@ SVR_Stream* SVR_Stream_new(const char* source_name) {
     stream->encoding = NULL;
     stream->decoder = NULL;
     stream->orphaned = false;
+    stream->handle = 0;
+    stream->frame_pool_depth = SVR_FRAMEPOOL_DEFAULT_DEPTH;
+    stream->frame_pool_policy = SVR_FRAMEPOOL_DROP_OLDEST;
 
+    pthread_mutex_init(&stream->decode_lock, NULL);
     pthread_cond_init(&stream->new_frame, NULL);
     SVR_LOCKABLE_INIT(stream);
 
@@ -86,9 +93,15 @@ void SVR_Stream_destroy(SVR_Stream* stream) {
 
     pthread_mutex_lock(&stream_list_lock);
     Dictionary_remove(streams, stream->stream_name);
-    SVR_LOCK(stream);
+    if(stream->handle) {
+        SVR_HandleTable_remove(stream_handles, stream->handle);
+    }
     pthread_mutex_unlock(&stream_list_lock);
 
+    /* Data already being provided to the stream holds the decode lock */
+    pthread_mutex_lock(&stream->decode_lock);
+    SVR_LOCK(stream);
+
     if(stream->frame_properties) {
         SVR_FrameProperties_destroy(stream->frame_properties);
     }
@@ -105,6 +118,8 @@ void SVR_Stream_destroy(SVR_Stream* stream) {
     free(stream->source_name);
 
     SVR_UNLOCK(stream);
+    pthread_mutex_unlock(&stream->decode_lock);
+    pthread_mutex_destroy(&stream->decode_lock);
     free(stream);
 }
 
@@ -116,8 +131,20 @@ static int SVR_Stream_open(SVR_Stream* stream) {
     SVR_Message* response;
     int return_code;
 
-    /* Open stream */
-    message = SVR_Message_new(2);
+    /* Open stream. With protocol version 2 the stream is given a handle which
+       the server uses to tag binary data messages */
+    if(SVR_Comm_getProtocol() >= SVR_PROTOCOL_V2) {
+        pthread_mutex_lock(&stream_list_lock);
+        stream->handle = SVR_HandleTable_add(stream_handles, stream);
+        pthread_mutex_unlock(&stream_list_lock);
+    }
+
+    if(stream->handle) {
+        message = SVR_Message_new(3);
+        message->components[2] = SVR_Arena_sprintf(message->alloc, "%u", stream->handle);
+    } else {
+        message = SVR_Message_new(2);
+    }
     message->components[0] = SVR_Arena_strdup(message->alloc, "Stream.open");
     message->components[1] = SVR_Arena_strdup(message->alloc, stream->stream_name);
 
@@ -128,6 +155,11 @@ static int SVR_Stream_open(SVR_Stream* stream) {
     SVR_Message_release(response);
 
     if(return_code != SVR_SUCCESS) {
+        if(stream->handle) {
+            pthread_mutex_lock(&stream_list_lock);
+            SVR_HandleTable_remove(stream_handles, stream->handle);
+            pthread_mutex_unlock(&stream_list_lock);
+        }
         return return_code;
     }
 
@@ -286,6 +318,49 @@ int SVR_Stream_resize(SVR_Stream* stream, int width, int height) {
     return return_code;
 }
 
+/**
+ * \brief Crop the stream
+ *
+ * Request that only a region of the source be sent. The region is cropped on
+ * the server side before the stream is resized and encoded. The stream's size
+ * is reset to the size of the region, so SVR_Stream_resize should be called
+ * after this to scale the region.
+ *
+ * \param stream The stream
+ * \param x Left edge of the region
+ * \param y Top edge of the region
+ * \param width Width of the region
+ * \param height Height of the region
+ * \return An SVR return code
+ */
+int SVR_Stream_setROI(SVR_Stream* stream, int x, int y, int width, int height) {
+    SVR_Message* message;
+    SVR_Message* response;
+    int return_code;
+
+    message = SVR_Message_new(6);
+    message->components[0] = SVR_Arena_strdup(message->alloc, "Stream.setROI");
+    message->components[1] = SVR_Arena_strdup(message->alloc, stream->stream_name);
+    message->components[2] = SVR_Arena_sprintf(message->alloc, "%d", x);
+    message->components[3] = SVR_Arena_sprintf(message->alloc, "%d", y);
+    message->components[4] = SVR_Arena_sprintf(message->alloc, "%d", width);
+    message->components[5] = SVR_Arena_sprintf(message->alloc, "%d", height);
+
+    response = SVR_Comm_sendMessage(message, true);
+    return_code = SVR_Comm_parseResponse(response);
+
+    SVR_Message_release(message);
+    SVR_Message_release(response);
+
+    if(return_code != SVR_SUCCESS) {
+        return return_code;
+    }
+
+    return_code = SVR_Stream_updateInfo(stream);
+
+    return return_code;
+}
+
 /**
  * \brief Change the color mode of the stream
  *
@@ -328,7 +403,10 @@ int SVR_Stream_setGrayscale(SVR_Stream* stream, bool grayscale) {
 /**
  * \brief Set the priority of the stream
  *
- * Set the stream priority. This currently has not effect
+ * Set the stream priority. Frames of higher priority streams are encoded
+ * first, and when the server can not keep up with a source, streams below the
+ * highest priority of that source's streams skip frames. New streams have a
+ * priority of 1.
  *
  * \param stream The stream
  * \param priority The stream priority
@@ -397,6 +475,103 @@ int SVR_Stream_setDropRate(SVR_Stream* stream, int drop_rate) {
     return return_code;
 }
 
+/**
+ * \brief Cap the stream's frame rate
+ *
+ * Request that at most fps frames per second be sent, whatever rate the source
+ * runs at. Frames over the cap are skipped by the server before they are
+ * encoded.
+ *
+ * \param stream The stream
+ * \param fps Maximum frames per second, or 0 for no limit
+ * \return An SVR return code
+ */
+int SVR_Stream_setMaxRate(SVR_Stream* stream, double fps) {
+    SVR_Message* message;
+    SVR_Message* response;
+    int return_code;
+
+    message = SVR_Message_new(3);
+    message->components[0] = SVR_Arena_strdup(message->alloc, "Stream.setMaxRate");
+    message->components[1] = SVR_Arena_strdup(message->alloc, stream->stream_name);
+    message->components[2] = SVR_Arena_sprintf(message->alloc, "%g", fps);
+
+    response = SVR_Comm_sendMessage(message, true);
+    return_code = SVR_Comm_parseResponse(response);
+
+    SVR_Message_release(message);
+    SVR_Message_release(response);
+
+    return return_code;
+}
+
+/**
+ * \brief Get the stream's delivery counters
+ *
+ * Get the number of frames the server has sent to the stream, and the number
+ * it dropped because the stream fell behind. A stream whose connection can not
+ * keep up is only ever sent the newest frame, so a growing drop count means
+ * the frame rate or frame size should be lowered.
+ *
+ * \param stream The stream
+ * \param frames_sent Set to the number of frames sent
+ * \param frames_dropped Set to the number of frames dropped
+ * \return An SVR return code
+ */
+int SVR_Stream_getStats(SVR_Stream* stream, unsigned long* frames_sent, unsigned long* frames_dropped) {
+    SVR_Message* message;
+    SVR_Message* response;
+    int return_code;
+
+    message = SVR_Message_new(2);
+    message->components[0] = SVR_Arena_strdup(message->alloc, "Stream.getStats");
+    message->components[1] = SVR_Arena_strdup(message->alloc, stream->stream_name);
+    response = SVR_Comm_sendMessage(message, true);
+
+    if(response->count == 3 && strcmp(response->components[0], "Stream.getStats") == 0) {
+        *frames_sent = strtoul(response->components[1], NULL, 10);
+        *frames_dropped = strtoul(response->components[2], NULL, 10);
+        return_code = 0;
+    } else {
+        return_code = SVR_Comm_parseResponse(response);
+    }
+
+    SVR_Message_release(message);
+    SVR_Message_release(response);
+
+    return return_code;
+}
+
+/**
+ * \brief Set the stream's frame pool
+ *
+ * Set the number of decoded frames buffered for the stream, and what happens
+ * when all of them are in use. The stream holds one frame for the next call to
+ * SVR_Stream_getFrame and decodes into another, so with a depth of n the
+ * caller may hold n - 2 frames at once without frames being dropped or, under
+ * SVR_FRAMEPOOL_BLOCK, stalling the stream. A stalled stream stalls the
+ * connection to the server, so no other stream receives frames and no request
+ * is answered until the caller returns a frame or calls SVR_Stream_getFrame.
+ * Takes effect when the stream is next unpaused.
+ *
+ * \param stream The stream
+ * \param depth Number of frames to buffer, at least 2
+ * \param policy What to do when all frames are in use
+ * \return An SVR return code
+ */
+int SVR_Stream_setFramePool(SVR_Stream* stream, int depth, SVR_FramePoolPolicy policy) {
+    if(depth < 2 || (policy != SVR_FRAMEPOOL_DROP_OLDEST && policy != SVR_FRAMEPOOL_BLOCK)) {
+        return SVR_INVALIDARGUMENT;
+    }
+
+    SVR_LOCK(stream);
+    stream->frame_pool_depth = depth;
+    stream->frame_pool_policy = policy;
+    SVR_UNLOCK(stream);
+
+    return SVR_SUCCESS;
+}
+
 /**
  * \brief Unpause the stream
  *
@@ -406,15 +581,28 @@ int SVR_Stream_setDropRate(SVR_Stream* stream, int drop_rate) {
  * \return An SVR return code
  */
 int SVR_Stream_unpause(SVR_Stream* stream) {
+    SVR_Decoder* previous_decoder;
     SVR_Message* message;
     SVR_Message* response;
     int return_code;
 
-    /* Reopen decoder */
-    if(stream->decoder) {
-        SVR_Decoder_destroy(stream->decoder);
+    /* Reopen decoder. The previous decoder lives on until the caller has
+       returned every frame it holds from it */
+    pthread_mutex_lock(&stream->decode_lock);
+    SVR_LOCK(stream);
+    previous_decoder = stream->decoder;
+    if(previous_decoder && stream->current_frame) {
+        SVR_Decoder_returnFrame(previous_decoder, stream->current_frame);
+        stream->current_frame = NULL;
+    }
+
+    stream->decoder = SVR_Decoder_newWithFramePool(stream->encoding, stream->frame_properties,
+                                                   stream->frame_pool_depth, stream->frame_pool_policy);
+    if(previous_decoder) {
+        SVR_Decoder_retire(previous_decoder, stream->decoder);
     }
-    stream->decoder = SVR_Decoder_new(stream->encoding, stream->frame_properties);
+    SVR_UNLOCK(stream);
+    pthread_mutex_unlock(&stream->decode_lock);
 
     /* Open stream */
     message = SVR_Message_new(2);
@@ -597,14 +785,58 @@ void SVR_Stream_provideData(const char* stream_name, void* buffer, size_t n) {
     pthread_mutex_lock(&stream_list_lock);
     stream = SVR_Stream_getByName(stream_name);
     if(stream == NULL) {
+        pthread_mutex_unlock(&stream_list_lock);
         SVR_log(SVR_WARNING, "Data arrived for unknown stream\n");
         return;
     }
-    SVR_LOCK(stream);
+    pthread_mutex_lock(&stream->decode_lock);
+    pthread_mutex_unlock(&stream_list_lock);
+
+    SVR_Stream_decodeData(stream, buffer, n);
+}
+
+/**
+ * \private
+ * \brief Provide encoded source data to a stream by handle
+ *
+ * Provide encoded source data received in a binary data message to a stream
+ *
+ * \param handle Handle of the stream the data is for
+ * \param buffer A buffer of encoded frame data
+ * \param n Number of bytes in the buffer
+ */
+void SVR_Stream_provideDataByHandle(uint32_t handle, void* buffer, size_t n) {
+    SVR_Stream* stream;
+
+    pthread_mutex_lock(&stream_list_lock);
+    stream = SVR_HandleTable_get(stream_handles, handle);
+    if(stream == NULL) {
+        pthread_mutex_unlock(&stream_list_lock);
+        SVR_log(SVR_WARNING, "Data arrived for unknown stream\n");
+        return;
+    }
+    pthread_mutex_lock(&stream->decode_lock);
     pthread_mutex_unlock(&stream_list_lock);
 
+    SVR_Stream_decodeData(stream, buffer, n);
+}
+
+/**
+ * Decode data provided to a stream whose decode lock is held, and release the
+ * decode lock
+ */
+static void SVR_Stream_decodeData(SVR_Stream* stream, void* buffer, size_t n) {
+    if(stream->decoder == NULL) {
+        pthread_mutex_unlock(&stream->decode_lock);
+        return;
+    }
+
+    /* The stream is not locked while decoding, since under
+       SVR_FRAMEPOOL_BLOCK the decoder may wait for the caller to get and
+       return a frame */
     SVR_Decoder_decode(stream->decoder, buffer, n);
 
+    SVR_LOCK(stream);
     if(SVR_Decoder_framesReady(stream->decoder)) {
         if(stream->current_frame) {
             SVR_Decoder_returnFrame(stream->decoder, stream->current_frame);
@@ -624,6 +856,7 @@ void SVR_Stream_provideData(const char* stream_name, void* buffer, size_t n) {
     pthread_mutex_unlock(&new_global_data_lock);
 
     SVR_UNLOCK(stream);
+    pthread_mutex_unlock(&stream->decode_lock);
 }
 
 /** \} */
@@ -23,6 +23,10 @@ _errors = {
     255: "Unknown error"
 }
 
+# Frame pool policies, see SVR_Stream_setFramePool
+FRAMEPOOL_DROP_OLDEST = 0
+FRAMEPOOL_BLOCK = 1
+
 
 class SVRSourcesList(ctypes.Structure):
 
@@ -64,12 +68,20 @@ _svr.SVR_Stream_setEncoding.argtypes = [ctypes.c_void_p, ctypes.c_char_p]
 _svr.SVR_Stream_setEncoding.restype = _check_stream_call
 _svr.SVR_Stream_resize.argtypes = [ctypes.c_void_p, ctypes.c_int, ctypes.c_int]
 _svr.SVR_Stream_resize.restype = _check_stream_call
+_svr.SVR_Stream_setROI.argtypes = [ctypes.c_void_p, ctypes.c_int, ctypes.c_int, ctypes.c_int, ctypes.c_int]
+_svr.SVR_Stream_setROI.restype = _check_stream_call
 _svr.SVR_Stream_setGrayscale.argtypes = [ctypes.c_void_p, ctypes.c_bool]
 _svr.SVR_Stream_setGrayscale.restype = _check_stream_call
 _svr.SVR_Stream_setDropRate.argtypes = [ctypes.c_void_p, ctypes.c_int]
 _svr.SVR_Stream_setDropRate.restype = _check_stream_call
+_svr.SVR_Stream_setMaxRate.argtypes = [ctypes.c_void_p, ctypes.c_double]
+_svr.SVR_Stream_setMaxRate.restype = _check_stream_call
+_svr.SVR_Stream_getStats.argtypes = [ctypes.c_void_p, ctypes.POINTER(ctypes.c_ulong), ctypes.POINTER(ctypes.c_ulong)]
+_svr.SVR_Stream_getStats.restype = _check_stream_call
 _svr.SVR_Stream_setPriority.argtypes = [ctypes.c_void_p, ctypes.c_short]
 _svr.SVR_Stream_setPriority.restype = _check_stream_call
+_svr.SVR_Stream_setFramePool.argtypes = [ctypes.c_void_p, ctypes.c_int, ctypes.c_int]
+_svr.SVR_Stream_setFramePool.restype = _check_stream_call
 _svr.SVR_Stream_unpause.argtypes = [ctypes.c_void_p]
 _svr.SVR_Stream_unpause.restype = _check_stream_call
 _svr.SVR_Stream_pause.argtypes = [ctypes.c_void_p]
@@ -141,6 +153,9 @@ class Stream(object):
     def resize(self, width, height):
         return self.svr.SVR_Stream_resize(self.handle, width, height)
 
+    def set_roi(self, x, y, width, height):
+        return self.svr.SVR_Stream_setROI(self.handle, x, y, width, height)
+
     def set_grayscale(self, grayscale=True):
         return self.svr.SVR_Stream_setGrayscale(self.handle, ctypes.c_bool(grayscale))
 
@@ -150,6 +165,18 @@ class Stream(object):
     def set_drop_rate(self, drop_rate):
         return self.svr.SVR_Stream_setDropRate(self.handle, drop_rate)
 
+    def set_max_rate(self, fps):
+        return self.svr.SVR_Stream_setMaxRate(self.handle, fps)
+
+    def get_stats(self):
+        frames_sent = ctypes.c_ulong()
+        frames_dropped = ctypes.c_ulong()
+        self.svr.SVR_Stream_getStats(self.handle, ctypes.byref(frames_sent), ctypes.byref(frames_dropped))
+        return frames_sent.value, frames_dropped.value
+
+    def set_frame_pool(self, depth, policy=FRAMEPOOL_DROP_OLDEST):
+        return self.svr.SVR_Stream_setFramePool(self.handle, depth, policy)
+
     def unpause(self):
         return self.svr.SVR_Stream_unpause(self.handle)
 
@@ -4,8 +4,31 @@
 #include "svr.h"
 #include "svrd.h"
 
+#include <fcntl.h>
+#include <sys/ioctl.h>
+
+#ifdef __SVR_Linux__
+# include <linux/sockios.h>
+#endif
+
 static void* SVRD_Client_worker(void* _client);
+static void* SVRD_Client_writer(void* _client);
+static void SVRD_Client_writeFrame(SVRD_Client* client);
+static SVR_Message* SVRD_Client_copyMessage(SVR_Message* message);
+static int SVRD_Client_flushControl(SVRD_Client* client);
+static void SVRD_Client_flushOutput(SVRD_Client* client);
+static bool SVRD_Client_sendOutput(SVRD_Client* client);
+static bool SVRD_Client_fillOutput(SVRD_Client* client);
+static void SVRD_Client_startFrame(SVRD_Client* client);
+static void SVRD_Client_finishFrame(SVRD_Client* client);
+static void SVRD_Client_discardOutput(SVRD_Client* client);
 static void SVRD_Client_cleanup(void* _client);
+static void SVRD_Client_processTask(void* _client);
+static int SVRD_Client_parseReceived(SVRD_Client* client);
+static bool SVRD_Client_submitPending(SVRD_Client* client);
+static void SVRD_Client_sendFailed(SVRD_Client* client);
+static void SVRD_Client_advertiseProtocol(SVRD_Client* client);
+static void SVRD_Client_checkProtocolRequest(SVRD_Client* client, SVR_Message* message);
 
 /* List of active clients */
 static List* clients = NULL;
@@ -46,9 +69,42 @@ SVRD_Client* SVRD_Client_new(int socket) {
     client->socket = socket;
     client->streams = Dictionary_new();
     client->sources = Dictionary_new();
+    client->source_handles = SVR_HandleTable_new();
     client->state = SVR_CONNECTED;
     client->payload_buffer = NULL;
     client->payload_buffer_size = 0;
+    client->protocol = SVR_PROTOCOL_V1;
+    client->receive_protocol = SVR_PROTOCOL_V1;
+
+    client->evented = false;
+    client->receive_buffer = NULL;
+    client->receive_buffer_size = 0;
+    client->received = 0;
+    client->pending_messages = NULL;
+    client->processing = false;
+    client->throttled = false;
+
+    client->outbound_streams = List_new();
+    client->writing_stream = NULL;
+    client->control_messages = List_new();
+    client->writer_started = false;
+    client->writer_stopping = false;
+    pthread_mutex_init(&client->outbound_lock, NULL);
+    pthread_cond_init(&client->outbound_cond, NULL);
+
+    client->sending = false;
+    client->write_blocked = false;
+    client->send_failed = false;
+    client->output_count = 0;
+    client->output_protocol = SVR_PROTOCOL_V1;
+    client->output_offset = 0;
+    client->writing_frame = NULL;
+    client->frame_messages = NULL;
+    client->frame_message_count = 0;
+    client->frame_message_index = 0;
+    client->frame_protocol = SVR_PROTOCOL_V1;
+    client->protocol_message = NULL;
+    client->next_protocol = SVR_PROTOCOL_V1;
 
     SVR_REFCOUNTED_INIT(client, SVRD_Client_cleanup);
     SVR_LOCKABLE_INIT(client);
@@ -60,12 +116,26 @@ SVRD_Client* SVRD_Client_new(int socket) {
     return client;
 }
 
-void SVRD_Client_provideSource(SVRD_Client* client, SVRD_Source* source) {
+/**
+ * \brief Provide a client source
+ *
+ * Register a source provided by the client
+ *
+ * \param client The client
+ * \param source The source provided
+ * \return The handle the client may use to send binary data messages for the
+ * source
+ */
+uint32_t SVRD_Client_provideSource(SVRD_Client* client, SVRD_Source* source) {
     Dictionary_set(client->sources, source->name, source);
+    source->client_handle = SVR_HandleTable_add(client->source_handles, source);
+
+    return source->client_handle;
 }
 
 void SVRD_Client_unprovideSource(SVRD_Client* client, SVRD_Source* source) {
     Dictionary_remove(client->sources, source->name);
+    SVR_HandleTable_remove(client->source_handles, source->client_handle);
 }
 
 void SVRD_Client_openStream(SVRD_Client* client, const char* stream_name) {
@@ -103,14 +173,65 @@ SVRD_Source* SVRD_Client_getSource(SVRD_Client* client, const char* source_name)
     return Dictionary_get(client->sources, source_name);
 }
 
+SVRD_Source* SVRD_Client_getSourceByHandle(SVRD_Client* client, uint32_t handle) {
+    return SVR_HandleTable_get(client->source_handles, handle);
+}
+
 static void SVRD_Client_cleanup(void* _client) {
     SVRD_Client* client = (SVRD_Client*) _client;
 
     SVR_log(SVR_DEBUG, "Cleaning up client");
 
-    pthread_join(client->thread, NULL);
+    /* Every stream has been closed, so the writer has nothing left to send */
+    pthread_mutex_lock(&client->outbound_lock);
+    client->writer_stopping = true;
+    pthread_cond_broadcast(&client->outbound_cond);
+    pthread_mutex_unlock(&client->outbound_lock);
+
+    if(client->writer_started) {
+        pthread_join(client->writer, NULL);
+    }
+
+    if(client->evented) {
+        pthread_mutex_lock(&client->outbound_lock);
+        SVRD_Client_discardOutput(client);
+        pthread_mutex_unlock(&client->outbound_lock);
+    }
+
+    List_destroy(client->outbound_streams);
+
+    while(List_getSize(client->control_messages) > 0) {
+        SVR_Message_release(List_remove(client->control_messages, 0));
+    }
+    List_destroy(client->control_messages);
+    pthread_mutex_destroy(&client->outbound_lock);
+    pthread_cond_destroy(&client->outbound_cond);
+
+    if(client->evented) {
+        /* The event loop only shuts the socket down, so the descriptor can not
+           be reused while the client may still be referenced */
+        close(client->socket);
+
+        while(List_getSize(client->pending_messages) > 0) {
+            SVR_Message_release(List_remove(client->pending_messages, 0));
+        }
+        List_destroy(client->pending_messages);
+        pthread_mutex_destroy(&client->pending_lock);
+        free(client->receive_buffer);
+    } else if(pthread_equal(pthread_self(), client->thread)) {
+        /* With inline or batched reclamation the last reference may be
+           released by the client's own thread */
+        pthread_detach(client->thread);
+    } else {
+        pthread_join(client->thread, NULL);
+    }
+
+    if(client->payload_buffer) {
+        free(client->payload_buffer);
+    }
 
     Dictionary_destroy(client->sources);
+    SVR_HandleTable_destroy(client->source_handles);
     Dictionary_destroy(client->streams);
     free(client);
 
@@ -124,14 +245,337 @@ static void SVRD_Client_cleanup(void* _client) {
 
 void SVRD_addClient(int socket) {
     SVRD_Client* client = SVRD_Client_new(socket);
+    struct timeval send_timeout = {SVRD_SEND_TIMEOUT, 0};
+
+    /* Sends block, but a client which stops reading can only hold up the
+       sending thread for a bounded time */
+    setsockopt(socket, SOL_SOCKET, SO_SNDTIMEO, &send_timeout, sizeof(send_timeout));
 
     SVRD_acquireGlobalClientsLock();
     List_append(clients, client);
+    if(List_getSize(clients) > MAX_CLIENTS) {
+        SVR_log(SVR_WARNING, Util_format("%d clients connected, consider running the server in event loop mode", List_getSize(clients)));
+    }
     SVRD_releaseGlobalClientsLock();
 
+    SVRD_Client_advertiseProtocol(client);
     pthread_create(&client->thread, NULL, &SVRD_Client_worker, client);
 }
 
+/**
+ * \brief Add an event loop client
+ *
+ * Add a client which is served by the event loop. No thread is started for the
+ * client. Instead the event loop calls SVRD_Client_receiveAvailable when the
+ * socket is readable and the received messages are processed by the message
+ * worker pool. The socket is made non-blocking, and whatever a send leaves
+ * unsent is sent by the event loop through SVRD_Client_sendAvailable. The
+ * initial reference to the client belongs to the event loop.
+ *
+ * \param socket The client's connected socket
+ * \return The new client
+ */
+SVRD_Client* SVRD_addEventClient(int socket) {
+    SVRD_Client* client = SVRD_Client_new(socket);
+
+    fcntl(socket, F_SETFL, fcntl(socket, F_GETFL) | O_NONBLOCK);
+
+    client->evented = true;
+    client->receive_buffer_size = 4096;
+    client->receive_buffer = malloc(client->receive_buffer_size);
+    client->pending_messages = List_new();
+    pthread_mutex_init(&client->pending_lock, NULL);
+
+    SVRD_acquireGlobalClientsLock();
+    List_append(clients, client);
+    SVRD_releaseGlobalClientsLock();
+
+    SVRD_Client_advertiseProtocol(client);
+
+    return client;
+}
+
+/**
+ * \brief Advertise the protocol version
+ *
+ * Tell a newly connected client the latest protocol version supported. Clients
+ * which do not support protocol negotiation ignore the message.
+ */
+static void SVRD_Client_advertiseProtocol(SVRD_Client* client) {
+    SVR_Message* message = SVR_Message_new(2);
+
+    message->components[0] = SVR_Arena_strdup(message->alloc, "SVR.protocol");
+    message->components[1] = SVR_Arena_sprintf(message->alloc, "%d", SVR_PROTOCOL_LATEST);
+    SVRD_Client_sendMessage(client, message);
+    SVR_Message_release(message);
+}
+
+/**
+ * \brief Switch the receive protocol on request
+ *
+ * Every message a client sends after an "SVR.setProtocol" request uses the
+ * requested version, so the switch must happen as soon as the request is
+ * received, before any later message is unpacked. The send protocol is
+ * switched later when the request is processed.
+ */
+static void SVRD_Client_checkProtocolRequest(SVRD_Client* client, SVR_Message* message) {
+    int protocol;
+
+    if(message->count == 2 && strcmp(message->components[0], "SVR.setProtocol") == 0) {
+        protocol = atoi(message->components[1]);
+
+        if(protocol >= SVR_PROTOCOL_V1 && protocol <= SVR_PROTOCOL_LATEST) {
+            client->receive_protocol = protocol;
+        }
+    }
+}
+
+/**
+ * \brief Set the send protocol version
+ *
+ * Acknowledge a client's protocol request and send every following message
+ * using the new version
+ *
+ * \param client The client
+ * \param protocol The new protocol version
+ */
+void SVRD_Client_setProtocol(SVRD_Client* client, int protocol) {
+    SVR_Message* message = SVR_Message_new(2);
+
+    message->components[0] = SVR_Arena_strdup(message->alloc, "SVR.setProtocol");
+    message->components[1] = SVR_Arena_sprintf(message->alloc, "%d", protocol);
+
+    /* An event loop client switches versions when the acknowledgement is
+       taken from the queue to be sent */
+    if(client->evented) {
+        pthread_mutex_lock(&client->outbound_lock);
+        client->protocol_message = SVRD_Client_copyMessage(message);
+        client->next_protocol = protocol;
+        List_append(client->control_messages, client->protocol_message);
+        pthread_mutex_unlock(&client->outbound_lock);
+
+        SVRD_Client_flushOutput(client);
+        SVR_Message_release(message);
+        return;
+    }
+
+    SVR_LOCK(client);
+    if(client->state != SVR_CLOSED) {
+        /* Messages queued before the acknowledgement use the old version */
+        SVRD_Client_flushControl(client);
+        if(SVR_Net_sendMessage(client->socket, client->protocol, message) < 0) {
+            SVRD_Client_sendFailed(client);
+        }
+        client->protocol = protocol;
+    }
+    SVR_UNLOCK(client);
+
+    SVR_Message_release(message);
+}
+
+/**
+ * \brief Receive from an event loop client
+ *
+ * Receive what is available on the client's socket without blocking, queue
+ * each complete message for processing, and submit a task to the message
+ * worker pool if one is not already processing the client's messages. At most
+ * SVRD_RECEIVE_PASS_LIMIT bytes are read per call, and reading stops as soon
+ * as the client is throttled, so one client can not monopolise the event loop
+ * or queue messages without bound. The receive buffer only grows to hold a
+ * single partly received message, which is limited by the maximum payload
+ * size. Only the event loop thread may call this.
+ *
+ * \param client The client to receive from
+ * \return 0 on success, or -1 if the connection was closed or failed
+ */
+int SVRD_Client_receiveAvailable(SVRD_Client* client) {
+    size_t pass_received = 0;
+    ssize_t n;
+
+    while(pass_received < SVRD_RECEIVE_PASS_LIMIT) {
+        /* Every complete message has been moved out, so a full buffer holds
+           part of a single message */
+        if(client->received == client->receive_buffer_size) {
+            client->receive_buffer_size *= 2;
+            client->receive_buffer = realloc(client->receive_buffer, client->receive_buffer_size);
+        }
+
+        n = recv(client->socket, client->receive_buffer + client->received,
+                 Util_min(client->receive_buffer_size - client->received, SVRD_RECEIVE_PASS_LIMIT - pass_received),
+                 MSG_DONTWAIT);
+
+        if(n > 0) {
+            client->received += n;
+            pass_received += n;
+
+            if(SVRD_Client_parseReceived(client) < 0) {
+                return -1;
+            }
+
+            if(SVRD_Client_submitPending(client)) {
+                break;
+            }
+        } else if(n < 0 && errno == EINTR) {
+            continue;
+        } else if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        } else {
+            if(client->state != SVR_CLOSED) {
+                SVR_log(SVR_WARNING, "Lost client connection");
+            }
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * \brief Submit received messages for processing
+ *
+ * Submit a processing task for the client's pending messages if none is
+ * running, and throttle the client if too many are pending
+ *
+ * \return True if the client is throttled
+ */
+static bool SVRD_Client_submitPending(SVRD_Client* client) {
+    bool suspend = false;
+    bool throttled;
+
+    pthread_mutex_lock(&client->pending_lock);
+    if(client->processing == false && List_getSize(client->pending_messages) > 0) {
+        client->processing = true;
+
+        /* Reference held by the processing task */
+        SVR_REF(client);
+        SVRD_WorkerPool_submit(SVRD_Server_getMessagePool(), SVRD_Client_processTask, client);
+    }
+
+    /* Stop reading from a client faster than its messages can be processed */
+    if(client->throttled == false && List_getSize(client->pending_messages) >= SVRD_MAX_PENDING_MESSAGES) {
+        client->throttled = true;
+        suspend = true;
+    }
+    throttled = client->throttled;
+    pthread_mutex_unlock(&client->pending_lock);
+
+    if(suspend) {
+        SVRD_Server_updateClient(client);
+    }
+
+    return throttled;
+}
+
+/**
+ * \brief Close an event loop client
+ *
+ * Worker pool task run once the event loop has stopped watching a closed
+ * client. Releases the event loop's reference to the client.
+ *
+ * \param _client The client to close
+ */
+void SVRD_Client_closeTask(void* _client) {
+    SVRD_Client* client = (SVRD_Client*) _client;
+
+    SVRD_Client_markForClosing(client);
+    SVR_UNREF(client);
+}
+
+/**
+ * \brief Split received data into messages
+ *
+ * Unpack every complete message in the client's receive buffer and move it to
+ * the pending message list
+ *
+ * \return 0 on success, or -1 if the client sent an oversized payload
+ */
+static int SVRD_Client_parseReceived(SVRD_Client* client) {
+    SVR_PackedMessage* packed_message;
+    SVR_Message* message;
+    uint16_t data_length;
+    uint32_t payload_size;
+    size_t message_length;
+    size_t offset = 0;
+
+    while(client->received - offset >= SVR_Message_prefixLength(client->receive_protocol)) {
+        SVR_Message_unpackLengths(client->receive_buffer + offset, client->receive_protocol, &data_length, &payload_size);
+
+        if(payload_size > SVR_MAX_PAYLOAD_V2) {
+            SVR_log(SVR_ERROR, "Received payload exceeds maximum size");
+            return -1;
+        }
+
+        message_length = SVR_Message_prefixLength(client->receive_protocol) + data_length;
+        if(client->received - offset < message_length + payload_size) {
+            break;
+        }
+
+        packed_message = SVR_PackedMessage_new(message_length);
+        memcpy(packed_message->data, client->receive_buffer + offset, message_length);
+        message = SVR_PackedMessage_unpack(packed_message, client->receive_protocol);
+        SVRD_Client_checkProtocolRequest(client, message);
+
+        if(payload_size > 0) {
+            message->payload = SVR_Arena_write(message->alloc, client->receive_buffer + offset + message_length, payload_size);
+        }
+
+        pthread_mutex_lock(&client->pending_lock);
+        List_append(client->pending_messages, message);
+        pthread_mutex_unlock(&client->pending_lock);
+
+        offset += message_length + payload_size;
+    }
+
+    /* Move any partial message to the start of the buffer */
+    if(offset > 0) {
+        memmove(client->receive_buffer, client->receive_buffer + offset, client->received - offset);
+        client->received -= offset;
+    }
+
+    return 0;
+}
+
+/**
+ * \brief Process pending messages
+ *
+ * Worker pool task processing an event loop client's messages in the order
+ * they were received
+ */
+static void SVRD_Client_processTask(void* _client) {
+    SVRD_Client* client = (SVRD_Client*) _client;
+    SVR_Message* message;
+    bool resume;
+
+    while(true) {
+        resume = false;
+        pthread_mutex_lock(&client->pending_lock);
+        if(List_getSize(client->pending_messages) == 0) {
+            client->processing = false;
+            pthread_mutex_unlock(&client->pending_lock);
+            break;
+        }
+
+        message = List_remove(client->pending_messages, 0);
+
+        if(client->throttled && List_getSize(client->pending_messages) <= SVRD_MAX_PENDING_MESSAGES / 2) {
+            client->throttled = false;
+            resume = true;
+        }
+        pthread_mutex_unlock(&client->pending_lock);
+
+        if(resume) {
+            SVRD_Server_updateClient(client);
+        }
+
+        if(client->state != SVR_CLOSED) {
+            SVRD_processMessage(client, message);
+        }
+        SVR_Message_release(message);
+    }
+
+    SVR_UNREF(client);
+}
+
 /**
  * \brief Mark a client as closed
  *
@@ -152,9 +596,13 @@ void SVRD_Client_markForClosing(SVRD_Client* client) {
         client->state = SVR_CLOSED;
         SVR_UNLOCK(client);
 
-        /* Immediately close the socket. The client can not longer generate requests */
+        /* Immediately close the socket. The client can not longer generate
+           requests. An evented client's descriptor is closed during cleanup,
+           once the event loop is no longer watching it */
         shutdown(client->socket, SHUT_RDWR);
-        close(client->socket);
+        if(client->evented == false) {
+            close(client->socket);
+        }
 
         /* Remove client from clients list */
         SVRD_acquireGlobalClientsLock();
@@ -206,6 +654,10 @@ void SVRD_Client_kick(SVRD_Client* client, const char* reason) {
     SVRD_Client_sendMessage(client, message);
     SVR_Message_release(message);
 
+    /* Make sure the reason is sent before the socket is shut down. An event
+       loop client is only sent what its socket accepts without blocking */
+    SVRD_Client_flushControl(client);
+
     SVRD_Client_markForClosing(client);
 }
 
@@ -254,18 +706,671 @@ void SVRD_releaseGlobalClientsLock(void) {
     pthread_mutex_unlock(&global_clients_lock);
 }
 
+/**
+ * \brief Send a message to a client
+ *
+ * Send a reply or notification to a client. Messages take priority over frame
+ * data. If a frame is being sent, the message is queued and sent at the next
+ * chunk boundary, so the caller never waits for a frame to be sent. Otherwise
+ * the message is sent immediately. Messages from the same caller are always
+ * sent in order. Sending to a threaded client blocks while its socket buffer
+ * is full, for at most SVRD_SEND_TIMEOUT seconds, after which the client is
+ * disconnected. An event loop client is sent what its socket accepts without
+ * blocking, and the rest once the socket is writable.
+ *
+ * \param client The client to send to
+ * \param message The message. The caller keeps ownership of it
+ * \return The number of bytes sent, 0 if the message was queued, or a negative
+ * value on error. Always 0 for an event loop client
+ */
 int SVRD_Client_sendMessage(SVRD_Client* client, SVR_Message* message) {
+    bool queued;
+
+    pthread_mutex_lock(&client->outbound_lock);
+    List_append(client->control_messages, SVRD_Client_copyMessage(message));
+    queued = (client->writing_stream != NULL);
+    pthread_mutex_unlock(&client->outbound_lock);
+
+    if(client->evented) {
+        SVRD_Client_flushOutput(client);
+        return 0;
+    }
+
+    if(queued) {
+        return 0;
+    }
+
+    return SVRD_Client_flushControl(client);
+}
+
+/**
+ * \brief Copy a message
+ *
+ * Copy a message into its own arena, so it can be queued after the caller
+ * releases the original
+ */
+static SVR_Message* SVRD_Client_copyMessage(SVR_Message* message) {
+    SVR_Message* copy = SVR_Message_new(message->count);
+
+    copy->request_id = message->request_id;
+    copy->opcode = message->opcode;
+    copy->handle = message->handle;
+
+    for(int i = 0; i < message->count; i++) {
+        copy->components[i] = SVR_Arena_strdup(copy->alloc, message->components[i]);
+    }
+
+    if(message->payload_size > 0) {
+        copy->payload = SVR_Arena_write(copy->alloc, message->payload, message->payload_size);
+        copy->payload_size = message->payload_size;
+    }
+
+    return copy;
+}
+
+/**
+ * \brief Send queued control messages
+ *
+ * Send every queued reply and notification, coalescing them into as few
+ * system calls as possible. An event loop client is sent what its socket
+ * accepts without blocking.
+ *
+ * \param client The client
+ * \return The number of bytes sent, or a negative value on error. Always 0 for
+ * an event loop client
+ */
+static int SVRD_Client_flushControl(SVRD_Client* client) {
+    SVR_Message* messages[SVRD_STREAM_SEND_BATCH];
+    int total = 0;
+    int count;
+    int n;
+
+    if(client->evented) {
+        SVRD_Client_flushOutput(client);
+        return 0;
+    }
+
+    SVR_LOCK(client);
+    while(true) {
+        pthread_mutex_lock(&client->outbound_lock);
+        for(count = 0; count < SVRD_STREAM_SEND_BATCH && List_getSize(client->control_messages) > 0; count++) {
+            messages[count] = List_remove(client->control_messages, 0);
+        }
+        pthread_mutex_unlock(&client->outbound_lock);
+
+        if(count == 0) {
+            break;
+        }
+
+        n = -1;
+        if(client->state != SVR_CLOSED && total >= 0) {
+            n = SVR_Net_sendMessages(client->socket, client->protocol, messages, count);
+            if(n < 0) {
+                SVRD_Client_sendFailed(client);
+            }
+        }
+        total = (n < 0) ? -1 : total + n;
+
+        for(int i = 0; i < count; i++) {
+            SVR_Message_release(messages[i]);
+        }
+    }
+    SVR_UNLOCK(client);
+
+    return total;
+}
+
+/**
+ * \brief Check for queued control messages
+ *
+ * \param client The client
+ * \return True if replies or notifications are waiting to be sent
+ */
+bool SVRD_Client_hasControlMessages(SVRD_Client* client) {
+    bool waiting;
+
+    pthread_mutex_lock(&client->outbound_lock);
+    waiting = List_getSize(client->control_messages) > 0;
+    pthread_mutex_unlock(&client->outbound_lock);
+
+    return waiting;
+}
+
+/**
+ * \brief Get the number of bytes queued to a client
+ *
+ * Get the number of bytes sent to the client which are still queued in the
+ * socket, waiting to be sent or acknowledged. Always 0 where the queue depth
+ * can not be read.
+ *
+ * \param client The client
+ * \return The number of bytes queued
+ */
+size_t SVRD_Client_getSendBacklog(SVRD_Client* client) {
+    int queued = 0;
+
+#ifdef SIOCOUTQ
+    if(ioctl(client->socket, SIOCOUTQ, &queued) < 0) {
+        queued = 0;
+    }
+#endif
+
+    return queued;
+}
+
+/**
+ * \brief Queue an encoded frame for a client
+ *
+ * Queue a stream's frame to be sent to the client. A client served by its own
+ * thread is given a second, writer thread with its first frame. An event loop
+ * client is instead sent what its socket accepts straight away, and the rest
+ * by the event loop once the socket is writable, so event loop mode keeps a
+ * fixed number of threads and never blocks one on a slow client. A keyframe
+ * replaces any frame the stream
+ * already has waiting, which is counted as dropped, so a slow client receives
+ * the newest frame rather than falling further behind. Any other frame depends
+ * on the frame before it, so it is only queued if the stream has no frame
+ * waiting and the frame directly follows the last one queued. Otherwise it is
+ * dropped and a keyframe is requested, once, to resume the stream.
+ *
+ * \param client The client
+ * \param stream The stream the frame belongs to
+ * \param encoded_frame The frame. A reference is taken
+ */
+void SVRD_Client_queueFrame(SVRD_Client* client, SVRD_Stream* stream, SVRD_EncodedFrame* encoded_frame) {
+    SVRD_EncodedFrame* dropped = NULL;
+    bool request_keyframe = false;
+    bool send = false;
+    int error;
+
+    SVR_REF(encoded_frame);
+
+    pthread_mutex_lock(&client->outbound_lock);
+    if(encoded_frame->keyframe || (stream->outbound_frame == NULL &&
+                                   encoded_frame->index == stream->queued_index + 1)) {
+        dropped = stream->outbound_frame;
+        if(dropped == NULL) {
+            List_append(client->outbound_streams, stream);
+        }
+        stream->outbound_frame = encoded_frame;
+        stream->queued_index = encoded_frame->index;
+
+        if(encoded_frame->keyframe) {
+            stream->keyframe_wanted = false;
+        }
+
+        if(client->evented) {
+            send = true;
+        } else if(client->writer_started == false) {
+            error = pthread_create(&client->writer, NULL, SVRD_Client_writer, client);
+            if(error == 0) {
+                client->writer_started = true;
+            } else {
+                /* Leave the frame queued for the next attempt */
+                SVR_log(SVR_ERROR, Util_format("Could not start client writer thread: %s", strerror(error)));
+            }
+        }
+        pthread_cond_broadcast(&client->outbound_cond);
+    } else {
+        /* Keep any waiting frame. Frames after this one depend on it, so they
+           are dropped too until the requested keyframe arrives */
+        dropped = encoded_frame;
+        request_keyframe = !stream->keyframe_wanted;
+        stream->keyframe_wanted = true;
+    }
+    pthread_mutex_unlock(&client->outbound_lock);
+
+    if(send) {
+        SVRD_Client_flushOutput(client);
+    }
+
+    if(request_keyframe) {
+        SVRD_SharedEncoder_requestKeyframe(stream->shared_encoder);
+    }
+
+    if(dropped) {
+        __atomic_add_fetch(&stream->frames_dropped, 1, __ATOMIC_RELAXED);
+        SVR_UNREF(dropped);
+    }
+}
+
+/**
+ * \brief Cancel a stream's queued frames
+ *
+ * Discard any frame the stream has waiting, and wait for the writer to
+ * finish sending a frame of the stream if it is doing so. An event loop
+ * client's frame may wait on a full socket indefinitely, so instead only a send
+ * in progress is waited for. The rest of the frame is still sent, so the client
+ * receives whole frames, but the stream is no longer involved. Called as the
+ * stream stops, before the frames' shared encoder is released.
+ *
+ * \param client The client
+ * \param stream The stream
+ */
+void SVRD_Client_cancelFrames(SVRD_Client* client, SVRD_Stream* stream) {
+    SVRD_EncodedFrame* encoded_frame;
+
+    pthread_mutex_lock(&client->outbound_lock);
+    encoded_frame = stream->outbound_frame;
+    if(encoded_frame) {
+        List_remove(client->outbound_streams, List_indexOf(client->outbound_streams, stream));
+        stream->outbound_frame = NULL;
+    }
+
+    while(client->writing_stream == stream && (client->evented == false || client->sending)) {
+        pthread_cond_wait(&client->outbound_cond, &client->outbound_lock);
+    }
+
+    if(client->writing_stream == stream) {
+        client->writing_stream = NULL;
+    }
+    pthread_mutex_unlock(&client->outbound_lock);
+
+    if(encoded_frame) {
+        SVR_UNREF(encoded_frame);
+    }
+}
+
+/**
+ * \brief Send several messages to a client
+ *
+ * Send a sequence of data messages to a client, coalescing them into as few
+ * system calls as possible. Any queued reply or notification is sent first. No
+ * other message sent to the client is interleaved with the sequence.
+ *
+ * \param client The client to send to
+ * \param messages The messages to send, in order
+ * \param count The number of messages
+ * \return The number of bytes sent, or a negative value on error
+ */
+int SVRD_Client_sendMessages(SVRD_Client* client, SVR_Message** messages, int count) {
     int n = -1;
 
     SVR_LOCK(client);
-    if(client->state != SVR_CLOSED) {
-        n = SVR_Net_sendMessage(client->socket, message);
+    if(SVRD_Client_flushControl(client) >= 0 && client->state != SVR_CLOSED) {
+        n = SVR_Net_sendMessages(client->socket, client->protocol, messages, count);
+        if(n < 0) {
+            SVRD_Client_sendFailed(client);
+        }
     }
     SVR_UNLOCK(client);
 
     return n;
 }
 
+/**
+ * \brief Handle a failed send
+ *
+ * A send which failed or timed out may have sent part of a message, after
+ * which nothing more can be sent to the client. Shut the connection down, so
+ * the client's thread or the event loop sees it close and closes the client.
+ *
+ * \param client The client
+ */
+static void SVRD_Client_sendFailed(SVRD_Client* client) {
+    if(client->state != SVR_CLOSED) {
+        SVR_log(SVR_WARNING, Util_format("Could not send to client: %s", strerror(errno)));
+    }
+
+    shutdown(client->socket, SHUT_RDWR);
+}
+
+/**
+ * \brief Send a queued frame
+ *
+ * Send the frame of the stream queued first to a threaded client, then any
+ * messages queued while it was being sent. Called with the client's outbound
+ * lock held and at least one stream queued. The lock is released while
+ * sending.
+ *
+ * \param client The client
+ */
+static void SVRD_Client_writeFrame(SVRD_Client* client) {
+    SVRD_EncodedFrame* encoded_frame;
+    SVRD_Stream* stream;
+
+    stream = List_remove(client->outbound_streams, 0);
+    encoded_frame = stream->outbound_frame;
+    stream->outbound_frame = NULL;
+    client->writing_stream = stream;
+    pthread_mutex_unlock(&client->outbound_lock);
+
+    if(SVRD_Stream_sendFrame(stream, encoded_frame) != SVR_SUCCESS) {
+        SVRD_Stream_pause(stream);
+    }
+    SVR_UNREF(encoded_frame);
+    SVR_RefCounter_flush();
+
+    pthread_mutex_lock(&client->outbound_lock);
+    client->writing_stream = NULL;
+    pthread_cond_broadcast(&client->outbound_cond);
+
+    /* Send messages queued while the frame was being sent */
+    if(List_getSize(client->control_messages) > 0) {
+        pthread_mutex_unlock(&client->outbound_lock);
+        SVRD_Client_flushControl(client);
+        pthread_mutex_lock(&client->outbound_lock);
+    }
+}
+
+/**
+ * \brief Client writer thread
+ *
+ * Send queued frames to a threaded client, one stream's frame at a time in the
+ * order they were queued. Stream workers only queue frames, so a client which
+ * reads slowly holds up its own writer and not the encoding of other streams.
+ *
+ * \param _client Pointer to a SVRD_Client structure
+ * \return Always returns NULL
+ */
+static void* SVRD_Client_writer(void* _client) {
+    SVRD_Client* client = (SVRD_Client*) _client;
+
+    pthread_mutex_lock(&client->outbound_lock);
+    while(true) {
+        while(List_getSize(client->outbound_streams) == 0 && client->writer_stopping == false) {
+            pthread_cond_wait(&client->outbound_cond, &client->outbound_lock);
+        }
+
+        if(List_getSize(client->outbound_streams) == 0) {
+            break;
+        }
+
+        SVRD_Client_writeFrame(client);
+    }
+    pthread_mutex_unlock(&client->outbound_lock);
+
+    return NULL;
+}
+
+/**
+ * \brief Send to an event loop client without blocking
+ *
+ * Send what the socket accepts of the client's queued messages and frames. If
+ * the socket fills, the event loop is told to send the rest once it is
+ * writable.
+ *
+ * \param client An event loop client
+ */
+static void SVRD_Client_flushOutput(SVRD_Client* client) {
+    bool blocked;
+
+    pthread_mutex_lock(&client->outbound_lock);
+    blocked = SVRD_Client_sendOutput(client);
+    pthread_mutex_unlock(&client->outbound_lock);
+
+    if(blocked) {
+        SVRD_Server_updateClient(client);
+    }
+}
+
+/**
+ * \brief Continue sending to a writable client
+ *
+ * Called by the event loop when the full socket of an event loop client has
+ * room again. Sending carries on from where it stopped, and the event loop
+ * stops watching for room once nothing is left to send.
+ *
+ * \param client An event loop client
+ */
+void SVRD_Client_sendAvailable(SVRD_Client* client) {
+    bool blocked;
+
+    pthread_mutex_lock(&client->outbound_lock);
+    client->write_blocked = false;
+    blocked = SVRD_Client_sendOutput(client);
+    pthread_mutex_unlock(&client->outbound_lock);
+
+    if(blocked == false) {
+        SVRD_Server_updateClient(client);
+    }
+
+    /* Clean up frames sent by the event loop thread */
+    SVR_RefCounter_flush();
+}
+
+/**
+ * \brief Send queued output until the socket is full
+ *
+ * Called with the client's outbound lock held, which is released while
+ * sending. Unless another thread is already sending, or the socket is known to
+ * be full, send batches of messages until nothing is left or the socket is
+ * full. A batch partly sent is finished before any other is started, so
+ * messages are never interleaved on the wire.
+ *
+ * \param client An event loop client
+ * \return True if this call left the socket full, so the event loop must watch
+ * for it becoming writable
+ */
+static bool SVRD_Client_sendOutput(SVRD_Client* client) {
+    int n;
+
+    if(client->sending || client->write_blocked) {
+        return false;
+    }
+
+    client->sending = true;
+    while(SVRD_Client_fillOutput(client)) {
+        pthread_mutex_unlock(&client->outbound_lock);
+        n = SVR_Net_trySendMessages(client->socket, client->output_protocol, client->output,
+                                    client->output_count, &client->output_offset);
+        if(n < 0) {
+            SVRD_Client_sendFailed(client);
+        }
+        pthread_mutex_lock(&client->outbound_lock);
+
+        if(n == 0) {
+            client->write_blocked = true;
+            break;
+        }
+
+        if(n < 0) {
+            client->send_failed = true;
+        }
+
+        for(int i = 0; i < client->output_count; i++) {
+            SVR_Message_release(client->output[i]);
+        }
+        client->output_count = 0;
+    }
+    client->sending = false;
+    pthread_cond_broadcast(&client->outbound_cond);
+
+    return client->write_blocked;
+}
+
+/**
+ * \brief Gather the next batch of output
+ *
+ * Called by the sending thread with the outbound lock held, which may be
+ * released in between. Unless part of a batch is left to send, fill the
+ * output with queued replies and notifications, or failing that the next data
+ * messages of the frame being sent, starting on the next queued frame as each
+ * is finished. Replies are therefore let in between any two batches of frame
+ * data. Once a send has failed or the client is closed, everything is
+ * discarded instead.
+ *
+ * \param client An event loop client
+ * \return True if the output holds messages to send
+ */
+static bool SVRD_Client_fillOutput(SVRD_Client* client) {
+    SVR_Message* message;
+
+    if(client->send_failed || client->state == SVR_CLOSED) {
+        SVRD_Client_discardOutput(client);
+        return false;
+    }
+
+    if(client->output_count > 0) {
+        return true;
+    }
+
+    client->output_offset = 0;
+
+    /* Messages after a protocol acknowledgement use the new version, so a
+       batch ends with one */
+    client->output_protocol = client->protocol;
+    while(client->output_count < SVRD_STREAM_SEND_BATCH && List_getSize(client->control_messages) > 0) {
+        message = List_remove(client->control_messages, 0);
+        client->output[client->output_count++] = message;
+
+        if(message == client->protocol_message) {
+            client->protocol = client->next_protocol;
+            client->protocol_message = NULL;
+            break;
+        }
+    }
+
+    if(client->output_count > 0) {
+        return true;
+    }
+
+    while(true) {
+        if(client->writing_frame && client->frame_message_index < client->frame_message_count) {
+            client->output_protocol = client->frame_protocol;
+            while(client->output_count < SVRD_STREAM_SEND_BATCH &&
+                  client->frame_message_index < client->frame_message_count) {
+                client->output[client->output_count++] = client->frame_messages[client->frame_message_index++];
+            }
+            return true;
+        }
+
+        if(client->writing_frame) {
+            SVRD_Client_finishFrame(client);
+        }
+
+        if(List_getSize(client->outbound_streams) == 0) {
+            return false;
+        }
+
+        SVRD_Client_startFrame(client);
+    }
+}
+
+/**
+ * \brief Start sending the next queued frame
+ *
+ * Called by the sending thread with the outbound lock held, which is released
+ * meanwhile. Take the frame of the stream queued first and split it into data
+ * messages, unless the stream can not decode it. Protocol version 2 frames are
+ * split into SVRD_STREAM_SEND_QUANTUM sized messages so replies can be sent
+ * between them.
+ *
+ * \param client An event loop client with a stream queued
+ */
+static void SVRD_Client_startFrame(SVRD_Client* client) {
+    SVRD_EncodedFrame* encoded_frame;
+    SVRD_Stream* stream;
+    size_t chunk_size;
+    size_t offset = 0;
+    int protocol = client->protocol;
+    int count;
+
+    stream = List_remove(client->outbound_streams, 0);
+    encoded_frame = stream->outbound_frame;
+    stream->outbound_frame = NULL;
+    client->writing_stream = stream;
+    pthread_mutex_unlock(&client->outbound_lock);
+
+    /* The stream can not be cancelled while this thread is sending */
+    if(SVRD_Stream_checkFrame(stream, encoded_frame) == false) {
+        SVR_UNREF(encoded_frame);
+
+        pthread_mutex_lock(&client->outbound_lock);
+        client->writing_stream = NULL;
+        pthread_cond_broadcast(&client->outbound_cond);
+        return;
+    }
+
+    chunk_size = (protocol < SVR_PROTOCOL_V2) ? stream->chunk_size : SVRD_STREAM_SEND_QUANTUM;
+    count = (encoded_frame->size + chunk_size - 1) / chunk_size;
+
+    client->frame_messages = malloc(sizeof(SVR_Message*) * Util_max(count, 1));
+    for(int i = 0; i < count; i++) {
+        client->frame_messages[i] = SVRD_Stream_newDataMessage(stream, ((uint8_t*)encoded_frame->data) + offset,
+                                                               Util_min(encoded_frame->size - offset, chunk_size));
+        offset += client->frame_messages[i]->payload_size;
+    }
+    client->frame_message_count = count;
+    client->frame_message_index = 0;
+    client->frame_protocol = protocol;
+    clock_gettime(CLOCK_MONOTONIC, &client->frame_start);
+
+    pthread_mutex_lock(&client->outbound_lock);
+    client->writing_frame = encoded_frame;
+}
+
+/**
+ * \brief Finish sending a frame
+ *
+ * Called by the sending thread with the outbound lock held, which is released
+ * meanwhile, once every data message of the frame is sent. The stream records
+ * the frame as sent, unless it was cancelled while the frame was being sent.
+ *
+ * \param client An event loop client
+ */
+static void SVRD_Client_finishFrame(SVRD_Client* client) {
+    SVRD_EncodedFrame* encoded_frame = client->writing_frame;
+    SVRD_Stream* stream = client->writing_stream;
+
+    pthread_mutex_unlock(&client->outbound_lock);
+    if(stream) {
+        SVRD_Stream_frameSent(stream, encoded_frame, &client->frame_start);
+    }
+    SVR_UNREF(encoded_frame);
+    free(client->frame_messages);
+    pthread_mutex_lock(&client->outbound_lock);
+
+    client->writing_frame = NULL;
+    client->frame_messages = NULL;
+    client->frame_message_count = 0;
+    client->frame_message_index = 0;
+    client->writing_stream = NULL;
+    pthread_cond_broadcast(&client->outbound_cond);
+}
+
+/**
+ * \brief Discard unsent output
+ *
+ * Release every message and frame waiting to be sent to an event loop client
+ * which can no longer be sent to. Frames still queued by streams are left to
+ * SVRD_Client_cancelFrames. Called with the outbound lock held, and by the
+ * sending thread unless the client is being cleaned up.
+ *
+ * \param client An event loop client
+ */
+static void SVRD_Client_discardOutput(SVRD_Client* client) {
+    SVRD_EncodedFrame* encoded_frame = client->writing_frame;
+
+    for(int i = 0; i < client->output_count; i++) {
+        SVR_Message_release(client->output[i]);
+    }
+    client->output_count = 0;
+
+    while(List_getSize(client->control_messages) > 0) {
+        SVR_Message_release(List_remove(client->control_messages, 0));
+    }
+    client->protocol_message = NULL;
+
+    for(int i = client->frame_message_index; i < client->frame_message_count; i++) {
+        SVR_Message_release(client->frame_messages[i]);
+    }
+    free(client->frame_messages);
+    client->frame_messages = NULL;
+    client->frame_message_count = 0;
+    client->frame_message_index = 0;
+
+    client->writing_frame = NULL;
+    client->writing_stream = NULL;
+    pthread_cond_broadcast(&client->outbound_cond);
+
+    if(encoded_frame) {
+        pthread_mutex_unlock(&client->outbound_lock);
+        SVR_UNREF(encoded_frame);
+        pthread_mutex_lock(&client->outbound_lock);
+    }
+}
+
 /**
  * \brief Client connection thread
  *
@@ -280,7 +1385,7 @@ static void* SVRD_Client_worker(void* _client) {
 
     while(client->state != SVR_CLOSED) {
         /* Read message from the client  */
-        message = SVR_Net_receiveMessage(client->socket);
+        message = SVR_Net_receiveMessage(client->socket, client->receive_protocol);
 
         if(message == NULL) {
             SVR_log(SVR_WARNING, "Lost client connection");
@@ -292,17 +1397,25 @@ static void* SVRD_Client_worker(void* _client) {
         if(message->payload_size > 0) {
             if(message->payload_size > client->payload_buffer_size) {
                 client->payload_buffer = realloc(client->payload_buffer, message->payload_size);
-                message->payload = client->payload_buffer;
-
-                SVR_Net_receivePayload(client->socket, message);
+                client->payload_buffer_size = message->payload_size;
             }
+
+            message->payload = client->payload_buffer;
+            SVR_Net_receivePayload(client->socket, message);
         }
 
+        /* Any following message may use a newly requested protocol */
+        SVRD_Client_checkProtocolRequest(client, message);
+
         /* Process message */
         SVRD_processMessage(client, message);
 
         /* Destroy client message */
         SVR_Message_release(message);
+
+        /* Clean up objects released while processing the message before
+           blocking on the next one */
+        SVR_RefCounter_flush();
     }
 
     SVR_UNREF(client);
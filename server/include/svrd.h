@@ -9,6 +9,10 @@
 #include "svrd/server.h"
 #include "svrd/source.h"
 #include "svrd/stream.h"
+#include "svrd/preprocess.h"
+#include "svrd/pyramid.h"
+#include "svrd/sharedencoder.h"
+#include "svrd/workerpool.h"
 #include "svrd/event.h"
 #include "svrd/messagerouting.h"
 #include "svrd/messagehandlers.h"
@@ -6,6 +6,7 @@
 
 #include <svr/forward.h>
 #include <svrd/forward.h>
+#include <svrd/stream.h>
 
 /**
  * Client state
@@ -55,9 +56,98 @@ struct SVRD_Client_s {
      */
     Dictionary* sources;
 
+    /**
+     * Handles of the sources the client provides, used by binary data messages
+     */
+    SVR_HandleTable* source_handles;
+
     void* payload_buffer;
     size_t payload_buffer_size;
 
+    /**
+     * Protocol version used to send to the client. Protected by the client
+     * lock, or for an event loop client by outbound_lock
+     */
+    int protocol;
+
+    /**
+     * Protocol version used to receive from the client. Only used by the
+     * thread receiving from the client
+     */
+    int receive_protocol;
+
+    /**
+     * Set if the client is served by the event loop rather than its own thread
+     */
+    bool evented;
+
+    /* Event loop mode receive buffer. Bytes [0, received) hold partially
+       received messages */
+    uint8_t* receive_buffer;
+    size_t receive_buffer_size;
+    size_t received;
+
+    /* Event loop mode messages waiting to be processed by the message worker
+       pool. The pending list, processing, and throttled flags are protected by
+       pending_lock */
+    List* pending_messages;
+    bool processing;
+    bool throttled;
+    pthread_mutex_t pending_lock;
+
+    /* Streams with a frame waiting to be sent, in the order they were queued,
+       and the stream whose frame is being sent. Each stream waits with at most
+       one frame, which newer frames replace. Protected by outbound_lock */
+    List* outbound_streams;
+    SVRD_Stream* writing_stream;
+
+    /* Replies and notifications waiting to be sent. They are sent by their
+       sender unless a frame is being sent, in which case they are sent before
+       its next chunk of data. Protected by outbound_lock */
+    List* control_messages;
+
+    /* Threaded clients send frames from a writer thread. Protected by
+       outbound_lock */
+    bool writer_started;
+    bool writer_stopping;
+    pthread_t writer;
+    pthread_mutex_t outbound_lock;
+    pthread_cond_t outbound_cond;
+
+    /* Event loop clients have a non-blocking socket. A thread queueing a
+       message or frame while no other thread is sending sends until the
+       socket is full, with sending set meanwhile. write_blocked is then set
+       until the event loop finds the socket writable and carries on. The
+       flags are protected by outbound_lock */
+    bool sending;
+    bool write_blocked;
+    bool send_failed;
+
+    /* Messages being sent to an event loop client, packed for output_protocol,
+       of which output_offset bytes are sent. Only used by the sending
+       thread */
+    SVR_Message* output[SVRD_STREAM_SEND_BATCH];
+    int output_count;
+    int output_protocol;
+    size_t output_offset;
+
+    /* Frame being sent to an event loop client, split into data messages
+       for frame_protocol, and the time sending started. Messages before
+       frame_message_index have been moved to output. Only used by the sending
+       thread */
+    SVRD_EncodedFrame* writing_frame;
+    SVR_Message** frame_messages;
+    int frame_message_count;
+    int frame_message_index;
+    int frame_protocol;
+    struct timespec frame_start;
+
+    /* Protocol acknowledgement queued to an event loop client, and the
+       version used for messages queued after it. Protected by
+       outbound_lock */
+    SVR_Message* protocol_message;
+    int next_protocol;
+
     /* This object is reference counted */
     SVR_REFCOUNTED;
 
@@ -68,13 +158,19 @@ struct SVRD_Client_s {
 void SVRD_Client_init(void);
 void SVRD_Client_close(void);
 SVRD_Client* SVRD_Client_new(int socket);
-void SVRD_Client_provideSource(SVRD_Client* client, SVRD_Source* source);
+uint32_t SVRD_Client_provideSource(SVRD_Client* client, SVRD_Source* source);
 void SVRD_Client_unprovideSource(SVRD_Client* client, SVRD_Source* source);
 void SVRD_Client_openStream(SVRD_Client* client, const char* stream_name);
 void SVRD_Client_closeStream(SVRD_Client* client, const char* stream_name);
 SVRD_Stream* SVRD_Client_getStream(SVRD_Client* client, const char* stream_name);
 SVRD_Source* SVRD_Client_getSource(SVRD_Client* client, const char* source_name);
+SVRD_Source* SVRD_Client_getSourceByHandle(SVRD_Client* client, uint32_t handle);
 void SVRD_addClient(int socket);
+SVRD_Client* SVRD_addEventClient(int socket);
+int SVRD_Client_receiveAvailable(SVRD_Client* client);
+void SVRD_Client_sendAvailable(SVRD_Client* client);
+void SVRD_Client_closeTask(void* _client);
+void SVRD_Client_setProtocol(SVRD_Client* client, int protocol);
 void SVRD_Client_markForClosing(SVRD_Client* client);
 void SVRD_Client_reply(SVRD_Client* client, SVR_Message* request, SVR_Message* response);
 void SVRD_Client_replyCode(SVRD_Client* client, SVR_Message* request, int error_code);
@@ -84,5 +180,10 @@ List* SVRD_getAllClients(void);
 void SVRD_acquireGlobalClientsLock(void);
 void SVRD_releaseGlobalClientsLock(void);
 int SVRD_Client_sendMessage(SVRD_Client* client, SVR_Message* message);
+int SVRD_Client_sendMessages(SVRD_Client* client, SVR_Message** messages, int count);
+bool SVRD_Client_hasControlMessages(SVRD_Client* client);
+size_t SVRD_Client_getSendBacklog(SVRD_Client* client);
+void SVRD_Client_queueFrame(SVRD_Client* client, SVRD_Stream* stream, SVRD_EncodedFrame* encoded_frame);
+void SVRD_Client_cancelFrames(SVRD_Client* client, SVRD_Stream* stream);
 
 #endif // #ifndef __SVR_SERVER_CLIENT_H
@@ -3,15 +3,25 @@
 #define __SVR_SERVER_FORWARD_H
 
 struct SVRD_Client_s;
+struct SVRD_EncodedFrame_s;
+struct SVRD_Preprocessor_s;
+struct SVRD_Pyramid_s;
+struct SVRD_SharedEncoder_s;
 struct SVRD_Source_s;
 struct SVRD_SourceFrame_s;
 struct SVRD_SourceType_s;
 struct SVRD_Stream_s;
+struct SVRD_WorkerPool_s;
 
 typedef struct SVRD_Client_s SVRD_Client;
+typedef struct SVRD_EncodedFrame_s SVRD_EncodedFrame;
+typedef struct SVRD_Preprocessor_s SVRD_Preprocessor;
+typedef struct SVRD_Pyramid_s SVRD_Pyramid;
+typedef struct SVRD_SharedEncoder_s SVRD_SharedEncoder;
 typedef struct SVRD_Source_s SVRD_Source;
 typedef struct SVRD_SourceFrame_s SVRD_SourceFrame;
 typedef struct SVRD_SourceType_s SVRD_SourceType;
 typedef struct SVRD_Stream_s SVRD_Stream;
+typedef struct SVRD_WorkerPool_s SVRD_WorkerPool;
 
 #endif // #ifndef __SVR_SERVER_FORWARD_H
@@ -0,0 +1,53 @@
+
+#ifndef __SVR_SERVER_PREPROCESS_H
+#define __SVR_SERVER_PREPROCESS_H
+
+#include <svr/forward.h>
+#include <svr/cv.h>
+#include <svrd/forward.h>
+
+/* Converts one row of the output frame. src points at the first source row
+   the output row is taken from */
+typedef void (*SVRD_PreprocessKernel)(SVRD_Preprocessor* preprocessor, const uint8_t* src, int src_step, uint8_t* dst);
+
+/**
+ * Crops, resizes and color converts source frames to a stream's frame
+ * properties. Common cases are handled by fused kernels which produce each output row in
+ * a single pass over the source. Everything else falls back to OpenCV through
+ * temporary frames.
+ */
+struct SVRD_Preprocessor_s {
+    /* Region of the source frame which is used. src_width and src_height are
+       the size of the region */
+    int src_x;
+    int src_y;
+    int src_width;
+    int src_height;
+    int src_channels;
+    int dst_width;
+    int dst_height;
+    int dst_channels;
+
+    /* Fused kernel and the output frame it writes to, or NULL to use OpenCV */
+    SVRD_PreprocessKernel kernel;
+    IplImage* output;
+
+    /* Integer downscale factor of area kernels, or 0 for nearest neighbour */
+    int factor;
+
+    /* Byte offset into a source row of each output pixel, for nearest
+       neighbour kernels */
+    int* x_offsets;
+
+    /* Intermediate frames of the OpenCV fallback, and a header describing
+       the region of each source frame used */
+    IplImage* temp_frame[2];
+    IplImage* region;
+};
+
+SVRD_Preprocessor* SVRD_Preprocessor_new(SVR_FrameProperties* source_frame_properties, CvRect roi, SVR_FrameProperties* frame_properties);
+void SVRD_Preprocessor_destroy(SVRD_Preprocessor* preprocessor);
+IplImage* SVRD_Preprocessor_process(SVRD_Preprocessor* preprocessor, IplImage* frame);
+void SVRD_Preprocessor_processInto(SVRD_Preprocessor* preprocessor, IplImage* frame, IplImage* output);
+
+#endif // #ifndef __SVR_SERVER_PREPROCESS_H
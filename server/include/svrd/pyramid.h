@@ -0,0 +1,41 @@
+
+#ifndef __SVR_SERVER_PYRAMID_H
+#define __SVR_SERVER_PYRAMID_H
+
+#include <svr/forward.h>
+#include <svr/cv.h>
+#include <svrd/forward.h>
+
+/* Maximum number of pyramid levels, including the full resolution frame.
+   Level n is downscaled by 2^n */
+#define SVRD_PYRAMID_LEVELS 4
+
+/**
+ * Describes the power of two downscales of a source's frames which streams
+ * may be encoded from. The downscaled frames themselves belong to each source
+ * frame and are only computed once a stream asks for them.
+ */
+struct SVRD_Pyramid_s {
+    /* Number of usable levels. Frames which can not be downscaled exactly
+       have only level 0, the source frame */
+    int levels;
+
+    SVR_FrameProperties* frame_properties[SVRD_PYRAMID_LEVELS];
+
+    /* Builds each level from the level above it */
+    SVRD_Preprocessor* preprocessors[SVRD_PYRAMID_LEVELS];
+
+    /* Level frames released by previous source frames, for reuse */
+    List* spare_frames[SVRD_PYRAMID_LEVELS];
+
+    SVR_LOCKABLE;
+};
+
+SVRD_Pyramid* SVRD_Pyramid_new(SVR_FrameProperties* frame_properties);
+void SVRD_Pyramid_destroy(SVRD_Pyramid* pyramid);
+int SVRD_Pyramid_selectLevel(SVRD_Pyramid* pyramid, CvRect roi, SVR_FrameProperties* frame_properties);
+CvRect SVRD_Pyramid_scaleRegion(CvRect roi, int level);
+IplImage* SVRD_Pyramid_getLevel(SVRD_Pyramid* pyramid, SVRD_SourceFrame* source_frame, int level);
+void SVRD_Pyramid_releaseLevels(SVRD_Pyramid* pyramid, SVRD_SourceFrame* source_frame);
+
+#endif // #ifndef __SVR_SERVER_PYRAMID_H
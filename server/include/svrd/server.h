@@ -2,10 +2,36 @@
 #ifndef __SVR_SERVER_SERVER_H
 #define __SVR_SERVER_SERVER_H
 
+#include <svrd/forward.h>
+
 void SVRD_Server_preClose(void);
 void SVRD_Server_close(void);
 void SVRD_Server_mainLoop(const char* bind_address);
+void SVRD_Server_eventLoop(const char* bind_address);
+SVRD_WorkerPool* SVRD_Server_getMessagePool(void);
+SVRD_WorkerPool* SVRD_Server_getFramePool(void);
+uint64_t SVRD_Server_getTime(void);
+void SVRD_Server_updateClient(SVRD_Client* client);
 
+/* Soft limit on the number of clients in threaded mode. Exceeding it only
+   produces a warning, as each client costs a thread. The event loop has no
+   such limit */
 #define MAX_CLIENTS 128
 
+/* Maximum number of epoll events handled per wakeup of the event loop */
+#define SVRD_MAX_EVENTS 64
+
+/* An evented client stops being read from when this many of its messages are
+   waiting to be processed, and is resumed once half of them have been */
+#define SVRD_MAX_PENDING_MESSAGES 64
+
+/* Maximum number of bytes read from an evented client before the event loop
+   moves on to other clients. The rest is read on the next wakeup */
+#define SVRD_RECEIVE_PASS_LIMIT (256 * 1024)
+
+/* Sends to a threaded client block for at most this many seconds. A client
+   which does not read for this long is disconnected, as the partly sent
+   message can not be completed. Sends to evented clients never block */
+#define SVRD_SEND_TIMEOUT 5
+
 #endif // #ifndef __SVR_SERVER_SERVER_H
@@ -0,0 +1,72 @@
+
+#ifndef __SVR_SERVER_SHAREDENCODER_H
+#define __SVR_SERVER_SHAREDENCODER_H
+
+#include <svr/forward.h>
+#include <svr/cv.h>
+#include <svrd/forward.h>
+
+/**
+ * A source frame after preprocessing and encoding. Encoded frames are shared
+ * by every stream using the same shared encoder.
+ */
+struct SVRD_EncodedFrame_s {
+    void* data;
+    size_t size;
+
+    /* Sequence number of the source frame this was encoded from */
+    unsigned long sequence;
+
+    /* Position of this frame in the encoder's output, counting from 1, and
+       whether it can be decoded without the frames before it */
+    unsigned long index;
+    bool keyframe;
+
+    SVR_REFCOUNTED;
+};
+
+/**
+ * Preprocessing and encoding state for one distinct stream configuration
+ * (region, frame size, channels, and encoding descriptor) of a source
+ */
+struct SVRD_SharedEncoder_s {
+    char* key;
+
+    SVRD_Source* source;
+    SVR_Encoding* encoding;
+    Dictionary* encoding_options;
+    SVR_Encoder* encoder;
+    SVR_FrameProperties* frame_properties;
+
+    /* Pyramid level of the source frames the stream is encoded from, and the
+       preprocessor converting that level */
+    int level;
+    SVRD_Preprocessor* preprocessor;
+
+    /* Most recently encoded frame */
+    SVRD_EncodedFrame* encoded_frame;
+    unsigned long frames_encoded;
+
+    /* Source sequence number of the most recently encoded frame. Written
+       under the lock, but may be read atomically without it */
+    unsigned long encoded_sequence;
+
+    /* Set when a stream missed a frame the next one depends on. Set and
+       cleared atomically, so a stream need not wait for an encode to set it */
+    bool keyframe_requested;
+
+    /* Number of streams using this encoder. Protected by the source lock */
+    int users;
+
+    SVR_LOCKABLE;
+};
+
+char* SVRD_SharedEncoder_makeKey(CvRect roi, SVR_FrameProperties* frame_properties, const char* encoding_descriptor, const char* group);
+SVRD_SharedEncoder* SVRD_SharedEncoder_new(SVRD_Source* source, CvRect roi, SVR_FrameProperties* frame_properties, const char* encoding_descriptor, const char* group);
+void SVRD_SharedEncoder_destroy(SVRD_SharedEncoder* shared_encoder);
+SVRD_EncodedFrame* SVRD_SharedEncoder_encode(SVRD_SharedEncoder* shared_encoder, SVRD_SourceFrame* source_frame);
+bool SVRD_SharedEncoder_hasEncoded(SVRD_SharedEncoder* shared_encoder, SVRD_SourceFrame* source_frame);
+void SVRD_SharedEncoder_requestKeyframe(SVRD_SharedEncoder* shared_encoder);
+void SVRD_SharedEncoder_reportSend(SVRD_SharedEncoder* shared_encoder, unsigned int send_ms, size_t backlog);
+
+#endif // #ifndef __SVR_SERVER_SHAREDENCODER_H
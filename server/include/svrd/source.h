@@ -3,10 +3,22 @@
 #define __SVR_SERVER_SOURCE_H
 
 #include <svr/forward.h>
+#include <svrd/pyramid.h>
 
 struct SVRD_SourceFrame_s {
     IplImage* frame;
     SVRD_Source* source;
+    unsigned long sequence;
+
+    /* Monotonic time the frame was provided, in nanoseconds */
+    uint64_t time;
+
+    /* Downscaled copies of the frame, built on first use by
+       SVRD_Pyramid_getLevel. levels[0] is unused, the frame itself being
+       level 0. Protected by the frame's lock */
+    IplImage* levels[SVRD_PYRAMID_LEVELS];
+
+    SVR_LOCKABLE;
     SVR_REFCOUNTED;
 };
 
@@ -17,14 +29,45 @@ struct SVRD_Source_s {
     Dictionary* encoding_options;
     SVR_Decoder* decoder;
     SVR_FrameProperties* frame_properties;
+    SVRD_Pyramid* pyramid;
 
+    /* Most recent frame. Published and read atomically, see
+       SVRD_Source_getFrame */
     SVRD_SourceFrame* current_frame;
-    pthread_mutex_t current_frame_lock;
-    pthread_cond_t new_frame;
+    unsigned long frame_count;
+
+    /* Running average of the time between frames, in nanoseconds. This is the
+       time the server has to process each frame before the next arrives */
+    uint64_t frame_interval;
+    uint64_t last_frame_time;
+
+    /* Incremented whenever a frame is published or waiting streams must
+       recheck their state. Streams without a new frame sleep on it */
+    uint32_t frame_event;
+    uint32_t frame_waiters;
+
+#ifndef __SVR_Linux__
+    pthread_mutex_t frame_event_lock;
+    pthread_cond_t frame_event_cond;
+#endif
+
+    /* Shared encoders keyed by stream configuration */
+    Dictionary* shared_encoders;
+
+    /* Unpaused streams. Those run by the worker pool are notified of each
+       new frame */
+    List* listeners;
+
+    /* Highest priority of the unpaused streams */
+    short top_priority;
 
     SVRD_SourceType* type;
     void* private_data;
 
+    /* Handle of a client source in its client's source handle table, used to
+       route binary data messages. 0 for server sources */
+    uint32_t client_handle;
+
     bool closed;
 
     SVR_LOCKABLE;
@@ -50,10 +93,17 @@ void SVRD_Source_fromFile(const char* filename);
 SVRD_Source* SVRD_Source_new(const char* name);
 void SVRD_Source_destroy(SVRD_Source* source);
 SVR_FrameProperties* SVRD_Source_getFrameProperties(SVRD_Source* source);
+SVRD_Pyramid* SVRD_Source_getPyramid(SVRD_Source* source);
 int SVRD_Source_setEncoding(SVRD_Source* source, const char* encoding_descriptor);
 int SVRD_Source_setFrameProperties(SVRD_Source* source, SVR_FrameProperties* frame_properties);
+SVRD_SharedEncoder* SVRD_Source_acquireEncoder(SVRD_Source* source, CvRect roi, SVR_FrameProperties* frame_properties, const char* encoding_descriptor, const char* group);
+void SVRD_Source_releaseEncoder(SVRD_Source* source, SVRD_SharedEncoder* shared_encoder);
 void SVRD_Source_adjustStreamPriority(SVRD_Source* source, SVRD_Stream* stream);
 void SVRD_Source_dismissPausedStreams(SVRD_Source* source);
+void SVRD_Source_addListener(SVRD_Source* source, SVRD_Stream* stream);
+void SVRD_Source_removeListener(SVRD_Source* source, SVRD_Stream* stream);
+bool SVRD_Source_shouldThrottle(SVRD_Source* source, SVRD_Stream* stream, SVRD_SourceFrame* source_frame);
+SVRD_SourceFrame* SVRD_Source_acquireCurrentFrame(SVRD_Source* source);
 SVRD_SourceFrame* SVRD_Source_getFrame(SVRD_Source* source, SVRD_Stream* stream, SVRD_SourceFrame* last_frame);
 int SVRD_Source_provideData(SVRD_Source* source, void* data, size_t data_available);
 
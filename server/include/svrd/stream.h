@@ -3,8 +3,32 @@
 #define __SVR_SERVER_STREAM_H
 
 #include <svr/forward.h>
+#include <svr/cv.h>
 #include <svrd/forward.h>
 
+#include <time.h>
+
+/* Maximum number of data messages sent to a client in one batch */
+#define SVRD_STREAM_SEND_BATCH 16
+
+/* Maximum bytes of frame data sent in one batch while replies to the client
+   are waiting, so replies wait for at most one batch. Otherwise frames are
+   sent to threaded protocol version 2 clients in a single data message, which
+   clients decode without copying. Event loop clients are always sent frames
+   in messages of this size, so a reply can follow any of them */
+#define SVRD_STREAM_SEND_QUANTUM (64 * 1024)
+
+/* Longest frame interval a rate cap sets, in nanoseconds. Lower rates are
+   treated as one frame a day */
+#define SVRD_STREAM_MAX_FRAME_INTERVAL (24 * 3600 * 1000000000ULL)
+
+/* Priority of new streams */
+#define SVRD_STREAM_DEFAULT_PRIORITY 1
+
+/* A stream throttled for the sake of higher priority streams still processes
+   at least one of every this many frames */
+#define SVRD_STREAM_THROTTLE_LIMIT 8
+
 struct SVRD_Stream_s {
     char* name;
 
@@ -12,25 +36,83 @@ struct SVRD_Stream_s {
     SVRD_Source* source;
 
     SVR_Encoding* encoding;
-    Dictionary* encoding_options;
-    SVR_Encoder* encoder;
+    char* encoding_descriptor;
+    SVRD_SharedEncoder* shared_encoder;
+
+    /* Set if the encoder adapts to the client's link, as jpeg with automatic
+       quality does. Such an encoder is only shared by streams of one client */
+    bool adaptive_encoding;
     SVR_FrameProperties* frame_properties;
 
+    /* Region of the source frames which is resized and encoded */
+    CvRect roi;
+
     SVR_StreamState state;
 
-    void* payload_buffer;
-    size_t payload_buffer_size;
+    /* Handle the client assigned to the stream. If not 0, data is sent in
+       binary data messages tagged with the handle */
+    uint32_t client_handle;
+
+    /* Maximum payload size of each data message sent with protocol version 1 */
+    size_t chunk_size;
 
     int drop_rate;
     int drop_counter;
 
+    /* Minimum time between frames sent, in nanoseconds, or 0 for no limit,
+       and the monotonic time the next frame is due. The interval is set
+       atomically by SVRD_Stream_setMaxRate, which also sets
+       frame_schedule_reset. The schedule is only touched by the thread or
+       task processing frames */
+    uint64_t frame_interval;
+    uint64_t next_frame_time;
+    bool frame_schedule_reset;
+
+    /* Drop rate and frame interval of the streams sharing a stateful
+       encoder, as of when the stream acquired it */
+    int group_drop_rate;
+    uint64_t group_frame_interval;
+
+    /* Streams with a higher priority are encoded first, and lower priority
+       streams skip late frames when the server can not keep up */
     short priority;
+    int throttled_frames;
+
+    /* Newest encoded frame waiting for the client's writer, or NULL.
+       Protected by the client's outbound lock */
+    SVRD_EncodedFrame* outbound_frame;
 
-    IplImage* temp_frame[2];
+    /* Index of the last encoded frame sent, so frames which depend on a
+       dropped frame are not sent */
+    unsigned long sent_index;
+
+    /* Index of the last encoded frame queued for the client's writer, and
+       whether a keyframe was requested because a frame was dropped since.
+       Protected by the client's outbound lock */
+    unsigned long queued_index;
+    bool keyframe_wanted;
+
+    /* Delivery counters, updated atomically */
+    unsigned long frames_sent;
+    unsigned long frames_dropped;
 
     pthread_t worker;
     bool worker_started;
 
+    /* Priority the worker thread's niceness was last set from */
+    short worker_priority;
+
+    /* Event loop mode. Frames are processed by worker pool tasks instead of a
+       dedicated thread. task_scheduled is set while a task is queued or
+       running, and frame_pending while a frame arrived since the task last
+       looked. Both are protected by task_lock */
+    bool pooled;
+    bool task_scheduled;
+    bool frame_pending;
+    unsigned long last_sequence;
+    pthread_mutex_t task_lock;
+    pthread_cond_t task_done;
+
     SVR_LOCKABLE;
 };
 
@@ -44,10 +126,18 @@ int SVRD_Stream_setEncoding(SVRD_Stream* stream, const char* encoding_descriptor
 int SVRD_Stream_setChannels(SVRD_Stream* stream, int channels);
 int SVRD_Stream_setPriority(SVRD_Stream* stream, short priority);
 int SVRD_Stream_setDropRate(SVRD_Stream* stream, int rate);
+int SVRD_Stream_setMaxRate(SVRD_Stream* stream, double fps);
 int SVRD_Stream_resize(SVRD_Stream* stream, int width, int height);
+int SVRD_Stream_setROI(SVRD_Stream* stream, int x, int y, int width, int height);
+void SVRD_Stream_getStats(SVRD_Stream* stream, unsigned long* frames_sent, unsigned long* frames_dropped);
 
 void SVRD_Stream_pause(SVRD_Stream* stream);
 void SVRD_Stream_unpause(SVRD_Stream* stream);
+void SVRD_Stream_frameReady(SVRD_Stream* stream);
 void SVRD_Stream_inputSourceFrame(SVRD_Stream* stream, IplImage* frame);
+bool SVRD_Stream_checkFrame(SVRD_Stream* stream, SVRD_EncodedFrame* encoded_frame);
+SVR_Message* SVRD_Stream_newDataMessage(SVRD_Stream* stream, void* payload, size_t payload_size);
+void SVRD_Stream_frameSent(SVRD_Stream* stream, SVRD_EncodedFrame* encoded_frame, struct timespec* send_start);
+int SVRD_Stream_sendFrame(SVRD_Stream* stream, SVRD_EncodedFrame* encoded_frame);
 
 #endif // #ifndef __SVR_SERVER_STREAM_H
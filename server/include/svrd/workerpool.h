@@ -0,0 +1,41 @@
+
+#ifndef __SVR_SERVER_WORKERPOOL_H
+#define __SVR_SERVER_WORKERPOOL_H
+
+#include <seawolf.h>
+
+#include <svr/lockable.h>
+#include <svrd/forward.h>
+
+typedef struct {
+    void (*task)(void*);
+    void* arg;
+    int priority;
+
+    /* Submission order, keeping tasks of equal priority first in first out */
+    unsigned long order;
+} SVRD_WorkerPool_Task;
+
+/**
+ * A fixed set of threads running queued tasks, highest priority first
+ */
+struct SVRD_WorkerPool_s {
+    /* Binary heap of queued tasks */
+    SVRD_WorkerPool_Task* tasks;
+    int task_count;
+    int task_capacity;
+    unsigned long submitted;
+    pthread_cond_t task_available;
+
+    pthread_t* workers;
+    int worker_count;
+
+    SVR_LOCKABLE;
+};
+
+SVRD_WorkerPool* SVRD_WorkerPool_new(int thread_count);
+void SVRD_WorkerPool_destroy(SVRD_WorkerPool* pool);
+void SVRD_WorkerPool_submit(SVRD_WorkerPool* pool, void (*task)(void*), void* arg);
+void SVRD_WorkerPool_submitWithPriority(SVRD_WorkerPool* pool, void (*task)(void*), void* arg, int priority);
+
+#endif // #ifndef __SVR_SERVER_WORKERPOOL_H
@@ -15,13 +15,16 @@ void SVRD_exitError(void) {
 }
 
 static void SVRD_usage(const char* argv0) {
-    printf("Usage: %s [-hd] [-b ADDRESS] [-l LOG_LEVEL] [-s SOURCES_CONFIG]\n"
+    printf("Usage: %s [-hde] [-b ADDRESS] [-l LOG_LEVEL] [-r RECLAIM_MODE] [-s SOURCES_CONFIG]\n"
            "Seawolf Video Router\n"
            "\n"
            "  -h                    Show this help message\n"
            "  -d                    Enable debugging\n"
+           "  -e                    Serve clients from an event loop and worker pools\n"
            "  -b ADDRESS            Address to listen on\n"
            "  -l LOG_LEVEL          Log level (DEBUG, INFO, NORMAL, WARNING, ERROR, CRITICAL)\n"
+           "  -r RECLAIM_MODE       Object cleanup mode (deferred, inline, batched),\n"
+           "                        overriding SVR_RECLAIM\n"
            "  -s SOURCES_CONFIG     Sources configuration file\n", argv0);
 }
 
@@ -30,8 +33,10 @@ int main(int argc, char** argv) {
     int debug_level = SVR_WARNING;
     char* source_conf_file = NULL;
     char* bind_address = "0.0.0.0";
+    int reclaim_mode = -1;
+    bool event_loop = false;
 
-    while((opt = getopt(argc, argv, ":hdl:s:b:")) != -1) {
+    while((opt = getopt(argc, argv, ":hdel:r:s:b:")) != -1) {
         switch(opt) {
         case 'h':
             SVRD_usage(argv[0]);
@@ -39,6 +44,9 @@ int main(int argc, char** argv) {
         case 'd':
             debug_level = SVR_DEBUG;
             break;
+        case 'e':
+            event_loop = true;
+            break;
         case 'b':
             bind_address = optarg;
             break;
@@ -50,6 +58,14 @@ int main(int argc, char** argv) {
                 return -1;
             }
             break;
+        case 'r':
+            reclaim_mode = SVR_RefCounter_getReclaimModeFromName(optarg);
+            if(reclaim_mode < 0) {
+                fprintf(stderr, "Invalid reclamation mode '%s'\n", optarg);
+                SVRD_usage(argv[0]);
+                return -1;
+            }
+            break;
         case 's':
             source_conf_file = optarg;
             break;
@@ -67,6 +83,19 @@ int main(int argc, char** argv) {
     SVR_initCore();
     SVR_Logging_setThreshold(debug_level);
 
+    /* The -r switch takes precedence over the SVR_RECLAIM environment
+       variable */
+    if(reclaim_mode < 0 && getenv("SVR_RECLAIM")) {
+        reclaim_mode = SVR_RefCounter_getReclaimModeFromName(getenv("SVR_RECLAIM"));
+        if(reclaim_mode < 0) {
+            SVR_log(SVR_WARNING, Util_format("Invalid reclamation mode \"%s\" in SVR_RECLAIM environment variable", getenv("SVR_RECLAIM")));
+        }
+    }
+
+    if(reclaim_mode >= 0) {
+        SVR_RefCounter_setReclaimMode(reclaim_mode);
+    }
+
     SVRD_Client_init();
     SVRD_Source_init();
     SVRD_MessageRouter_init();
@@ -79,7 +108,11 @@ int main(int argc, char** argv) {
        of writing to a closed socket. We handle this ourselves. */
     signal(SIGPIPE, SIG_IGN);
 
-    SVRD_Server_mainLoop(bind_address);
+    if(event_loop) {
+        SVRD_Server_eventLoop(bind_address);
+    } else {
+        SVRD_Server_mainLoop(bind_address);
+    }
 
     return 0;
 }
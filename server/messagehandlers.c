@@ -2,15 +2,21 @@
 #include <svr.h>
 #include <svrd.h>
 
-/* source_name stream_name [encoding] */
+/* stream_name [handle] */
 void SVRD_Stream_rOpen(SVRD_Client* client, SVR_Message* message) {
     char* stream_name;
+    uint32_t handle = 0;
 
     switch(message->count) {
     case 2:
         stream_name = message->components[1];
         break;
 
+    case 3:
+        stream_name = message->components[1];
+        handle = strtoul(message->components[2], NULL, 10);
+        break;
+
     default:
         SVRD_Client_kick(client, "Invalid message");
         return;
@@ -22,6 +28,13 @@ void SVRD_Stream_rOpen(SVRD_Client* client, SVR_Message* message) {
     }
 
     SVRD_Client_openStream(client, stream_name);
+
+    /* Data for the stream is sent in binary data messages tagged with the
+       client's handle */
+    if(handle && SVRD_Client_getStream(client, stream_name)) {
+        SVRD_Client_getStream(client, stream_name)->client_handle = handle;
+    }
+
     SVRD_Client_replyCode(client, message, SVR_SUCCESS);
 }
 
@@ -89,6 +102,41 @@ void SVRD_Stream_rGetInfo(SVRD_Client* client, SVR_Message* message) {
     SVR_Message_release(response);
 }
 
+/* stream_name */
+void SVRD_Stream_rGetStats(SVRD_Client* client, SVR_Message* message) {
+    SVR_Message* response;
+    SVRD_Stream* stream;
+    char* stream_name;
+    unsigned long frames_sent;
+    unsigned long frames_dropped;
+
+    switch(message->count) {
+    case 2:
+        stream_name = message->components[1];
+        break;
+
+    default:
+        SVRD_Client_kick(client, "Invalid message");
+        return;
+    }
+
+    stream = SVRD_Client_getStream(client, stream_name);
+    if(stream == NULL) {
+        SVRD_Client_replyCode(client, message, SVR_NOSUCHSTREAM);
+        return;
+    }
+
+    SVRD_Stream_getStats(stream, &frames_sent, &frames_dropped);
+
+    response = SVR_Message_new(3);
+    response->components[0] = SVR_Arena_strdup(response->alloc, "Stream.getStats");
+    response->components[1] = SVR_Arena_sprintf(response->alloc, "%lu", frames_sent);
+    response->components[2] = SVR_Arena_sprintf(response->alloc, "%lu", frames_dropped);
+
+    SVRD_Client_reply(client, message, response);
+    SVR_Message_release(response);
+}
+
 /* stream_name */
 void SVRD_Stream_rPause(SVRD_Client* client, SVR_Message* message) {
     SVRD_Stream* stream;
@@ -165,6 +213,34 @@ void SVRD_Stream_rResize(SVRD_Client* client, SVR_Message* message) {
     SVRD_Client_replyCode(client, message, SVRD_Stream_resize(stream, width, height));
 }
 
+void SVRD_Stream_rSetROI(SVRD_Client* client, SVR_Message* message) {
+    SVRD_Stream* stream;
+    char* stream_name;
+    int x, y, width, height;
+
+    switch(message->count) {
+    case 6:
+        stream_name = message->components[1];
+        x = atoi(message->components[2]);
+        y = atoi(message->components[3]);
+        width = atoi(message->components[4]);
+        height = atoi(message->components[5]);
+        break;
+
+    default:
+        SVRD_Client_kick(client, "Invalid message");
+        return;
+    }
+
+    stream = SVRD_Client_getStream(client, stream_name);
+    if(stream == NULL) {
+        SVRD_Client_replyCode(client, message, SVR_NOSUCHSTREAM);
+        return;
+    }
+
+    SVRD_Client_replyCode(client, message, SVRD_Stream_setROI(stream, x, y, width, height));
+}
+
 void SVRD_Stream_rSetChannels(SVRD_Client* client, SVR_Message* message) {
     SVRD_Stream* stream;
     char* stream_name;
@@ -279,6 +355,31 @@ void SVRD_Stream_rSetDropRate(SVRD_Client* client, SVR_Message* message) {
     SVRD_Client_replyCode(client, message, SVRD_Stream_setDropRate(stream, drop_rate));
 }
 
+void SVRD_Stream_rSetMaxRate(SVRD_Client* client, SVR_Message* message) {
+    SVRD_Stream* stream;
+    char* stream_name;
+    double fps;
+
+    switch(message->count) {
+    case 3:
+        stream_name = message->components[1];
+        fps = atof(message->components[2]);
+        break;
+
+    default:
+        SVRD_Client_kick(client, "Invalid message");
+        return;
+    }
+
+    stream = SVRD_Client_getStream(client, stream_name);
+    if(stream == NULL) {
+        SVRD_Client_replyCode(client, message, SVR_NOSUCHSTREAM);
+        return;
+    }
+
+    SVRD_Client_replyCode(client, message, SVRD_Stream_setMaxRate(stream, fps));
+}
+
 void SVRD_Stream_rSetEncoding(SVRD_Client* client, SVR_Message* message) {
     SVRD_Stream* stream;
     char* stream_name;
@@ -305,7 +406,9 @@ void SVRD_Stream_rSetEncoding(SVRD_Client* client, SVR_Message* message) {
 }
 
 void SVRD_Source_rOpen(SVRD_Client* client, SVR_Message* message) {
+    SVR_Message* response;
     SVRD_Source* source;
+    uint32_t handle;
     bool client_source;
     char* source_name;
     char* source_descriptor;
@@ -350,7 +453,19 @@ void SVRD_Source_rOpen(SVRD_Client* client, SVR_Message* message) {
         }
 
         SVRD_Source_setEncoding(source, "jpeg");
-        SVRD_Client_provideSource(client, source);
+        handle = SVRD_Client_provideSource(client, source);
+
+        /* Protocol version 2 clients are told the handle to send binary data
+           messages with */
+        if(handle && client->protocol >= SVR_PROTOCOL_V2) {
+            response = SVR_Message_new(3);
+            response->components[0] = SVR_Arena_strdup(response->alloc, "SVR.response");
+            response->components[1] = SVR_Arena_sprintf(response->alloc, "%d", SVR_SUCCESS);
+            response->components[2] = SVR_Arena_sprintf(response->alloc, "%u", handle);
+            SVRD_Client_reply(client, message, response);
+            SVR_Message_release(response);
+            return;
+        }
     } else {
         source = SVRD_Source_openInstance(source_name, source_descriptor, &err);
 
@@ -442,6 +557,19 @@ void SVRD_Source_rData(SVRD_Client* client, SVR_Message* message) {
     SVRD_Source_provideData(source, message->payload, message->payload_size);
 }
 
+/* Binary data message */
+void SVRD_Source_rBinaryData(SVRD_Client* client, SVR_Message* message) {
+    SVRD_Source* source;
+
+    source = SVRD_Client_getSourceByHandle(client, message->handle);
+    if(source == NULL) {
+        SVRD_Client_replyCode(client, message, SVR_NOSUCHSOURCE);
+        return;
+    }
+
+    SVRD_Source_provideData(source, message->payload, message->payload_size);
+}
+
 void SVRD_Source_rClose(SVRD_Client* client, SVR_Message* message) {
     SVRD_Source* source;
     char* source_name;
@@ -527,3 +655,25 @@ void SVRD_Event_rRegister(SVRD_Client* client, SVR_Message* message) {
 void SVRD_Event_rUnregister(SVRD_Client* client, SVR_Message* message) {
     // --
 }
+
+/* protocol_version */
+void SVRD_SVR_rSetProtocol(SVRD_Client* client, SVR_Message* message) {
+    int protocol;
+
+    switch(message->count) {
+    case 2:
+        protocol = atoi(message->components[1]);
+        break;
+
+    default:
+        SVRD_Client_kick(client, "Invalid message");
+        return;
+    }
+
+    if(protocol < SVR_PROTOCOL_V1 || protocol > SVR_PROTOCOL_LATEST) {
+        SVRD_Client_kick(client, "Unsupported protocol version");
+        return;
+    }
+
+    SVRD_Client_setProtocol(client, protocol);
+}
@@ -23,11 +23,14 @@ static SVRD_RequestMapping request_types[] = {
     {"Stream.close", SVRD_Stream_rClose},
     {"Stream.attachSource", SVRD_Stream_rAttachSource},
     {"Stream.resize", SVRD_Stream_rResize},
+    {"Stream.setROI", SVRD_Stream_rSetROI},
     {"Stream.setChannels", SVRD_Stream_rSetChannels},
     {"Stream.setEncoding", SVRD_Stream_rSetEncoding},
     {"Stream.setDropRate", SVRD_Stream_rSetDropRate},
+    {"Stream.setMaxRate", SVRD_Stream_rSetMaxRate},
     {"Stream.setPriority", SVRD_Stream_rSetPriority},
     {"Stream.getInfo", SVRD_Stream_rGetInfo},
+    {"Stream.getStats", SVRD_Stream_rGetStats},
     {"Stream.pause", SVRD_Stream_rPause},
     {"Stream.unpause", SVRD_Stream_rUnpause},
 
@@ -39,7 +42,14 @@ static SVRD_RequestMapping request_types[] = {
     {"Data", SVRD_Source_rData},
 
     {"Event.register", SVRD_Event_rRegister},
-    {"Event.unregister", SVRD_Event_rUnregister}
+    {"Event.unregister", SVRD_Event_rUnregister},
+
+    {"SVR.setProtocol", SVRD_SVR_rSetProtocol}
+};
+
+/* Handlers for binary messages, indexed by opcode */
+static void (*opcode_handlers[SVR_OPCODE_COUNT])(SVRD_Client* client, SVR_Message* message) = {
+    [SVR_OPCODE_DATA] = SVRD_Source_rBinaryData
 };
 
 static int SVRD_compareRequestMapping(const void* v1, const void* v2);
@@ -89,6 +99,16 @@ static SVRD_RequestMapping* SVRD_findRequestMapping(const char* request_string)
 void SVRD_processMessage(SVRD_Client* client, SVR_Message* message) {
     SVRD_RequestMapping* request_type;
 
+    if(message->opcode != SVR_OPCODE_NONE) {
+        if(message->opcode >= SVR_OPCODE_COUNT || opcode_handlers[message->opcode] == NULL) {
+            SVRD_Client_kick(client, INVALID_MESSAGE);
+            return;
+        }
+
+        opcode_handlers[message->opcode](client, message);
+        return;
+    }
+
     if(message->count == 0) {
         SVRD_Client_kick(client, INVALID_MESSAGE);
         return;
@@ -0,0 +1,403 @@
+/**
+ * \file
+ * \brief Frame preprocessing
+ */
+
+#include <svr.h>
+#include <svrd.h>
+
+/* Kernels are built for the baseline instruction set and, on x86, again for
+   AVX2. The best version for the running CPU is picked when the server
+   starts. Other architectures rely on their baseline vector unit (e.g. NEON
+   on aarch64) */
+#if defined(__GNUC__) && defined(__x86_64__) && defined(__SVR_Linux__)
+# define SVRD_PREPROCESS_KERNEL __attribute__((target_clones("avx2", "default")))
+#else
+# define SVRD_PREPROCESS_KERNEL
+#endif
+
+/* Kernel bodies are expanded with constant factors and channel counts, so
+   each specialization compiles to straight line, vectorizable loops */
+#define SVRD_PREPROCESS_INLINE static inline __attribute__((always_inline))
+
+static SVRD_PreprocessKernel SVRD_Preprocessor_selectKernel(SVRD_Preprocessor* preprocessor);
+static IplImage* SVRD_Preprocessor_processFallback(SVRD_Preprocessor* preprocessor, IplImage* frame);
+
+/**
+ * \defgroup Preprocess Frame preprocessing
+ * \brief Crop, resize and color convert source frames for streams
+ *
+ * Streams may ask for only a region of the source frame, for frames smaller
+ * than the source provides, or for a different number of channels. A
+ * preprocessor converts source frames to a stream's frame properties before
+ * they are encoded. Cropping is free: the region is read in place and the rest
+ * of the frame is never touched.
+ *
+ * For 8 bit frames with 1 or 3 channels, resizing and color conversion are
+ * fused into one kernel which writes each output row in a single pass over
+ * the source. Downscaling by exactly 2 or 4 averages each block of source
+ * pixels. Any other size change samples the nearest source pixel. 3 channel
+ * frames are treated as BGR. Other frames are converted with OpenCV through
+ * temporary frames.
+ *
+ * \{
+ */
+
+/**
+ * Store one pixel, converting between gray and BGR
+ */
+SVRD_PREPROCESS_INLINE void storePixel(uint8_t* dst, const int* pixel, const int src_channels, const int dst_channels) {
+    if(src_channels == dst_channels) {
+        for(int c = 0; c < dst_channels; c++) {
+            dst[c] = pixel[c];
+        }
+    } else if(dst_channels == 1) {
+        /* BT.601 luma from BGR, in 8 bit fixed point */
+        dst[0] = (29 * pixel[0] + 150 * pixel[1] + 77 * pixel[2] + 128) >> 8;
+    } else {
+        dst[0] = pixel[0];
+        dst[1] = pixel[0];
+        dst[2] = pixel[0];
+    }
+}
+
+/**
+ * Produce an output row from the average of each factor x factor block of the
+ * source rows starting at src
+ */
+SVRD_PREPROCESS_INLINE void areaRow(const uint8_t* src, int src_step, uint8_t* dst, int width,
+                                    const int factor, const int src_channels, const int dst_channels) {
+    const int shift = (factor == 1) ? 0 : (factor == 2) ? 2 : 4;
+
+    for(int x = 0; x < width; x++) {
+        const uint8_t* block = src + x * factor * src_channels;
+        int pixel[3] = {0, 0, 0};
+
+        for(int dy = 0; dy < factor; dy++) {
+            for(int dx = 0; dx < factor; dx++) {
+                for(int c = 0; c < src_channels; c++) {
+                    pixel[c] += block[dy * src_step + dx * src_channels + c];
+                }
+            }
+        }
+
+        if(shift) {
+            for(int c = 0; c < src_channels; c++) {
+                pixel[c] = (pixel[c] + (1 << (shift - 1))) >> shift;
+            }
+        }
+
+        storePixel(dst + x * dst_channels, pixel, src_channels, dst_channels);
+    }
+}
+
+/**
+ * Produce an output row from the nearest source pixels in the row at src
+ */
+SVRD_PREPROCESS_INLINE void nearestRow(const int* x_offsets, const uint8_t* src, uint8_t* dst, int width,
+                                       const int src_channels, const int dst_channels) {
+    for(int x = 0; x < width; x++) {
+        const uint8_t* source_pixel = src + x_offsets[x];
+        int pixel[3];
+
+        for(int c = 0; c < src_channels; c++) {
+            pixel[c] = source_pixel[c];
+        }
+
+        storePixel(dst + x * dst_channels, pixel, src_channels, dst_channels);
+    }
+}
+
+#define SVRD_AREA_KERNEL(factor, src_channels, dst_channels) \
+    SVRD_PREPROCESS_KERNEL \
+    static void area_##factor##_##src_channels##_##dst_channels(SVRD_Preprocessor* preprocessor, const uint8_t* src, int src_step, uint8_t* dst) { \
+        areaRow(src, src_step, dst, preprocessor->dst_width, factor, src_channels, dst_channels); \
+    }
+
+#define SVRD_NEAREST_KERNEL(src_channels, dst_channels) \
+    SVRD_PREPROCESS_KERNEL \
+    static void nearest_##src_channels##_##dst_channels(SVRD_Preprocessor* preprocessor, const uint8_t* src, int src_step, uint8_t* dst) { \
+        nearestRow(preprocessor->x_offsets, src, dst, preprocessor->dst_width, src_channels, dst_channels); \
+    }
+
+/* Cropping and color conversion without resizing */
+SVRD_AREA_KERNEL(1, 1, 1)
+SVRD_AREA_KERNEL(1, 3, 3)
+SVRD_AREA_KERNEL(1, 3, 1)
+SVRD_AREA_KERNEL(1, 1, 3)
+
+/* Downscaling by 2 and 4 */
+SVRD_AREA_KERNEL(2, 1, 1)
+SVRD_AREA_KERNEL(2, 3, 3)
+SVRD_AREA_KERNEL(2, 3, 1)
+SVRD_AREA_KERNEL(2, 1, 3)
+SVRD_AREA_KERNEL(4, 1, 1)
+SVRD_AREA_KERNEL(4, 3, 3)
+SVRD_AREA_KERNEL(4, 3, 1)
+SVRD_AREA_KERNEL(4, 1, 3)
+
+/* Any other size */
+SVRD_NEAREST_KERNEL(1, 1)
+SVRD_NEAREST_KERNEL(3, 3)
+SVRD_NEAREST_KERNEL(3, 1)
+SVRD_NEAREST_KERNEL(1, 3)
+
+/**
+ * \brief Create a preprocessor
+ *
+ * Create a preprocessor converting a region of frames with the source's frame
+ * properties to the given frame properties. The region must lie within the
+ * source frame.
+ *
+ * \param source_frame_properties Properties of the source frames
+ * \param roi Region of the source frames to use
+ * \param frame_properties Properties of the preprocessed frames
+ * \return A new preprocessor
+ */
+SVRD_Preprocessor* SVRD_Preprocessor_new(SVR_FrameProperties* source_frame_properties, CvRect roi, SVR_FrameProperties* frame_properties) {
+    SVRD_Preprocessor* preprocessor = malloc(sizeof(SVRD_Preprocessor));
+    SVR_FrameProperties* temp_frame_properties;
+    bool crop;
+    bool resize;
+    bool color_convert;
+
+    preprocessor->src_x = roi.x;
+    preprocessor->src_y = roi.y;
+    preprocessor->src_width = roi.width;
+    preprocessor->src_height = roi.height;
+    preprocessor->src_channels = source_frame_properties->channels;
+    preprocessor->dst_width = frame_properties->width;
+    preprocessor->dst_height = frame_properties->height;
+    preprocessor->dst_channels = frame_properties->channels;
+
+    preprocessor->output = NULL;
+    preprocessor->factor = 0;
+    preprocessor->x_offsets = NULL;
+    preprocessor->temp_frame[0] = NULL;
+    preprocessor->temp_frame[1] = NULL;
+    preprocessor->region = NULL;
+
+    crop = (roi.width != source_frame_properties->width ||
+            roi.height != source_frame_properties->height);
+    resize = (preprocessor->dst_width != preprocessor->src_width ||
+              preprocessor->dst_height != preprocessor->src_height);
+    color_convert = (preprocessor->dst_channels != preprocessor->src_channels);
+
+    /* Frames which need no preprocessing are passed through */
+    if(!crop && !resize && !color_convert) {
+        preprocessor->kernel = NULL;
+        return preprocessor;
+    }
+
+    preprocessor->kernel = NULL;
+    if(source_frame_properties->depth == 8 && frame_properties->depth == 8) {
+        preprocessor->kernel = SVRD_Preprocessor_selectKernel(preprocessor);
+    }
+
+    if(preprocessor->kernel) {
+        preprocessor->output = SVR_FrameProperties_imageFromProperties(frame_properties);
+        return preprocessor;
+    }
+
+    if(crop) {
+        preprocessor->region = cvCreateImageHeader(cvSize(roi.width, roi.height),
+                                                   source_frame_properties->depth,
+                                                   source_frame_properties->channels);
+    }
+
+    if(resize && color_convert) {
+        temp_frame_properties = SVR_FrameProperties_clone(frame_properties);
+        temp_frame_properties->channels = source_frame_properties->channels;
+
+        preprocessor->temp_frame[0] = SVR_FrameProperties_imageFromProperties(temp_frame_properties);
+        preprocessor->temp_frame[1] = SVR_FrameProperties_imageFromProperties(frame_properties);
+
+        SVR_FrameProperties_destroy(temp_frame_properties);
+    } else {
+        preprocessor->temp_frame[0] = SVR_FrameProperties_imageFromProperties(frame_properties);
+    }
+
+    return preprocessor;
+}
+
+/**
+ * \brief Destroy a preprocessor
+ *
+ * \param preprocessor The preprocessor to destroy
+ */
+void SVRD_Preprocessor_destroy(SVRD_Preprocessor* preprocessor) {
+    if(preprocessor->output) {
+        cvReleaseImage(&preprocessor->output);
+    }
+
+    if(preprocessor->temp_frame[0]) {
+        cvReleaseImage(&preprocessor->temp_frame[0]);
+    }
+
+    if(preprocessor->temp_frame[1]) {
+        cvReleaseImage(&preprocessor->temp_frame[1]);
+    }
+
+    if(preprocessor->region) {
+        cvReleaseImageHeader(&preprocessor->region);
+    }
+
+    free(preprocessor->x_offsets);
+    free(preprocessor);
+}
+
+/**
+ * \brief Pick the fused kernel for a preprocessor
+ *
+ * \return A kernel, or NULL if no kernel handles the conversion
+ */
+static SVRD_PreprocessKernel SVRD_Preprocessor_selectKernel(SVRD_Preprocessor* preprocessor) {
+    int src_channels = preprocessor->src_channels;
+    int dst_channels = preprocessor->dst_channels;
+
+    if((src_channels != 1 && src_channels != 3) || (dst_channels != 1 && dst_channels != 3)) {
+        return NULL;
+    }
+
+    for(int factor = 1; factor <= 4; factor *= 2) {
+        if(preprocessor->src_width == preprocessor->dst_width * factor &&
+           preprocessor->src_height == preprocessor->dst_height * factor) {
+            preprocessor->factor = factor;
+        }
+    }
+
+    switch(preprocessor->factor) {
+        case 1:
+            if(src_channels == 3) {
+                return (dst_channels == 3) ? area_1_3_3 : area_1_3_1;
+            }
+            return (dst_channels == 3) ? area_1_1_3 : area_1_1_1;
+
+        case 2:
+            if(src_channels == 3) {
+                return (dst_channels == 3) ? area_2_3_3 : area_2_3_1;
+            }
+            return (dst_channels == 3) ? area_2_1_3 : area_2_1_1;
+
+        case 4:
+            if(src_channels == 3) {
+                return (dst_channels == 3) ? area_4_3_3 : area_4_3_1;
+            }
+            return (dst_channels == 3) ? area_4_1_3 : area_4_1_1;
+    }
+
+    /* Sample the nearest source pixel, as OpenCV's CV_INTER_NN does */
+    preprocessor->x_offsets = malloc(sizeof(int) * preprocessor->dst_width);
+    for(int x = 0; x < preprocessor->dst_width; x++) {
+        preprocessor->x_offsets[x] = ((x * preprocessor->src_width) / preprocessor->dst_width) * src_channels;
+    }
+
+    if(src_channels == 3) {
+        return (dst_channels == 3) ? nearest_3_3 : nearest_3_1;
+    }
+    return (dst_channels == 3) ? nearest_1_3 : nearest_1_1;
+}
+
+/**
+ * \brief Preprocess a frame
+ *
+ * Convert a source frame to the preprocessor's frame properties. The returned
+ * frame is either the source frame itself, if no conversion is needed, or a
+ * frame owned by the preprocessor which is overwritten by the next call. The
+ * source frame is never modified.
+ *
+ * \param preprocessor The preprocessor
+ * \param frame A source frame
+ * \return The preprocessed frame
+ */
+IplImage* SVRD_Preprocessor_process(SVRD_Preprocessor* preprocessor, IplImage* frame) {
+    if(preprocessor->kernel == NULL) {
+        return SVRD_Preprocessor_processFallback(preprocessor, frame);
+    }
+
+    SVRD_Preprocessor_processInto(preprocessor, frame, preprocessor->output);
+    return preprocessor->output;
+}
+
+/**
+ * \brief Preprocess a frame into a given frame
+ *
+ * Convert a source frame with the preprocessor's fused kernel, writing the
+ * result to a frame owned by the caller. This does not modify the
+ * preprocessor, so it may be called from several threads at once. Only
+ * preprocessors with a fused kernel support this.
+ *
+ * \param preprocessor The preprocessor
+ * \param frame A source frame
+ * \param output Frame with the preprocessor's frame properties to write to
+ */
+void SVRD_Preprocessor_processInto(SVRD_Preprocessor* preprocessor, IplImage* frame, IplImage* output) {
+    const uint8_t* src;
+    int src_y;
+
+    for(int y = 0; y < preprocessor->dst_height; y++) {
+        if(preprocessor->factor) {
+            src_y = y * preprocessor->factor;
+        } else {
+            src_y = (y * preprocessor->src_height) / preprocessor->dst_height;
+        }
+
+        src = (uint8_t*) frame->imageData + (preprocessor->src_y + src_y) * frame->widthStep +
+              preprocessor->src_x * preprocessor->src_channels;
+        preprocessor->kernel(preprocessor, src, frame->widthStep,
+                             (uint8_t*) output->imageData + y * output->widthStep);
+    }
+}
+
+/**
+ * \brief Preprocess a frame with OpenCV
+ */
+static IplImage* SVRD_Preprocessor_processFallback(SVRD_Preprocessor* preprocessor, IplImage* frame) {
+    bool resize = (preprocessor->dst_width != preprocessor->src_width ||
+                   preprocessor->dst_height != preprocessor->src_height);
+    bool color_convert = (preprocessor->dst_channels != preprocessor->src_channels);
+
+    /* Point the region header at the region of this frame. Shared source
+       frames can not have their own ROI set */
+    if(preprocessor->region) {
+        cvSetData(preprocessor->region,
+                  frame->imageData + preprocessor->src_y * frame->widthStep +
+                  preprocessor->src_x * ((frame->depth & 255) / 8) * frame->nChannels,
+                  frame->widthStep);
+        frame = preprocessor->region;
+    }
+
+    if(resize && color_convert) {
+        cvResize(frame, preprocessor->temp_frame[0], CV_INTER_NN);
+
+        if(preprocessor->dst_channels == 1) {
+            cvCvtColor(preprocessor->temp_frame[0], preprocessor->temp_frame[1], CV_BGR2GRAY);
+        } else {
+            cvCvtColor(preprocessor->temp_frame[0], preprocessor->temp_frame[1], CV_GRAY2BGR);
+        }
+
+        return preprocessor->temp_frame[1];
+
+    } else if(resize) {
+        cvResize(frame, preprocessor->temp_frame[0], CV_INTER_NN);
+        return preprocessor->temp_frame[0];
+
+    } else if(color_convert) {
+        if(preprocessor->dst_channels == 1) {
+            cvCvtColor(frame, preprocessor->temp_frame[0], CV_BGR2GRAY);
+        } else {
+            cvCvtColor(frame, preprocessor->temp_frame[0], CV_GRAY2BGR);
+        }
+
+        return preprocessor->temp_frame[0];
+
+    } else if(preprocessor->region) {
+        /* Encoders expect contiguous frames */
+        cvCopy(frame, preprocessor->temp_frame[0], NULL);
+        return preprocessor->temp_frame[0];
+    }
+
+    return frame;
+}
+
+/** \} */
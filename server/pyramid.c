@@ -0,0 +1,217 @@
+/**
+ * \file
+ * \brief Source frame pyramids
+ */
+
+#include <svr.h>
+#include <svrd.h>
+
+static IplImage* SVRD_Pyramid_acquireFrame(SVRD_Pyramid* pyramid, int level);
+
+/**
+ * \defgroup Pyramid Source frame pyramid
+ * \brief Downscale each source frame once for every stream
+ *
+ * Streams of one source often ask for several sizes of the same frames, such
+ * as 640x480, 320x240 and 160x120 views of a camera. Rather than each shared
+ * encoder reading the full resolution frame, a source keeps a pyramid of
+ * frames downscaled by powers of two. Each level is computed from the level
+ * above it the first time a stream needs it for a frame, and is shared by
+ * every stream after that. Streams are encoded from the smallest level which
+ * is still at least as large as the stream, so the full resolution frame is
+ * only read once per frame however many small streams there are.
+ *
+ * \{
+ */
+
+/**
+ * \brief Create a pyramid
+ *
+ * Create the pyramid for frames with the given properties. Levels are only
+ * provided for 8 bit, 1 or 3 channel frames, and only as long as the frame
+ * size divides exactly.
+ *
+ * \param frame_properties Properties of the source frames
+ * \return A new pyramid
+ */
+SVRD_Pyramid* SVRD_Pyramid_new(SVR_FrameProperties* frame_properties) {
+    SVRD_Pyramid* pyramid = malloc(sizeof(SVRD_Pyramid));
+    SVR_FrameProperties* level_properties;
+    SVRD_Preprocessor* preprocessor;
+    CvRect roi;
+
+    pyramid->levels = 1;
+    pyramid->frame_properties[0] = SVR_FrameProperties_clone(frame_properties);
+    pyramid->preprocessors[0] = NULL;
+    pyramid->spare_frames[0] = NULL;
+
+    for(int level = 1; level < SVRD_PYRAMID_LEVELS; level++) {
+        SVR_FrameProperties* above = pyramid->frame_properties[level - 1];
+
+        if(above->width % 2 || above->height % 2 || above->width < 4 || above->height < 4) {
+            break;
+        }
+
+        level_properties = SVR_FrameProperties_clone(above);
+        level_properties->width = above->width / 2;
+        level_properties->height = above->height / 2;
+
+        roi = cvRect(0, 0, above->width, above->height);
+        preprocessor = SVRD_Preprocessor_new(above, roi, level_properties);
+
+        /* Levels are only worth keeping if they can be built by a fused
+           kernel */
+        if(preprocessor->kernel == NULL) {
+            SVRD_Preprocessor_destroy(preprocessor);
+            SVR_FrameProperties_destroy(level_properties);
+            break;
+        }
+
+        pyramid->frame_properties[level] = level_properties;
+        pyramid->preprocessors[level] = preprocessor;
+        pyramid->spare_frames[level] = List_new();
+        pyramid->levels++;
+    }
+
+    SVR_LOCKABLE_INIT(pyramid);
+
+    return pyramid;
+}
+
+/**
+ * \brief Destroy a pyramid
+ *
+ * Destroy a pyramid. No source frames may still hold level frames from it.
+ *
+ * \param pyramid The pyramid to destroy
+ */
+void SVRD_Pyramid_destroy(SVRD_Pyramid* pyramid) {
+    IplImage* frame;
+
+    SVR_FrameProperties_destroy(pyramid->frame_properties[0]);
+
+    for(int level = 1; level < pyramid->levels; level++) {
+        while(List_getSize(pyramid->spare_frames[level]) > 0) {
+            frame = List_remove(pyramid->spare_frames[level], 0);
+            cvReleaseImage(&frame);
+        }
+
+        List_destroy(pyramid->spare_frames[level]);
+        SVRD_Preprocessor_destroy(pyramid->preprocessors[level]);
+        SVR_FrameProperties_destroy(pyramid->frame_properties[level]);
+    }
+
+    free(pyramid);
+}
+
+/**
+ * \brief Pick the pyramid level a stream is encoded from
+ *
+ * Pick the smallest level which is at least as large as the stream's frames
+ * and on which the stream's region falls on whole pixels.
+ *
+ * \param pyramid The pyramid
+ * \param roi Region of the full resolution frame used by the stream
+ * \param frame_properties Frame properties of the stream
+ * \return The level to encode from
+ */
+int SVRD_Pyramid_selectLevel(SVRD_Pyramid* pyramid, CvRect roi, SVR_FrameProperties* frame_properties) {
+    int selected = 0;
+
+    for(int level = 1; level < pyramid->levels; level++) {
+        int mask = (1 << level) - 1;
+
+        if((roi.x | roi.y | roi.width | roi.height) & mask) {
+            break;
+        }
+
+        if((roi.width >> level) < frame_properties->width ||
+           (roi.height >> level) < frame_properties->height) {
+            break;
+        }
+
+        selected = level;
+    }
+
+    return selected;
+}
+
+/**
+ * \brief Scale a region of the full resolution frame to a pyramid level
+ *
+ * \param roi A region which falls on whole pixels of the level
+ * \param level The level
+ * \return The region in the level's frames
+ */
+CvRect SVRD_Pyramid_scaleRegion(CvRect roi, int level) {
+    return cvRect(roi.x >> level, roi.y >> level, roi.width >> level, roi.height >> level);
+}
+
+/**
+ * \brief Get a pyramid level of a source frame
+ *
+ * Get the given level of a source frame, building it and any missing level
+ * above it if no stream has asked for it yet. The returned frame is owned by
+ * the source frame and is valid as long as the source frame is referenced.
+ *
+ * \param pyramid The source's pyramid
+ * \param source_frame The source frame
+ * \param level A level less than the pyramid's number of levels
+ * \return The level frame
+ */
+IplImage* SVRD_Pyramid_getLevel(SVRD_Pyramid* pyramid, SVRD_SourceFrame* source_frame, int level) {
+    IplImage* above;
+    IplImage* frame;
+
+    if(level == 0) {
+        return source_frame->frame;
+    }
+
+    SVR_LOCK(source_frame);
+    if(source_frame->levels[level] == NULL) {
+        above = SVRD_Pyramid_getLevel(pyramid, source_frame, level - 1);
+        frame = SVRD_Pyramid_acquireFrame(pyramid, level);
+
+        SVRD_Preprocessor_processInto(pyramid->preprocessors[level], above, frame);
+        source_frame->levels[level] = frame;
+    }
+    frame = source_frame->levels[level];
+    SVR_UNLOCK(source_frame);
+
+    return frame;
+}
+
+/**
+ * \brief Return the level frames of a released source frame
+ *
+ * \param pyramid The source's pyramid
+ * \param source_frame A source frame no longer referenced by anyone
+ */
+void SVRD_Pyramid_releaseLevels(SVRD_Pyramid* pyramid, SVRD_SourceFrame* source_frame) {
+    SVR_LOCK(pyramid);
+    for(int level = 1; level < pyramid->levels; level++) {
+        if(source_frame->levels[level]) {
+            List_append(pyramid->spare_frames[level], source_frame->levels[level]);
+            source_frame->levels[level] = NULL;
+        }
+    }
+    SVR_UNLOCK(pyramid);
+}
+
+static IplImage* SVRD_Pyramid_acquireFrame(SVRD_Pyramid* pyramid, int level) {
+    IplImage* frame = NULL;
+
+    SVR_LOCK(pyramid);
+    if(List_getSize(pyramid->spare_frames[level]) > 0) {
+        frame = List_remove(pyramid->spare_frames[level], List_getSize(pyramid->spare_frames[level]) - 1);
+    }
+    SVR_UNLOCK(pyramid);
+
+    if(frame == NULL) {
+        frame = SVR_FrameProperties_imageFromProperties(pyramid->frame_properties[level]);
+    }
+
+    return frame;
+}
+
+/** \} */
@@ -15,6 +15,11 @@
 #include <sys/select.h>
 #include <sys/socket.h>
 #include <sys/time.h>
+#include <time.h>
+
+#ifdef __SVR_Linux__
+# include <sys/epoll.h>
+#endif
 
 /** Server socket */
 static int svr_sock = -1;
@@ -32,6 +37,16 @@ static bool mainloop_running = false;
 static pthread_cond_t mainloop_done = PTHREAD_COND_INITIALIZER;
 static pthread_mutex_t mainloop_done_lock = PTHREAD_MUTEX_INITIALIZER;
 
+/** Event loop epoll instance */
+static int epoll_fd = -1;
+
+/** Serializes changes to the events watched for each client */
+static pthread_mutex_t watch_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** Worker pools used in event loop mode */
+static SVRD_WorkerPool* message_pool = NULL;
+static SVRD_WorkerPool* frame_pool = NULL;
+
 static void SVRD_Server_initServerSocket(const char* bind_address);
 
 /**
@@ -74,7 +89,7 @@ static void SVRD_Server_initServerSocket(const char* bind_address) {
     }
 
     /* Start listening */
-    if(listen(svr_sock, MAX_CLIENTS)) {
+    if(listen(svr_sock, SOMAXCONN)) {
         SVR_log(SVR_CRITICAL, Util_format("Error setting socket to listen: %s", strerror(errno)));
         SVRD_exitError();
     }
@@ -160,4 +175,184 @@ void SVRD_Server_mainLoop(const char* bind_address) {
     pthread_cond_broadcast(&mainloop_done);
     pthread_mutex_unlock(&mainloop_done_lock);
 }
+
+/**
+ * \brief Get the message worker pool
+ *
+ * \return The pool processing client messages in event loop mode, or NULL if
+ * the event loop is not running
+ */
+SVRD_WorkerPool* SVRD_Server_getMessagePool(void) {
+    return message_pool;
+}
+
+/**
+ * \brief Get the frame worker pool
+ *
+ * \return The pool encoding and sending stream frames in event loop mode, or
+ * NULL if the event loop is not running
+ */
+SVRD_WorkerPool* SVRD_Server_getFramePool(void) {
+    return frame_pool;
+}
+
+/**
+ * \brief Get the monotonic time
+ *
+ * \return Time from an arbitrary fixed point, in nanoseconds
+ */
+uint64_t SVRD_Server_getTime(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((uint64_t) now.tv_sec) * 1000000000 + now.tv_nsec;
+}
+
+#ifdef __SVR_Linux__
+
+static void SVRD_Server_watchClient(SVRD_Client* client, int op, uint32_t events) {
+    struct epoll_event event;
+
+    event.events = events;
+    event.data.ptr = client;
+
+    /* May fail harmlessly if the event loop already stopped watching the
+       client because it closed */
+    epoll_ctl(epoll_fd, op, client->socket, &event);
+}
+
+/**
+ * \brief Update the events watched for a client
+ *
+ * Watch a client for input unless it is throttled, and for room to send while
+ * its socket is full. Hang ups are always reported. Called after either
+ * changes, without the client's pending or outbound lock held.
+ *
+ * \param client The client
+ */
+void SVRD_Server_updateClient(SVRD_Client* client) {
+    uint32_t events = 0;
+
+    pthread_mutex_lock(&watch_lock);
+    pthread_mutex_lock(&client->pending_lock);
+    if(client->throttled == false) {
+        events |= EPOLLIN;
+    }
+    pthread_mutex_unlock(&client->pending_lock);
+
+    pthread_mutex_lock(&client->outbound_lock);
+    if(client->write_blocked) {
+        events |= EPOLLOUT;
+    }
+    pthread_mutex_unlock(&client->outbound_lock);
+
+    SVRD_Server_watchClient(client, EPOLL_CTL_MOD, events);
+    pthread_mutex_unlock(&watch_lock);
+}
+
+/**
+ * \brief SVR event loop
+ *
+ * Alternative to SVRD_Server_mainLoop which serves every client from a single
+ * epoll loop rather than a thread per client. Client messages are processed by
+ * a message worker pool and stream frames are encoded by a frame worker pool,
+ * each with one thread per processor. Client sockets are non-blocking. The
+ * task which queues a message or frame sends what the socket accepts, and the
+ * event loop sends the rest once the socket is writable, so no thread waits on
+ * a slow client. Frame tasks never wait on message tasks, so a message task may
+ * wait on frame tasks without deadlocking.
+ */
+void SVRD_Server_eventLoop(const char* bind_address) {
+    struct epoll_event events[SVRD_MAX_EVENTS];
+    struct epoll_event listen_event;
+    SVRD_Client* client;
+    int client_new;
+    int n;
+
+    SVRD_Server_initServerSocket(bind_address);
+
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if(epoll_fd < 0) {
+        SVR_log(SVR_CRITICAL, Util_format("Error creating epoll instance: %s", strerror(errno)));
+        SVRD_exitError();
+    }
+
+    /* The server socket is identified by a NULL client */
+    listen_event.events = EPOLLIN;
+    listen_event.data.ptr = NULL;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, svr_sock, &listen_event);
+
+    message_pool = SVRD_WorkerPool_new(0);
+    frame_pool = SVRD_WorkerPool_new(0);
+
+    SVR_log(SVR_INFO, "Accepting client connections (event loop)");
+
+    mainloop_running = true;
+
+    while(run_mainloop) {
+        n = epoll_wait(epoll_fd, events, SVRD_MAX_EVENTS, -1);
+
+        if(n < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+
+            SVR_log(SVR_ERROR, Util_format("Error waiting for events: %s", strerror(errno)));
+            break;
+        }
+
+        for(int i = 0; i < n; i++) {
+            client = events[i].data.ptr;
+
+            if(client == NULL) {
+                client_new = accept(svr_sock, NULL, 0);
+
+                if(client_new < 0) {
+                    SVR_log(SVR_ERROR, "Error accepting new client connection");
+                    continue;
+                }
+
+                client = SVRD_addEventClient(client_new);
+                SVRD_Server_watchClient(client, EPOLL_CTL_ADD, EPOLLIN);
+            } else if((events[i].events & ~EPOLLOUT) && SVRD_Client_receiveAvailable(client) < 0) {
+                /* Stop watching the client before its descriptor can be
+                   closed, then release the event loop's reference from a
+                   worker since closing may block on the client's streams */
+                epoll_ctl(epoll_fd, EPOLL_CTL_DEL, client->socket, NULL);
+                SVRD_WorkerPool_submit(message_pool, SVRD_Client_closeTask, client);
+            } else if(events[i].events & EPOLLOUT) {
+                SVRD_Client_sendAvailable(client);
+            }
+        }
+    }
+
+    /* The worker pools are left running, as clients still connected may be
+       kicked and closed after the loop ends */
+    pthread_mutex_lock(&mainloop_done_lock);
+    mainloop_running = false;
+    shutdown(svr_sock, SHUT_RDWR);
+    close(svr_sock);
+    close(epoll_fd);
+
+    pthread_cond_broadcast(&mainloop_done);
+    pthread_mutex_unlock(&mainloop_done_lock);
+}
+
+#else
+
+void SVRD_Server_updateClient(SVRD_Client* client) {
+}
+
+/**
+ * \brief SVR event loop
+ *
+ * The event loop requires epoll. On other systems the threaded main loop is
+ * used instead.
+ */
+void SVRD_Server_eventLoop(const char* bind_address) {
+    SVR_log(SVR_WARNING, "Event loop mode is only supported on Linux, using threaded mode");
+    SVRD_Server_mainLoop(bind_address);
+}
+
+#endif // #ifdef __SVR_Linux__
 /** \} */
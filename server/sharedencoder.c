@@ -0,0 +1,226 @@
+/**
+ * \file
+ * \brief Shared encoders
+ */
+
+#include <svr.h>
+#include <svrd.h>
+
+static void SVRD_EncodedFrame_cleanup(void* _encoded_frame);
+
+/**
+ * \defgroup SharedEncoder Shared encoder
+ * \brief Encode each source frame once per distinct stream configuration
+ *
+ * Streams attached to the same source which request the same region, frame
+ * size, channel count, and encoding descriptor produce identical data. Rather than
+ * each stream preprocessing and encoding every frame, a source keeps one
+ * shared encoder per distinct configuration. The first stream to request a new
+ * source frame from a shared encoder performs the work, and every other stream
+ * receives a reference to the same encoded frame. Streams may also be split
+ * into sharing groups, such as when an encoder adapts to a single client.
+ *
+ * \{
+ */
+
+/**
+ * \brief Build a shared encoder key
+ *
+ * Build the key identifying a stream configuration
+ *
+ * \param roi Region of the source frames used by the stream
+ * \param frame_properties Frame properties of the stream
+ * \param encoding_descriptor Encoding option string of the stream
+ * \param group Sharing group of the stream. Only streams of the same group
+ * share an encoder
+ * \return A newly allocated key which should be freed by the caller
+ */
+char* SVRD_SharedEncoder_makeKey(CvRect roi, SVR_FrameProperties* frame_properties, const char* encoding_descriptor, const char* group) {
+    return strdup(Util_format("%d,%d,%d,%d,%d,%d,%d,%s,%s", roi.x, roi.y, roi.width, roi.height,
+                                                            frame_properties->width,
+                                                            frame_properties->height,
+                                                            frame_properties->channels,
+                                                            group,
+                                                            encoding_descriptor));
+}
+
+/**
+ * \brief Create a shared encoder
+ *
+ * Create a new shared encoder for the given source. This should only be called
+ * through SVRD_Source_acquireEncoder.
+ *
+ * \param source The source frames will be taken from
+ * \param roi Region of the source frames which is encoded
+ * \param frame_properties Properties of the encoded frames
+ * \param encoding_descriptor Option string describing the encoding
+ * \param group Sharing group of the streams using the encoder
+ * \return A new shared encoder, or NULL if the encoding descriptor is invalid
+ */
+SVRD_SharedEncoder* SVRD_SharedEncoder_new(SVRD_Source* source, CvRect roi, SVR_FrameProperties* frame_properties, const char* encoding_descriptor, const char* group) {
+    SVRD_SharedEncoder* shared_encoder;
+    SVRD_Pyramid* pyramid;
+    Dictionary* options;
+    SVR_Encoding* encoding;
+
+    options = SVR_parseOptionString(encoding_descriptor);
+    if(options == NULL) {
+        return NULL;
+    }
+
+    encoding = SVR_Encoding_getByName(Dictionary_get(options, "%name"));
+    if(encoding == NULL) {
+        SVR_freeParsedOptionString(options);
+        return NULL;
+    }
+
+    shared_encoder = malloc(sizeof(SVRD_SharedEncoder));
+    shared_encoder->key = SVRD_SharedEncoder_makeKey(roi, frame_properties, encoding_descriptor, group);
+    shared_encoder->source = source;
+    shared_encoder->encoding = encoding;
+    shared_encoder->encoding_options = options;
+    shared_encoder->frame_properties = SVR_FrameProperties_clone(frame_properties);
+    shared_encoder->encoder = SVR_Encoder_new(encoding, options, shared_encoder->frame_properties);
+    shared_encoder->encoded_frame = NULL;
+    shared_encoder->frames_encoded = 0;
+    shared_encoder->encoded_sequence = 0;
+    shared_encoder->keyframe_requested = false;
+    shared_encoder->users = 0;
+
+    /* Start from the smallest downscale of the source frames which still
+       covers the stream */
+    pyramid = SVRD_Source_getPyramid(source);
+    shared_encoder->level = SVRD_Pyramid_selectLevel(pyramid, roi, frame_properties);
+    shared_encoder->preprocessor = SVRD_Preprocessor_new(pyramid->frame_properties[shared_encoder->level],
+                                                         SVRD_Pyramid_scaleRegion(roi, shared_encoder->level),
+                                                         frame_properties);
+
+    SVR_LOCKABLE_INIT(shared_encoder);
+
+    return shared_encoder;
+}
+
+/**
+ * \brief Destroy a shared encoder
+ *
+ * Destroy a shared encoder. This should only be called through
+ * SVRD_Source_releaseEncoder once the last user has released it.
+ *
+ * \param shared_encoder The shared encoder to destroy
+ */
+void SVRD_SharedEncoder_destroy(SVRD_SharedEncoder* shared_encoder) {
+    if(shared_encoder->encoded_frame) {
+        SVR_UNREF(shared_encoder->encoded_frame);
+    }
+
+    SVRD_Preprocessor_destroy(shared_encoder->preprocessor);
+    SVR_Encoder_destroy(shared_encoder->encoder);
+    SVR_FrameProperties_destroy(shared_encoder->frame_properties);
+    SVR_freeParsedOptionString(shared_encoder->encoding_options);
+    free(shared_encoder->key);
+    free(shared_encoder);
+}
+
+/**
+ * \brief Get the encoded form of a source frame
+ *
+ * Return the encoded form of the given source frame. If no newer frame has
+ * already been encoded by another user of this shared encoder, the frame is
+ * preprocessed and encoded now. Otherwise the existing encoded frame is
+ * returned. The caller must release the returned frame with SVR_UNREF.
+ *
+ * \param shared_encoder The shared encoder
+ * \param source_frame The source frame to encode
+ * \return A reference to the encoded frame
+ */
+SVRD_EncodedFrame* SVRD_SharedEncoder_encode(SVRD_SharedEncoder* shared_encoder, SVRD_SourceFrame* source_frame) {
+    SVRD_EncodedFrame* encoded_frame;
+    SVRD_EncodedFrame* replaced_frame = NULL;
+    IplImage* frame;
+
+    SVR_LOCK(shared_encoder);
+    if(shared_encoder->encoded_frame == NULL ||
+       shared_encoder->encoded_frame->sequence < source_frame->sequence) {
+        frame = SVRD_Pyramid_getLevel(SVRD_Source_getPyramid(shared_encoder->source), source_frame, shared_encoder->level);
+        frame = SVRD_Preprocessor_process(shared_encoder->preprocessor, frame);
+
+        /* The encoded frame takes the encoder's output buffer, so the data
+           is sent from where the encoding wrote it */
+        encoded_frame = malloc(sizeof(SVRD_EncodedFrame));
+        if(__atomic_exchange_n(&shared_encoder->keyframe_requested, false, __ATOMIC_RELAXED)) {
+            SVR_Encoder_forceKeyframe(shared_encoder->encoder);
+        }
+        SVR_Encoder_encode(shared_encoder->encoder, frame);
+        encoded_frame->data = SVR_Encoder_takeData(shared_encoder->encoder, &encoded_frame->size);
+        encoded_frame->sequence = source_frame->sequence;
+        encoded_frame->index = ++shared_encoder->frames_encoded;
+        encoded_frame->keyframe = shared_encoder->encoder->keyframe;
+        SVR_REFCOUNTED_INIT(encoded_frame, SVRD_EncodedFrame_cleanup);
+
+        replaced_frame = shared_encoder->encoded_frame;
+        shared_encoder->encoded_frame = encoded_frame;
+        __atomic_store_n(&shared_encoder->encoded_sequence, encoded_frame->sequence, __ATOMIC_RELAXED);
+    }
+
+    encoded_frame = shared_encoder->encoded_frame;
+    SVR_REF(encoded_frame);
+    SVR_UNLOCK(shared_encoder);
+
+    /* Released unlocked, as the frame may be cleaned up on this thread */
+    if(replaced_frame) {
+        SVR_UNREF(replaced_frame);
+    }
+
+    return encoded_frame;
+}
+
+/**
+ * \brief Check if a source frame has been encoded
+ *
+ * Does not wait for an encode in progress
+ *
+ * \param shared_encoder The shared encoder
+ * \param source_frame The source frame
+ * \return True if the frame, or a newer one, has already been encoded, so
+ * SVRD_SharedEncoder_encode would not encode again
+ */
+bool SVRD_SharedEncoder_hasEncoded(SVRD_SharedEncoder* shared_encoder, SVRD_SourceFrame* source_frame) {
+    return __atomic_load_n(&shared_encoder->encoded_sequence, __ATOMIC_RELAXED) >= source_frame->sequence;
+}
+
+/**
+ * \brief Request that the next frame be a keyframe
+ *
+ * Called when a stream could not be sent a frame which later frames depend
+ * on. The stream resumes once the next frame is encoded as a keyframe.
+ *
+ * \param shared_encoder The shared encoder
+ */
+void SVRD_SharedEncoder_requestKeyframe(SVRD_SharedEncoder* shared_encoder) {
+    __atomic_store_n(&shared_encoder->keyframe_requested, true, __ATOMIC_RELAXED);
+}
+
+/**
+ * \brief Report how an encoded frame was sent
+ *
+ * Pass a stream's send time and socket backlog for a frame to the encoder, so
+ * adaptive encodings can adjust later frames
+ *
+ * \param shared_encoder The shared encoder
+ * \param send_ms Time taken to send the frame, in milliseconds
+ * \param backlog Number of bytes still queued to the client
+ */
+void SVRD_SharedEncoder_reportSend(SVRD_SharedEncoder* shared_encoder, unsigned int send_ms, size_t backlog) {
+    /* Encodings handle reports during an encode themselves, so a send never
+       waits for the next frame to be encoded */
+    SVR_Encoder_reportSend(shared_encoder->encoder, send_ms, backlog);
+}
+
+static void SVRD_EncodedFrame_cleanup(void* _encoded_frame) {
+    SVRD_EncodedFrame* encoded_frame = (SVRD_EncodedFrame*) _encoded_frame;
+
+    free(encoded_frame->data);
+    free(encoded_frame);
+}
+
+/** \} */
@@ -3,12 +3,23 @@
 #include <svrd.h>
 
 #include <ctype.h>
+#include <limits.h>
+
+#ifdef __SVR_Linux__
+# include <linux/futex.h>
+# include <sys/syscall.h>
+# include <unistd.h>
+#endif
 
 #include "sources/sources.h"
 
 static void SVRD_Source_addType(SVRD_SourceType* source_type);
 static void SVRD_Source_releaseSourceFrame(void* _source_frame);
 static void SVRD_Source_cleanup(void* _source);
+static void SVRD_Source_signalFrameEvent(SVRD_Source* source);
+static void SVRD_Source_waitFrameEvent(SVRD_Source* source, uint32_t event);
+static void SVRD_Source_notifyListeners(SVRD_Source* source);
+static void SVRD_Source_updateTopPriority(SVRD_Source* source);
 
 static Dictionary* sources = NULL;
 static Dictionary* source_types = NULL;
@@ -176,15 +187,27 @@ SVRD_Source* SVRD_Source_new(const char* name) {
     source = malloc(sizeof(SVRD_Source));
     source->name = strdup(name);
     source->frame_properties = NULL;
+    source->pyramid = NULL;
     source->encoding = NULL;
     source->decoder = NULL;
     source->type = NULL;
     source->private_data = NULL;
     source->current_frame = NULL;
+    source->frame_count = 0;
+    source->frame_interval = 0;
+    source->last_frame_time = 0;
+    source->frame_event = 0;
+    source->frame_waiters = 0;
+    source->shared_encoders = Dictionary_new();
+    source->listeners = List_new();
+    source->top_priority = SVRD_STREAM_DEFAULT_PRIORITY;
+    source->client_handle = 0;
     source->closed = false;
 
-    pthread_mutex_init(&source->current_frame_lock, NULL);
-    pthread_cond_init(&source->new_frame, NULL);
+#ifndef __SVR_Linux__
+    pthread_mutex_init(&source->frame_event_lock, NULL);
+    pthread_cond_init(&source->frame_event_cond, NULL);
+#endif
     SVR_LOCKABLE_INIT(source);
     SVR_REFCOUNTED_INIT(source, SVRD_Source_cleanup);
 
@@ -205,6 +228,12 @@ static void SVRD_Source_cleanup(void* _source) {
         SVR_Decoder_destroy(source->decoder);
     }
 
+    if(source->pyramid) {
+        SVRD_Pyramid_destroy(source->pyramid);
+    }
+
+    Dictionary_destroy(source->shared_encoders);
+    List_destroy(source->listeners);
     free(source->name);
     free(source);
 }
@@ -237,8 +266,9 @@ void SVRD_Source_destroy(SVRD_Source* source) {
         source->type->close(source);
     }
 
-    /* Wake up any SVRD_Source_getFrame calls */
-    pthread_cond_broadcast(&source->new_frame);
+    /* Wake up any SVRD_Source_getFrame calls and pooled streams */
+    SVRD_Source_signalFrameEvent(source);
+    SVRD_Source_notifyListeners(source);
 
     /* Remove self reference. Object will be garbage collected once all
        references a released */
@@ -279,9 +309,11 @@ int SVRD_Source_setFrameProperties(SVRD_Source* source, SVR_FrameProperties* fra
 
     if(source->frame_properties) {
         SVR_FrameProperties_destroy(source->frame_properties);
+        SVRD_Pyramid_destroy(source->pyramid);
     }
 
     source->frame_properties = SVR_FrameProperties_clone(frame_properties);
+    source->pyramid = SVRD_Pyramid_new(frame_properties);
     return SVR_SUCCESS;
 }
 
@@ -289,50 +321,341 @@ SVR_FrameProperties* SVRD_Source_getFrameProperties(SVRD_Source* source) {
     return source->frame_properties;
 }
 
+/**
+ * \brief Get the pyramid of a source's frames
+ *
+ * \param source The source
+ * \return The source's pyramid, or NULL if the source has no frame properties
+ * yet
+ */
+SVRD_Pyramid* SVRD_Source_getPyramid(SVRD_Source* source) {
+    return source->pyramid;
+}
+
+/**
+ * \brief Wake streams waiting for a frame
+ *
+ * Increment the frame event counter and wake any streams blocked in
+ * SVRD_Source_getFrame. On Linux no system call is made unless a stream is
+ * actually waiting.
+ *
+ * \param source The source
+ */
+static void SVRD_Source_signalFrameEvent(SVRD_Source* source) {
+#ifdef __SVR_Linux__
+    __atomic_add_fetch(&source->frame_event, 1, __ATOMIC_SEQ_CST);
+
+    if(__atomic_load_n(&source->frame_waiters, __ATOMIC_SEQ_CST) > 0) {
+        syscall(SYS_futex, &source->frame_event, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+    }
+#else
+    pthread_mutex_lock(&source->frame_event_lock);
+    __atomic_add_fetch(&source->frame_event, 1, __ATOMIC_SEQ_CST);
+    pthread_cond_broadcast(&source->frame_event_cond);
+    pthread_mutex_unlock(&source->frame_event_lock);
+#endif
+}
+
+/**
+ * \brief Wait for a frame event
+ *
+ * Block until the frame event counter differs from the given value. Spurious
+ * wake ups are possible, so callers must recheck their condition.
+ *
+ * \param source The source
+ * \param event The value of the frame event counter read before the caller
+ * last checked for a new frame
+ */
+static void SVRD_Source_waitFrameEvent(SVRD_Source* source, uint32_t event) {
+#ifdef __SVR_Linux__
+    /* The futex call only sleeps if the counter still holds the given value,
+       so a frame published after the caller's check is never missed */
+    __atomic_add_fetch(&source->frame_waiters, 1, __ATOMIC_SEQ_CST);
+    syscall(SYS_futex, &source->frame_event, FUTEX_WAIT_PRIVATE, event, NULL, NULL, 0);
+    __atomic_sub_fetch(&source->frame_waiters, 1, __ATOMIC_SEQ_CST);
+#else
+    pthread_mutex_lock(&source->frame_event_lock);
+    while(__atomic_load_n(&source->frame_event, __ATOMIC_SEQ_CST) == event) {
+        pthread_cond_wait(&source->frame_event_cond, &source->frame_event_lock);
+    }
+    pthread_mutex_unlock(&source->frame_event_lock);
+#endif
+}
+
+/**
+ * \brief Reference the current frame
+ *
+ * Load and reference the current frame without locking. The frame may be
+ * replaced and released between loading and referencing it. Source frames come
+ * from a block allocator, so a released frame's memory stays valid, and its
+ * reference count stays 0 until the block is reused. A frame is therefore only
+ * referenced if it has not been released, and only returned if it is still
+ * the current frame once referenced. Otherwise the new current frame is tried.
+ *
+ * \param source The source
+ * \return A new reference to the current frame, or NULL if no frame has been
+ * provided yet
+ */
+SVRD_SourceFrame* SVRD_Source_acquireCurrentFrame(SVRD_Source* source) {
+    SVRD_SourceFrame* frame;
+
+#ifdef SVR_DUMMY_ALLOC
+    /* Released frames are freed, so the frame must be referenced while
+       provideData can not replace it */
+    SVR_LOCK(source);
+    frame = source->current_frame;
+    if(frame) {
+        SVR_REF(frame);
+    }
+    SVR_UNLOCK(source);
+#else
+    while(true) {
+        frame = __atomic_load_n(&source->current_frame, __ATOMIC_ACQUIRE);
+        if(frame == NULL) {
+            break;
+        }
+
+        if(SVR_TRYREF(frame)) {
+            if(__atomic_load_n(&source->current_frame, __ATOMIC_ACQUIRE) == frame) {
+                break;
+            }
+
+            SVR_UNREF(frame);
+        }
+    }
+#endif
+
+    return frame;
+}
+
 SVRD_SourceFrame* SVRD_Source_getFrame(SVRD_Source* source, SVRD_Stream* stream, SVRD_SourceFrame* last_frame) {
-    SVRD_SourceFrame* new_frame = NULL;
+    SVRD_SourceFrame* new_frame;
+    unsigned long last_sequence = 0;
+    uint32_t event;
 
-    /* Dereference the last frame */
+    /* Dereference the last frame. Frames are compared by sequence number
+       since the frame structure may be reused once released */
     if(last_frame) {
+        last_sequence = last_frame->sequence;
         SVR_UNREF(last_frame);
     }
 
     /* Wait for a different frame */
-    pthread_mutex_lock(&source->current_frame_lock);
-    while(source->closed == false && source->current_frame == last_frame &&
-          (stream == NULL || stream->state == SVR_UNPAUSED)) {
-        pthread_cond_wait(&source->new_frame, &source->current_frame_lock);
+    while(true) {
+        event = __atomic_load_n(&source->frame_event, __ATOMIC_SEQ_CST);
+
+        if(source->closed || (stream && stream->state != SVR_UNPAUSED)) {
+            return NULL;
+        }
+
+        new_frame = SVRD_Source_acquireCurrentFrame(source);
+        if(new_frame) {
+            if(new_frame->sequence != last_sequence) {
+                return new_frame;
+            }
+
+            SVR_UNREF(new_frame);
+        }
+
+        /* Clean up any batched objects while idle */
+        SVR_RefCounter_flush();
+        SVRD_Source_waitFrameEvent(source, event);
+    }
+}
+
+/**
+ * \brief Acquire a shared encoder
+ *
+ * Get the shared encoder for the given stream configuration, creating it if
+ * no other stream currently uses the same configuration. Each successful call
+ * must be paired with a call to SVRD_Source_releaseEncoder.
+ *
+ * \param source The source
+ * \param roi The region of the source frames used by the stream
+ * \param frame_properties The frame properties of the stream
+ * \param encoding_descriptor The encoding option string of the stream
+ * \param group The sharing group of the stream. Only streams of the same
+ * group share an encoder
+ * \return A shared encoder, or NULL if the encoding descriptor is invalid
+ */
+SVRD_SharedEncoder* SVRD_Source_acquireEncoder(SVRD_Source* source, CvRect roi, SVR_FrameProperties* frame_properties, const char* encoding_descriptor, const char* group) {
+    SVRD_SharedEncoder* shared_encoder;
+    char* key = SVRD_SharedEncoder_makeKey(roi, frame_properties, encoding_descriptor, group);
+
+    SVR_LOCK(source);
+    shared_encoder = Dictionary_get(source->shared_encoders, key);
+    if(shared_encoder == NULL) {
+        shared_encoder = SVRD_SharedEncoder_new(source, roi, frame_properties, encoding_descriptor, group);
+
+        if(shared_encoder) {
+            Dictionary_set(source->shared_encoders, shared_encoder->key, shared_encoder);
+        }
     }
 
-    if(source->closed == false && stream->state == SVR_UNPAUSED) {
-        new_frame = source->current_frame;
-        SVR_REF(new_frame);
+    if(shared_encoder) {
+        shared_encoder->users++;
     }
+    SVR_UNLOCK(source);
 
-    pthread_mutex_unlock(&source->current_frame_lock);
+    free(key);
+    return shared_encoder;
+}
 
-    return new_frame;
+/**
+ * \brief Release a shared encoder
+ *
+ * Release a shared encoder previously returned by SVRD_Source_acquireEncoder.
+ * The encoder is destroyed once it has no remaining users.
+ *
+ * \param source The source the encoder was acquired from
+ * \param shared_encoder The shared encoder to release
+ */
+void SVRD_Source_releaseEncoder(SVRD_Source* source, SVRD_SharedEncoder* shared_encoder) {
+    SVR_LOCK(source);
+    shared_encoder->users--;
+    if(shared_encoder->users == 0) {
+        Dictionary_remove(source->shared_encoders, shared_encoder->key);
+        SVRD_SharedEncoder_destroy(shared_encoder);
+    }
+    SVR_UNLOCK(source);
 }
 
 void SVRD_Source_dismissPausedStreams(SVRD_Source* source) {
-    pthread_cond_broadcast(&source->new_frame);
+    SVRD_Source_signalFrameEvent(source);
+}
+
+/**
+ * \brief Register an unpaused stream
+ *
+ * Register a stream taking frames from the source. Streams run by the worker
+ * pool are notified through SVRD_Stream_frameReady whenever a new frame is
+ * provided or the source closes.
+ *
+ * \param source The source
+ * \param stream The stream to register
+ */
+void SVRD_Source_addListener(SVRD_Source* source, SVRD_Stream* stream) {
+    SVR_LOCK(source);
+    List_append(source->listeners, stream);
+    SVRD_Source_updateTopPriority(source);
+    SVR_UNLOCK(source);
+
+    /* Pick up the current frame, or notice the source has already closed */
+    if(stream->pooled) {
+        SVRD_Stream_frameReady(stream);
+    }
+}
+
+/**
+ * \brief Unregister a stream
+ *
+ * Stop tracking a stream registered with SVRD_Source_addListener
+ *
+ * \param source The source
+ * \param stream The stream to remove
+ */
+void SVRD_Source_removeListener(SVRD_Source* source, SVRD_Stream* stream) {
+    int index;
+
+    SVR_LOCK(source);
+    index = List_indexOf(source->listeners, stream);
+    if(index >= 0) {
+        List_remove(source->listeners, index);
+    }
+    SVRD_Source_updateTopPriority(source);
+    SVR_UNLOCK(source);
+}
+
+/**
+ * \brief Take note of a stream's changed priority
+ *
+ * \param source The source
+ * \param stream The stream whose priority changed
+ */
+void SVRD_Source_adjustStreamPriority(SVRD_Source* source, SVRD_Stream* stream) {
+    SVR_LOCK(source);
+    SVRD_Source_updateTopPriority(source);
+    SVR_UNLOCK(source);
+}
+
+/**
+ * \brief Decide whether a stream should skip a frame to save CPU
+ *
+ * A frame which is still waiting to be processed after a whole frame interval
+ * means the server can not keep up with the source. Streams below the
+ * highest priority of the source's streams then skip such frames, so the CPU
+ * goes to the more important streams first.
+ *
+ * \param source The source
+ * \param stream The stream about to process the frame
+ * \param source_frame The frame
+ * \return True if the stream should skip the frame
+ */
+bool SVRD_Source_shouldThrottle(SVRD_Source* source, SVRD_Stream* stream, SVRD_SourceFrame* source_frame) {
+    uint64_t frame_interval = __atomic_load_n(&source->frame_interval, __ATOMIC_RELAXED);
+
+    if(__atomic_load_n(&stream->priority, __ATOMIC_RELAXED) >= __atomic_load_n(&source->top_priority, __ATOMIC_RELAXED) ||
+       frame_interval == 0) {
+        return false;
+    }
+
+    /* Skipping a frame another stream already encoded saves nothing */
+    if(SVRD_SharedEncoder_hasEncoded(stream->shared_encoder, source_frame)) {
+        return false;
+    }
+
+    return SVRD_Server_getTime() - source_frame->time > frame_interval;
+}
+
+static void SVRD_Source_notifyListeners(SVRD_Source* source) {
+    SVRD_Stream* stream;
+
+    SVR_LOCK(source);
+    for(int i = 0; (stream = List_get(source->listeners, i)) != NULL; i++) {
+        if(stream->pooled) {
+            SVRD_Stream_frameReady(stream);
+        }
+    }
+    SVR_UNLOCK(source);
+}
+
+/**
+ * \brief Recompute the highest priority of the source's streams. The source
+ * must be locked
+ */
+static void SVRD_Source_updateTopPriority(SVRD_Source* source) {
+    SVRD_Stream* stream;
+    short top_priority = SHRT_MIN;
+
+    for(int i = 0; (stream = List_get(source->listeners, i)) != NULL; i++) {
+        top_priority = Util_max(top_priority, __atomic_load_n(&stream->priority, __ATOMIC_RELAXED));
+    }
+
+    __atomic_store_n(&source->top_priority, (top_priority == SHRT_MIN) ? SVRD_STREAM_DEFAULT_PRIORITY : top_priority,
+                     __ATOMIC_RELAXED);
 }
 
 static void SVRD_Source_releaseSourceFrame(void* _source_frame) {
     SVRD_SourceFrame* source_frame = (SVRD_SourceFrame*) _source_frame;
 
+    SVRD_Pyramid_releaseLevels(source_frame->source->pyramid, source_frame);
+    pthread_mutex_destroy(SVR_GET_LOCK(source_frame));
+
     SVR_Decoder_returnFrame(source_frame->source->decoder, source_frame->frame);
     SVR_BlockAlloc_free(source_frame_alloc, source_frame);
 }
 
 int SVRD_Source_provideData(SVRD_Source* source, void* data, size_t data_available) {
     SVRD_SourceFrame* source_frame;
+    SVRD_SourceFrame* old_frame;
+    List* replaced_frames = List_new();
     IplImage* frame;
 
     SVR_LOCK(source);
     if(source->decoder == NULL) {
         if(source->encoding == NULL || source->frame_properties == NULL) {
             SVR_UNLOCK(source);
+            List_destroy(replaced_frames);
             return SVR_INVALIDSTATE;
         }
 
@@ -343,20 +666,46 @@ int SVRD_Source_provideData(SVRD_Source* source, void* data, size_t data_availab
     while(SVR_Decoder_framesReady(source->decoder) > 0) {
         frame = SVR_Decoder_getFrame(source->decoder);
 
-        pthread_mutex_lock(&source->current_frame_lock);
         source_frame = SVR_BlockAlloc_alloc(source_frame_alloc);
         source_frame->source = source;
         source_frame->frame = frame;
+        source_frame->sequence = ++source->frame_count;
+        source_frame->time = SVRD_Server_getTime();
+        memset(source_frame->levels, 0, sizeof(source_frame->levels));
+        SVR_LOCKABLE_INIT(source_frame);
         SVR_REFCOUNTED_INIT(source_frame, SVRD_Source_releaseSourceFrame);
 
-        if(source->current_frame) {
-            SVR_UNREF(source->current_frame);
+        /* Average the frame interval over roughly the last 8 frames. Streams
+           read it without the source lock */
+        if(source->last_frame_time) {
+            if(source->frame_interval) {
+                __atomic_store_n(&source->frame_interval,
+                                 (source->frame_interval * 7 + (source_frame->time - source->last_frame_time)) / 8,
+                                 __ATOMIC_RELAXED);
+            } else {
+                __atomic_store_n(&source->frame_interval, source_frame->time - source->last_frame_time, __ATOMIC_RELAXED);
+            }
         }
-        source->current_frame = source_frame;
-        pthread_cond_broadcast(&source->new_frame);
-        pthread_mutex_unlock(&source->current_frame_lock);
+        source->last_frame_time = source_frame->time;
+
+        /* Publish the new frame. Readers which loaded the old frame only keep
+           it if they referenced it before it is released below */
+        old_frame = __atomic_exchange_n(&source->current_frame, source_frame, __ATOMIC_ACQ_REL);
+        if(old_frame) {
+            List_append(replaced_frames, old_frame);
+        }
+
+        SVRD_Source_signalFrameEvent(source);
+        SVRD_Source_notifyListeners(source);
     }
     SVR_UNLOCK(source);
 
+    /* Releasing a frame may return it to the decoder on this thread, so
+       replaced frames are released without the source locked */
+    for(int i = 0; (old_frame = List_get(replaced_frames, i)) != NULL; i++) {
+        SVR_UNREF(old_frame);
+    }
+    List_destroy(replaced_frames);
+
     return SVR_SUCCESS;
 }
@@ -2,10 +2,22 @@
 #include <svr.h>
 #include <svrd.h>
 
-static void SVRD_Stream_initializeEncoder(SVRD_Stream* stream);
-static void SVRD_Stream_reallocateTemporaryFrames(SVRD_Stream* stream);
-static IplImage* SVRD_Stream_preprocessFrame(SVRD_Stream* stream, IplImage* frame);
+#include <math.h>
+#include <time.h>
+
+#ifdef __SVR_Linux__
+# include <errno.h>
+# include <sys/resource.h>
+# include <sys/syscall.h>
+# include <unistd.h>
+#endif
+
+static void SVRD_Stream_collectWorker(SVRD_Stream* stream);
+static char* SVRD_Stream_encoderGroup(SVRD_Stream* stream);
+static int SVRD_Stream_processFrame(SVRD_Stream* stream, SVRD_SourceFrame* source_frame);
+static void SVRD_Stream_frameTask(void* _stream);
 static void* SVRD_Stream_worker(void* _stream);
+static void SVRD_Stream_setWorkerNiceness(SVRD_Stream* stream);
 
 SVRD_Stream* SVRD_Stream_new(const char* name) {
     SVRD_Stream* stream = malloc(sizeof(SVRD_Stream));
@@ -13,26 +25,47 @@ SVRD_Stream* SVRD_Stream_new(const char* name) {
     stream->client = NULL;
     stream->name = strdup(name);
     stream->state = SVR_PAUSED;
+    stream->client_handle = 0;
 
     stream->source = NULL;
     stream->frame_properties = SVR_FrameProperties_new();
-    stream->encoder = NULL;
+    stream->roi = cvRect(0, 0, 0, 0);
+    stream->shared_encoder = NULL;
     stream->encoding = NULL;
-    stream->encoding_options = NULL;
+    stream->encoding_descriptor = NULL;
+    stream->adaptive_encoding = false;
 
-    stream->payload_buffer_size = 8 * 1024;
-    stream->payload_buffer = malloc(stream->payload_buffer_size);
+    stream->chunk_size = 8 * 1024;
 
-    stream->priority = 1;
-
-    stream->temp_frame[0] = NULL;
-    stream->temp_frame[1] = NULL;
+    stream->priority = SVRD_STREAM_DEFAULT_PRIORITY;
+    stream->throttled_frames = 0;
 
     stream->drop_counter = 0;
     stream->drop_rate = 0;
 
+    stream->frame_interval = 0;
+    stream->group_frame_interval = 0;
+    stream->group_drop_rate = 0;
+    stream->next_frame_time = 0;
+    stream->frame_schedule_reset = false;
+
+    stream->outbound_frame = NULL;
+    stream->sent_index = 0;
+    stream->queued_index = 0;
+    stream->keyframe_wanted = false;
+    stream->frames_sent = 0;
+    stream->frames_dropped = 0;
+
     memset(&stream->worker, 1, sizeof(pthread_t));
     stream->worker_started = false;
+    stream->worker_priority = SVRD_STREAM_DEFAULT_PRIORITY;
+
+    stream->pooled = false;
+    stream->task_scheduled = false;
+    stream->frame_pending = false;
+    stream->last_sequence = 0;
+    pthread_mutex_init(&stream->task_lock, NULL);
+    pthread_cond_init(&stream->task_done, NULL);
 
     SVR_LOCKABLE_INIT(stream);
 
@@ -43,25 +76,17 @@ SVRD_Stream* SVRD_Stream_new(const char* name) {
 }
 
 void SVRD_Stream_setClient(SVRD_Stream* stream, SVRD_Client* client) {
-    SVR_LOCK(stream);
-    if(stream->client) {
-        SVR_UNREF(stream->client);
-        stream->client = NULL;
-    }
+    SVRD_Client* previous_client;
 
+    SVR_LOCK(stream);
+    previous_client = stream->client;
     stream->client = client;
     SVR_REF(stream->client);
     SVR_UNLOCK(stream);
-}
 
-static void SVRD_Stream_initializeEncoder(SVRD_Stream* stream) {
-    SVR_LOCK(stream);
-    if(stream->encoder) {
-        SVR_Encoder_destroy(stream->encoder);
+    if(previous_client) {
+        SVR_UNREF(previous_client);
     }
-
-    stream->encoder = SVR_Encoder_new(stream->encoding, stream->encoding_options, stream->frame_properties);
-    SVR_UNLOCK(stream);
 }
 
 
@@ -80,6 +105,7 @@ int SVRD_Stream_attachSource(SVRD_Stream* stream, SVRD_Source* source) {
     }
 
     stream->frame_properties = SVR_FrameProperties_clone(SVRD_Source_getFrameProperties(source));
+    stream->roi = cvRect(0, 0, stream->frame_properties->width, stream->frame_properties->height);
 
     return SVR_SUCCESS;
 }
@@ -89,6 +115,10 @@ int SVRD_Stream_detachSource(SVRD_Stream* stream) {
         return SVR_INVALIDSTATE;
     }
 
+    if(stream->source) {
+        SVR_UNREF(stream->source);
+    }
+
     stream->source = NULL;
     stream->frame_properties = NULL;
     return SVR_SUCCESS;
@@ -132,11 +162,17 @@ int SVRD_Stream_setEncoding(SVRD_Stream* stream, const char* encoding_descriptor
         return SVR_NOSUCHENCODING;
     }
 
-    if(stream->encoding_options) {
-        SVR_freeParsedOptionString(stream->encoding_options);
+    stream->adaptive_encoding = Dictionary_exists(options, "quality") &&
+                                strcmp(Dictionary_get(options, "quality"), "auto") == 0;
+    SVR_freeParsedOptionString(options);
+
+    /* The encoder itself is shared between streams of the same configuration
+       and is acquired from the source when the stream is unpaused */
+    if(stream->encoding_descriptor) {
+        free(stream->encoding_descriptor);
     }
     stream->encoding = encoding;
-    stream->encoding_options = options;
+    stream->encoding_descriptor = strdup(encoding_descriptor);
 
     return SVR_SUCCESS;
 }
@@ -149,41 +185,57 @@ int SVRD_Stream_setDropRate(SVRD_Stream* stream, int rate) {
     return SVR_SUCCESS;
 }
 
-int SVRD_Stream_setPriority(SVRD_Stream* stream, short priority) {
-    stream->priority = priority;
-    return SVR_SUCCESS;
-}
-
-static void SVRD_Stream_reallocateTemporaryFrames(SVRD_Stream* stream) {
-    SVR_FrameProperties* source_frame_properties = SVRD_Source_getFrameProperties(stream->source);
-    SVR_FrameProperties* temp_frame_properties;
-
-    bool resize = (stream->frame_properties->width != source_frame_properties->width ||
-                   stream->frame_properties->height != source_frame_properties->height);
-    bool color_convert = (stream->frame_properties->channels != source_frame_properties->channels);
+/**
+ * \brief Cap the rate frames are sent at
+ *
+ * Send at most fps frames per second, regardless of the rate of the source.
+ * Frames arriving early are skipped before they are preprocessed or encoded.
+ *
+ * \param stream The stream
+ * \param fps Maximum frames per second, or 0 for no limit
+ * \return An SVR return code
+ */
+int SVRD_Stream_setMaxRate(SVRD_Stream* stream, double fps) {
+    uint64_t frame_interval = 0;
 
-    if(stream->temp_frame[0]) {
-        cvReleaseImage(&stream->temp_frame[0]);
+    if(!(fps >= 0) || !isfinite(fps)) {
+        return SVR_INVALIDARGUMENT;
     }
 
-    if(stream->temp_frame[1]) {
-        cvReleaseImage(&stream->temp_frame[1]);
+    if(fps > 0) {
+        frame_interval = (1e9 / fps < SVRD_STREAM_MAX_FRAME_INTERVAL) ? (uint64_t) (1e9 / fps) : SVRD_STREAM_MAX_FRAME_INTERVAL;
     }
 
-    stream->temp_frame[0] = NULL;
-    stream->temp_frame[1] = NULL;
+    /* The frame schedule belongs to the thread or task processing frames,
+       which restarts it when it sees the reset */
+    __atomic_store_n(&stream->frame_interval, frame_interval, __ATOMIC_RELAXED);
+    __atomic_store_n(&stream->frame_schedule_reset, true, __ATOMIC_RELEASE);
 
-    if(resize && color_convert) {
-        temp_frame_properties = SVR_FrameProperties_clone(stream->frame_properties);
-        temp_frame_properties->channels = source_frame_properties->channels;
+    return SVR_SUCCESS;
+}
 
-        stream->temp_frame[0] = SVR_FrameProperties_imageFromProperties(temp_frame_properties);
-        stream->temp_frame[1] = SVR_FrameProperties_imageFromProperties(stream->frame_properties);
+/**
+ * \brief Set the priority of a stream
+ *
+ * In event loop mode, frames of higher priority streams are encoded first. In
+ * threaded mode, the stream's worker thread is given a niceness relative to
+ * SVRD_STREAM_DEFAULT_PRIORITY. In both modes, when frames wait longer than
+ * the source's frame interval, streams below the highest priority among the
+ * source's streams skip them.
+ *
+ * \param stream The stream
+ * \param priority The new priority
+ * \return An SVR return code
+ */
+int SVRD_Stream_setPriority(SVRD_Stream* stream, short priority) {
+    /* Read without a lock when deciding whether to throttle */
+    __atomic_store_n(&stream->priority, priority, __ATOMIC_RELAXED);
 
-        SVR_FrameProperties_destroy(temp_frame_properties);
-    } else if(resize || color_convert) {
-        stream->temp_frame[0] = SVR_FrameProperties_imageFromProperties(stream->frame_properties);
+    if(stream->source) {
+        SVRD_Source_adjustStreamPriority(stream->source, stream);
     }
+
+    return SVR_SUCCESS;
 }
 
 int SVRD_Stream_resize(SVRD_Stream* stream, int width, int height) {
@@ -194,7 +246,40 @@ int SVRD_Stream_resize(SVRD_Stream* stream, int width, int height) {
     stream->frame_properties->width = width;
     stream->frame_properties->height = height;
 
-    SVRD_Stream_reallocateTemporaryFrames(stream);
+    return SVR_SUCCESS;
+}
+
+/**
+ * \brief Crop the stream to a region of the source
+ *
+ * Only the given region of each source frame is resized, encoded and sent.
+ * The stream's frame size is reset to the size of the region, and may be
+ * changed afterwards with SVRD_Stream_resize to scale the region.
+ *
+ * \param stream The stream
+ * \param x Left edge of the region
+ * \param y Top edge of the region
+ * \param width Width of the region
+ * \param height Height of the region
+ * \return An SVR return code
+ */
+int SVRD_Stream_setROI(SVRD_Stream* stream, int x, int y, int width, int height) {
+    SVR_FrameProperties* source_frame_properties;
+
+    if(stream->state == SVR_UNPAUSED || stream->source == NULL) {
+        return SVR_INVALIDSTATE;
+    }
+
+    source_frame_properties = SVRD_Source_getFrameProperties(stream->source);
+    if(x < 0 || y < 0 || width <= 0 || height <= 0 ||
+       x + width > source_frame_properties->width ||
+       y + height > source_frame_properties->height) {
+        return SVR_INVALIDARGUMENT;
+    }
+
+    stream->roi = cvRect(x, y, width, height);
+    stream->frame_properties->width = width;
+    stream->frame_properties->height = height;
 
     return SVR_SUCCESS;
 }
@@ -210,8 +295,6 @@ int SVRD_Stream_setChannels(SVRD_Stream* stream, int channels) {
 
     stream->frame_properties->channels = channels;
 
-    SVRD_Stream_reallocateTemporaryFrames(stream);
-
     return SVR_SUCCESS;
 }
 
@@ -231,29 +314,126 @@ void SVRD_Stream_pause(SVRD_Stream* stream) {
     stream->state = SVR_PAUSED;
     SVR_UNLOCK(stream);
 
-    /* Request that the source dismiss the streams getFrame request */
-    SVRD_Source_dismissPausedStreams(stream->source);
+    if(stream->pooled) {
+        /* Stop frame notifications. A running task stops on its own */
+        SVRD_Source_removeListener(stream->source, stream);
+    } else {
+        /* Request that the source dismiss the streams getFrame request */
+        SVRD_Source_dismissPausedStreams(stream->source);
+    }
+}
+
+/**
+ * Get the sharing group of the stream's encoder, which must be freed by the
+ * caller. An adaptive encoder tunes itself to a single link, so it is only
+ * shared by streams of the same client. Frames of a stateful encoding depend
+ * on the frame before, so a stream paced differently from the others would
+ * keep missing frames and forcing keyframes on all of them. Such encoders are
+ * only shared by streams with the same rate limit and drop rate, as of when
+ * the stream is unpaused. Called when the stream acquires its encoder
+ */
+static char* SVRD_Stream_encoderGroup(SVRD_Stream* stream) {
+    SVRD_Client* client = NULL;
+    unsigned long long frame_interval = 0;
+    int drop_rate = 0;
+
+    if(stream->adaptive_encoding) {
+        client = stream->client;
+    }
+
+    if(stream->encoding->forceKeyframe) {
+        frame_interval = __atomic_load_n(&stream->frame_interval, __ATOMIC_RELAXED);
+        drop_rate = stream->drop_rate;
+    }
+    stream->group_frame_interval = frame_interval;
+    stream->group_drop_rate = drop_rate;
+
+    return strdup(Util_format("%p,%llu,%d", (void*) client, frame_interval, drop_rate));
+}
+
+/**
+ * \brief Wait for a paused stream's worker to finish
+ *
+ * Join the worker thread, or in event loop mode wait for any queued or running
+ * frame task and release the shared encoder. This is done without a lock
+ * since the worker may lock the stream when pausing itself.
+ *
+ * \param stream A paused stream
+ */
+static void SVRD_Stream_collectWorker(SVRD_Stream* stream) {
+    SVRD_Source* source;
+
+    if(stream->worker_started) {
+        pthread_join(stream->worker, NULL);
+        stream->worker_started = false;
+    }
+
+    if(stream->pooled) {
+        pthread_mutex_lock(&stream->task_lock);
+        while(stream->task_scheduled) {
+            pthread_cond_wait(&stream->task_done, &stream->task_lock);
+        }
+        pthread_mutex_unlock(&stream->task_lock);
+
+        /* Queued frames reference the shared encoder */
+        SVRD_Client_cancelFrames(stream->client, stream);
+
+        source = stream->shared_encoder->source;
+        SVRD_Source_releaseEncoder(source, stream->shared_encoder);
+        SVR_UNREF(source);
+        stream->shared_encoder = NULL;
+        stream->pooled = false;
+    }
 }
 
 void SVRD_Stream_unpause(SVRD_Stream* stream) {
+    char* group;
+
+    /* Collect the worker from any previous unpause. It holds a shared encoder
+       until it is collected */
+    if(stream->state == SVR_PAUSED) {
+        SVRD_Stream_collectWorker(stream);
+    }
+
     SVR_LOCK(stream);
     if(stream->state == SVR_PAUSED && stream->client != NULL &&
        stream->encoding != NULL && stream->source != NULL) {
-        stream->state = SVR_UNPAUSED;
-        SVRD_Stream_initializeEncoder(stream);
-        pthread_create(&stream->worker, NULL, SVRD_Stream_worker, stream);
-        stream->worker_started = true;
+        if(SVRD_Server_getFramePool()) {
+            /* Frames are processed by pool tasks as the source provides them */
+            group = SVRD_Stream_encoderGroup(stream);
+            stream->shared_encoder = SVRD_Source_acquireEncoder(stream->source, stream->roi, stream->frame_properties, stream->encoding_descriptor, group);
+            free(group);
+            if(stream->shared_encoder == NULL) {
+                SVR_log(SVR_ERROR, Util_format("Could not open encoder for stream '%s'", stream->name));
+                SVR_UNLOCK(stream);
+                return;
+            }
+
+            /* The shared encoder keeps the source alive until it is
+               released by SVRD_Stream_collectWorker */
+            SVR_REF(stream->source);
+            stream->pooled = true;
+            stream->last_sequence = 0;
+            stream->sent_index = 0;
+            stream->queued_index = 0;
+            stream->keyframe_wanted = false;
+            stream->state = SVR_UNPAUSED;
+            SVRD_Source_addListener(stream->source, stream);
+        } else {
+            stream->state = SVR_UNPAUSED;
+            pthread_create(&stream->worker, NULL, SVRD_Stream_worker, stream);
+            stream->worker_started = true;
+        }
     }
     SVR_UNLOCK(stream);
 }
 
 void SVRD_Stream_destroy(SVRD_Stream* stream) {
-    SVR_LOCK(stream);
-
+    /* The worker may lock the stream until it is collected */
     SVRD_Stream_pause(stream);
-    if(stream->worker_started) {
-        pthread_join(stream->worker, NULL);
-    }
+    SVRD_Stream_collectWorker(stream);
+
+    SVR_LOCK(stream);
 
     /* Detach the source without a lock to avoid a deadlock */
     SVRD_Stream_detachSource(stream);
@@ -263,114 +443,400 @@ void SVRD_Stream_destroy(SVRD_Stream* stream) {
         stream->name = NULL;
     }
 
-    if(stream->payload_buffer) {
-        free(stream->payload_buffer);
-        stream->payload_buffer = NULL;
+    if(stream->encoding_descriptor) {
+        free(stream->encoding_descriptor);
+        stream->encoding_descriptor = NULL;
     }
 
-    if(stream->encoder) {
-        SVR_Encoder_destroy(stream->encoder);
-        stream->encoder = NULL;
+    pthread_mutex_destroy(&stream->task_lock);
+    pthread_cond_destroy(&stream->task_done);
+    SVR_UNLOCK(stream);
+
+    /* The client's cleanup may run on this thread, and waits for its writer,
+       which may lock the stream */
+    SVR_UNREF(stream->client);
+    free(stream);
+}
+
+/**
+ * \brief Process a source frame
+ *
+ * Encode a source frame and queue it to be sent to the stream's client,
+ * applying the stream's drop rate and rate cap. Streams sharing the encoder of
+ * a stateful encoding have the same drop rate and cap, and a stream which is
+ * out of step with the others takes any frame they have encoded, so it does
+ * not miss frames its next frame depends on. This never waits for the client.
+ *
+ * \param stream The stream
+ * \param source_frame The new source frame
+ * \return An SVR return code
+ */
+static int SVRD_Stream_processFrame(SVRD_Stream* stream, SVRD_SourceFrame* source_frame) {
+    SVRD_EncodedFrame* encoded_frame;
+    uint64_t frame_interval;
+    uint64_t now;
+    bool group_encoded;
+
+    /* Leave late frames to higher priority streams, but never starve this
+       stream completely */
+    if(SVRD_Source_shouldThrottle(source_frame->source, stream, source_frame) &&
+       stream->throttled_frames < SVRD_STREAM_THROTTLE_LIMIT - 1) {
+        stream->throttled_frames++;
+        __atomic_add_fetch(&stream->frames_dropped, 1, __ATOMIC_RELAXED);
+        return SVR_SUCCESS;
+    }
+    stream->throttled_frames = 0;
+
+    /* Only follow the other streams while still paced as they are */
+    group_encoded = stream->encoding->forceKeyframe != NULL &&
+                    __atomic_load_n(&stream->frame_interval, __ATOMIC_RELAXED) == stream->group_frame_interval &&
+                    stream->drop_rate == stream->group_drop_rate &&
+                    SVRD_SharedEncoder_hasEncoded(stream->shared_encoder, source_frame);
+
+    if(stream->drop_rate) {
+        stream->drop_counter = (stream->drop_counter + 1) % stream->drop_rate;
+
+        if(group_encoded) {
+            /* Fall in step with the other streams */
+            stream->drop_counter = 0;
+        } else if(stream->drop_counter != 0) {
+            return SVR_SUCCESS;
+        }
     }
 
-    if(stream->temp_frame[0]) {
-        cvReleaseImage(&stream->temp_frame[0]);
+    if(__atomic_exchange_n(&stream->frame_schedule_reset, false, __ATOMIC_ACQUIRE)) {
+        stream->next_frame_time = 0;
     }
 
-    if(stream->temp_frame[1]) {
-        cvReleaseImage(&stream->temp_frame[1]);
+    frame_interval = __atomic_load_n(&stream->frame_interval, __ATOMIC_RELAXED);
+    if(frame_interval) {
+        now = SVRD_Server_getTime();
+        if(now < stream->next_frame_time && !group_encoded) {
+            return SVR_SUCCESS;
+        }
+
+        /* Keep to the schedule so the average rate matches the cap, unless
+           the stream fell more than a frame behind or is falling in step
+           with the other streams */
+        if(now >= stream->next_frame_time && now - stream->next_frame_time < frame_interval) {
+            stream->next_frame_time += frame_interval;
+        } else {
+            stream->next_frame_time = now + frame_interval;
+        }
     }
 
-    SVR_UNREF(stream->client);
-    SVR_UNLOCK(stream);
-    free(stream);
+    /* Preprocessing and encoding is performed only by the first stream
+       with this configuration to request the frame */
+    encoded_frame = SVRD_SharedEncoder_encode(stream->shared_encoder, source_frame);
+
+    /* The client's writer sends the frame, or a newer one if the client does
+       not keep up */
+    SVRD_Client_queueFrame(stream->client, stream, encoded_frame);
+    SVR_UNREF(encoded_frame);
+
+    return SVR_SUCCESS;
 }
 
-static IplImage* SVRD_Stream_preprocessFrame(SVRD_Stream* stream, IplImage* frame) {
-    SVR_FrameProperties* source_frame_properties = SVRD_Source_getFrameProperties(stream->source);
-    bool resize = (stream->frame_properties->width != source_frame_properties->width ||
-                   stream->frame_properties->height != source_frame_properties->height);
-    bool color_convert = (stream->frame_properties->channels != source_frame_properties->channels);
+/**
+ * \brief Check that an encoded frame can be sent
+ *
+ * A frame of an encoding whose frames depend on the one before is only sent if
+ * the stream received that frame. Otherwise it is dropped and a keyframe is
+ * requested, so the client never decodes a frame against a reference it does
+ * not have.
+ *
+ * \param stream The stream
+ * \param encoded_frame The frame about to be sent
+ * \return True if the frame should be sent
+ */
+bool SVRD_Stream_checkFrame(SVRD_Stream* stream, SVRD_EncodedFrame* encoded_frame) {
+    if(encoded_frame->keyframe == false && encoded_frame->index != stream->sent_index + 1) {
+        __atomic_add_fetch(&stream->frames_dropped, 1, __ATOMIC_RELAXED);
+        SVRD_SharedEncoder_requestKeyframe(stream->shared_encoder);
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * \brief Build a data message
+ *
+ * Build a message carrying part of an encoded frame to the stream's client.
+ * The payload is not copied, but the message does not otherwise refer to the
+ * stream, so it may be sent after the stream is destroyed.
+ *
+ * \param stream The stream
+ * \param payload The part of the frame to carry
+ * \param payload_size Size of the part
+ * \return A new message, to be released with SVR_Message_release
+ */
+SVR_Message* SVRD_Stream_newDataMessage(SVRD_Stream* stream, void* payload, size_t payload_size) {
+    SVR_Message* message;
+
+    if(stream->client_handle) {
+        message = SVR_Message_new(0);
+        message->opcode = SVR_OPCODE_DATA;
+        message->handle = stream->client_handle;
+    } else {
+        message = SVR_Message_new(2);
+        message->components[0] = "Data";
+        message->components[1] = SVR_Arena_strdup(message->alloc, stream->name);
+    }
+
+    message->payload = payload;
+    message->payload_size = payload_size;
+
+    return message;
+}
+
+/**
+ * \brief Record that a frame was sent
+ *
+ * Count a frame as sent to the client, so frames which depend on it may follow,
+ * and let adaptive encodings see how the client is keeping up
+ *
+ * \param stream The stream
+ * \param encoded_frame The frame sent
+ * \param send_start Monotonic time sending the frame started
+ */
+void SVRD_Stream_frameSent(SVRD_Stream* stream, SVRD_EncodedFrame* encoded_frame, struct timespec* send_start) {
+    struct timespec send_end;
+    unsigned int send_ms;
+
+    if(stream->encoding->reportSend) {
+        clock_gettime(CLOCK_MONOTONIC, &send_end);
+        send_ms = (send_end.tv_sec - send_start->tv_sec) * 1000 +
+                  (send_end.tv_nsec - send_start->tv_nsec) / 1000000;
+        SVRD_SharedEncoder_reportSend(stream->shared_encoder, send_ms,
+                                      SVRD_Client_getSendBacklog(stream->client));
+    }
+
+    stream->sent_index = encoded_frame->index;
+    __atomic_add_fetch(&stream->frames_sent, 1, __ATOMIC_RELAXED);
+}
 
-    if(resize && color_convert) {
-        cvResize(frame, stream->temp_frame[0], CV_INTER_NN);
+/**
+ * \brief Send an encoded frame to the stream's client
+ *
+ * Called by a threaded client's writer with frames queued by
+ * SVRD_Client_queueFrame. Blocks until the frame is sent. Frames which can not
+ * be decoded are dropped, as described for SVRD_Stream_checkFrame.
+ *
+ * \param stream The stream
+ * \param encoded_frame The frame to send
+ * \return SVR_SUCCESS, or SVR_UNKNOWNERROR if the frame could not be sent
+ */
+int SVRD_Stream_sendFrame(SVRD_Stream* stream, SVRD_EncodedFrame* encoded_frame) {
+    SVR_Message* messages[SVRD_STREAM_SEND_BATCH];
+    SVR_Message* message;
+    size_t chunk_size;
+    size_t batch_size;
+    size_t offset;
+    int count;
+    int return_code = SVR_SUCCESS;
+    struct timespec send_start;
+
+    if(SVRD_Stream_checkFrame(stream, encoded_frame) == false) {
+        return SVR_SUCCESS;
+    }
 
-        if(stream->frame_properties->channels == 1) {
-            cvCvtColor(stream->temp_frame[0], stream->temp_frame[1], CV_RGB2GRAY);
+    /* Send all the encoded data out in chunks, coalescing up to
+       SVRD_STREAM_SEND_BATCH chunks or SVRD_STREAM_SEND_QUANTUM bytes into
+       each send */
+    clock_gettime(CLOCK_MONOTONIC, &send_start);
+    offset = 0;
+    while(offset < encoded_frame->size) {
+        /* Protocol version 2 clients receive the rest of the frame in one
+           message, unless replies are waiting to be let through */
+        if(stream->client->protocol < SVR_PROTOCOL_V2) {
+            chunk_size = stream->chunk_size;
+        } else if(SVRD_Client_hasControlMessages(stream->client)) {
+            chunk_size = SVRD_STREAM_SEND_QUANTUM;
         } else {
-            cvCvtColor(stream->temp_frame[0], stream->temp_frame[1], CV_GRAY2RGB);
+            chunk_size = SVR_MAX_PAYLOAD_V2;
         }
 
-        return stream->temp_frame[1];
+        batch_size = 0;
+        for(count = 0; count < SVRD_STREAM_SEND_BATCH && batch_size < SVRD_STREAM_SEND_QUANTUM &&
+                       offset < encoded_frame->size; count++) {
+            /* Send part of the payload directly from the encoded frame */
+            message = SVRD_Stream_newDataMessage(stream, ((uint8_t*)encoded_frame->data) + offset,
+                                                 Util_min(encoded_frame->size - offset, chunk_size));
+            offset += message->payload_size;
+            batch_size += message->payload_size;
 
-    } else if(resize) {
-        cvResize(frame, stream->temp_frame[0], CV_INTER_NN);
-        return stream->temp_frame[0];
+            messages[count] = message;
+        }
 
-    } else if(color_convert) {
-        if(stream->frame_properties->channels == 1) {
-            cvCvtColor(frame, stream->temp_frame[0], CV_RGB2GRAY);
-        } else {
-            cvCvtColor(frame, stream->temp_frame[0], CV_GRAY2RGB);
+        /* Send messages */
+        if(SVRD_Client_sendMessages(stream->client, messages, count) < 0) {
+            SVR_log(SVR_DEBUG, "Can not send message");
+            return_code = SVR_UNKNOWNERROR;
         }
 
-        return stream->temp_frame[0];
+        for(int i = 0; i < count; i++) {
+            SVR_Message_release(messages[i]);
+        }
+
+        if(return_code != SVR_SUCCESS) {
+            break;
+        }
     }
 
-    return frame;
+    if(return_code == SVR_SUCCESS) {
+        SVRD_Stream_frameSent(stream, encoded_frame, &send_start);
+    }
+
+    return return_code;
 }
 
-static void* SVRD_Stream_worker(void* _stream) {
+/**
+ * \brief Get a stream's delivery counters
+ *
+ * \param stream The stream
+ * \param frames_sent Set to the number of frames sent to the client
+ * \param frames_dropped Set to the number of frames dropped because the client
+ * or the server could not keep up
+ */
+void SVRD_Stream_getStats(SVRD_Stream* stream, unsigned long* frames_sent, unsigned long* frames_dropped) {
+    *frames_sent = __atomic_load_n(&stream->frames_sent, __ATOMIC_RELAXED);
+    *frames_dropped = __atomic_load_n(&stream->frames_dropped, __ATOMIC_RELAXED);
+}
+
+/**
+ * \brief Notify a pooled stream of a new frame
+ *
+ * Called by the source when a new frame is available or the source is closing.
+ * Schedules a frame task unless one is already queued or running, in which
+ * case that task will pick up the new frame.
+ *
+ * \param stream The stream
+ */
+void SVRD_Stream_frameReady(SVRD_Stream* stream) {
+    pthread_mutex_lock(&stream->task_lock);
+    stream->frame_pending = true;
+    if(stream->task_scheduled == false) {
+        stream->task_scheduled = true;
+        SVRD_WorkerPool_submitWithPriority(SVRD_Server_getFramePool(), SVRD_Stream_frameTask, stream, stream->priority);
+    }
+    pthread_mutex_unlock(&stream->task_lock);
+}
+
+/**
+ * \brief Worker pool task processing the latest frames of a stream
+ *
+ * Process the source's current frame until no newer frame is available, the
+ * stream is paused, or the source closes. Frames which arrive while a frame is
+ * being processed are coalesced, so only the latest is processed.
+ *
+ * \param _stream The stream
+ */
+static void SVRD_Stream_frameTask(void* _stream) {
     SVRD_Stream* stream = (SVRD_Stream*) _stream;
-    SVRD_SourceFrame* source_frame = NULL;
-    IplImage* frame;
-    SVR_Message* message;
+    /* The source is kept alive by the stream's reference for its shared
+       encoder */
+    SVRD_Source* source = stream->source;
+    SVRD_SourceFrame* source_frame;
+    bool source_closing = false;
+    int return_code = SVR_SUCCESS;
 
     while(stream->state == SVR_UNPAUSED) {
-        source_frame = SVRD_Source_getFrame(stream->source, stream, source_frame);
-
-        if(source_frame == NULL) {
-            if(stream->state == SVR_UNPAUSED) {
-                /* Source closing */
-                SVRD_Stream_sourceClosing(stream);
-            }
+        pthread_mutex_lock(&stream->task_lock);
+        stream->frame_pending = false;
+        pthread_mutex_unlock(&stream->task_lock);
 
+        if(source->closed) {
+            source_closing = true;
             break;
         }
 
-        if(stream->drop_rate) {
-            stream->drop_counter = (stream->drop_counter + 1) % stream->drop_rate;
+        source_frame = SVRD_Source_acquireCurrentFrame(source);
+        if(source_frame && source_frame->sequence != stream->last_sequence) {
+            stream->last_sequence = source_frame->sequence;
+            return_code = SVRD_Stream_processFrame(stream, source_frame);
+            SVR_UNREF(source_frame);
 
-            if(stream->drop_counter != 0) {
-                continue;
+            if(return_code != SVR_SUCCESS) {
+                break;
             }
+
+            continue;
         }
 
+        if(source_frame) {
+            SVR_UNREF(source_frame);
+        }
 
-        frame = SVRD_Stream_preprocessFrame(stream, source_frame->frame);
-        SVR_Encoder_encode(stream->encoder, frame);
+        /* Finish unless another frame arrived since the check above. The
+           stream may be destroyed as soon as task_scheduled is cleared */
+        pthread_mutex_lock(&stream->task_lock);
+        if(stream->frame_pending == false) {
+            stream->task_scheduled = false;
+            pthread_cond_broadcast(&stream->task_done);
+            pthread_mutex_unlock(&stream->task_lock);
+            return;
+        }
+        pthread_mutex_unlock(&stream->task_lock);
+    }
 
-        /* Send all the encoded data out in chunks */
-        while(SVR_Encoder_dataReady(stream->encoder) > 0) {
-            /* Build the data message */
-            message = SVR_Message_new(2);
-            message->components[0] = "Data";
-            message->components[1] = stream->name;
-            message->payload = stream->payload_buffer;
+    if(source_closing && stream->state == SVR_UNPAUSED) {
+        SVRD_Stream_sourceClosing(stream);
+    } else if(return_code != SVR_SUCCESS) {
+        SVRD_Stream_pause(stream);
+    }
 
-            /* Get part of payload */
-            message->payload_size = SVR_Encoder_readData(stream->encoder,
-                                                         message->payload,
-                                                         stream->payload_buffer_size);
+    pthread_mutex_lock(&stream->task_lock);
+    stream->task_scheduled = false;
+    pthread_cond_broadcast(&stream->task_done);
+    pthread_mutex_unlock(&stream->task_lock);
+}
 
-            /* Send message */
-            if(SVRD_Client_sendMessage(stream->client, message) < 0) {
-                SVRD_Stream_pause(stream);
-                SVR_log(SVR_DEBUG, "Can not send message");
-                break;
+static void* SVRD_Stream_worker(void* _stream) {
+    SVRD_Stream* stream = (SVRD_Stream*) _stream;
+    SVRD_Source* source = stream->source;
+    SVRD_SourceFrame* source_frame = NULL;
+    char* group;
+
+    /* Keep the source alive even if the stream is detached from it while
+       running */
+    SVR_REF(source);
+
+    group = SVRD_Stream_encoderGroup(stream);
+    stream->shared_encoder = SVRD_Source_acquireEncoder(source, stream->roi, stream->frame_properties, stream->encoding_descriptor, group);
+    free(group);
+    if(stream->shared_encoder == NULL) {
+        SVR_log(SVR_ERROR, Util_format("Could not open encoder for stream '%s'", stream->name));
+        SVRD_Stream_pause(stream);
+        SVR_UNREF(source);
+        return NULL;
+    }
+
+    stream->sent_index = 0;
+    stream->queued_index = 0;
+    stream->keyframe_wanted = false;
+    SVRD_Source_addListener(source, stream);
+    SVRD_Stream_setWorkerNiceness(stream);
+
+    while(stream->state == SVR_UNPAUSED) {
+        if(stream->worker_priority != stream->priority) {
+            SVRD_Stream_setWorkerNiceness(stream);
+        }
+
+        source_frame = SVRD_Source_getFrame(source, stream, source_frame);
+
+        if(source_frame == NULL) {
+            if(stream->state == SVR_UNPAUSED) {
+                /* Source closing */
+                SVRD_Stream_sourceClosing(stream);
             }
 
-            SVR_Message_release(message);
+            break;
+        }
+
+        if(SVRD_Stream_processFrame(stream, source_frame) != SVR_SUCCESS) {
+            SVRD_Stream_pause(stream);
+            break;
         }
     }
 
@@ -378,5 +844,35 @@ static void* SVRD_Stream_worker(void* _stream) {
         SVR_UNREF(source_frame);
     }
 
+    SVRD_Source_removeListener(source, stream);
+    SVRD_Client_cancelFrames(stream->client, stream);
+    SVRD_Source_releaseEncoder(source, stream->shared_encoder);
+    stream->shared_encoder = NULL;
+    SVR_UNREF(source);
+
     return NULL;
 }
+
+/**
+ * \brief Set the niceness of a stream's worker thread from its priority
+ *
+ * Each step above SVRD_STREAM_DEFAULT_PRIORITY lowers the niceness by one,
+ * and each step below raises it. Lowering the niceness below 0 needs
+ * privileges, so without them higher priorities only take effect relative to
+ * lower priority streams. Must be called from the worker thread.
+ *
+ * \param stream The stream
+ */
+static void SVRD_Stream_setWorkerNiceness(SVRD_Stream* stream) {
+    stream->worker_priority = stream->priority;
+
+#ifdef __SVR_Linux__
+    int niceness = Util_max(-20, Util_min(19, SVRD_STREAM_DEFAULT_PRIORITY - stream->worker_priority));
+
+    /* Niceness is per thread on Linux */
+    if(setpriority(PRIO_PROCESS, syscall(SYS_gettid), niceness) < 0) {
+        SVR_log(SVR_DEBUG, Util_format("Could not set niceness of stream '%s' to %d: %s",
+                                       stream->name, niceness, strerror(errno)));
+    }
+#endif
+}
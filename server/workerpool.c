@@ -0,0 +1,217 @@
+/**
+ * \file
+ * \brief Worker pool
+ */
+
+#include "svr.h"
+#include "svrd.h"
+
+#include <limits.h>
+
+/* Priority of the tasks stopping workers, run after every other task */
+#define SVRD_WORKERPOOL_STOP_PRIORITY INT_MIN
+
+static bool SVRD_WorkerPool_before(SVRD_WorkerPool_Task* a, SVRD_WorkerPool_Task* b);
+static void SVRD_WorkerPool_push(SVRD_WorkerPool* pool, SVRD_WorkerPool_Task* pool_task);
+static SVRD_WorkerPool_Task SVRD_WorkerPool_pop(SVRD_WorkerPool* pool);
+static void* SVRD_WorkerPool_worker(void* _pool);
+
+/**
+ * \defgroup WorkerPool Worker pool
+ * \brief Fixed set of threads running queued tasks
+ *
+ * In event loop mode, message processing for clients and frame processing for
+ * streams is performed by fixed size worker pools rather than a thread per
+ * client and per stream. Queued tasks are started highest priority first, and
+ * in the order they were submitted among tasks of equal priority. A task may
+ * block, but doing so ties up one of the pool's workers, so a task
+ * must never wait on another task queued to the same pool.
+ *
+ * \{
+ */
+
+/**
+ * \brief Start a worker pool
+ *
+ * Create a worker pool and start its threads
+ *
+ * \param thread_count Number of worker threads to start. If less than 1, one
+ * thread is started for each online processor
+ * \return A new worker pool
+ */
+SVRD_WorkerPool* SVRD_WorkerPool_new(int thread_count) {
+    SVRD_WorkerPool* pool = malloc(sizeof(SVRD_WorkerPool));
+
+    if(thread_count < 1) {
+        thread_count = Util_max(sysconf(_SC_NPROCESSORS_ONLN), 1);
+    }
+
+    pool->task_capacity = 16;
+    pool->tasks = malloc(sizeof(SVRD_WorkerPool_Task) * pool->task_capacity);
+    pool->task_count = 0;
+    pool->submitted = 0;
+    pthread_cond_init(&pool->task_available, NULL);
+    SVR_LOCKABLE_INIT(pool);
+
+    pool->workers = malloc(sizeof(pthread_t) * thread_count);
+    pool->worker_count = thread_count;
+
+    for(int i = 0; i < pool->worker_count; i++) {
+        pthread_create(&pool->workers[i], NULL, SVRD_WorkerPool_worker, pool);
+    }
+
+    return pool;
+}
+
+/**
+ * \brief Stop a worker pool
+ *
+ * Wait for all queued tasks to complete, stop the worker threads, and free the
+ * pool
+ *
+ * \param pool The pool to destroy
+ */
+void SVRD_WorkerPool_destroy(SVRD_WorkerPool* pool) {
+    /* A NULL task stops one worker */
+    for(int i = 0; i < pool->worker_count; i++) {
+        SVRD_WorkerPool_submitWithPriority(pool, NULL, NULL, SVRD_WORKERPOOL_STOP_PRIORITY);
+    }
+
+    for(int i = 0; i < pool->worker_count; i++) {
+        pthread_join(pool->workers[i], NULL);
+    }
+
+    pthread_cond_destroy(&pool->task_available);
+    free(pool->tasks);
+    free(pool->workers);
+    free(pool);
+}
+
+/**
+ * \brief Submit a task
+ *
+ * Queue a task to be run by one of the pool workers with priority 0
+ *
+ * \param pool The pool to run the task
+ * \param task Function to run
+ * \param arg Argument passed to the task function
+ */
+void SVRD_WorkerPool_submit(SVRD_WorkerPool* pool, void (*task)(void*), void* arg) {
+    SVRD_WorkerPool_submitWithPriority(pool, task, arg, 0);
+}
+
+/**
+ * \brief Submit a task with a priority
+ *
+ * Queue a task to be run by one of the pool workers. When more tasks are
+ * queued than there are idle workers, tasks with a higher priority are started
+ * first.
+ *
+ * \param pool The pool to run the task
+ * \param task Function to run
+ * \param arg Argument passed to the task function
+ * \param priority Priority of the task
+ */
+void SVRD_WorkerPool_submitWithPriority(SVRD_WorkerPool* pool, void (*task)(void*), void* arg, int priority) {
+    SVRD_WorkerPool_Task pool_task;
+
+    pool_task.task = task;
+    pool_task.arg = arg;
+    pool_task.priority = priority;
+
+    SVR_LOCK(pool);
+    pool_task.order = pool->submitted++;
+    SVRD_WorkerPool_push(pool, &pool_task);
+    pthread_cond_signal(&pool->task_available);
+    SVR_UNLOCK(pool);
+}
+
+/**
+ * \brief Whether task a should start before task b
+ */
+static bool SVRD_WorkerPool_before(SVRD_WorkerPool_Task* a, SVRD_WorkerPool_Task* b) {
+    if(a->priority != b->priority) {
+        return a->priority > b->priority;
+    }
+
+    return a->order < b->order;
+}
+
+/**
+ * \brief Add a task to the heap. The pool must be locked
+ */
+static void SVRD_WorkerPool_push(SVRD_WorkerPool* pool, SVRD_WorkerPool_Task* pool_task) {
+    SVRD_WorkerPool_Task* tasks;
+    int i;
+
+    if(pool->task_count == pool->task_capacity) {
+        pool->task_capacity *= 2;
+        pool->tasks = realloc(pool->tasks, sizeof(SVRD_WorkerPool_Task) * pool->task_capacity);
+    }
+
+    /* Sift up from the new leaf */
+    tasks = pool->tasks;
+    i = pool->task_count++;
+    while(i > 0 && SVRD_WorkerPool_before(pool_task, &tasks[(i - 1) / 2])) {
+        tasks[i] = tasks[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    tasks[i] = *pool_task;
+}
+
+/**
+ * \brief Remove the first task from the heap. The pool must be locked and
+ * have a queued task
+ */
+static SVRD_WorkerPool_Task SVRD_WorkerPool_pop(SVRD_WorkerPool* pool) {
+    SVRD_WorkerPool_Task* tasks = pool->tasks;
+    SVRD_WorkerPool_Task first = tasks[0];
+    SVRD_WorkerPool_Task last = tasks[--pool->task_count];
+    int n = pool->task_count;
+    int i = 0;
+    int child;
+
+    /* Sift the last task down from the root */
+    while((child = 2 * i + 1) < n) {
+        if(child + 1 < n && SVRD_WorkerPool_before(&tasks[child + 1], &tasks[child])) {
+            child++;
+        }
+
+        if(!SVRD_WorkerPool_before(&tasks[child], &last)) {
+            break;
+        }
+
+        tasks[i] = tasks[child];
+        i = child;
+    }
+    tasks[i] = last;
+
+    return first;
+}
+
+static void* SVRD_WorkerPool_worker(void* _pool) {
+    SVRD_WorkerPool* pool = (SVRD_WorkerPool*) _pool;
+    SVRD_WorkerPool_Task pool_task;
+
+    while(true) {
+        SVR_LOCK(pool);
+        while(pool->task_count == 0) {
+            SVR_LOCK_WAIT(pool, &pool->task_available);
+        }
+        pool_task = SVRD_WorkerPool_pop(pool);
+        SVR_UNLOCK(pool);
+
+        if(pool_task.task == NULL) {
+            break;
+        }
+
+        pool_task.task(pool_task.arg);
+
+        /* Clean up objects released by the task */
+        SVR_RefCounter_flush();
+    }
+
+    return NULL;
+}
+
+/** \} */
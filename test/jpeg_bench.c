@@ -0,0 +1,103 @@
+
+#include <svr.h>
+
+#include <time.h>
+
+#define DEFAULT_FRAMES 200
+
+static double now(void) {
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static void fillFrame(IplImage* frame) {
+    uint8_t* row;
+
+    /* Smooth gradients compress like camera frames more than noise does */
+    for(int y = 0; y < frame->height; y++) {
+        row = (uint8_t*) frame->imageData + y * frame->widthStep;
+        for(int x = 0; x < frame->width; x++) {
+            row[x * 3 + 0] = (x * 255) / frame->width;
+            row[x * 3 + 1] = (y * 255) / frame->height;
+            row[x * 3 + 2] = 128;
+        }
+    }
+}
+
+static void benchmark(int width, int height, int frames) {
+    SVR_Encoding* encoding = SVR_Encoding_getByName("jpeg");
+    SVR_FrameProperties* frame_properties = SVR_FrameProperties_new();
+    Dictionary* options = Dictionary_new();
+    SVR_Encoder* encoder;
+    SVR_Decoder* decoder;
+    IplImage* frame;
+    void* data;
+    size_t data_size = 0;
+    double start;
+    double encode_time;
+    double decode_time;
+
+    frame_properties->width = width;
+    frame_properties->height = height;
+    frame_properties->depth = 8;
+    frame_properties->channels = 3;
+
+    frame = SVR_FrameProperties_imageFromProperties(frame_properties);
+    fillFrame(frame);
+
+    encoder = SVR_Encoder_new(encoding, options, frame_properties);
+    decoder = SVR_Decoder_new(encoding, frame_properties);
+
+    /* Encode */
+    start = now();
+    for(int i = 0; i < frames; i++) {
+        SVR_Encoder_encode(encoder, frame);
+        data_size = SVR_Encoder_dataReady(encoder);
+
+        /* Keep the last frame's data to decode */
+        if(i < frames - 1) {
+            data = malloc(data_size);
+            SVR_Encoder_readData(encoder, data, data_size);
+            free(data);
+        }
+    }
+    encode_time = now() - start;
+
+    data = malloc(data_size);
+    SVR_Encoder_readData(encoder, data, data_size);
+
+    /* Decode */
+    start = now();
+    for(int i = 0; i < frames; i++) {
+        SVR_Decoder_decode(decoder, data, data_size);
+        SVR_Decoder_returnFrame(decoder, SVR_Decoder_getFrame(decoder));
+    }
+    decode_time = now() - start;
+
+    printf("%4dx%-4d  %8.1f fps encode  %8.1f fps decode  %8zu bytes/frame\n",
+           width, height, frames / encode_time, frames / decode_time, data_size);
+
+    free(data);
+    SVR_Decoder_destroy(decoder);
+    SVR_Encoder_destroy(encoder);
+    cvReleaseImage(&frame);
+    Dictionary_destroy(options);
+    SVR_FrameProperties_destroy(frame_properties);
+}
+
+int main(int argc, char** argv) {
+    int frames = DEFAULT_FRAMES;
+
+    if(argc > 1) {
+        frames = atoi(argv[1]);
+    }
+
+    SVR_initCore();
+
+    benchmark(640, 480, frames);
+    benchmark(1920, 1080, frames);
+
+    return 0;
+}